@@ -0,0 +1,79 @@
+#include "aot.hpp"
+#include "cpu.hpp"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+
+AOTLoadResult AOTModule::Load(const char* path)
+{
+    Unload();
+#if defined(_WIN32)
+    HMODULE library = LoadLibraryA(path);
+    if (library == nullptr)
+        return AOTLoadResult::CannotOpen;
+    handle = library;
+    image = reinterpret_cast<const AOTImage*>(GetProcAddress(library, "aotImage"));
+#else
+    handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr)
+        return AOTLoadResult::CannotOpen;
+    image = static_cast<const AOTImage*>(dlsym(handle, "aotImage"));
+#endif
+    if (image == nullptr) {
+        Unload();
+        return AOTLoadResult::NoImage;
+    }
+    if (image->version != AOTImage::CurrentVersion || image->cpuSize != sizeof(CPU)) {
+        Unload();
+        return AOTLoadResult::WrongLayout;
+    }
+    return AOTLoadResult::Ok;
+}
+
+void AOTModule::Unload()
+{
+    if (handle != nullptr) {
+#if defined(_WIN32)
+        FreeLibrary(static_cast<HMODULE>(handle));
+#else
+        dlclose(handle);
+#endif
+    }
+    handle = nullptr;
+    image = nullptr;
+}
+
+bool AOTModule::Matches(const CPU& cpu) const
+{
+    if (image == nullptr || image->codeStart >= image->codeEnd || !cpu.memory.Contains(image->codeStart, image->codeEnd - image->codeStart))
+        return false;
+    return HashCode(cpu.memory.buffer + image->codeStart, image->codeEnd - image->codeStart) == image->codeHash;
+}
+
+const char* AOTLoadResultMessage(AOTLoadResult result)
+{
+    switch (result) {
+        case AOTLoadResult::Ok: return "Success";
+        case AOTLoadResult::CannotOpen: return "Could not open shared object";
+        case AOTLoadResult::NoImage: return "Shared object does not export an image";
+        case AOTLoadResult::WrongLayout: return "Image was generated by an incompatible build";
+    }
+    return "";
+}
+
+// FNV-1a
+uint64_t HashCode(const uint8_t* code, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= code[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+
+struct CPU;
+
+
+enum class AOTExit : uint32_t
+{
+    // Execution can continue at cpu.pc
+    Continue,
+    // cpu.pc is not part of the image, or its instruction must go through the interpreter
+    Interpret,
+};
+
+
+// Exported as "aotImage" by the shared objects that tools/aot.cpp generates
+struct AOTImage
+{
+    constexpr static uint32_t CurrentVersion = 3;
+
+    // Bumped whenever this struct or the calling convention of run changes
+    uint32_t version;
+    // sizeof(CPU) in the build that generated the image, which must match the one loading it
+    uint32_t cpuSize;
+    // The translated instructions lie in [codeStart, codeEnd), codeHash covers their bytes
+    uint32_t codeStart;
+    uint32_t codeEnd;
+    uint64_t codeHash;
+    // Runs translated code starting at cpu.pc until it leaves the image or the budget runs out,
+    // and takes the instructions that ran out of the budget
+    AOTExit (*run)(CPU& cpu, int32_t& budget);
+};
+
+
+enum class AOTLoadResult : uint32_t
+{
+    Ok,
+    CannotOpen,
+    NoImage,
+    WrongLayout,
+};
+
+
+// A loaded image, which CPU::Run uses once it is assigned to cpu.aot
+struct AOTModule
+{
+    AOTModule() = default;
+    AOTModule(const AOTModule&) = delete;
+    AOTModule& operator=(const AOTModule&) = delete;
+    ~AOTModule() { Unload(); }
+
+    AOTLoadResult Load(const char* path);
+    void Unload();
+    // Whether the image was translated from the program currently in memory
+    bool Matches(const CPU& cpu) const;
+
+    void* handle = nullptr;
+    const AOTImage* image = nullptr;
+};
+
+
+const char* AOTLoadResultMessage(AOTLoadResult result);
+uint64_t HashCode(const uint8_t* code, size_t size);
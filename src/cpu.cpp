@@ -1,13 +1,37 @@
 #include "cpu.hpp"
 
 #include "elf.h"
+// Older copies of elf.h do not have this one
+#ifndef SHT_RISCV_ATTRIBUTES
+#define SHT_RISCV_ATTRIBUTES 0x70000003
+#endif
 #include <cstdlib>
+#include <algorithm>
 #include <cmath>
 #include <cfenv>
 #include <climits>
 #include <bit>
+#include <atomic>
+#include <thread>
+#include <new>
 #include "helpers.hpp"
 
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#include <csetjmp>
+
+// Computed goto is a GNU extension, other compilers always dispatch through the switch
+#if defined(__GNUC__)
+#define CPU_THREADED_DISPATCH 1
+#else
+#define CPU_THREADED_DISPATCH 0
+#endif
+
 static int32_t SignExtend(uint32_t x, uint32_t n)
 {
     assert(n > 0 && n < 32);
@@ -19,6 +43,11 @@ static int32_t SignExtend(uint32_t x, uint32_t n)
     return static_cast<int32_t>(x | extendedBitMask);
 }
 
+static bool IsSignalingNaN(float x)
+{
+    return std::isnan(x) && !(bit_cast<uint32_t>(x) & 0x00400000U);
+}
+
 FormattedInstruction FormatInstruction(RawInstruction ins)
 {
     FormattedInstruction result;
@@ -366,93 +395,52 @@ static const char* RMName(uint32_t rm)
 void FormatInstruction(RawInstruction ins, char* buffer, size_t buffsz)
 {
     InstructionType type = DecodeInstruction(ins);
-    switch (type) {
-        default:
+    switch (EncodingOf(type).format) {
+        case InstructionFormat::Unimplemented:
             snprintf(buffer, buffsz, "unimp");
             break;
-        case InstructionType::ILLEGAL:
-        case InstructionType::MRET:
-        case InstructionType::FENCE:
-        case InstructionType::FENCE_I: // TODO: Format fence correctly
-        case InstructionType::ECALL:
-        case InstructionType::EBREAK:
+        case InstructionFormat::Bare: // TODO: Format fence correctly
             snprintf(buffer, buffsz, "%s", InstructionName(type));
             break;
         // I-type
-        case InstructionType::ADDI:
-        case InstructionType::SLTI:
-        case InstructionType::SLTIU:
-        case InstructionType::ANDI:
-        case InstructionType::ORI:
-        case InstructionType::XORI:
-        case InstructionType::JALR:
+        case InstructionFormat::Immediate:
             snprintf(buffer, buffsz, "%s x%d, x%d, %d", InstructionName(type), ins.Ityp.rd, ins.Ityp.rs1, SignExtend(ins.Ityp.imm11_0, 12));
             break;
         // I-type (shift)
-        case InstructionType::SLLI:
-        case InstructionType::SRLI:
-        case InstructionType::SRAI:
+        case InstructionFormat::Shift:
             snprintf(buffer, buffsz, "%s x%d, x%d, %d", InstructionName(type), ins.Ityp.rd, ins.Ityp.rs1, ins.Ityp.imm11_0 & 0b11111);
             break;
         // U-type
-        case InstructionType::LUI:
-        case InstructionType::AUIPC:
+        case InstructionFormat::Upper:
             snprintf(buffer, buffsz, "%s x%d, %d", InstructionName(type), ins.Utyp.rd, SignExtend(ins.Utyp.imm31_12, 20));
             break;
         // R-type
-        case InstructionType::ADD:
-        case InstructionType::SUB:
-        case InstructionType::SLT:
-        case InstructionType::SLTU:
-        case InstructionType::AND:
-        case InstructionType::OR:
-        case InstructionType::XOR:
-        case InstructionType::SLL:
-        case InstructionType::SRL:
-        case InstructionType::SRA:
-        case InstructionType::MUL:
-        case InstructionType::MULH:
-        case InstructionType::MULHSU:
-        case InstructionType::MULHU:
-        case InstructionType::DIV:
-        case InstructionType::DIVU:
-        case InstructionType::REM:
-        case InstructionType::REMU:
+        case InstructionFormat::Register:
             snprintf(buffer, buffsz, "%s x%d, x%d, x%d", InstructionName(type), ins.Rtyp.rd, ins.Rtyp.rs1, ins.Rtyp.rs2);
             break;
         // J-type
-        case InstructionType::JAL:
+        case InstructionFormat::Jump:
             snprintf(buffer, buffsz, "%s x%d, %d", InstructionName(type), ins.Jtyp.rd, SignExtend(ins.Jtyp.imm(), 21));
             break;
         // B-type
-        case InstructionType::BEQ:
-        case InstructionType::BNE:
-        case InstructionType::BLT:
-        case InstructionType::BLTU:
-        case InstructionType::BGE:
-        case InstructionType::BGEU:
+        case InstructionFormat::Branch:
             snprintf(buffer, buffsz, "%s x%d, x%d, %d", InstructionName(type), ins.Btyp.rs1, ins.Btyp.rs2, SignExtend(ins.Btyp.imm(), 13));
             break;
         // I-type (load)
-        case InstructionType::LW:
-        case InstructionType::LH:
-        case InstructionType::LHU:
-        case InstructionType::LB:
-        case InstructionType::LBU:
+        case InstructionFormat::Load:
             snprintf(buffer, buffsz, "%s x%d, %d(x%d)", InstructionName(type), ins.Ityp.rd, SignExtend(ins.Ityp.imm11_0, 12), ins.Ityp.rs1);
             break;
         // S-type
-        case InstructionType::SW:
-        case InstructionType::SH:
-        case InstructionType::SB:
+        case InstructionFormat::Store:
             snprintf(buffer, buffsz, "%s x%d, %d(x%d)", InstructionName(type), ins.Styp.rs2, SignExtend(ins.Styp.imm(), 12), ins.Ityp.rs1);
             break;
-        case InstructionType::CSRRW:
-        case InstructionType::CSRRS:
-        case InstructionType::CSRRC:
-        case InstructionType::CSRRWI:
-        case InstructionType::CSRRSI:
-        case InstructionType::CSRRCI: {
+        case InstructionFormat::LoadReserved:
+            snprintf(buffer, buffsz, "%s x%d, (x%d)", InstructionName(type), ins.Rtyp.rd, ins.Rtyp.rs1);
+            break;
+        case InstructionFormat::Atomic:
+            snprintf(buffer, buffsz, "%s x%d, x%d, (x%d)", InstructionName(type), ins.Rtyp.rd, ins.Rtyp.rs2, ins.Rtyp.rs1);
+            break;
+        case InstructionFormat::CSR: {
             const char* csrRepr = CSRName(ins.Ityp.imm11_0);
             if (csrRepr[0] != '\0') {
                 snprintf(buffer, buffsz, "%s x%d, %s, x%d", InstructionName(type), ins.Ityp.rd, csrRepr, ins.Ityp.rs1);
@@ -462,29 +450,19 @@ void FormatInstruction(RawInstruction ins, char* buffer, size_t buffsz)
             }
         } break;
         // I-type (float)
-        case InstructionType::FLW:
+        case InstructionFormat::FloatLoad:
             snprintf(buffer, buffsz, "%s f%d, %d(x%d)", InstructionName(type), ins.Ityp.rd, SignExtend(ins.Ityp.imm11_0, 12), ins.Ityp.rs1);
             break;
         // S-type (float)
-        case InstructionType::FSW:
+        case InstructionFormat::FloatStore:
             snprintf(buffer, buffsz, "%s f%d, %d(x%d)", InstructionName(type), ins.Styp.rs2, SignExtend(ins.Styp.imm(), 12), ins.Ityp.rs1);
             break;
         // R-type (float)
-        case InstructionType::FSGNJS:
-        case InstructionType::FSGNJNS:
-        case InstructionType::FSGNJXS:
-        case InstructionType::FMINS:
-        case InstructionType::FMAXS:
-        case InstructionType::FEQS:
-        case InstructionType::FLTS:
-        case InstructionType::FLES:
+        case InstructionFormat::FloatRegister:
             snprintf(buffer, buffsz, "%s f%d, f%d, f%d", InstructionName(type), ins.Rtyp.rd, ins.Rtyp.rs1, ins.Rtyp.rs2);
             break;
         // R4-type (f, f, f, f, rm)
-        case InstructionType::FMADDS:
-        case InstructionType::FMSUBS:
-        case InstructionType::FNMSUBS:
-        case InstructionType::FNMADDS: {
+        case InstructionFormat::FloatFused: {
             const char* rmRepr = RMName(ins.R4typ.funct3);
             if (rmRepr[0] != '\0') {
                 snprintf(buffer, buffsz, "%s f%d, f%d, f%d, f%d, %s", InstructionName(type), ins.R4typ.rd, ins.R4typ.rs1, ins.R4typ.rs2, ins.R4typ.rs3, rmRepr);
@@ -494,10 +472,7 @@ void FormatInstruction(RawInstruction ins, char* buffer, size_t buffsz)
             }
         } break;
         // R-type (f, f, f, rm)
-        case InstructionType::FADDS:
-        case InstructionType::FSUBS:
-        case InstructionType::FMULS:
-        case InstructionType::FDIVS: {
+        case InstructionFormat::FloatRounded: {
             const char* rmRepr = RMName(ins.Rtyp.funct3);
             if (rmRepr[0] != '\0') {
                 snprintf(buffer, buffsz, "%s f%d, f%d, f%d, %s", InstructionName(type), ins.Rtyp.rd, ins.Rtyp.rs1, ins.Rtyp.rs2, rmRepr);
@@ -507,7 +482,7 @@ void FormatInstruction(RawInstruction ins, char* buffer, size_t buffsz)
             }
         } break;
         // R-type (f, f, rm)
-        case InstructionType::FSQRTS: {
+        case InstructionFormat::FloatUnaryRounded: {
             const char* rmRepr = RMName(ins.Rtyp.funct3);
             if (rmRepr[0] != '\0') {
                 snprintf(buffer, buffsz, "%s f%d, f%d, %s", InstructionName(type), ins.Rtyp.rd, ins.Rtyp.rs1, rmRepr);
@@ -517,8 +492,7 @@ void FormatInstruction(RawInstruction ins, char* buffer, size_t buffsz)
             }
         } break;
         // R-type (x, f, rm)
-        case InstructionType::FCVTWS:
-        case InstructionType::FCVTWUS: {
+        case InstructionFormat::FloatToInteger: {
             const char* rmRepr = RMName(ins.Rtyp.funct3);
             if (rmRepr[0] != '\0') {
                 snprintf(buffer, buffsz, "%s x%d, f%d, %s", InstructionName(type), ins.Rtyp.rd, ins.Rtyp.rs1, rmRepr);
@@ -528,8 +502,7 @@ void FormatInstruction(RawInstruction ins, char* buffer, size_t buffsz)
             }
         } break;
         // R-type (f, x, rm)
-        case InstructionType::FCVTSW:
-        case InstructionType::FCVTSWU: {
+        case InstructionFormat::IntegerToFloat: {
             const char* rmRepr = RMName(ins.Rtyp.funct3);
             if (rmRepr[0] != '\0') {
                 snprintf(buffer, buffsz, "%s f%d, x%d, %s", InstructionName(type), ins.Rtyp.rd, ins.Rtyp.rs1, rmRepr);
@@ -539,12 +512,11 @@ void FormatInstruction(RawInstruction ins, char* buffer, size_t buffsz)
             }
         } break;
         // R-type (x, f)
-        case InstructionType::FCLASSS:
-        case InstructionType::FMVXW:
+        case InstructionFormat::FloatMoveToInteger:
             snprintf(buffer, buffsz, "%s x%d, f%d", InstructionName(type), ins.Rtyp.rd, ins.Rtyp.rs1);
             break;
         // R-type (f, x)
-        case InstructionType::FMVWX:
+        case InstructionFormat::FloatMoveFromInteger:
             snprintf(buffer, buffsz, "%s f%d, x%d", InstructionName(type), ins.Rtyp.rd, ins.Rtyp.rs1);
             break;
     }
@@ -556,6 +528,8 @@ const char* InstructionName(InstructionType type)
     const char* names[] = {
         "illegal",
         "mret",
+        "sret",
+        "sfence.vma",
         "lui",
         "auipc",
         "jal",
@@ -611,6 +585,17 @@ const char* InstructionName(InstructionType type)
         "divu",
         "rem",
         "remu",
+        "lr.w",
+        "sc.w",
+        "amoswap.w",
+        "amoadd.w",
+        "amoxor.w",
+        "amoand.w",
+        "amoor.w",
+        "amomin.w",
+        "amomax.w",
+        "amominu.w",
+        "amomaxu.w",
         "flw",
         "fsw",
         "fmadd.s",
@@ -637,624 +622,2340 @@ const char* InstructionName(InstructionType type)
         "fcvt.s.w",
         "fcvt.s.wu",
         "fmv.w.x",
+        "lui+addi",
+        "auipc+addi",
+        "auipc+lw",
+        "auipc+jalr",
+        "slli+srli",
+        "mulh+mul",
+        "mulhu+mul",
     };
     static_assert(static_cast<uint32_t>(InstructionType::COUNT) == sizeof(names) / sizeof(names[0]), "Exhaustive check of Instruction types failed");
     return names[static_cast<uint32_t>(type)];
 }
 
-static InstructionType DecodeQ0(RawInstruction instruction)
-{
-    fprintf(stderr, "DecodeQ0: Instruction 0x%08X unimplemented\n", instruction.value);
-    (void) instruction;
-    return InstructionType::ILLEGAL;
-}
-
-static InstructionType DecodeQ1(RawInstruction instruction)
-{
-    fprintf(stderr, "DecodeQ1: Instruction 0x%08X unimplemented\n", instruction.value);
-    (void) instruction;
-    return InstructionType::ILLEGAL;
-}
-
-static InstructionType DecodeQ2(RawInstruction instruction)
-{
-    fprintf(stderr, "DecodeQ2: Instruction 0x%08X unimplemented\n", instruction.value);
-    (void) instruction;
-    return InstructionType::ILLEGAL;
-}
-
-static InstructionType DecodeQ3(RawInstruction instruction)
-{
-    switch (instruction.value) {
-        case 0b00110000001000000000000001110011: return InstructionType::MRET;
-    }
-
-    switch (instruction.Rtyp.opcode) {
-        case 0b0110111: return InstructionType::LUI;
-        case 0b0010111: return InstructionType::AUIPC;
-        case 0b1101111: return InstructionType::JAL;
-        case 0b1100111: return InstructionType::JALR;
-        case 0b1100011: {
-            switch (instruction.Btyp.funct3) {
-                case 0b000: return InstructionType::BEQ;
-                case 0b001: return InstructionType::BNE;
-                case 0b100: return InstructionType::BLT;
-                case 0b101: return InstructionType::BGE;
-                case 0b110: return InstructionType::BLTU;
-                case 0b111: return InstructionType::BGEU;
-            }
-        } break;
-        case 0b0000011: {
-            switch (instruction.Ityp.funct3) {
-                case 0b000: return InstructionType::LB;
-                case 0b001: return InstructionType::LH;
-                case 0b010: return InstructionType::LW;
-                case 0b100: return InstructionType::LBU;
-                case 0b101: return InstructionType::LHU;
-            }
-        } break;
-        case 0b0100011: {
-            switch (instruction.Styp.funct3) {
-                case 0b000: return InstructionType::SB;
-                case 0b001: return InstructionType::SH;
-                case 0b010: return InstructionType::SW;
-            }
-        } break;
-        case 0b0010011: {
-            switch (instruction.Ityp.funct3) {
-                case 0b000: return InstructionType::ADDI;
-                case 0b010: return InstructionType::SLTI;
-                case 0b011: return InstructionType::SLTIU;
-                case 0b100: return InstructionType::XORI;
-                case 0b110: return InstructionType::ORI;
-                case 0b111: return InstructionType::ANDI;
-                case 0b001: return InstructionType::SLLI;
-                case 0b101: {
-                    switch (instruction.Rtyp.funct7) {
-                        case 0b0000000: return InstructionType::SRLI;
-                        case 0b0100000: return InstructionType::SRAI;
-                    }
-                } break;
-            }
-        } break;
-        case 0b0110011: {
-            switch (instruction.Rtyp.funct3) {
-                case 0b000: {
-                    switch (instruction.Rtyp.funct7) {
-                        case 0b0000000: return InstructionType::ADD;
-                        case 0b0100000: return InstructionType::SUB;
-                        case 0b0000001: return InstructionType::MUL;
-                    }
-                } break;
-                case 0b001: {
-                    switch (instruction.Rtyp.funct7) {
-                        case 0b0000000: return InstructionType::SLL;
-                        case 0b0000001: return InstructionType::MULH;
-                    }
-                } break;
-                case 0b010: {
-                    switch (instruction.Rtyp.funct7) {
-                        case 0b0000000: return InstructionType::SLT;
-                        case 0b0000001: return InstructionType::MULHSU;
-                    }
-                } break;
-                case 0b011: {
-                    switch (instruction.Rtyp.funct7) {
-                        case 0b0000000: return InstructionType::SLTU;
-                        case 0b0000001: return InstructionType::MULHU;
-                    }
-                } break;
-                case 0b100: {
-                    switch (instruction.Rtyp.funct7) {
-                        case 0b0000000: return InstructionType::XOR;
-                        case 0b0000001: return InstructionType::DIV;
-                    }
-                } break;
-                case 0b101: {
-                    switch (instruction.Rtyp.funct7) {
-                        case 0b0000000: return InstructionType::SRL;
-                        case 0b0100000: return InstructionType::SRA;
-                        case 0b0000001: return InstructionType::DIVU;
-                    }
-                } break;
-                case 0b110: {
-                    switch (instruction.Rtyp.funct7) {
-                        case 0b0000000: return InstructionType::OR;
-                        case 0b0000001: return InstructionType::REM;
-                    }
-                } break;
-                case 0b111: {
-                    switch (instruction.Rtyp.funct7) {
-                        case 0b0000000: return InstructionType::AND;
-                        case 0b0000001: return InstructionType::REMU;
-                    }
-                } break;
-            }
-        } break;
-        case 0b0001111: {
-            return InstructionType::FENCE;
-        } break;
-        case 0b1110011: {
-            switch (instruction.Rtyp.funct3) {
-                case 0b000: {
-                    switch (instruction.Ityp.imm11_0) {
-                        case 0b000000000000: return InstructionType::ECALL;
-                        case 0b000000000001: return InstructionType::EBREAK;
-                    }
-                } break;
-                case 0b001: return InstructionType::CSRRW;
-                case 0b010: return InstructionType::CSRRS;
-                case 0b011: return InstructionType::CSRRC;
-                case 0b101: return InstructionType::CSRRWI;
-                case 0b110: return InstructionType::CSRRSI;
-                case 0b111: return InstructionType::CSRRCI;
-            }
-        } break;
-        case 0b0000111: return InstructionType::FLW;
-        case 0b0100111: return InstructionType::FSW;
-        case 0b1000011: return InstructionType::FMADDS;
-        case 0b1000111: return InstructionType::FMSUBS;
-        case 0b1001011: return InstructionType::FNMSUBS;
-        case 0b1001111: return InstructionType::FNMADDS;
-        case 0b1010011: {
-            switch (instruction.Rtyp.funct7) {
-                case 0b0000000: return InstructionType::FADDS;
-                case 0b0000100: return InstructionType::FSUBS;
-                case 0b0001000: return InstructionType::FMULS;
-                case 0b0001100: return InstructionType::FDIVS;
-                case 0b0101100: return InstructionType::FSQRTS;
-                case 0b0010000: {
-                    switch (instruction.Rtyp.funct3) {
-                        case 0b000: return InstructionType::FSGNJS;
-                        case 0b001: return InstructionType::FSGNJNS;
-                        case 0b010: return InstructionType::FSGNJXS;
-                    }
-                } break;
-                case 0b0010100: {
-                    switch (instruction.Rtyp.funct3) {
-                        case 0b000: return InstructionType::FMINS;
-                        case 0b001: return InstructionType::FMAXS;
-                    }
-                } break;
-                case 0b1100000: {
-                    switch (instruction.Rtyp.rs2) {
-                        case 0b00000: return InstructionType::FCVTWS;
-                        case 0b00001: return InstructionType::FCVTWUS;
-                    }
-                } break;
-                case 0b1110000: {
-                    switch (instruction.Rtyp.funct3) {
-                        case 0b000: return InstructionType::FMVXW;
-                        case 0b001: return InstructionType::FCLASSS;
-                    }
-                } break;
-                case 0b1010000: {
-                    switch (instruction.Rtyp.funct3) {
-                        case 0b010: return InstructionType::FEQS;
-                        case 0b001: return InstructionType::FLTS;
-                        case 0b000: return InstructionType::FLES;
-                    }
-                } break;
-                case 0b1101000: {
-                    switch (instruction.Rtyp.rs2) {
-                        case 0b00000: return InstructionType::FCVTSW;
-                        case 0b00001: return InstructionType::FCVTSWU;
-                    }
-                } break;
-                case 0b1111000: return InstructionType::FMVWX;
-            }
-        } break;
-    }
-    return InstructionType::ILLEGAL;
-}
-
-InstructionType DecodeInstruction(RawInstruction instruction)
-{
-    switch (instruction.value & 0b11) {
-        case 0b00: return InstructionType::ILLEGAL; // return DecodeQ0(instruction);
-        case 0b01: return InstructionType::ILLEGAL; // return DecodeQ1(instruction);
-        case 0b10: return InstructionType::ILLEGAL; // return DecodeQ2(instruction);
-        case 0b11: return DecodeQ3(instruction);
-    }
-    return InstructionType::ILLEGAL;
-}
-
-void CPU::Reset()
-{
-    pc = 0;
-    memset(&intRegs, 0, sizeof(intRegs));
-    memset(&fltRegs, 0, sizeof(fltRegs));
-    memset(&csr, 0, sizeof(csr));
-    memset(&memory, 0, sizeof(memory));
-}
-
-const char* ParseELFResultMessage(ParseELFResult result)
-{
-    switch (result) {
-        case ParseELFResult::Ok: return "Success";
-        case ParseELFResult::WrongMagic: return "Missing ELF header";
-        case ParseELFResult::WrongClass: return "ELF file is not 32-bit";
-        case ParseELFResult::WrongData: return "ELF file is not little-endian";
-        case ParseELFResult::WrongType: return "ELF file is not executable";
-        case ParseELFResult::WrongMachine: return "ELF file targets wrong machine, expected RISC-V";
-        case ParseELFResult::WrongVersion: return "ELF file has wrong version, expected 1";
-        case ParseELFResult::NoEntry: return "ELF file does not specify entry point";
-    }
-    return "";
-}
-
-ParseELFResult CPU::InitializeFromELF(uint8_t* data, size_t size)
+// The decoder looks an instruction up in two steps. The primary table is indexed by the bits that
+// almost every instruction is told apart by (opcode[6:2], funct3 and bit 20, which is the low bit
+// of rs2 for the conversions and of the immediate for ecall/ebreak) and points at a block of the
+// secondary table, which is indexed by as much of funct7 as that block depends on. The encoding
+// of the result is then checked against the whole word, which covers the bits neither table
+// looked at (and rejects the compressed quadrants, since every mask covers the low two bits).
+struct DecodeTables
 {
-    // ELF Header
-    assert(sizeof(Elf32_Ehdr) < size);
-    Elf32_Ehdr header;
-    memcpy(&header, data, sizeof(header));
+    constexpr static uint32_t PrimarySize = 1 << 9;
+    constexpr static uint32_t Funct7Size = 1 << 7;
+    constexpr static uint32_t SecondarySize = 4096;
 
-    if (header.e_ident[EI_MAG0] != ELFMAG0 ||
-        header.e_ident[EI_MAG1] != ELFMAG1 ||
-        header.e_ident[EI_MAG2] != ELFMAG2 ||
-        header.e_ident[EI_MAG3] != ELFMAG3)
+    struct Primary
     {
-        return ParseELFResult::WrongMagic;
-    }
+        uint16_t base;
+        uint8_t funct7Mask;
+    };
 
-    if (header.e_ident[EI_CLASS] != ELFCLASS32) {
-        return ParseELFResult::WrongClass;
-    }
+    Primary primary[PrimarySize]{};
+    uint8_t secondary[SecondarySize]{};
+    uint32_t secondaryUsed = 0;
+    InstructionEncoding byType[static_cast<uint32_t>(InstructionType::COUNT)]{};
 
-    if (header.e_ident[EI_DATA] != ELFDATA2LSB) {
-        return ParseELFResult::WrongData;
+    constexpr static uint32_t PrimaryIndex(uint32_t word)
+    {
+        return ((word >> 2) & 0x1F) | ((word >> 7) & 0xE0) | ((word >> 12) & 0x100);
     }
 
-    // Rest of e_ident: version, OSABI, padding...
-
-    if (header.e_type != ET_EXEC) {
-        return ParseELFResult::WrongType;
+    constexpr InstructionType Decode(uint32_t word) const
+    {
+        Primary entry = primary[PrimaryIndex(word)];
+        auto type = static_cast<InstructionType>(secondary[entry.base + ((word >> 25) & entry.funct7Mask)]);
+        const InstructionEncoding& encoding = byType[static_cast<uint32_t>(type)];
+        return (word & encoding.mask) == encoding.match ? type : InstructionType::ILLEGAL;
     }
+};
 
-    if (header.e_machine != EM_RISCV) {
-        return ParseELFResult::WrongMachine;
-    }
+static_assert(static_cast<uint32_t>(InstructionType::COUNT) <= UINT8_MAX);
 
-    if (header.e_version != EV_CURRENT) {
-        return ParseELFResult::WrongVersion;
-    }
+static constexpr DecodeTables BuildDecodeTables()
+{
+    constexpr uint32_t PrimaryBits = 0x0010707C;
+    constexpr uint32_t Funct7Bits = 0xFE000000;
+    constexpr uint32_t EncodingCount = sizeof(InstructionEncodings) / sizeof(InstructionEncodings[0]);
 
-    if (header.e_entry == 0) {
-        return ParseELFResult::NoEntry;
+    DecodeTables tables;
+    tables.byType[0] = { InstructionType::ILLEGAL, InstructionFormat::Bare, 0, 0 };
+    for (const InstructionEncoding& encoding : InstructionEncodings) {
+        // Every instruction is 32 bits wide, and can only be told apart from another one by a bit
+        // that is part of a key or checked afterwards
+        if ((encoding.mask & 0x7F) != 0x7F || (encoding.match & ~encoding.mask) != 0)
+            throw "Malformed instruction encoding";
+        tables.byType[static_cast<uint32_t>(encoding.type)] = encoding;
     }
 
-    // Parsed successfully...
-    Reset();
-    pc = header.e_entry & ~0x80000000;
-
-    assert(header.e_phoff == sizeof(Elf32_Ehdr));
-    size_t programHeaderOffset = header.e_phoff;
-    size_t sectionHeaderOffset = header.e_shoff;
-
-    assert(header.e_ehsize == sizeof(Elf32_Ehdr));
-    assert(header.e_phentsize == sizeof(Elf32_Phdr));
-    assert(header.e_shentsize == sizeof(Elf32_Shdr));
-
-    size_t numProgramHeaders = header.e_phnum;
-    size_t numSectionHeaders = header.e_shnum;
-
-    size_t sectionHeadersStartIdx = header.e_shstrndx;
-
-
-    // Program Headers
-    size_t programHeadersSize = numProgramHeaders * sizeof(Elf32_Phdr);
-    Elf32_Phdr* programHeaders = (Elf32_Phdr*) malloc(programHeadersSize);
-    assert(programHeaders != NULL && "malloc failed - buy more RAM");
+    for (uint32_t index = 0; index < DecodeTables::PrimarySize; ++index) {
+        uint32_t primaryWord = ((index & 0x1F) << 2) | ((index & 0xE0) << 7) | ((index & 0x100) << 12);
 
-    assert(programHeaderOffset + programHeadersSize <= size);
-    memcpy(programHeaders, data + programHeaderOffset, programHeadersSize);
-    for (size_t i = 0; i < numProgramHeaders; ++i) {
-        Elf32_Phdr pHeader = programHeaders[i];
-        if (pHeader.p_type == PT_LOAD) {
-            assert(pHeader.p_paddr == pHeader.p_vaddr); // Not always true, but simpler
-            assert(pHeader.p_filesz == pHeader.p_memsz);
-            pHeader.p_paddr &= ~0x80000000;
-            // TODO: Respect flags
-            memcpy(memory.buffer + pHeader.p_paddr, data + pHeader.p_offset, pHeader.p_filesz);
+        // Only the encodings that agree with this entry on its primary bits can be in its block
+        uint32_t candidates[EncodingCount]{};
+        uint32_t candidateCount = 0;
+        uint32_t funct7Mask = 0;
+        for (uint32_t i = 0; i < EncodingCount; ++i) {
+            const InstructionEncoding& encoding = InstructionEncodings[i];
+            if ((primaryWord & encoding.mask & PrimaryBits) == (encoding.match & PrimaryBits)) {
+                candidates[candidateCount++] = i;
+                funct7Mask |= (encoding.mask & Funct7Bits) >> 25;
+            }
         }
-    }
-
-    free(programHeaders);
-
-    (void) numSectionHeaders;
-    (void) sectionHeadersStartIdx;
-    (void) sectionHeaderOffset;
-#if 0 // These are unimportant for execution, only for linking
-    // Section Headers
-    size_t sectionHeadersSize = numSectionHeaders * sizeof(Elf32_Shdr);
-    Elf32_Shdr* sectionHeaders = (Elf32_Shdr*) malloc(sectionHeadersSize);
-    assert(sectionHeaders != NULL && "malloc failed - buy more RAM");
-
-    assert(sectionHeaderOffset + sectionHeadersSize <= size);
-    memcpy(sectionHeaders, data + sectionHeaderOffset, sectionHeadersSize);
-
-    assert(sectionHeadersStartIdx != SHN_UNDEF);
-    Elf32_Shdr shstrtab = sectionHeaders[sectionHeadersStartIdx];
-    assert(shstrtab.sh_type == SHT_STRTAB);
 
-    for (size_t i = 0; i < numSectionHeaders; ++i) {
-        Elf32_Shdr sHeader = sectionHeaders[i];
-        if (sHeader.sh_name != SHN_UNDEF) {
-            const char* sectionName = (char*) data + shstrtab.sh_offset + sHeader.sh_name;
-            printf("%zu: %s\n", i, sectionName);
+        uint8_t block[DecodeTables::Funct7Size]{};
+        uint32_t blockSize = funct7Mask + 1;
+        for (uint32_t funct7 = 0; funct7 < blockSize; ++funct7) {
+            if ((funct7 & ~funct7Mask) != 0)
+                continue;
+            uint32_t key = primaryWord | (funct7 << 25);
+            for (uint32_t i = 0; i < candidateCount; ++i) {
+                const InstructionEncoding& encoding = InstructionEncodings[candidates[i]];
+                uint32_t keyMask = encoding.mask & (PrimaryBits | Funct7Bits);
+                if ((key & keyMask) != (encoding.match & keyMask))
+                    continue;
+                if (block[funct7] != 0)
+                    throw "Two instruction encodings share a decode key";
+                block[funct7] = static_cast<uint8_t>(encoding.type);
+            }
         }
 
-        // ...
+        // Many entries decode the same way (e.g. funct3 is the rounding mode of most float
+        // instructions), so they share their block
+        uint32_t base = 0;
+        for (; base + blockSize <= tables.secondaryUsed; ++base) {
+            bool same = true;
+            for (uint32_t i = 0; i < blockSize && same; ++i)
+                same = tables.secondary[base + i] == block[i];
+            if (same)
+                break;
+        }
+        if (base + blockSize > tables.secondaryUsed) {
+            base = tables.secondaryUsed;
+            if (base + blockSize > DecodeTables::SecondarySize)
+                throw "Secondary decode table is too small";
+            for (uint32_t i = 0; i < blockSize; ++i)
+                tables.secondary[base + i] = block[i];
+            tables.secondaryUsed += blockSize;
+        }
+        tables.primary[index] = { static_cast<uint16_t>(base), static_cast<uint8_t>(funct7Mask) };
     }
+    return tables;
+}
 
-    free(sectionHeaders);
-#endif
+static constexpr DecodeTables decodeTables = BuildDecodeTables();
 
-    return ParseELFResult::Ok;
+static_assert(decodeTables.Decode(0x30200073) == InstructionType::MRET);
+static_assert(decodeTables.Decode(0x10200073) == InstructionType::SRET);
+static_assert(decodeTables.Decode(0x12b50073) == InstructionType::SFENCE_VMA);
+static_assert(decodeTables.Decode(0x00000073) == InstructionType::ECALL);
+static_assert(decodeTables.Decode(0x00100073) == InstructionType::EBREAK);
+static_assert(decodeTables.Decode(0x40d75733) == InstructionType::SRA);
+static_assert(decodeTables.Decode(0xc0151553) == InstructionType::FCVTWUS);
+static_assert(decodeTables.Decode(0xc0251553) == InstructionType::ILLEGAL);
+static_assert(decodeTables.Decode(0x100526af) == InstructionType::LR_W);
+static_assert(decodeTables.Decode(0x10b526af) == InstructionType::ILLEGAL);
+static_assert(decodeTables.Decode(0x0eb526af) == InstructionType::AMOSWAP_W);
+static_assert(decodeTables.Decode(0xe0b526af) == InstructionType::AMOMAXU_W);
+static_assert(decodeTables.Decode(0x00004501) == InstructionType::ILLEGAL);
+
+InstructionType DecodeInstruction(RawInstruction instruction)
+{
+    return decodeTables.Decode(instruction.value);
 }
 
+const InstructionEncoding& EncodingOf(InstructionType type)
+{
+    return decodeTables.byType[static_cast<uint32_t>(type)];
+}
 
-bool CPU::Step()
+DecodedInstruction DecodeOperands(RawInstruction instruction, uint32_t pc)
 {
-    RawInstruction ins{memory.Read<uint32_t>(pc)};
-    InstructionType type = DecodeInstruction(ins);
-    if (type == InstructionType::MRET) {
-        // TODO: Actually do privilege stuff
-        pc = csr.Read(CSR_mepc);
-        return true;
+    DecodedInstruction ins{
+        .type = DecodeInstruction(instruction),
+        .rd = static_cast<uint8_t>(instruction.Rtyp.rd),
+        .rs1 = static_cast<uint8_t>(instruction.Rtyp.rs1),
+        .rs2 = static_cast<uint8_t>(instruction.Rtyp.rs2),
+        .rs3 = static_cast<uint8_t>(instruction.R4typ.rs3),
+        .imm = 0,
+        .nextPc = pc + 4,
+    };
+    switch (ins.type) {
+        // I-type
+        case InstructionType::ADDI:
+        case InstructionType::SLTI:
+        case InstructionType::SLTIU:
+        case InstructionType::ANDI:
+        case InstructionType::ORI:
+        case InstructionType::XORI:
+        case InstructionType::JALR:
+        case InstructionType::LW:
+        case InstructionType::LH:
+        case InstructionType::LHU:
+        case InstructionType::LB:
+        case InstructionType::LBU:
+        case InstructionType::FLW:
+            ins.imm = SignExtend(instruction.Ityp.imm11_0, 12);
+            break;
+        // I-type (shift)
+        case InstructionType::SLLI:
+        case InstructionType::SRLI:
+        case InstructionType::SRAI:
+            ins.imm = instruction.Ityp.imm11_0 & 0b11111;
+            break;
+        // I-type (csr)
+        case InstructionType::CSRRW:
+        case InstructionType::CSRRS:
+        case InstructionType::CSRRC:
+        case InstructionType::CSRRWI:
+        case InstructionType::CSRRSI:
+        case InstructionType::CSRRCI:
+            ins.imm = instruction.Ityp.imm11_0;
+            break;
+        // Its predecessor and successor sets
+        case InstructionType::FENCE:
+            ins.imm = instruction.Ityp.imm11_0 & 0xFF;
+            break;
+        // Float instructions that round
+        case InstructionType::FMADDS:
+        case InstructionType::FMSUBS:
+        case InstructionType::FNMSUBS:
+        case InstructionType::FNMADDS:
+        case InstructionType::FADDS:
+        case InstructionType::FSUBS:
+        case InstructionType::FMULS:
+        case InstructionType::FDIVS:
+        case InstructionType::FSQRTS:
+        case InstructionType::FCVTWS:
+        case InstructionType::FCVTWUS:
+        case InstructionType::FCVTSW:
+        case InstructionType::FCVTSWU:
+            ins.imm = instruction.Rtyp.funct3;
+            break;
+        // S-type
+        case InstructionType::SW:
+        case InstructionType::SH:
+        case InstructionType::SB:
+        case InstructionType::FSW:
+            ins.imm = SignExtend(instruction.Styp.imm(), 12);
+            break;
+        // U-type
+        case InstructionType::LUI:
+            ins.imm = instruction.Utyp.imm31_12 << 12;
+            break;
+        case InstructionType::AUIPC:
+            ins.imm = pc + (instruction.Utyp.imm31_12 << 12);
+            break;
+        // J-type
+        case InstructionType::JAL:
+            ins.imm = pc + SignExtend(instruction.Jtyp.imm(), 21);
+            break;
+        // B-type
+        case InstructionType::BEQ:
+        case InstructionType::BNE:
+        case InstructionType::BLT:
+        case InstructionType::BLTU:
+        case InstructionType::BGE:
+        case InstructionType::BGEU:
+            ins.imm = pc + SignExtend(instruction.Btyp.imm(), 13);
+            break;
+        // No immediate
+        case InstructionType::ILLEGAL:
+        case InstructionType::MRET:
+        case InstructionType::SRET:
+        case InstructionType::SFENCE_VMA:
+        case InstructionType::ADD:
+        case InstructionType::SUB:
+        case InstructionType::SLL:
+        case InstructionType::SLT:
+        case InstructionType::SLTU:
+        case InstructionType::XOR:
+        case InstructionType::SRL:
+        case InstructionType::SRA:
+        case InstructionType::OR:
+        case InstructionType::AND:
+        case InstructionType::ECALL:
+        case InstructionType::EBREAK:
+        case InstructionType::FENCE_I:
+        case InstructionType::MUL:
+        case InstructionType::MULH:
+        case InstructionType::MULHSU:
+        case InstructionType::MULHU:
+        case InstructionType::DIV:
+        case InstructionType::DIVU:
+        case InstructionType::REM:
+        case InstructionType::REMU:
+        case InstructionType::LR_W:
+        case InstructionType::SC_W:
+        case InstructionType::AMOSWAP_W:
+        case InstructionType::AMOADD_W:
+        case InstructionType::AMOXOR_W:
+        case InstructionType::AMOAND_W:
+        case InstructionType::AMOOR_W:
+        case InstructionType::AMOMIN_W:
+        case InstructionType::AMOMAX_W:
+        case InstructionType::AMOMINU_W:
+        case InstructionType::AMOMAXU_W:
+        case InstructionType::FSGNJS:
+        case InstructionType::FSGNJNS:
+        case InstructionType::FSGNJXS:
+        case InstructionType::FMINS:
+        case InstructionType::FMAXS:
+        case InstructionType::FMVXW:
+        case InstructionType::FEQS:
+        case InstructionType::FLTS:
+        case InstructionType::FLES:
+        case InstructionType::FCLASSS:
+        case InstructionType::FMVWX:
+        case InstructionType::LUI_ADDI:
+        case InstructionType::AUIPC_ADDI:
+        case InstructionType::AUIPC_LW:
+        case InstructionType::AUIPC_JALR:
+        case InstructionType::SLLI_SRLI:
+        case InstructionType::MULH_MUL:
+        case InstructionType::MULHU_MUL:
+        case InstructionType::COUNT:
+            break;
+    }
+    return ins;
+}
+
+Extensions RequiredExtensions(InstructionType type)
+{
+    // InstructionType lists the instructions of each extension together
+    if (type >= InstructionType::FLW && type <= InstructionType::FMVWX) return Extensions::RV32IMAF;
+    if (type >= InstructionType::LR_W && type <= InstructionType::AMOMAXU_W) return Extensions::RV32IMA;
+    if (type >= InstructionType::MUL && type <= InstructionType::REMU) return Extensions::RV32IM;
+    if (type == InstructionType::MULH_MUL || type == InstructionType::MULHU_MUL) return Extensions::RV32IM;
+    return Extensions::RV32I;
+}
+
+InstructionType UnfusedType(InstructionType type)
+{
+    if (type == InstructionType::LUI_ADDI) return InstructionType::LUI;
+    if (type == InstructionType::AUIPC_ADDI || type == InstructionType::AUIPC_LW || type == InstructionType::AUIPC_JALR) return InstructionType::AUIPC;
+    if (type == InstructionType::SLLI_SRLI) return InstructionType::SLLI;
+    if (type == InstructionType::MULH_MUL) return InstructionType::MULH;
+    if (type == InstructionType::MULHU_MUL) return InstructionType::MULHU;
+    return type;
+}
+
+// Compilers emit these pairs for constants, addresses, far calls, zero extension and wide multiplies
+static InstructionType FusedType(const DecodedInstruction& first, const DecodedInstruction& second)
+{
+    // The second instruction uses the result of the first, and overwrites it where that is required
+    bool isChained = first.rd != 0 && second.rs1 == first.rd;
+    bool isSameDestination = isChained && second.rd == first.rd;
+    bool isSameProduct = second.type == InstructionType::MUL && second.rs1 == first.rs1 && second.rs2 == first.rs2
+                      && first.rd != first.rs1 && first.rd != first.rs2;
+    if (first.type == InstructionType::LUI) {
+        if (isSameDestination && second.type == InstructionType::ADDI) return InstructionType::LUI_ADDI;
+    }
+    else if (first.type == InstructionType::AUIPC) {
+        if (isSameDestination && second.type == InstructionType::ADDI) return InstructionType::AUIPC_ADDI;
+        if (isChained && second.type == InstructionType::LW) return InstructionType::AUIPC_LW;
+        if (isChained && second.type == InstructionType::JALR) return InstructionType::AUIPC_JALR;
+    }
+    else if (first.type == InstructionType::SLLI) {
+        if (isSameDestination && second.type == InstructionType::SRLI && second.imm == first.imm) return InstructionType::SLLI_SRLI;
+    }
+    else if (first.type == InstructionType::MULH || first.type == InstructionType::MULHU) {
+        if (isSameProduct) return first.type == InstructionType::MULH ? InstructionType::MULH_MUL : InstructionType::MULHU_MUL;
+    }
+    return first.type;
+}
+
+static void FuseInstructions(std::vector<DecodedInstruction>& instructions)
+{
+    for (size_t i = 0; i + 1 < instructions.size(); ++i) {
+        InstructionType fused = FusedType(instructions[i], instructions[i + 1]);
+        if (fused != instructions[i].type) {
+            instructions[i].type = fused;
+            ++i;
+        }
+    }
+}
+
+static bool EndsBasicBlock(const DecodedInstruction& ins)
+{
+    InstructionType type = ins.type;
+    // Paging selects another interpreter, which has to take over from the next instruction
+    if (type >= InstructionType::CSRRW && type <= InstructionType::CSRRCI)
+        return AffectsTranslation(ins.imm);
+    // Traps and returns from them, control transfers, and what changes the code or translation
+    return type <= InstructionType::SFENCE_VMA
+        || (type >= InstructionType::JAL && type <= InstructionType::BGEU)
+        || type == InstructionType::FENCE_I || type == InstructionType::ECALL || type == InstructionType::EBREAK;
+}
+
+BasicBlock& BlockCache::Insert(BasicBlock&& block)
+{
+    uint32_t firstRegion = block.startPc >> RegionBits;
+    uint32_t lastRegion = (block.endPc - 1) >> RegionBits;
+    if (codeRegions.size() <= lastRegion)
+        codeRegions.resize(lastRegion + 1);
+    for (uint32_t region = firstRegion; region <= lastRegion; ++region)
+        codeRegions[region] = true;
+
+    uint32_t startPc = block.startPc;
+    BasicBlock& inserted = blocks.insert_or_assign(startPc, std::move(block)).first->second;
+    lookup[(startPc >> 2) % LookupSize] = &inserted;
+    return inserted;
+}
+
+// Blocks are not removed immediately, since the block that performed the store may still be executing.
+// The invalidation takes effect before the next block is looked up, which is at the latest after the
+// FENCE.I that the specification requires before modified instructions are guaranteed to be fetched.
+void BlockCache::Invalidate(uint32_t address, uint32_t size)
+{
+    uint32_t firstRegion = address >> RegionBits;
+    uint32_t lastRegion = (address + size - 1) >> RegionBits;
+    for (uint32_t region = firstRegion; region <= lastRegion; ++region) {
+        if (region < codeRegions.size() && codeRegions[region]) {
+            codeRegions[region] = false;
+            pendingRegions.push_back(region);
+        }
+    }
+}
+
+void BlockCache::InvalidateAll()
+{
+    pendingFlushAll = true;
+}
+
+void BlockCache::FlushPendingInvalidations()
+{
+    if (pendingFlushAll) {
+        Clear();
+        return;
+    }
+    if (pendingRegions.empty())
+        return;
+
+    for (auto it = blocks.begin(); it != blocks.end();) {
+        const BasicBlock& block = it->second;
+        uint32_t firstRegion = block.startPc >> RegionBits;
+        uint32_t lastRegion = (block.endPc - 1) >> RegionBits;
+        bool isInvalidated = false;
+        for (uint32_t region : pendingRegions)
+            isInvalidated |= firstRegion <= region && region <= lastRegion;
+        it = isInvalidated ? blocks.erase(it) : std::next(it);
+    }
+    memset(lookup, 0, sizeof(lookup));
+    pendingRegions.clear();
+}
+
+void BlockCache::Clear()
+{
+    blocks.clear();
+    memset(lookup, 0, sizeof(lookup));
+    codeRegions.clear();
+    pendingRegions.clear();
+    pendingFlushAll = false;
+}
+
+static uint8_t* ReserveWindow()
+{
+#if defined(_WIN32)
+    return static_cast<uint8_t*>(VirtualAlloc(nullptr, Memory::WindowSize, MEM_RESERVE, PAGE_NOACCESS));
+#else
+    void* mapping = mmap(nullptr, Memory::WindowSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return (mapping == MAP_FAILED) ? nullptr : static_cast<uint8_t*>(mapping);
+#endif
+}
+
+static void ReleaseWindow(void* window)
+{
+    if (window == nullptr) return;
+#if defined(_WIN32)
+    VirtualFree(window, 0, MEM_RELEASE);
+#else
+    munmap(window, Memory::WindowSize);
+#endif
+}
+
+// Room for pages, permissions and dirty, which read as zero until they are written, so that a
+// Memory only pays for the entries of the pages it uses
+static uint8_t* ReserveTables()
+{
+#if defined(_WIN32)
+    void* mapping = VirtualAlloc(nullptr, Memory::TablesSize, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (mapping == nullptr)
+        throw std::bad_alloc();
+#else
+    void* mapping = mmap(nullptr, Memory::TablesSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED)
+        throw std::bad_alloc();
+#endif
+    return static_cast<uint8_t*>(mapping);
+}
+
+static void ReleaseTables(void* tables)
+{
+#if defined(_WIN32)
+    VirtualFree(tables, 0, MEM_RELEASE);
+#else
+    munmap(tables, Memory::TablesSize);
+#endif
+}
+
+static bool CommitPages(void* window, MemoryRegion region)
+{
+    if (window == nullptr) return false;
+    uint8_t* pages = static_cast<uint8_t*>(window) + region.start;
+#if defined(_WIN32)
+    return VirtualAlloc(pages, region.size, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+    return mprotect(pages, region.size, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+// On POSIX, pages are replaced rather than advised away, since the ones mapped from a file would
+// go back to its contents rather than to zero, see Memory::MapFile
+static void DecommitPages(void* window, MemoryRegion region)
+{
+    uint8_t* pages = static_cast<uint8_t*>(window) + region.start;
+#if defined(_WIN32)
+    VirtualFree(pages, region.size, MEM_DECOMMIT);
+#else
+    mmap(pages, region.size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+#endif
+}
+
+// Leaves the pages reading as zero, without holding on to host memory
+static void DiscardPages(void* window, MemoryRegion region)
+{
+    uint8_t* pages = static_cast<uint8_t*>(window) + region.start;
+#if defined(_WIN32)
+    VirtualFree(pages, region.size, MEM_DECOMMIT);
+    VirtualAlloc(pages, region.size, MEM_COMMIT, PAGE_READWRITE);
+#else
+    mmap(pages, region.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+#endif
+}
+
+// The Step or Run that the thread is in, which its CPU's faulting accesses return to
+struct MemoryFaultGuard
+{
+    CPU* cpu;
+#if defined(_WIN32)
+    jmp_buf recovery;
+#else
+    sigjmp_buf recovery;
+#endif
+    volatile StopReason reason;
+    // The instructions Run had completed before the block that the interpreter is in, and its start
+    volatile uint64_t count;
+    volatile uint32_t blockStart;
+    MemoryFaultGuard* previous;
+};
+
+static thread_local MemoryFaultGuard* activeGuard = nullptr;
+
+// Abandons the instruction whose access faulted, see GuardMemoryFaults
+[[noreturn]] static void RaiseFault(StopReason reason)
+{
+    assert(activeGuard != nullptr);
+    activeGuard->reason = reason;
+#if defined(_WIN32)
+    longjmp(activeGuard->recovery, 1);
+#else
+    siglongjmp(activeGuard->recovery, 1);
+#endif
+}
+
+template<typename Execution>
+RunResult CPU::GuardMemoryFaults(Execution execution)
+{
+    MemoryFaultGuard guard;
+    guard.cpu = this;
+    guard.reason = StopReason::MemoryFault;
+    guard.count = 0;
+    guard.blockStart = pc;
+    guard.previous = activeGuard;
+    activeGuard = &guard;
+    RunResult result;
+#if defined(_WIN32)
+    if (setjmp(guard.recovery) == 0) {
+#else
+    if (sigsetjmp(guard.recovery, 0) == 0) {
+#endif
+        result = execution();
+    }
+    else {
+        // Accesses come before anything else that an instruction does, so it is left undone
+        pc = accessingInstruction->nextPc - 4;
+        result = { guard.reason, guard.count + (pc - guard.blockStart) / 4 };
+        // The other faults were recorded where they were raised. Atomics have no offset, and fault
+        // as stores unless they only load.
+        if (guard.reason == StopReason::MemoryFault) {
+            const DecodedInstruction& ins = *accessingInstruction;
+            bool isLoad = (ins.type >= InstructionType::LB && ins.type <= InstructionType::LHU)
+                       || ins.type == InstructionType::FLW || ins.type == InstructionType::LR_W;
+            RecordFault(intRegs.Read<uint32_t>(ins.rs1) + ins.imm, isLoad ? AccessType::Read : AccessType::Write, guard.reason);
+        }
+    }
+    activeGuard = guard.previous;
+    return result;
+}
+
+Memory::Memory()
+{
+    buffer = ReserveWindow();
+#if CPU_TRACK_CHANGES
+    didChange = reinterpret_cast<bool*>(ReserveWindow());
+#endif
+    // Every page starts out unmapped, without permissions, and clean
+    static_assert(Unmapped == 0);
+    uint8_t* tables = ReserveTables();
+    pages = tables;
+    permissions = tables + PageCount;
+    dirty = reinterpret_cast<uint64_t*>(tables + 2 * PageCount);
+    Map(0, DefaultSize);
+}
+
+Memory::Memory(const Memory& other) : Memory()
+{
+    *this = other;
+}
+
+Memory& Memory::operator=(const Memory& other)
+{
+    if (this == &other)
+        return *this;
+    UnmapAll();
+    DetachDevices();
+    for (const Device& device : other.devices)
+        AttachDevice(device);
+    for (const MemoryRegion& region : other.regions)
+        Map(region.start, region.size);
+    // The rest reads as zero already
+    for (uint32_t page : other.dirtyPages) {
+        if (pages[page] != RAM) continue;
+        NoteFirstWrite(page);
+        uint32_t address = page * PageSize;
+        memcpy(buffer + address, other.buffer + address, PageSize);
+#if CPU_TRACK_CHANGES
+        memcpy(didChange + address, other.didChange + address, PageSize);
+#endif
+    }
+    // Without the code, which the copy has not decoded yet, or the other's snapshot. Pages outside
+    // of memory have none in either.
+    for (const MemoryRegion& region : other.regions)
+        for (uint64_t page = region.start / PageSize; page < (region.start + region.size) / PageSize; ++page)
+            permissions[page] = other.permissions[page] & ~(HoldsCode | Shared);
+    return *this;
+}
+
+Memory::~Memory()
+{
+    ReleaseSnapshot();
+    ReleaseWindow(buffer);
+#if CPU_TRACK_CHANGES
+    ReleaseWindow(didChange);
+#endif
+    ReleaseTables(pages);
+}
+
+bool Memory::Map(uint32_t start, uint64_t size)
+{
+    if (size == 0)
+        return true;
+    uint64_t first = start & ~static_cast<uint64_t>(PageSize - 1);
+    uint64_t last = std::min((start + size + PageSize - 1) & ~static_cast<uint64_t>(PageSize - 1), WindowSize);
+    for (uint64_t page = first / PageSize; page < last / PageSize; ++page)
+        if (pages[page] >= FirstDevice)
+            return false;
+    ReleaseSnapshot();
+    MemoryRegion range{ static_cast<uint32_t>(first), last - first };
+    if (!CommitPages(buffer, range))
+        return false;
+#if CPU_TRACK_CHANGES
+    if (!CommitPages(didChange, range))
+        return false;
+#endif
+    for (uint64_t page = first / PageSize; page < last / PageSize; ++page) {
+        if (pages[page] != RAM)
+            permissions[page] = Readable | Writable | Executable | Clean;
+        pages[page] = RAM;
+    }
+
+    std::vector<MemoryRegion> merged;
+    for (const MemoryRegion& region : regions) {
+        uint64_t end = region.start + region.size;
+        if (end < first || region.start > last) {
+            merged.push_back(region);
+        }
+        else {
+            first = std::min<uint64_t>(first, region.start);
+            last = std::max(last, end);
+        }
+    }
+    merged.push_back({ static_cast<uint32_t>(first), last - first });
+    std::sort(merged.begin(), merged.end(), [](const MemoryRegion& a, const MemoryRegion& b) { return a.start < b.start; });
+    regions = std::move(merged);
+    return true;
+}
+
+void Memory::UnmapAll()
+{
+    ReleaseSnapshot();
+    for (const MemoryRegion& region : regions) {
+        DecommitPages(buffer, region);
+#if CPU_TRACK_CHANGES
+        DecommitPages(didChange, region);
+#endif
+        std::fill_n(pages + region.start / PageSize, region.size / PageSize, Unmapped);
+        std::fill_n(permissions + region.start / PageSize, region.size / PageSize, 0);
+    }
+    regions.clear();
+    for (uint32_t page : dirtyPages)
+        dirty[page / 64] &= ~(uint64_t(1) << (page % 64));
+    dirtyPages.clear();
+    codePages.clear();
+    fileRanges.clear();
+}
+
+bool Memory::MapFile(uint32_t start, uint32_t size, [[maybe_unused]] const MappedFile& file, uint64_t offset)
+{
+#if defined(_WIN32)
+    // Views cannot be placed inside of a reservation without placeholders, so the caller copies
+    return false;
+#else
+    uint32_t first = start & ~(PageSize - 1);
+    uint64_t last = (static_cast<uint64_t>(start) + size + PageSize - 1) & ~static_cast<uint64_t>(PageSize - 1);
+    if (size == 0 || offset % PageSize != start % PageSize || offset + size > file.size || !Contains(first, static_cast<uint32_t>(last - first)))
+        return false;
+    ReleaseSnapshot();
+    NoteWrite(first, static_cast<uint32_t>(last - first));
+    void* mapping = mmap(buffer + first, last - first, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, file.descriptor, offset - (start - first));
+    if (mapping == MAP_FAILED) {
+        DiscardPages(buffer, { first, last - first });
+        return false;
+    }
+    fileRanges.push_back({ first, last - first });
+    // The file goes on around the range, but memory does not
+    auto clear = [&](uint64_t from, uint64_t to) {
+        for (uint64_t a = from; a < to; ++a) {
+            if (buffer[a] != 0) {
+                memset(buffer + a, 0, to - a);
+                break;
+            }
+        }
+    };
+    clear(first, start);
+    clear(static_cast<uint64_t>(start) + size, last);
+    return true;
+#endif
+}
+
+void Memory::Protect(uint32_t start, uint64_t size, uint8_t allowed)
+{
+    uint64_t last = std::min<uint64_t>((start + size + PageSize - 1) / PageSize, PageCount);
+    for (uint64_t page = start / PageSize; page < last; ++page)
+        if (pages[page] == RAM)
+            permissions[page] = (permissions[page] & (HoldsCode | Watched)) | allowed;
+}
+
+bool Memory::AttachDevice(Device device)
+{
+    if (device.size == 0 || device.start + device.size > WindowSize || devices.size() == 256 - FirstDevice)
+        return false;
+    uint64_t first = device.start / PageSize;
+    uint64_t last = (device.start + device.size + PageSize - 1) / PageSize;
+    for (uint64_t page = first; page < last; ++page)
+        if (pages[page] != Unmapped)
+            return false;
+    std::fill(pages + first, pages + last, static_cast<uint8_t>(FirstDevice + devices.size()));
+    devices.push_back(std::move(device));
+    return true;
+}
+
+void Memory::DetachDevices()
+{
+    for (const Device& device : devices)
+        std::fill(pages + device.start / PageSize, pages + (device.start + device.size + PageSize - 1) / PageSize, Unmapped);
+    devices.clear();
+}
+
+void Memory::Clear()
+{
+    ReleaseSnapshot();
+    // Pages from a file are replaced rather than zeroed, so that they stop holding on to it
+    for (const MemoryRegion& range : fileRanges)
+        DiscardPages(buffer, range);
+    ClearChanges();
+    for (uint32_t page : dirtyPages) {
+        uint32_t address = page * PageSize;
+        bool isFromFile = std::any_of(fileRanges.begin(), fileRanges.end(), [&](const MemoryRegion& range) { return address - range.start < range.size; });
+        if (!isFromFile)
+            memset(buffer + address, 0, PageSize);
+        dirty[page / 64] &= ~(uint64_t(1) << (page % 64));
+        permissions[page] |= Clean;
+    }
+    dirtyPages.clear();
+    fileRanges.clear();
+    for (uint32_t page : codePages)
+        permissions[page] &= ~HoldsCode;
+    codePages.clear();
+}
+
+void Memory::ClearChanges()
+{
+#if CPU_TRACK_CHANGES
+    // Stores note their pages before they write them, so only dirty pages can have changed
+    for (uint32_t page : dirtyPages)
+        memset(didChange + page * PageSize, 0, PageSize);
+#endif
+}
+
+void Memory::NoteCode(uint32_t page)
+{
+    std::lock_guard lock(firstWriteLock);
+    // Another hart may have marked it while this one waited
+    if (permissions[page] & HoldsCode)
+        return;
+    codePages.push_back(page);
+    std::atomic_ref(permissions[page]).fetch_or(HoldsCode);
+}
+
+void Memory::NoteFirstWrite(uint32_t page)
+{
+    std::lock_guard lock(firstWriteLock);
+    // Another hart may have noted it while this one waited
+    if (!(permissions[page] & Watched))
+        return;
+    if (permissions[page] & Clean) {
+        dirty[page / 64] |= uint64_t(1) << (page % 64);
+        dirtyPages.push_back(page);
+    }
+    // Restore shares the pages it copies back again, which are saved already
+    if (permissions[page] & Shared) {
+        std::vector<uint8_t>& saved = snapshot->pages[page];
+        if (saved.empty())
+            saved.assign(buffer + page * PageSize, buffer + (page + 1) * PageSize);
+    }
+    std::atomic_ref(permissions[page]).fetch_and(static_cast<uint8_t>(~Watched));
+}
+
+void Memory::Share(Snapshot& other)
+{
+    ReleaseSnapshot();
+    if (other.memory != nullptr)
+        other.memory->ReleaseSnapshot();
+    for (const MemoryRegion& region : regions)
+        for (uint64_t page = region.start / PageSize; page < (region.start + region.size) / PageSize; ++page)
+            permissions[page] |= Shared;
+    snapshot = &other;
+    snapshot->memory = this;
+}
+
+void Memory::ReleaseSnapshot()
+{
+    if (snapshot == nullptr)
+        return;
+    for (const MemoryRegion& region : regions)
+        for (uint64_t page = region.start / PageSize; page < (region.start + region.size) / PageSize; ++page)
+            permissions[page] &= ~Shared;
+    snapshot->memory = nullptr;
+    snapshot = nullptr;
+}
+
+Snapshot::~Snapshot()
+{
+    if (memory != nullptr)
+        memory->ReleaseSnapshot();
+}
+
+void CPU::TakeSnapshot(Snapshot& snapshot)
+{
+    memory.Share(snapshot);
+    snapshot.pages.clear();
+    snapshot.pc = pc;
+    snapshot.intRegs = intRegs;
+    snapshot.fltRegs = fltRegs;
+    snapshot.csr = csr;
+    snapshot.privilege = privilege;
+    // Stores to the pages have to miss it now
+    tlb.Flush();
+}
+
+bool CPU::Restore(Snapshot& snapshot)
+{
+    if (snapshot.memory != &memory)
+        return false;
+    for (const auto& [page, saved] : snapshot.pages) {
+        // Not written since the last restore
+        if (memory.permissions[page] & Memory::Shared)
+            continue;
+        uint32_t address = page * Memory::PageSize;
+        memcpy(memory.buffer + address, saved.data(), Memory::PageSize);
+#if CPU_TRACK_CHANGES
+        memset(memory.didChange + address, 0, Memory::PageSize);
+#endif
+        memory.permissions[page] |= Memory::Shared;
+        if (memory.permissions[page] & Memory::HoldsCode)
+            InvalidateCode(address, Memory::PageSize);
+    }
+    bool wasPaging = paging;
+    pc = snapshot.pc;
+    intRegs = snapshot.intRegs;
+    fltRegs = snapshot.fltRegs;
+    csr = snapshot.csr;
+    privilege = snapshot.privilege;
+    hasReservation = false;
+    floatFlagsPending = false;
+    tlb.Flush();
+    // The page tables may have been restored too
+    UpdateTranslation(wasPaging);
+    return true;
+}
+
+CPU::CPU(Memory& shared, uint32_t _hartId) : MemoryHolder(shared), hartId(_hartId)
+{
+    ResetHart();
+}
+
+void CPU::Reset()
+{
+    memory.Clear();
+    ResetHart();
+}
+
+void CPU::ResetHart()
+{
+    pc = 0;
+    memset(&intRegs, 0, sizeof(intRegs));
+    memset(&fltRegs, 0, sizeof(fltRegs));
+    memset(&csr, 0, sizeof(csr));
+    csr.Write(CSR_mhartid, hartId);
+    blockCache.Clear();
+    tlb.Flush();
+    jit.Clear();
+    aot = nullptr;
+    floatFlagsPending = false;
+    privilege = PRIV_M;
+    paging = false;
+    hasReservation = false;
+}
+
+const char* ParseELFResultMessage(ParseELFResult result)
+{
+    switch (result) {
+        case ParseELFResult::Ok: return "Success";
+        case ParseELFResult::WrongMagic: return "Missing ELF header";
+        case ParseELFResult::WrongClass: return "ELF file is not 32-bit";
+        case ParseELFResult::WrongData: return "ELF file is not little-endian";
+        case ParseELFResult::WrongType: return "ELF file is not executable";
+        case ParseELFResult::WrongMachine: return "ELF file targets wrong machine, expected RISC-V";
+        case ParseELFResult::WrongVersion: return "ELF file has wrong version, expected 1";
+        case ParseELFResult::NoEntry: return "ELF file does not specify entry point";
+    }
+    return "";
+}
+
+const char* StopReasonMessage(StopReason reason)
+{
+    switch (reason) {
+        case StopReason::Budget: return "Instruction budget exhausted";
+        case StopReason::Ecall: return "Environment call";
+        case StopReason::Ebreak: return "Environment break";
+        case StopReason::IllegalInstruction: return "Illegal instruction";
+        case StopReason::Breakpoint: return "Breakpoint hit";
+        case StopReason::MemoryFault: return "Memory access out of bounds";
+        case StopReason::PageFault: return "Page fault";
+        case StopReason::AccessFault: return "Access not permitted";
+        case StopReason::MisalignedAccess: return "Misaligned memory access";
+    }
+    return "";
+}
+
+static uint32_t ReadULEB128(const uint8_t*& p, const uint8_t* end)
+{
+    uint32_t value = 0;
+    for (uint32_t shift = 0; p < end; shift += 7) {
+        uint8_t byte = *p++;
+        if (shift < 32) value |= (byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) break;
+    }
+    return value;
+}
+
+// Arch strings look like "rv32i2p1_m2p0_f2p2_zicsr2p0", or "rv32imf" without versions
+static Extensions ExtensionsFromArch(const char* arch, size_t length)
+{
+    if (length < 4 || memcmp(arch, "rv32", 4) != 0)
+        return Extensions::RV32IMAF;
+    bool hasM = false;
+    bool hasA = false;
+    bool hasF = false;
+    for (size_t i = 4; i < length; ++i) {
+        char c = arch[i];
+        if (c == '_') {
+            // Multi-letter extensions run until the next underscore, none of them matter here
+            if (i + 1 < length && (arch[i + 1] == 'z' || arch[i + 1] == 's' || arch[i + 1] == 'x'))
+                while (i + 1 < length && arch[i + 1] != '_') ++i;
+            continue;
+        }
+        // Skip version numbers like 2p1
+        if ((c >= '0' && c <= '9') || (c == 'p' && arch[i - 1] >= '0' && arch[i - 1] <= '9'))
+            continue;
+        hasM |= c == 'm' || c == 'g';
+        hasA |= c == 'a' || c == 'g';
+        hasF |= c == 'f' || c == 'g';
+    }
+    // Each interpreter has the extensions of the ones before it, so programs get the smallest
+    // set that has everything they use
+    if (hasF) return Extensions::RV32IMAF;
+    if (hasA) return Extensions::RV32IMA;
+    if (hasM) return Extensions::RV32IM;
+    return Extensions::RV32I;
+}
+
+// e_flags only gives the floating point ABI, so the extensions come from the Tag_RISCV_arch
+// attribute instead. Programs without one are allowed to use everything.
+static Extensions ParseExtensions(const uint8_t* data, size_t size, const Elf32_Ehdr& header)
+{
+    constexpr uint32_t Tag_File = 1;
+    constexpr uint32_t Tag_RISCV_arch = 5;
+
+    if (header.e_shoff == 0 || header.e_shentsize != sizeof(Elf32_Shdr) || header.e_shoff + header.e_shnum * sizeof(Elf32_Shdr) > size)
+        return Extensions::RV32IMAF;
+    for (size_t i = 0; i < header.e_shnum; ++i) {
+        Elf32_Shdr section;
+        memcpy(&section, data + header.e_shoff + i * sizeof(section), sizeof(section));
+        if (section.sh_type != SHT_RISCV_ATTRIBUTES || section.sh_offset + section.sh_size > size)
+            continue;
+
+        // A format version, then subsections of a length, a vendor name and tagged attribute lists
+        const uint8_t* p = data + section.sh_offset;
+        const uint8_t* end = p + section.sh_size;
+        if (p == end || *p++ != 'A')
+            continue;
+        while (end - p > 4) {
+            uint32_t length;
+            memcpy(&length, p, sizeof(length));
+            if (length <= 4 || length > static_cast<size_t>(end - p))
+                break;
+            const uint8_t* subsectionEnd = p + length;
+            const char* vendor = reinterpret_cast<const char*>(p + 4);
+            size_t vendorLength = strnlen(vendor, subsectionEnd - (p + 4));
+            const uint8_t* q = p + 4 + vendorLength + 1;
+            if (vendorLength == 5 && memcmp(vendor, "riscv", 5) == 0 && subsectionEnd - q > 5 && *q == Tag_File) {
+                memcpy(&length, q + 1, sizeof(length));
+                const uint8_t* attributesEnd = (length <= static_cast<size_t>(subsectionEnd - q)) ? q + length : subsectionEnd;
+                q += 5;
+                while (q < attributesEnd) {
+                    // Odd tags have string values, even ones numbers
+                    uint32_t tag = ReadULEB128(q, attributesEnd);
+                    if (tag % 2 == 0) {
+                        ReadULEB128(q, attributesEnd);
+                        continue;
+                    }
+                    const char* value = reinterpret_cast<const char*>(q);
+                    size_t valueLength = strnlen(value, attributesEnd - q);
+                    if (tag == Tag_RISCV_arch)
+                        return ExtensionsFromArch(value, valueLength);
+                    q += valueLength + 1;
+                }
+            }
+            p = subsectionEnd;
+        }
+    }
+    return Extensions::RV32IMAF;
+}
+
+// Reads the ELF header, and checks that it is one of a program that can run here
+static ParseELFResult ParseELFHeader(const uint8_t* data, size_t size, Elf32_Ehdr& header)
+{
+    assert(sizeof(Elf32_Ehdr) < size);
+    memcpy(&header, data, sizeof(header));
+
+    if (header.e_ident[EI_MAG0] != ELFMAG0 ||
+        header.e_ident[EI_MAG1] != ELFMAG1 ||
+        header.e_ident[EI_MAG2] != ELFMAG2 ||
+        header.e_ident[EI_MAG3] != ELFMAG3)
+    {
+        return ParseELFResult::WrongMagic;
+    }
+
+    if (header.e_ident[EI_CLASS] != ELFCLASS32) {
+        return ParseELFResult::WrongClass;
+    }
+
+    if (header.e_ident[EI_DATA] != ELFDATA2LSB) {
+        return ParseELFResult::WrongData;
+    }
+
+    // Rest of e_ident: version, OSABI, padding...
+
+    if (header.e_type != ET_EXEC) {
+        return ParseELFResult::WrongType;
+    }
+
+    if (header.e_machine != EM_RISCV) {
+        return ParseELFResult::WrongMachine;
+    }
+
+    if (header.e_version != EV_CURRENT) {
+        return ParseELFResult::WrongVersion;
+    }
+
+    if (header.e_entry == 0) {
+        return ParseELFResult::NoEntry;
+    }
+
+    return ParseELFResult::Ok;
+}
+
+ParseELFResult CheckELF(const uint8_t* data, size_t size)
+{
+    Elf32_Ehdr header;
+    return ParseELFHeader(data, size, header);
+}
+
+ParseELFResult CPU::InitializeFromELF(const uint8_t* data, size_t size)
+{
+    return LoadELF(data, size, nullptr);
+}
+
+ParseELFResult CPU::InitializeFromELF(const MappedFile& file)
+{
+    return LoadELF(file.data, file.size, &file);
+}
+
+ParseELFResult CPU::LoadELF(const uint8_t* data, size_t size, const MappedFile* file)
+{
+    Elf32_Ehdr header;
+    ParseELFResult result = ParseELFHeader(data, size, header);
+    if (result != ParseELFResult::Ok)
+        return result;
+
+    // Parsed successfully... Memory is unmapped below, which leaves nothing for Reset to clear
+    ResetHart();
+    pc = header.e_entry;
+    extensions = ParseExtensions(data, size, header);
+
+    assert(header.e_phoff == sizeof(Elf32_Ehdr));
+    size_t programHeaderOffset = header.e_phoff;
+    size_t sectionHeaderOffset = header.e_shoff;
+
+    assert(header.e_ehsize == sizeof(Elf32_Ehdr));
+    assert(header.e_phentsize == sizeof(Elf32_Phdr));
+    assert(header.e_shentsize == sizeof(Elf32_Shdr));
+
+    size_t numProgramHeaders = header.e_phnum;
+    size_t numSectionHeaders = header.e_shnum;
+
+    size_t sectionHeadersStartIdx = header.e_shstrndx;
+
+
+    // Program Headers
+    size_t programHeadersSize = numProgramHeaders * sizeof(Elf32_Phdr);
+    Elf32_Phdr* programHeaders = (Elf32_Phdr*) malloc(programHeadersSize);
+    assert(programHeaders != NULL && "malloc failed - buy more RAM");
+
+    assert(programHeaderOffset + programHeadersSize <= size);
+    memcpy(programHeaders, data + programHeaderOffset, programHeadersSize);
+    // Segments go at the addresses they are linked at, and the program gets the default amount of
+    // memory from its lowest one for whatever it keeps outside of them, like its stack
+    memory.UnmapAll();
+    uint32_t lowestAddress = UINT32_MAX;
+    for (size_t i = 0; i < numProgramHeaders; ++i) {
+        Elf32_Phdr pHeader = programHeaders[i];
+        if (pHeader.p_type == PT_LOAD && pHeader.p_memsz != 0) {
+            assert(pHeader.p_paddr == pHeader.p_vaddr); // Not always true, but simpler
+            assert(pHeader.p_filesz <= pHeader.p_memsz);
+            assert(pHeader.p_offset + pHeader.p_filesz <= size);
+            bool mapped = memory.Map(pHeader.p_paddr, pHeader.p_memsz);
+            assert(mapped && "mmap failed - buy more RAM");
+            (void) mapped;
+            // A segment is mapped from the file if it has its pages to itself, otherwise it is
+            // copied, next to others that only ever write their own bytes. Either way, the rest is
+            // .bss, which fresh pages already hold zeroes for.
+            bool isShared = false;
+            for (size_t j = 0; j < numProgramHeaders; ++j) {
+                const Elf32_Phdr& other = programHeaders[j];
+                isShared |= j != i && other.p_type == PT_LOAD && other.p_memsz != 0
+                    && other.p_paddr / Memory::PageSize <= (pHeader.p_paddr + pHeader.p_memsz - 1ull) / Memory::PageSize
+                    && pHeader.p_paddr / Memory::PageSize <= (other.p_paddr + other.p_memsz - 1ull) / Memory::PageSize;
+            }
+            if (pHeader.p_filesz != 0 && (file == nullptr || isShared || !memory.MapFile(pHeader.p_paddr, pHeader.p_filesz, *file, pHeader.p_offset))) {
+                memory.NoteWrite(pHeader.p_paddr, pHeader.p_filesz);
+                memcpy(memory.buffer + pHeader.p_paddr, data + pHeader.p_offset, pHeader.p_filesz);
+            }
+            lowestAddress = std::min(lowestAddress, pHeader.p_paddr);
+        }
+    }
+    uint32_t defaultStart = (lowestAddress == UINT32_MAX) ? 0 : lowestAddress;
+    memory.Map(defaultStart, Memory::DefaultSize);
+
+    // Memory outside of the segments holds data. Pages that segments share allow what either of them does.
+    memory.Protect(defaultStart, Memory::DefaultSize, Memory::Readable | Memory::Writable);
+    for (size_t i = 0; i < numProgramHeaders; ++i)
+        if (programHeaders[i].p_type == PT_LOAD && programHeaders[i].p_memsz != 0)
+            memory.Protect(programHeaders[i].p_paddr, programHeaders[i].p_memsz, 0);
+    for (size_t i = 0; i < numProgramHeaders; ++i) {
+        const Elf32_Phdr& pHeader = programHeaders[i];
+        if (pHeader.p_type != PT_LOAD || pHeader.p_memsz == 0)
+            continue;
+        uint8_t allowed = 0;
+        if (pHeader.p_flags & PF_R) allowed |= Memory::Readable;
+        if (pHeader.p_flags & PF_W) allowed |= Memory::Writable;
+        if (pHeader.p_flags & PF_X) allowed |= Memory::Executable;
+        for (uint64_t page = pHeader.p_paddr / Memory::PageSize; page <= (pHeader.p_paddr + pHeader.p_memsz - 1ull) / Memory::PageSize; ++page)
+            memory.permissions[page] |= allowed;
+    }
+
+    free(programHeaders);
+
+    (void) numSectionHeaders;
+    (void) sectionHeadersStartIdx;
+    (void) sectionHeaderOffset;
+#if 0 // These are unimportant for execution, only for linking
+    // Section Headers
+    size_t sectionHeadersSize = numSectionHeaders * sizeof(Elf32_Shdr);
+    Elf32_Shdr* sectionHeaders = (Elf32_Shdr*) malloc(sectionHeadersSize);
+    assert(sectionHeaders != NULL && "malloc failed - buy more RAM");
+
+    assert(sectionHeaderOffset + sectionHeadersSize <= size);
+    memcpy(sectionHeaders, data + sectionHeaderOffset, sectionHeadersSize);
+
+    assert(sectionHeadersStartIdx != SHN_UNDEF);
+    Elf32_Shdr shstrtab = sectionHeaders[sectionHeadersStartIdx];
+    assert(shstrtab.sh_type == SHT_STRTAB);
+
+    for (size_t i = 0; i < numSectionHeaders; ++i) {
+        Elf32_Shdr sHeader = sectionHeaders[i];
+        if (sHeader.sh_name != SHN_UNDEF) {
+            const char* sectionName = (char*) data + shstrtab.sh_offset + sHeader.sh_name;
+            printf("%zu: %s\n", i, sectionName);
+        }
+
+        // ...
+    }
+
+    free(sectionHeaders);
+#endif
+
+    return ParseELFResult::Ok;
+}
+
+
+// The bits that a device access of size bytes carries
+static uint32_t SizeMask(uint32_t size)
+{
+    return (size == 4) ? UINT32_MAX : (1u << (8 * size)) - 1;
+}
+
+// Sv32 splits a virtual address into two 10 bit page numbers and a 12 bit offset. The first one
+// indexes the root table that satp points to, whose entry is either a 4 MB superpage or points
+// to a table that the second one indexes. A and D are set by the walk rather than faulting.
+bool CPU::Walk(uint32_t address, AccessType access, uint32_t& physical, StopReason& fault)
+{
+    fault = StopReason::PageFault;
+    uint64_t table = static_cast<uint64_t>(csr.Read(CSR_satp) & SATP_PPN) * Memory::PageSize;
+    for (int32_t level = 1; level >= 0; --level) {
+        uint64_t entryAddress = table + ((address >> (12 + 10 * level)) & 0x3FF) * 4;
+        if (entryAddress >= Memory::WindowSize || !memory.Contains(static_cast<uint32_t>(entryAddress), 4)) {
+            fault = StopReason::MemoryFault;
+            return false;
+        }
+        uint32_t pte = memory.Read<uint32_t>(static_cast<uint32_t>(entryAddress));
+        if (!(pte & PTE_V) || (!(pte & PTE_R) && (pte & PTE_W)))
+            return false;
+        uint64_t pageNumber = pte >> 10;
+        if (!(pte & (PTE_R | PTE_X))) {
+            table = pageNumber * Memory::PageSize;
+            continue;
+        }
+
+        uint32_t status = csr.Read(CSR_mstatus);
+        if (privilege == PRIV_U && !(pte & PTE_U))
+            return false;
+        // Supervisor code never runs from user pages, and only accesses their data with SUM
+        if (privilege == PRIV_S && (pte & PTE_U) && (access == AccessType::Execute || !(status & MSTATUS_SUM)))
+            return false;
+        bool isAllowed = false;
+        switch (access) {
+            case AccessType::Read: isAllowed = (pte & PTE_R) || ((status & MSTATUS_MXR) && (pte & PTE_X));
+            break; case AccessType::Write: isAllowed = pte & PTE_W;
+            break; case AccessType::Execute: isAllowed = pte & PTE_X;
+        }
+        if (!isAllowed)
+            return false;
+        // A superpage has to be aligned to its size
+        if (level == 1 && (pageNumber & 0x3FF) != 0)
+            return false;
+
+        uint64_t page = (level == 1) ? (pageNumber << 12) | (address & 0x003FF000) : pageNumber << 12;
+        if (page >= Memory::WindowSize || memory.PageKind(static_cast<uint32_t>(page)) == Memory::Unmapped) {
+            fault = StopReason::MemoryFault;
+            return false;
+        }
+        // Below the page tables, memory has permissions of its own
+        uint8_t allowed = memory.permissions[page / Memory::PageSize];
+        if (memory.PageKind(static_cast<uint32_t>(page)) == Memory::RAM
+            && ((access == AccessType::Read && !(allowed & Memory::Readable))
+                || (access == AccessType::Write && !(allowed & Memory::Writable))
+                || (access == AccessType::Execute && !(allowed & Memory::Fetchable))))
+        {
+            fault = StopReason::AccessFault;
+            return false;
+        }
+        uint32_t updated = pte | PTE_A | ((access == AccessType::Write) ? PTE_D : 0);
+        if (updated != pte) {
+            memory.Write<false>(static_cast<uint32_t>(entryAddress), updated);
+        }
+
+        // Device pages stay out of the TLB, so that their accesses keep missing it, and so do
+        // stores to watched pages until StoreMissed has noted them
+        bool isWatched = memory.permissions[page / Memory::PageSize] & Memory::Watched;
+        if (memory.PageKind(static_cast<uint32_t>(page)) == Memory::RAM && !(access == AccessType::Write && isWatched)) {
+            TLB::Entry* entries = (access == AccessType::Read) ? tlb.read : (access == AccessType::Write) ? tlb.write : tlb.execute;
+            uint32_t virtualPage = address & ~(Memory::PageSize - 1);
+            entries[TLB::Index(address)] = { virtualPage, reinterpret_cast<uintptr_t>(memory.buffer + page) - virtualPage };
+        }
+        physical = static_cast<uint32_t>(page) | (address & (Memory::PageSize - 1));
+        return true;
+    }
+    return false;
+}
+
+void CPU::RecordFault(uint32_t address, AccessType access, StopReason fault)
+{
+    // Accesses outside of memory are access faults too
+    if (fault != StopReason::PageFault && fault != StopReason::AccessFault && fault != StopReason::MemoryFault)
+        return;
+    bool isPageFault = fault == StopReason::PageFault;
+    switch (access) {
+        case AccessType::Read: csr.Write(CSR_mcause, isPageFault ? CAUSE_LOAD_PAGE_FAULT : CAUSE_LOAD_ACCESS);
+        break; case AccessType::Write: csr.Write(CSR_mcause, isPageFault ? CAUSE_STORE_PAGE_FAULT : CAUSE_STORE_ACCESS);
+        break; case AccessType::Execute: csr.Write(CSR_mcause, isPageFault ? CAUSE_FETCH_PAGE_FAULT : CAUSE_FETCH_ACCESS);
+    }
+    csr.Write(CSR_mtval, address);
+}
+
+void CPU::CheckMemory(uint32_t address, uint32_t size, AccessType access)
+{
+    if (!memory.Contains(address, size))
+        RaiseFault(StopReason::MemoryFault);
+    uint32_t first = address / Memory::PageSize;
+    uint32_t last = (address + size - 1) / Memory::PageSize;
+    uint8_t allowed = (access == AccessType::Read) ? Memory::Readable : Memory::Writable;
+    if (!(memory.permissions[first] & memory.permissions[last] & allowed)) {
+        RecordFault(address, access, StopReason::AccessFault);
+        RaiseFault(StopReason::AccessFault);
+    }
+    if (access == AccessType::Write) {
+        if ((memory.permissions[first] | memory.permissions[last]) & Memory::HoldsCode)
+            InvalidateCode(address, size);
+        memory.NoteWrite(address, size);
+    }
+}
+
+uint32_t CPU::CheckLoad(uint32_t address, uint32_t size)
+{
+    Device* device = memory.DeviceAt(address, size);
+    if (device != nullptr && device->read)
+        return device->read(address - device->start, size) & SizeMask(size);
+    CheckMemory(address, size, AccessType::Read);
+    uint32_t value = 0;
+    memcpy(&value, memory.buffer + address, size);
+    return value;
+}
+
+void CPU::CheckStore(uint32_t address, const void* value, uint32_t size, bool track)
+{
+    Device* device = memory.DeviceAt(address, size);
+    if (device != nullptr && device->write) {
+        uint32_t part = 0;
+        memcpy(&part, value, size);
+        device->write(address - device->start, size, part);
+        return;
+    }
+    CheckMemory(address, size, AccessType::Write);
+    memcpy(memory.buffer + address, value, size);
+#if CPU_TRACK_CHANGES
+    if (track)
+        memset(memory.didChange + address, 1, size);
+#else
+    (void) track;
+#endif
+}
+
+void CPU::UpdateTranslation(bool isRemapped)
+{
+    bool translating = (csr.Read(CSR_satp) & SATP_MODE) && privilege != PRIV_M;
+    // Entries hold the permissions of the mode and mstatus bits they were made with
+    if (translating || paging)
+        tlb.Flush();
+    // Blocks are cached by the address they were fetched from, which changes meaning with paging.
+    // Permissions are checked at the start of every block, so they do not matter.
+    if (translating != paging || isRemapped)
+        blockCache.InvalidateAll();
+    paging = translating;
+}
+
+const uint8_t* CPU::InstructionAt(uint32_t address, StopReason& fault)
+{
+    fault = StopReason::MemoryFault;
+    if (!paging) {
+        if (!memory.Contains(address, 4))
+            return nullptr;
+        fault = StopReason::AccessFault;
+        return (memory.permissions[address / Memory::PageSize] & Memory::Fetchable) ? memory.buffer + address : nullptr;
+    }
+    const TLB::Entry& entry = tlb.execute[TLB::Index(address)];
+    if (entry.tag == TLB::Tag(address, 4)) [[likely]]
+        return reinterpret_cast<const uint8_t*>(address + entry.addend);
+    // Only a misaligned instruction can cross into the next page, which Run does not fetch
+    uint32_t physical;
+    if (address % 4 != 0 || !Walk(address, AccessType::Execute, physical, fault))
+        return nullptr;
+    fault = StopReason::MemoryFault;
+    return (memory.PageKind(physical) == Memory::RAM) ? memory.buffer + physical : nullptr;
+}
+
+uint8_t* CPU::TranslateData(uint32_t address, AccessType access, uint32_t& physical)
+{
+    const TLB::Entry& entry = ((access == AccessType::Read) ? tlb.read : tlb.write)[TLB::Index(address)];
+    if (entry.tag == TLB::Tag(address, 1)) {
+        uint8_t* host = reinterpret_cast<uint8_t*>(address + entry.addend);
+        physical = static_cast<uint32_t>(host - memory.buffer);
+        return host;
+    }
+    StopReason fault;
+    if (!Walk(address, access, physical, fault)) {
+        RecordFault(address, access, fault);
+        RaiseFault(fault);
+    }
+    return (memory.PageKind(physical) == Memory::RAM) ? memory.buffer + physical : nullptr;
+}
+
+uint32_t CPU::LoadMissed(uint32_t address, uint32_t size)
+{
+    uint32_t value = 0;
+    for (uint32_t done = 0; done < size;) {
+        uint32_t piece = std::min(size - done, Memory::PageSize - (address + done) % Memory::PageSize);
+        uint32_t physical;
+        if (const uint8_t* host = TranslateData(address + done, AccessType::Read, physical)) {
+            memcpy(reinterpret_cast<uint8_t*>(&value) + done, host, piece);
+        }
+        else {
+            Device* device = memory.DeviceAt(physical, piece);
+            if (device == nullptr || !device->read)
+                RaiseFault(StopReason::MemoryFault);
+            value |= (device->read(physical - device->start, piece) & SizeMask(piece)) << (8 * done);
+        }
+        done += piece;
+    }
+    return value;
+}
+
+// Every page the store touches is translated before any of it is written, so that a page fault
+// leaves memory as it was
+void CPU::StoreMissed(uint32_t address, const void* value, uint32_t size, bool track)
+{
+    uint8_t* pieces[2];
+    uint32_t physical[2];
+    Device* devices[2] = {};
+    uint32_t first = std::min(size, Memory::PageSize - address % Memory::PageSize);
+    for (uint32_t done = 0, i = 0; done < size; ++i) {
+        uint32_t piece = (i == 0) ? first : size - first;
+        pieces[i] = TranslateData(address + done, AccessType::Write, physical[i]);
+        if (pieces[i] == nullptr) {
+            devices[i] = memory.DeviceAt(physical[i], piece);
+            if (devices[i] == nullptr || !devices[i]->write)
+                RaiseFault(StopReason::MemoryFault);
+        }
+        done += piece;
+    }
+    for (uint32_t done = 0, i = 0; done < size; ++i) {
+        uint32_t piece = (i == 0) ? first : size - first;
+        if (devices[i] != nullptr) {
+            uint32_t part = 0;
+            memcpy(&part, static_cast<const uint8_t*>(value) + done, piece);
+            devices[i]->write(physical[i] - devices[i]->start, piece, part);
+            done += piece;
+            continue;
+        }
+        memory.NoteWrite(physical[i], piece);
+        memcpy(pieces[i], static_cast<const uint8_t*>(value) + done, piece);
+#if CPU_TRACK_CHANGES
+        if (track)
+            memset(memory.didChange + physical[i], 1, piece);
+#else
+        (void) track;
+#endif
+        if (memory.permissions[physical[i] / Memory::PageSize] & Memory::HoldsCode)
+            InvalidateCode(address + done, piece, physical[i]);
+        done += piece;
+    }
+}
+
+template<bool Paging, bool Track>
+uint32_t* CPU::AtomicWord(uint32_t address, bool isStore, uint32_t& physical)
+{
+    uint8_t* host;
+    if constexpr (Paging) {
+        host = TranslateData(address, isStore ? AccessType::Write : AccessType::Read, physical);
+        // Devices cannot do atomics
+        if (host == nullptr)
+            RaiseFault(StopReason::MemoryFault);
+        if (isStore) {
+            memory.NoteWrite(physical, 4);
+            if (memory.permissions[physical / Memory::PageSize] & Memory::HoldsCode)
+                InvalidateCode(address, 4, physical);
+        }
+    }
+    else {
+        physical = address;
+        // Devices cannot do atomics
+        if (isStore && !memory.IsPlainStore(address, 4))
+            CheckMemory(address, 4, AccessType::Write);
+        else if (!isStore && !memory.IsPlainLoad(address, 4))
+            CheckMemory(address, 4, AccessType::Read);
+        host = memory.buffer + address;
+    }
+#if CPU_TRACK_CHANGES
+    if (Track && isStore)
+        memset(memory.didChange + physical, 1, 4);
+#endif
+    return reinterpret_cast<uint32_t*>(host);
+}
+
+bool CPU::Step()
+{
+    StopReason fault;
+    const uint8_t* word = InstructionAt(pc, fault);
+    if (word == nullptr) {
+        RecordFault(pc, AccessType::Execute, fault);
+        return false;
+    }
+    uint32_t raw;
+    memcpy(&raw, word, sizeof(raw));
+    DecodedInstruction ins = DecodeOperands(raw, pc);
+    StopReason reason = GuardMemoryFaults([&] {
+        return RunResult{ (this->*SelectExecute(Dispatch::Switch))(&ins, &ins + 1), 0 };
+    }).reason;
+    if (floatFlagsPending) FoldFloatFlags();
+    if (hostRoundingMode != RM_RNE) SetHostRoundingMode(RM_RNE);
+    return reason == StopReason::Budget;
+}
+
+RunResult CPU::Run(uint64_t maxInstructions)
+{
+    RunResult result = GuardMemoryFaults([&] { return RunBlocks(maxInstructions); });
+    if (floatFlagsPending) FoldFloatFlags();
+    if (hostRoundingMode != RM_RNE) SetHostRoundingMode(RM_RNE);
+    return result;
+}
+
+bool CPU::TakeInterrupt()
+{
+    uint32_t status = csr.Read(CSR_mstatus);
+    uint32_t pending = csr.Read(CSR_mip) & csr.Read(CSR_mie) & MIP_MSIP;
+    // Machine interrupts are always enabled below machine mode
+    if (pending == 0 || (privilege == PRIV_M && !(status & MSTATUS_MIE)))
+        return false;
+    uint32_t code = std::countr_zero(pending);
+    csr.Write(CSR_mepc, pc);
+    csr.Write(CSR_mcause, CAUSE_INTERRUPT | code);
+    csr.Write(CSR_mtval, 0);
+    status = (status & ~(MSTATUS_MIE | MSTATUS_MPIE | MSTATUS_MPP)) | ((status & MSTATUS_MIE) ? MSTATUS_MPIE : 0) | (privilege << MSTATUS_MPP_SHIFT);
+    csr.Write(CSR_mstatus, status);
+    privilege = PRIV_M;
+    // Vectored mode puts each interrupt at an entry of its own
+    uint32_t tvec = csr.Read(CSR_mtvec);
+    pc = (tvec & ~0b11u) + ((tvec & 1) ? 4 * code : 0);
+    UpdateTranslation();
+    return true;
+}
+
+Machine::Machine(uint32_t hartCount) : msip(new std::atomic<uint32_t>[hartCount]{})
+{
+    for (uint32_t i = 0; i < hartCount; ++i)
+        harts.push_back(std::make_unique<CPU>(memory, i));
+    // Only the low bit of each register is writable
+    Device clint{
+        .start = CLINT_BASE,
+        .size = CLINT_SIZE,
+        .read = [this, hartCount](uint32_t offset, uint32_t) {
+            return (offset / 4 < hartCount) ? msip[offset / 4].load() >> (offset % 4 * 8) : 0;
+        },
+        .write = [this, hartCount](uint32_t offset, uint32_t, uint32_t value) {
+            if (offset / 4 < hartCount && offset % 4 == 0)
+                msip[offset / 4].store(value & 1);
+        },
+    };
+    bool attached = memory.AttachDevice(clint);
+    assert(attached);
+    (void) attached;
+}
+
+void Machine::Reset()
+{
+    memory.Clear();
+    time = 0;
+    devices.clear();
+    for (uint32_t i = 0; i < harts.size(); ++i) {
+        harts[i]->ResetHart();
+        msip[i].store(0);
+    }
+}
+
+ParseELFResult Machine::InitializeFromELF(const uint8_t* data, size_t size)
+{
+    ParseELFResult result = harts[0]->InitializeFromELF(data, size);
+    if (result != ParseELFResult::Ok)
+        return result;
+    for (uint32_t i = 0; i < harts.size(); ++i) {
+        if (i != 0) {
+            harts[i]->ResetHart();
+            harts[i]->pc = harts[0]->pc;
+            harts[i]->extensions = harts[0]->extensions;
+        }
+        msip[i].store(0);
+    }
+    return result;
+}
+
+std::vector<RunResult> Machine::Run(uint64_t maxInstructions)
+{
+    if (scheduling == Scheduling::RoundRobin)
+        return RunRoundRobin(maxInstructions);
+    std::vector<RunResult> results(harts.size());
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < harts.size(); ++i)
+        threads.emplace_back([this, i, maxInstructions, &results] { results[i] = RunHart(i, maxInstructions); });
+    for (std::thread& thread : threads)
+        thread.join();
+    return results;
+}
+
+RunResult Machine::RunHart(uint32_t hart, uint64_t maxInstructions)
+{
+    RunResult result = { StopReason::Budget, 0 };
+    while (result.reason == StopReason::Budget && result.instructionCount < maxInstructions) {
+        RunResult quantum = RunQuantum(hart, maxInstructions - result.instructionCount);
+        result = { quantum.reason, result.instructionCount + quantum.instructionCount };
+    }
+    return result;
+}
+
+std::vector<RunResult> Machine::RunRoundRobin(uint64_t maxInstructions)
+{
+    std::vector<RunResult> results(harts.size(), { StopReason::Budget, 0 });
+    bool isRunning = true;
+    while (isRunning) {
+        // Devices spawned while resuming others wait for the next turn
+        size_t deviceCount = devices.size();
+        for (size_t i = 0; i < deviceCount; ++i) {
+            std::coroutine_handle<DeviceCoroutine::promise_type> device = devices[i].handle;
+            if (!device.done() && device.promise().wakeTime <= time)
+                device.resume();
+        }
+        isRunning = false;
+        for (uint32_t i = 0; i < harts.size(); ++i) {
+            RunResult& result = results[i];
+            if (result.reason != StopReason::Budget || result.instructionCount >= maxInstructions)
+                continue;
+            RunResult quantum = RunQuantum(i, maxInstructions - result.instructionCount);
+            result = { quantum.reason, result.instructionCount + quantum.instructionCount };
+            isRunning |= result.reason == StopReason::Budget && result.instructionCount < maxInstructions;
+        }
+        time += Quantum;
+    }
+    return results;
+}
+
+RunResult Machine::RunQuantum(uint32_t hart, uint64_t budget)
+{
+    CPU& cpu = *harts[hart];
+    uint32_t mip = cpu.csr.Read(CSR_mip) & ~MIP_MSIP;
+    if (msip[hart].load() != 0)
+        mip |= MIP_MSIP;
+    cpu.csr.Write(CSR_mip, mip);
+    cpu.TakeInterrupt();
+    return cpu.Run(std::min(Quantum, budget));
+}
+
+void Machine::Spawn(DeviceCoroutine device)
+{
+    device.handle.promise().wakeTime = time;
+    devices.push_back(std::move(device));
+}
+
+RunResult CPU::RunBlocks(uint64_t maxInstructions)
+{
+    ExecuteFunction execute = SelectExecute(dispatch);
+    bool isExecutePaging = paging;
+    if (aot != nullptr && aot->codeStart < aot->codeEnd)
+        memory.MarkCode(aot->codeStart, aot->codeEnd - aot->codeStart);
+    uint64_t count = 0;
+    while (count < maxInstructions) {
+        // The breakpoint at the starting pc is skipped, so that a run can resume from it
+        if (count != 0 && !breakpoints.empty() && breakpoints.contains(pc))
+            return { StopReason::Breakpoint, count };
+        StopReason fault;
+        if (InstructionAt(pc, fault) == nullptr) {
+            RecordFault(pc, AccessType::Execute, fault);
+            return { fault, count };
+        }
+        // Blocks that change paging end with the instruction that did it
+        if (paging != isExecutePaging) {
+            execute = SelectExecute(dispatch);
+            isExecutePaging = paging;
+        }
+
+        // Native code runs across blocks without looking for breakpoints. Each tier only returns
+        // to the loop once it has made progress, otherwise the next one takes over at the same pc.
+        // It does not translate addresses.
+        bool canRunNative = breakpoints.empty() && !paging;
+        int32_t nativeBudget = static_cast<int32_t>(std::min<uint64_t>(maxInstructions - count, INT32_MAX));
+        // Ahead of time translations never check alignment
+        if (canRunNative && aot != nullptr && misalignedAccess == MisalignedAccess::Native) {
+            int32_t budget = nativeBudget;
+            aot->run(*this, budget);
+            count += nativeBudget - budget;
+            if (budget != nativeBudget) continue;
+        }
+        BasicBlock* block = &LookupBlock(pc);
+#if CPU_JIT
+        if (canRunNative && jit.enabled && block->isTranslatable) {
+            if (block->translation == nullptr && ++block->executionCount >= jit.hotThreshold) {
+                block->translation = jit.Translate(*this, *block);
+                block->isTranslatable = block->translation != nullptr;
+            }
+            if (block->translation != nullptr) {
+                int32_t budget = nativeBudget;
+                jit.Run(*this, block->translation, budget);
+                count += nativeBudget - budget;
+                if (budget != nativeBudget) continue;
+            }
+        }
+#endif
+        size_t length = static_cast<size_t>(std::min<uint64_t>(block->instructions.size(), maxInstructions - count));
+        const DecodedInstruction* begin = block->instructions.data();
+        activeGuard->count = count;
+        activeGuard->blockStart = block->startPc;
+        StopReason reason = (this->*execute)(begin, begin + length);
+        if (reason != StopReason::Budget) {
+            // Blocks are straight line code up to the instruction that stopped
+            count += (pc - block->startPc) / 4;
+            return { reason, count };
+        }
+        count += length;
+    }
+    return { StopReason::Budget, count };
+}
+
+void CPU::ClaimFloatFlags()
+{
+    feclearexcept(FE_ALL_EXCEPT);
+    floatFlagsPending = true;
+}
+
+void CPU::SetHostRoundingMode(uint32_t roundingMode)
+{
+    constexpr int hostRoundingModes[] = { FE_TONEAREST, FE_TOWARDZERO, FE_DOWNWARD, FE_UPWARD };
+    assert(roundingMode < sizeof(hostRoundingModes) / sizeof(hostRoundingModes[0]));
+    fesetround(hostRoundingModes[roundingMode]);
+    hostRoundingMode = roundingMode;
+}
+
+template<typename Operation>
+float CPU::RoundToMaxMagnitude(Operation operation)
+{
+    // The operation is done in double rounding to odd (truncating, then setting the lowest bit if
+    // anything was cut off), which keeps enough bits for rounding to float afterwards to be correct.
+    // An exact tie is then rounded to even by the host, and moved away from zero by hand.
+    if (floatFlagsPending) FoldFloatFlags();
+    fesetround(FE_TOWARDZERO);
+    feclearexcept(FE_ALL_EXCEPT);
+    double x = operation();
+    int raised = fetestexcept(FE_ALL_EXCEPT);
+    if (raised & FE_INEXACT)
+        x = bit_cast<double>(bit_cast<uint64_t>(x) | 1);
+    SetHostRoundingMode(RM_RNE);
+    feclearexcept(FE_ALL_EXCEPT);
+    float result = static_cast<float>(x);
+    if (std::isfinite(result) && static_cast<double>(result) != x) {
+        float away = bit_cast<float>(bit_cast<uint32_t>(result) + 1);
+        if (std::fabs(x - static_cast<double>(result)) == std::fabs(static_cast<double>(away) - x))
+            result = away;
+    }
+    feraiseexcept(raised & (FE_INVALID | FE_DIVBYZERO));
+    floatFlagsPending = true;
+    return result;
+}
+
+// Rounds to an integral value in the host's rounding mode, raising inexact if that changes it.
+// This is what rintf does, but compilers expand rintf assuming round to nearest.
+static float RoundToInteger(float x)
+{
+    // From 2^23 on every float is an integer
+    constexpr float Integral = 8388608.0f;
+    if (!(std::fabs(x) < Integral))
+        return x;
+    float offset = std::copysign(Integral, x);
+    return (x + offset) - offset;
+}
+
+static float RoundToIntegerMaxMagnitude(float x)
+{
+    float result = roundf(x);
+    if (result != x)
+        feraiseexcept(FE_INEXACT);
+    return result;
+}
+
+void CPU::SetBreakpoint(uint32_t address, bool enabled)
+{
+    if (enabled) breakpoints.insert(address);
+    else breakpoints.erase(address);
+    // Blocks end before breakpoints, so they have to be rebuilt
+    blockCache.InvalidateAll();
+}
+
+void CPU::SetChangeTracking(bool enabled)
+{
+    trackChanges = enabled;
+    // Translations only record changes if tracking was on when they were made
+    blockCache.InvalidateAll();
+}
+
+void CPU::SetMisalignedAccess(MisalignedAccess mode)
+{
+    misalignedAccess = mode;
+    // Translations only check alignment if accesses were not native when they were made
+    blockCache.InvalidateAll();
+}
+
+bool CPU::AllowMisaligned(const DecodedInstruction& ins, uint32_t address)
+{
+    bool isAtomic = ins.type >= InstructionType::LR_W && ins.type <= InstructionType::AMOMAXU_W;
+    if (misalignedAccess == MisalignedAccess::Count && !isAtomic) {
+        ++misalignedAccesses[ins.nextPc - 4];
+        return true;
+    }
+    bool isStore = ins.type == InstructionType::SH || ins.type == InstructionType::SW || ins.type == InstructionType::FSW
+        || (isAtomic && ins.type != InstructionType::LR_W);
+    csr.Write(CSR_mcause, isStore ? CAUSE_STORE_MISALIGNED : CAUSE_LOAD_MISALIGNED);
+    csr.Write(CSR_mtval, address);
+    return false;
+}
+
+template<bool Threaded, bool TrackChanges, bool Paging>
+CPU::ExecuteFunction CPU::SelectExecute(Extensions extensions)
+{
+    switch (extensions) {
+        case Extensions::RV32I: return &CPU::Execute<ExecutionPolicy<Threaded, Extensions::RV32I, TrackChanges, Paging>>;
+        case Extensions::RV32IM: return &CPU::Execute<ExecutionPolicy<Threaded, Extensions::RV32IM, TrackChanges, Paging>>;
+        case Extensions::RV32IMA: return &CPU::Execute<ExecutionPolicy<Threaded, Extensions::RV32IMA, TrackChanges, Paging>>;
+        case Extensions::RV32IMAF: return &CPU::Execute<ExecutionPolicy<Threaded, Extensions::RV32IMAF, TrackChanges, Paging>>;
+    }
+    return nullptr;
+}
+
+CPU::ExecuteFunction CPU::SelectExecute(Dispatch dispatchMode) const
+{
+    bool threaded = dispatchMode == Dispatch::Threaded;
+    if (paging) {
+        if (threaded) return trackChanges ? SelectExecute<true, true, true>(extensions) : SelectExecute<true, false, true>(extensions);
+        return trackChanges ? SelectExecute<false, true, true>(extensions) : SelectExecute<false, false, true>(extensions);
+    }
+    if (threaded) return trackChanges ? SelectExecute<true, true, false>(extensions) : SelectExecute<true, false, false>(extensions);
+    return trackChanges ? SelectExecute<false, true, false>(extensions) : SelectExecute<false, false, false>(extensions);
+}
+
+BasicBlock& CPU::LookupBlock(uint32_t address)
+{
+    // Translations cover a prefix of their block, so they are invalidated along with it
+    jit.FlushPendingInvalidations(blockCache);
+    blockCache.FlushPendingInvalidations();
+    if (BasicBlock* block = blockCache.Find(address))
+        return *block;
+
+    BasicBlock block{ .startPc = address, .endPc = address, .instructions = {} };
+    while (block.instructions.size() < BlockCache::MaxBlockLength) {
+        if (!block.instructions.empty() && breakpoints.contains(block.endPc)) break;
+        // With paging, Run checks that a block may be fetched at its start, which has to cover all of it
+        if (!block.instructions.empty() && paging && block.endPc % Memory::PageSize == 0) break;
+        StopReason fault;
+        const uint8_t* word = InstructionAt(block.endPc, fault);
+        if (word == nullptr) break;
+        uint32_t raw;
+        memcpy(&raw, word, sizeof(raw));
+        DecodedInstruction ins = DecodeOperands(raw, block.endPc);
+        memory.MarkCode(static_cast<uint32_t>(word - memory.buffer), sizeof(raw));
+        block.instructions.push_back(ins);
+        block.endPc = ins.nextPc;
+        if (EndsBasicBlock(ins)) break;
     }
-    uint32_t oldPc = pc;
-    pc += 4;
-    switch (type) {
-        default: fprintf(stderr, "\"%s\" unimplemented!\n", InstructionName(type)); return false;
-        break; case InstructionType::ADDI:  intRegs.Write(ins.Ityp.rd, intRegs.Read<uint32_t>(ins.Ityp.rs1) + SignExtend(ins.Ityp.imm11_0, 12));
-        break; case InstructionType::SLTI:  intRegs.Write(ins.Ityp.rd, intRegs.Read< int32_t>(ins.Ityp.rs1) < SignExtend(ins.Ityp.imm11_0, 12));
-        break; case InstructionType::SLTIU: intRegs.Write(ins.Ityp.rd, intRegs.Read<uint32_t>(ins.Ityp.rs1) < (uint32_t)SignExtend(ins.Ityp.imm11_0, 12));
-        break; case InstructionType::ANDI:  intRegs.Write(ins.Ityp.rd, intRegs.Read< int32_t>(ins.Ityp.rs1) & SignExtend(ins.Ityp.imm11_0, 12));
-        break; case InstructionType::ORI:   intRegs.Write(ins.Ityp.rd, intRegs.Read< int32_t>(ins.Ityp.rs1) | SignExtend(ins.Ityp.imm11_0, 12));
-        break; case InstructionType::XORI:  intRegs.Write(ins.Ityp.rd, intRegs.Read< int32_t>(ins.Ityp.rs1) ^ SignExtend(ins.Ityp.imm11_0, 12));
-        break; case InstructionType::SLLI:  intRegs.Write(ins.Ityp.rd, intRegs.Read<uint32_t>(ins.Ityp.rs1) << (ins.Ityp.imm11_0 & 0b11111));
-        break; case InstructionType::SRLI:  intRegs.Write(ins.Ityp.rd, intRegs.Read<uint32_t>(ins.Ityp.rs1) >> (ins.Ityp.imm11_0 & 0b11111));
-        break; case InstructionType::SRAI:  intRegs.Write(ins.Ityp.rd, intRegs.Read< int32_t>(ins.Ityp.rs1) >> (ins.Ityp.imm11_0 & 0b11111));
-        break; case InstructionType::LUI:   intRegs.Write(ins.Utyp.rd, ins.Utyp.imm31_12 << 12);
-        break; case InstructionType::AUIPC: intRegs.Write(ins.Utyp.rd, oldPc + ((uint32_t)ins.Utyp.imm31_12 << 12));
-        break; case InstructionType::ADD:   intRegs.Write(ins.Rtyp.rd, intRegs.Read<uint32_t>(ins.Rtyp.rs1) + intRegs.Read<uint32_t>(ins.Rtyp.rs2));
-        break; case InstructionType::SUB:   intRegs.Write(ins.Rtyp.rd, intRegs.Read<uint32_t>(ins.Rtyp.rs1) - intRegs.Read<uint32_t>(ins.Rtyp.rs2));
-        break; case InstructionType::SLT:   intRegs.Write(ins.Rtyp.rd, intRegs.Read< int32_t>(ins.Rtyp.rs1) < intRegs.Read< int32_t>(ins.Rtyp.rs2));
-        break; case InstructionType::SLTU:  intRegs.Write(ins.Rtyp.rd, intRegs.Read<uint32_t>(ins.Rtyp.rs1) < intRegs.Read<uint32_t>(ins.Rtyp.rs2));
-        break; case InstructionType::AND:   intRegs.Write(ins.Rtyp.rd, intRegs.Read<uint32_t>(ins.Rtyp.rs1) & intRegs.Read<uint32_t>(ins.Rtyp.rs2));
-        break; case InstructionType::OR:    intRegs.Write(ins.Rtyp.rd, intRegs.Read<uint32_t>(ins.Rtyp.rs1) | intRegs.Read<uint32_t>(ins.Rtyp.rs2));
-        break; case InstructionType::XOR:   intRegs.Write(ins.Rtyp.rd, intRegs.Read<uint32_t>(ins.Rtyp.rs1) ^ intRegs.Read<uint32_t>(ins.Rtyp.rs2));
-        break; case InstructionType::SLL:   intRegs.Write(ins.Rtyp.rd, intRegs.Read<uint32_t>(ins.Rtyp.rs1) << (intRegs.Read<uint32_t>(ins.Rtyp.rs2) & 0b11111));
-        break; case InstructionType::SRL:   intRegs.Write(ins.Rtyp.rd, intRegs.Read<uint32_t>(ins.Rtyp.rs1) >> (intRegs.Read<uint32_t>(ins.Rtyp.rs2) & 0b11111));
-        break; case InstructionType::SRA:   intRegs.Write(ins.Rtyp.rd, intRegs.Read< int32_t>(ins.Rtyp.rs1) >> (intRegs.Read<uint32_t>(ins.Rtyp.rs2) & 0b11111));
-        break; case InstructionType::JAL: {
-            int32_t offset = SignExtend(ins.Jtyp.imm(), 21);
-            intRegs.Write(ins.Rtyp.rd, oldPc + 4);
-            pc = oldPc + offset;
-        }
-        break; case InstructionType::JALR: {
-            // Should base address be unsigned?
-            int32_t offset = SignExtend(ins.Ityp.imm11_0, 12);
-            int32_t target = (intRegs.Read<int32_t>(ins.Ityp.rs1) + offset) & ~0b1;
-            intRegs.Write(ins.Rtyp.rd, oldPc + 4);
-            pc = target;
-        }
-        break; case InstructionType::BEQ:   if (intRegs.Read<uint32_t>(ins.Btyp.rs1) == intRegs.Read<uint32_t>(ins.Btyp.rs2)) pc = pc + SignExtend(ins.Btyp.imm(), 13) - 4;
-        break; case InstructionType::BNE:   if (intRegs.Read<uint32_t>(ins.Btyp.rs1) != intRegs.Read<uint32_t>(ins.Btyp.rs2)) pc = pc + SignExtend(ins.Btyp.imm(), 13) - 4;
-        break; case InstructionType::BLT:   if (intRegs.Read< int32_t>(ins.Btyp.rs1) <  intRegs.Read< int32_t>(ins.Btyp.rs2)) pc = pc + SignExtend(ins.Btyp.imm(), 13) - 4;
-        break; case InstructionType::BLTU:  if (intRegs.Read<uint32_t>(ins.Btyp.rs1) <  intRegs.Read<uint32_t>(ins.Btyp.rs2)) pc = pc + SignExtend(ins.Btyp.imm(), 13) - 4;
-        break; case InstructionType::BGE:   if (intRegs.Read< int32_t>(ins.Btyp.rs1) >= intRegs.Read< int32_t>(ins.Btyp.rs2)) pc = pc + SignExtend(ins.Btyp.imm(), 13) - 4;
-        break; case InstructionType::BGEU:  if (intRegs.Read<uint32_t>(ins.Btyp.rs1) >= intRegs.Read<uint32_t>(ins.Btyp.rs2)) pc = pc + SignExtend(ins.Btyp.imm(), 13) - 4;
-        break; case InstructionType::LW:    intRegs.Write(ins.Ityp.rd, memory.Read< int32_t>(intRegs.Read<uint32_t>(ins.Ityp.rs1) + SignExtend(ins.Ityp.imm11_0, 12)));
-        break; case InstructionType::LH:    intRegs.Write(ins.Ityp.rd, memory.Read< int16_t>(intRegs.Read<uint32_t>(ins.Ityp.rs1) + SignExtend(ins.Ityp.imm11_0, 12)));
-        break; case InstructionType::LHU:   intRegs.Write(ins.Ityp.rd, memory.Read<uint16_t>(intRegs.Read<uint32_t>(ins.Ityp.rs1) + SignExtend(ins.Ityp.imm11_0, 12)));
-        break; case InstructionType::LB:    intRegs.Write(ins.Ityp.rd, memory.Read<  int8_t>(intRegs.Read<uint32_t>(ins.Ityp.rs1) + SignExtend(ins.Ityp.imm11_0, 12)));
-        break; case InstructionType::LBU:   intRegs.Write(ins.Ityp.rd, memory.Read< uint8_t>(intRegs.Read<uint32_t>(ins.Ityp.rs1) + SignExtend(ins.Ityp.imm11_0, 12)));
-        break; case InstructionType::SW:    memory.Write(intRegs.Read<uint32_t>(ins.Styp.rs1) + SignExtend(ins.Styp.imm(), 12), intRegs.Read<uint32_t>(ins.Styp.rs2));
-        break; case InstructionType::SH:    memory.Write(intRegs.Read<uint32_t>(ins.Styp.rs1) + SignExtend(ins.Styp.imm(), 12), intRegs.Read<uint16_t>(ins.Styp.rs2));
-        break; case InstructionType::SB:    memory.Write(intRegs.Read<uint32_t>(ins.Styp.rs1) + SignExtend(ins.Styp.imm(), 12), intRegs.Read< uint8_t>(ins.Styp.rs2));
-        break; case InstructionType::FENCE: // Do nothing
-        break; case InstructionType::FENCE_I:
-        break; case InstructionType::ECALL:  return false;
-        break; case InstructionType::EBREAK: return false;
-        break; case InstructionType::CSRRW: {
-            uint32_t oldCsr = csr.Read(ins.Ityp.imm11_0);
-            uint32_t oldRs1 = intRegs.Read(ins.Ityp.rs1);
-            intRegs.Write(ins.Ityp.rd, oldCsr);
-            csr.Write(ins.Ityp.imm11_0, oldRs1);
-        }
-        break; case InstructionType::CSRRS: {
-            uint32_t oldCsr = csr.Read(ins.Ityp.imm11_0);
-            uint32_t oldRs1 = intRegs.Read(ins.Ityp.rs1);
-            intRegs.Write(ins.Ityp.rd, oldCsr);
-            csr.Write(ins.Ityp.imm11_0, oldCsr | oldRs1);
-        }
-        break; case InstructionType::CSRRC: {
-            uint32_t oldCsr = csr.Read(ins.Ityp.imm11_0);
-            uint32_t oldRs1 = intRegs.Read(ins.Ityp.rs1);
-            intRegs.Write(ins.Ityp.rd, oldCsr);
-            csr.Write(ins.Ityp.imm11_0, oldCsr & ~oldRs1);
-        }
-        break; case InstructionType::CSRRWI: {
-            uint32_t oldCsr = csr.Read(ins.Ityp.imm11_0);
-            intRegs.Write(ins.Ityp.rd, oldCsr);
-            csr.Write(ins.Ityp.imm11_0, ins.Ityp.rs1);
-        }
-        break; case InstructionType::CSRRSI: {
-            uint32_t oldCsr = csr.Read(ins.Ityp.imm11_0);
-            intRegs.Write(ins.Ityp.rd, oldCsr);
-            csr.Write(ins.Ityp.imm11_0, oldCsr | ins.Ityp.rs1);
-        }
-        break; case InstructionType::CSRRCI: {
-            uint32_t oldCsr = csr.Read(ins.Ityp.imm11_0);
-            intRegs.Write(ins.Ityp.rd, oldCsr);
-            csr.Write(ins.Ityp.imm11_0, oldCsr & ~ins.Ityp.rs1);
-        }
-        break; case InstructionType::MUL:   intRegs.Write(ins.Rtyp.rd, ( int32_t)((( int64_t)intRegs.Read< int32_t>(ins.Rtyp.rs1) * ( int64_t)intRegs.Read< int32_t>(ins.Rtyp.rs2))));
-        break; case InstructionType::MULH:  intRegs.Write(ins.Rtyp.rd, ( int32_t)((( int64_t)intRegs.Read< int32_t>(ins.Rtyp.rs1) * ( int64_t)intRegs.Read< int32_t>(ins.Rtyp.rs2)) >> 32UL));
-        break; case InstructionType::MULHSU:intRegs.Write(ins.Rtyp.rd, ( int32_t)((( int64_t)intRegs.Read< int32_t>(ins.Rtyp.rs1) * (uint64_t)intRegs.Read<uint32_t>(ins.Rtyp.rs2)) >> 32UL));
-        break; case InstructionType::MULHU: intRegs.Write(ins.Rtyp.rd, ( int32_t)(((uint64_t)intRegs.Read<uint32_t>(ins.Rtyp.rs1) * (uint64_t)intRegs.Read<uint32_t>(ins.Rtyp.rs2)) >> 32UL));
-        break; case InstructionType::DIVU: {
-            uint64_t divisor = intRegs.Read<uint32_t>(ins.Rtyp.rs2);
-            uint64_t dividend = intRegs.Read<uint32_t>(ins.Rtyp.rs1);
+    FuseInstructions(block.instructions);
+    return blockCache.Insert(std::move(block));
+}
+
+// Executes the decoded instructions in [ins, end), which must not contain a control transfer
+// before the last instruction, and returns StopReason::Budget if all of them ran. With threaded
+// dispatch, each handler jumps directly to the handler of the next instruction, so the host branch
+// predictor gets a separate indirect branch per handler to learn from, instead of the single shared
+// one at the top of the switch.
+#if CPU_THREADED_DISPATCH
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+// Threaded policies never go back to the switch
+#pragma GCC diagnostic ignored "-Wunused-label"
+#endif
+template<typename Policy>
+StopReason CPU::Execute(const DecodedInstruction* ins, const DecodedInstruction* end)
+{
+#if CPU_THREADED_DISPATCH
+    static const void* const handlers[] = {
+        &&execute_ILLEGAL,
+        &&execute_MRET,
+        &&execute_SRET,
+        &&execute_SFENCE_VMA,
+        &&execute_LUI,
+        &&execute_AUIPC,
+        &&execute_JAL,
+        &&execute_JALR,
+        &&execute_BEQ,
+        &&execute_BNE,
+        &&execute_BLT,
+        &&execute_BGE,
+        &&execute_BLTU,
+        &&execute_BGEU,
+        &&execute_LB,
+        &&execute_LH,
+        &&execute_LW,
+        &&execute_LBU,
+        &&execute_LHU,
+        &&execute_SB,
+        &&execute_SH,
+        &&execute_SW,
+        &&execute_ADDI,
+        &&execute_SLTI,
+        &&execute_SLTIU,
+        &&execute_XORI,
+        &&execute_ORI,
+        &&execute_ANDI,
+        &&execute_SLLI,
+        &&execute_SRLI,
+        &&execute_SRAI,
+        &&execute_ADD,
+        &&execute_SUB,
+        &&execute_SLL,
+        &&execute_SLT,
+        &&execute_SLTU,
+        &&execute_XOR,
+        &&execute_SRL,
+        &&execute_SRA,
+        &&execute_OR,
+        &&execute_AND,
+        &&execute_FENCE,
+        &&execute_ECALL,
+        &&execute_EBREAK,
+        &&execute_FENCE_I,
+        &&execute_CSRRW,
+        &&execute_CSRRS,
+        &&execute_CSRRC,
+        &&execute_CSRRWI,
+        &&execute_CSRRSI,
+        &&execute_CSRRCI,
+        &&execute_MUL,
+        &&execute_MULH,
+        &&execute_MULHSU,
+        &&execute_MULHU,
+        &&execute_DIV,
+        &&execute_DIVU,
+        &&execute_REM,
+        &&execute_REMU,
+        &&execute_LR_W,
+        &&execute_SC_W,
+        &&execute_AMOSWAP_W,
+        &&execute_AMOADD_W,
+        &&execute_AMOXOR_W,
+        &&execute_AMOAND_W,
+        &&execute_AMOOR_W,
+        &&execute_AMOMIN_W,
+        &&execute_AMOMAX_W,
+        &&execute_AMOMINU_W,
+        &&execute_AMOMAXU_W,
+        &&execute_FLW,
+        &&execute_FSW,
+        &&execute_FMADDS,
+        &&execute_FMSUBS,
+        &&execute_FNMSUBS,
+        &&execute_FNMADDS,
+        &&execute_FADDS,
+        &&execute_FSUBS,
+        &&execute_FMULS,
+        &&execute_FDIVS,
+        &&execute_FSQRTS,
+        &&execute_FSGNJS,
+        &&execute_FSGNJNS,
+        &&execute_FSGNJXS,
+        &&execute_FMINS,
+        &&execute_FMAXS,
+        &&execute_FCVTWS,
+        &&execute_FCVTWUS,
+        &&execute_FMVXW,
+        &&execute_FEQS,
+        &&execute_FLTS,
+        &&execute_FLES,
+        &&execute_FCLASSS,
+        &&execute_FCVTSW,
+        &&execute_FCVTSWU,
+        &&execute_FMVWX,
+        &&execute_LUI_ADDI,
+        &&execute_AUIPC_ADDI,
+        &&execute_AUIPC_LW,
+        &&execute_AUIPC_JALR,
+        &&execute_SLLI_SRLI,
+        &&execute_MULH_MUL,
+        &&execute_MULHU_MUL,
+    };
+    static_assert(static_cast<uint32_t>(InstructionType::COUNT) == sizeof(handlers) / sizeof(handlers[0]), "Exhaustive check of Instruction types failed");
+#define DISPATCH() do { if constexpr (Policy::Threaded) goto *handlers[static_cast<uint32_t>(ins->type)]; else goto dispatch; } while (0)
+#define HANDLER(type) case InstructionType::type: execute_##type:
+#else
+#define DISPATCH() goto dispatch
+#define HANDLER(type) case InstructionType::type:
+#endif
+#define STOP(reason) do { pc = nextPc; return StopReason::reason; } while (0)
+// Stops without executing the current instruction
+#define FAULT(reason) do { pc = ins->nextPc - 4; return StopReason::reason; } while (0)
+// Misaligned accesses come before any other fault the access could have
+#define CHECK_ALIGNMENT(T) \
+    if (sizeof(T) > 1 && effectiveAddress % sizeof(T) != 0 && misalignedAccess != MisalignedAccess::Native \
+        && !AllowMisaligned(*ins, effectiveAddress)) [[unlikely]] FAULT(MisalignedAccess)
+// Load and Store check the address themselves, once, against the page permissions or the TLB,
+// and fault from there with accessingInstruction
+#define CHECKED_ADDRESS(T) \
+    effectiveAddress = intRegs.Read<uint32_t>(ins->rs1) + ins->imm; \
+    accessingInstruction = ins; \
+    CHECK_ALIGNMENT(T)
+#define NEXT() do { if (++ins == end) STOP(Budget); nextPc = ins->nextPc; DISPATCH(); } while (0)
+// Moves on to the second instruction of a fused pair, which must not be past the end
+#define SKIP_TO_SECOND() do { ++ins; nextPc = ins->nextPc; } while (0)
+#define INSTRUCTION(type) NEXT(); HANDLER(type)
+// Instructions of an extension that the policy leaves out are illegal, and their handlers compile to nothing else
+#define EXTENSION_INSTRUCTION(extension, type) INSTRUCTION(type) if constexpr (!Policy::Has##extension) FAULT(IllegalInstruction); else
+// Atomics act on guest memory with host atomics, so they stay atomic between CPUs that share it.
+// The host needs them aligned, so they fault without it whatever misalignedAccess says.
+#define ATOMIC_WORD(isStore) \
+    effectiveAddress = intRegs.Read<uint32_t>(ins->rs1); \
+    accessingInstruction = ins; \
+    if (effectiveAddress % 4 != 0 && !AllowMisaligned(*ins, effectiveAddress)) [[unlikely]] FAULT(MisalignedAccess); \
+    uint32_t physical; \
+    std::atomic_ref<uint32_t> word{ *AtomicWord<Paging, Track>(effectiveAddress, isStore, physical) }
+// The value word had before it was atomically replaced with expression of it and rs2
+#define ATOMIC_UPDATE(expression) \
+    [&] { \
+        uint32_t old = word.load(); \
+        uint32_t operand = intRegs.Read<uint32_t>(ins->rs2); \
+        while (!word.compare_exchange_weak(old, static_cast<uint32_t>(expression))) {} \
+        return old; \
+    }()
+// Float instructions leave their exception flags accrued in the host's floating-point environment,
+// and fcsr only catches up with them when it is accessed or execution stops, see FoldFloatFlags
+#define CLAIM_FLOAT_FLAGS() do { if (!floatFlagsPending) ClaimFloatFlags(); } while (0)
+#define RAISE_FLOAT_FLAGS(flags) csr.Write<Track>(CSR_fflags, csr.Read(CSR_fflags) | (flags))
+// Resolves the rounding mode of the instruction and switches the host to it if it is not already
+// there. The host has no rmm, so that one is left to ROUNDED and ROUNDED_TO_INTEGER.
+#define ROUNDING_MODE() \
+    uint32_t roundingMode = ins->imm == RM_DYN ? csr.Read(CSR_frm) : ins->imm; \
+    if (roundingMode != hostRoundingMode) [[unlikely]] { \
+        if (roundingMode > RM_RMM) FAULT(IllegalInstruction); \
+        if (roundingMode != RM_RMM) SetHostRoundingMode(roundingMode); \
+    } \
+    CLAIM_FLOAT_FLAGS()
+// Evaluates expression in the rounding mode, or doubleExpression when it is rmm
+#define ROUNDED(expression, doubleExpression) \
+    (roundingMode == RM_RMM ? RoundToMaxMagnitude([&] { return (double)(doubleExpression); }) : (expression))
+// Rounds to an integral value, raising inexact on the host if that changed it
+#define ROUNDED_TO_INTEGER(value) (roundingMode == RM_RMM ? RoundToIntegerMaxMagnitude(value) : RoundToInteger(value))
+
+    constexpr bool Track = Policy::TrackChanges;
+    constexpr bool Paging = Policy::Paging;
+    // The pc is only written back when execution stops, in between it lives in a local
+    uint32_t nextPc = ins->nextPc;
+    uint32_t effectiveAddress;
+    DISPATCH();
+dispatch:
+    switch (ins->type) {
+        case InstructionType::COUNT:
+        default:
+        HANDLER(ILLEGAL) FAULT(IllegalInstruction);
+        // Returns to the mode in MPP/SPP with the interrupt enable from before the trap. Privileged
+        // instructions are illegal below their mode.
+        INSTRUCTION(MRET) {
+            if (privilege != PRIV_M) FAULT(IllegalInstruction);
+            uint32_t status = csr.Read(CSR_mstatus);
+            privilege = (status & MSTATUS_MPP) >> MSTATUS_MPP_SHIFT;
+            status = (status & ~(MSTATUS_MIE | MSTATUS_MPP)) | ((status & MSTATUS_MPIE) ? MSTATUS_MIE : 0) | MSTATUS_MPIE;
+            csr.Write<Track>(CSR_mstatus, status);
+            nextPc = csr.Read(CSR_mepc);
+            UpdateTranslation();
+        }
+        INSTRUCTION(SRET) {
+            if (privilege == PRIV_U) FAULT(IllegalInstruction);
+            uint32_t status = csr.Read(CSR_mstatus);
+            privilege = (status & MSTATUS_SPP) ? PRIV_S : PRIV_U;
+            status = (status & ~(MSTATUS_SIE | MSTATUS_SPP)) | ((status & MSTATUS_SPIE) ? MSTATUS_SIE : 0) | MSTATUS_SPIE;
+            csr.Write<Track>(CSR_mstatus, status);
+            nextPc = csr.Read(CSR_sepc);
+            UpdateTranslation();
+        }
+        // Flushes everything, whatever address and address space it names
+        INSTRUCTION(SFENCE_VMA) {
+            if (privilege == PRIV_U) FAULT(IllegalInstruction);
+            tlb.Flush();
+            blockCache.InvalidateAll();
+        }
+        INSTRUCTION(ADDI)  intRegs.Write<Track>(ins->rd, intRegs.Read<uint32_t>(ins->rs1) + ins->imm);
+        INSTRUCTION(SLTI)  intRegs.Write<Track>(ins->rd, intRegs.Read< int32_t>(ins->rs1) < (int32_t)ins->imm);
+        INSTRUCTION(SLTIU) intRegs.Write<Track>(ins->rd, intRegs.Read<uint32_t>(ins->rs1) < (uint32_t)ins->imm);
+        INSTRUCTION(ANDI)  intRegs.Write<Track>(ins->rd, intRegs.Read< int32_t>(ins->rs1) & ins->imm);
+        INSTRUCTION(ORI)   intRegs.Write<Track>(ins->rd, intRegs.Read< int32_t>(ins->rs1) | ins->imm);
+        INSTRUCTION(XORI)  intRegs.Write<Track>(ins->rd, intRegs.Read< int32_t>(ins->rs1) ^ ins->imm);
+        INSTRUCTION(SLLI)  intRegs.Write<Track>(ins->rd, intRegs.Read<uint32_t>(ins->rs1) << ins->imm);
+        INSTRUCTION(SRLI)  intRegs.Write<Track>(ins->rd, intRegs.Read<uint32_t>(ins->rs1) >> ins->imm);
+        INSTRUCTION(SRAI)  intRegs.Write<Track>(ins->rd, intRegs.Read< int32_t>(ins->rs1) >> ins->imm);
+        INSTRUCTION(LUI)   intRegs.Write<Track>(ins->rd, ins->imm);
+        INSTRUCTION(AUIPC) intRegs.Write<Track>(ins->rd, ins->imm);
+        INSTRUCTION(ADD)   intRegs.Write<Track>(ins->rd, intRegs.Read<uint32_t>(ins->rs1) + intRegs.Read<uint32_t>(ins->rs2));
+        INSTRUCTION(SUB)   intRegs.Write<Track>(ins->rd, intRegs.Read<uint32_t>(ins->rs1) - intRegs.Read<uint32_t>(ins->rs2));
+        INSTRUCTION(SLT)   intRegs.Write<Track>(ins->rd, intRegs.Read< int32_t>(ins->rs1) < intRegs.Read< int32_t>(ins->rs2));
+        INSTRUCTION(SLTU)  intRegs.Write<Track>(ins->rd, intRegs.Read<uint32_t>(ins->rs1) < intRegs.Read<uint32_t>(ins->rs2));
+        INSTRUCTION(AND)   intRegs.Write<Track>(ins->rd, intRegs.Read<uint32_t>(ins->rs1) & intRegs.Read<uint32_t>(ins->rs2));
+        INSTRUCTION(OR)    intRegs.Write<Track>(ins->rd, intRegs.Read<uint32_t>(ins->rs1) | intRegs.Read<uint32_t>(ins->rs2));
+        INSTRUCTION(XOR)   intRegs.Write<Track>(ins->rd, intRegs.Read<uint32_t>(ins->rs1) ^ intRegs.Read<uint32_t>(ins->rs2));
+        INSTRUCTION(SLL)   intRegs.Write<Track>(ins->rd, intRegs.Read<uint32_t>(ins->rs1) << (intRegs.Read<uint32_t>(ins->rs2) & 0b11111));
+        INSTRUCTION(SRL)   intRegs.Write<Track>(ins->rd, intRegs.Read<uint32_t>(ins->rs1) >> (intRegs.Read<uint32_t>(ins->rs2) & 0b11111));
+        INSTRUCTION(SRA)   intRegs.Write<Track>(ins->rd, intRegs.Read< int32_t>(ins->rs1) >> (intRegs.Read<uint32_t>(ins->rs2) & 0b11111));
+        INSTRUCTION(JAL) {
+            intRegs.Write<Track>(ins->rd, ins->nextPc);
+            nextPc = ins->imm;
+        }
+        INSTRUCTION(JALR) {
+            uint32_t target = (intRegs.Read<uint32_t>(ins->rs1) + ins->imm) & ~0b1U;
+            intRegs.Write<Track>(ins->rd, ins->nextPc);
+            nextPc = target;
+        }
+        INSTRUCTION(BEQ)   if (intRegs.Read<uint32_t>(ins->rs1) == intRegs.Read<uint32_t>(ins->rs2)) nextPc = ins->imm;
+        INSTRUCTION(BNE)   if (intRegs.Read<uint32_t>(ins->rs1) != intRegs.Read<uint32_t>(ins->rs2)) nextPc = ins->imm;
+        INSTRUCTION(BLT)   if (intRegs.Read< int32_t>(ins->rs1) <  intRegs.Read< int32_t>(ins->rs2)) nextPc = ins->imm;
+        INSTRUCTION(BLTU)  if (intRegs.Read<uint32_t>(ins->rs1) <  intRegs.Read<uint32_t>(ins->rs2)) nextPc = ins->imm;
+        INSTRUCTION(BGE)   if (intRegs.Read< int32_t>(ins->rs1) >= intRegs.Read< int32_t>(ins->rs2)) nextPc = ins->imm;
+        INSTRUCTION(BGEU)  if (intRegs.Read<uint32_t>(ins->rs1) >= intRegs.Read<uint32_t>(ins->rs2)) nextPc = ins->imm;
+        INSTRUCTION(LW)    CHECKED_ADDRESS(int32_t); intRegs.Write<Track>(ins->rd, Load<Paging, int32_t>(effectiveAddress));
+        INSTRUCTION(LH)    CHECKED_ADDRESS(int16_t); intRegs.Write<Track>(ins->rd, Load<Paging, int16_t>(effectiveAddress));
+        INSTRUCTION(LHU)   CHECKED_ADDRESS(uint16_t); intRegs.Write<Track>(ins->rd, Load<Paging, uint16_t>(effectiveAddress));
+        INSTRUCTION(LB)    CHECKED_ADDRESS(int8_t); intRegs.Write<Track>(ins->rd, Load<Paging, int8_t>(effectiveAddress));
+        INSTRUCTION(LBU)   CHECKED_ADDRESS(uint8_t); intRegs.Write<Track>(ins->rd, Load<Paging, uint8_t>(effectiveAddress));
+        INSTRUCTION(SW)    CHECKED_ADDRESS(uint32_t); Store<Paging, Track>(effectiveAddress, intRegs.Read<uint32_t>(ins->rs2));
+        INSTRUCTION(SH)    CHECKED_ADDRESS(uint16_t); Store<Paging, Track>(effectiveAddress, intRegs.Read<uint16_t>(ins->rs2));
+        INSTRUCTION(SB)    CHECKED_ADDRESS(uint8_t); Store<Paging, Track>(effectiveAddress, intRegs.Read< uint8_t>(ins->rs2));
+        // Harts see each other's accesses in the order the host makes them, which the fence keeps
+        // as the guest asks. Only earlier stores before later loads take a full fence, the host's
+        // acquire and release fences order everything else.
+        INSTRUCTION(FENCE) {
+            if ((ins->imm & FENCE_PRED_W) && (ins->imm & FENCE_SUCC_R))
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+            else
+                std::atomic_thread_fence(std::memory_order_acq_rel);
+        }
+        INSTRUCTION(FENCE_I) blockCache.InvalidateAll();
+        INSTRUCTION(ECALL)  STOP(Ecall);
+        INSTRUCTION(EBREAK) STOP(Ebreak);
+        INSTRUCTION(CSRRW) {
+            if (floatFlagsPending) FoldFloatFlags();
+            uint32_t oldCsr = csr.Read(ins->imm);
+            uint32_t oldRs1 = intRegs.Read(ins->rs1);
+            intRegs.Write<Track>(ins->rd, oldCsr);
+            csr.Write<Track>(ins->imm, oldRs1);
+            if (AffectsTranslation(ins->imm)) UpdateTranslation(ins->imm == CSR_satp);
+        }
+        INSTRUCTION(CSRRS) {
+            if (floatFlagsPending) FoldFloatFlags();
+            uint32_t oldCsr = csr.Read(ins->imm);
+            uint32_t oldRs1 = intRegs.Read(ins->rs1);
+            intRegs.Write<Track>(ins->rd, oldCsr);
+            csr.Write<Track>(ins->imm, oldCsr | oldRs1);
+            if (AffectsTranslation(ins->imm)) UpdateTranslation(ins->imm == CSR_satp);
+        }
+        INSTRUCTION(CSRRC) {
+            if (floatFlagsPending) FoldFloatFlags();
+            uint32_t oldCsr = csr.Read(ins->imm);
+            uint32_t oldRs1 = intRegs.Read(ins->rs1);
+            intRegs.Write<Track>(ins->rd, oldCsr);
+            csr.Write<Track>(ins->imm, oldCsr & ~oldRs1);
+            if (AffectsTranslation(ins->imm)) UpdateTranslation(ins->imm == CSR_satp);
+        }
+        INSTRUCTION(CSRRWI) {
+            if (floatFlagsPending) FoldFloatFlags();
+            uint32_t oldCsr = csr.Read(ins->imm);
+            intRegs.Write<Track>(ins->rd, oldCsr);
+            csr.Write<Track>(ins->imm, ins->rs1);
+            if (AffectsTranslation(ins->imm)) UpdateTranslation(ins->imm == CSR_satp);
+        }
+        INSTRUCTION(CSRRSI) {
+            if (floatFlagsPending) FoldFloatFlags();
+            uint32_t oldCsr = csr.Read(ins->imm);
+            intRegs.Write<Track>(ins->rd, oldCsr);
+            csr.Write<Track>(ins->imm, oldCsr | ins->rs1);
+            if (AffectsTranslation(ins->imm)) UpdateTranslation(ins->imm == CSR_satp);
+        }
+        INSTRUCTION(CSRRCI) {
+            if (floatFlagsPending) FoldFloatFlags();
+            uint32_t oldCsr = csr.Read(ins->imm);
+            intRegs.Write<Track>(ins->rd, oldCsr);
+            csr.Write<Track>(ins->imm, oldCsr & ~ins->rs1);
+            if (AffectsTranslation(ins->imm)) UpdateTranslation(ins->imm == CSR_satp);
+        }
+        EXTENSION_INSTRUCTION(M, MUL)   intRegs.Write<Track>(ins->rd, ( int32_t)((( int64_t)intRegs.Read< int32_t>(ins->rs1) * ( int64_t)intRegs.Read< int32_t>(ins->rs2))));
+        EXTENSION_INSTRUCTION(M, MULH)  intRegs.Write<Track>(ins->rd, ( int32_t)((( int64_t)intRegs.Read< int32_t>(ins->rs1) * ( int64_t)intRegs.Read< int32_t>(ins->rs2)) >> 32UL));
+        EXTENSION_INSTRUCTION(M, MULHSU)intRegs.Write<Track>(ins->rd, ( int32_t)((( int64_t)intRegs.Read< int32_t>(ins->rs1) * (uint64_t)intRegs.Read<uint32_t>(ins->rs2)) >> 32UL));
+        EXTENSION_INSTRUCTION(M, MULHU) intRegs.Write<Track>(ins->rd, ( int32_t)(((uint64_t)intRegs.Read<uint32_t>(ins->rs1) * (uint64_t)intRegs.Read<uint32_t>(ins->rs2)) >> 32UL));
+        EXTENSION_INSTRUCTION(M, DIVU) {
+            uint64_t divisor = intRegs.Read<uint32_t>(ins->rs2);
+            uint64_t dividend = intRegs.Read<uint32_t>(ins->rs1);
             uint32_t quotient = (divisor == 0) ? 0xFFFFFFFFUL : (uint32_t) (dividend / divisor);
-            intRegs.Write(ins.Rtyp.rd, quotient);
+            intRegs.Write<Track>(ins->rd, quotient);
         }
-        break; case InstructionType::DIV: {
-            int64_t divisor = intRegs.Read< int32_t>(ins.Rtyp.rs2);
-            int64_t dividend = intRegs.Read< int32_t>(ins.Rtyp.rs1);
+        EXTENSION_INSTRUCTION(M, DIV) {
+            int64_t divisor = intRegs.Read< int32_t>(ins->rs2);
+            int64_t dividend = intRegs.Read< int32_t>(ins->rs1);
             int32_t quotient =  (divisor == 0) ? -1L : (int32_t) (dividend / divisor);
-            intRegs.Write(ins.Rtyp.rd, quotient);
+            intRegs.Write<Track>(ins->rd, quotient);
         }
-        break; case InstructionType::REM: {
-            int64_t divisor = intRegs.Read< int32_t>(ins.Rtyp.rs2);
-            int64_t dividend = intRegs.Read< int32_t>(ins.Rtyp.rs1);
+        EXTENSION_INSTRUCTION(M, REM) {
+            int64_t divisor = intRegs.Read< int32_t>(ins->rs2);
+            int64_t dividend = intRegs.Read< int32_t>(ins->rs1);
             int32_t remainder = (int32_t) ((divisor == 0) ? dividend : dividend % divisor);
-            intRegs.Write(ins.Rtyp.rd, remainder);
+            intRegs.Write<Track>(ins->rd, remainder);
         }
-        break; case InstructionType::REMU:  {
-            uint64_t divisor = intRegs.Read<uint32_t>(ins.Rtyp.rs2);
-            uint64_t dividend = intRegs.Read<uint32_t>(ins.Rtyp.rs1);
+        EXTENSION_INSTRUCTION(M, REMU)  {
+            uint64_t divisor = intRegs.Read<uint32_t>(ins->rs2);
+            uint64_t dividend = intRegs.Read<uint32_t>(ins->rs1);
             uint32_t remainder = (uint32_t) ((divisor == 0) ? dividend : dividend % divisor);
-            intRegs.Write(ins.Rtyp.rd, remainder);
-        }
-        break; case InstructionType::FLW:     fltRegs.Write(ins.Ityp.rd, memory.Read<float>(intRegs.Read<uint32_t>(ins.Ityp.rs1) + SignExtend(ins.Ityp.imm11_0, 12)));
-        break; case InstructionType::FSW:     memory.Write(intRegs.Read<uint32_t>(ins.Styp.rs1) + SignExtend(ins.Styp.imm(), 12), fltRegs.Read(ins.Styp.rs2));
-        break; case InstructionType::FMADDS: {
-            feclearexcept(FE_ALL_EXCEPT);
-            float x = (fltRegs.Read(ins.R4typ.rs1) * fltRegs.Read(ins.R4typ.rs2)) + fltRegs.Read(ins.R4typ.rs3);
-            uint32_t flags = (bool(fetestexcept(FE_INEXACT))   << 0)
-                           | (bool(fetestexcept(FE_UNDERFLOW)) << 1)
-                           | (bool(fetestexcept(FE_OVERFLOW))  << 2)
-                           | (bool(fetestexcept(FE_DIVBYZERO)) << 3)
-                           | (bool(fetestexcept(FE_INVALID))   << 4);
-            csr.Write(CSR_fflags, flags);
+            intRegs.Write<Track>(ins->rd, remainder);
+        }
+        EXTENSION_INSTRUCTION(A, LR_W) {
+            ATOMIC_WORD(false);
+            reservedValue = word.load();
+            reservedAddress = physical;
+            hasReservation = true;
+            intRegs.Write<Track>(ins->rd, reservedValue);
+        }
+        EXTENSION_INSTRUCTION(A, SC_W) {
+            ATOMIC_WORD(true);
+            uint32_t expected = reservedValue;
+            bool isStored = hasReservation && reservedAddress == physical && word.compare_exchange_strong(expected, intRegs.Read<uint32_t>(ins->rs2));
+            hasReservation = false;
+            intRegs.Write<Track>(ins->rd, !isStored);
+        }
+        EXTENSION_INSTRUCTION(A, AMOSWAP_W) { ATOMIC_WORD(true); intRegs.Write<Track>(ins->rd, word.exchange(intRegs.Read<uint32_t>(ins->rs2))); }
+        EXTENSION_INSTRUCTION(A, AMOADD_W)  { ATOMIC_WORD(true); intRegs.Write<Track>(ins->rd, word.fetch_add(intRegs.Read<uint32_t>(ins->rs2))); }
+        EXTENSION_INSTRUCTION(A, AMOXOR_W)  { ATOMIC_WORD(true); intRegs.Write<Track>(ins->rd, word.fetch_xor(intRegs.Read<uint32_t>(ins->rs2))); }
+        EXTENSION_INSTRUCTION(A, AMOAND_W)  { ATOMIC_WORD(true); intRegs.Write<Track>(ins->rd, word.fetch_and(intRegs.Read<uint32_t>(ins->rs2))); }
+        EXTENSION_INSTRUCTION(A, AMOOR_W)   { ATOMIC_WORD(true); intRegs.Write<Track>(ins->rd, word.fetch_or(intRegs.Read<uint32_t>(ins->rs2))); }
+        EXTENSION_INSTRUCTION(A, AMOMIN_W)  { ATOMIC_WORD(true); intRegs.Write<Track>(ins->rd, ATOMIC_UPDATE(std::min<int32_t>(old, operand))); }
+        EXTENSION_INSTRUCTION(A, AMOMAX_W)  { ATOMIC_WORD(true); intRegs.Write<Track>(ins->rd, ATOMIC_UPDATE(std::max<int32_t>(old, operand))); }
+        EXTENSION_INSTRUCTION(A, AMOMINU_W) { ATOMIC_WORD(true); intRegs.Write<Track>(ins->rd, ATOMIC_UPDATE(std::min<uint32_t>(old, operand))); }
+        EXTENSION_INSTRUCTION(A, AMOMAXU_W) { ATOMIC_WORD(true); intRegs.Write<Track>(ins->rd, ATOMIC_UPDATE(std::max<uint32_t>(old, operand))); }
+        EXTENSION_INSTRUCTION(F, FLW)     { CHECKED_ADDRESS(float); fltRegs.Write<Track>(ins->rd, Load<Paging, float>(effectiveAddress)); }
+        EXTENSION_INSTRUCTION(F, FSW)     { CHECKED_ADDRESS(float); Store<Paging, Track>(effectiveAddress, fltRegs.Read(ins->rs2)); }
+        EXTENSION_INSTRUCTION(F, FMADDS) {
+            ROUNDING_MODE();
+            float a = fltRegs.Read(ins->rs1), b = fltRegs.Read(ins->rs2), c = fltRegs.Read(ins->rs3);
+            float x = ROUNDED((a * b) + c, std::fma((double)a, b, c));
             if (std::isnan(x)) x = bit_cast<float>(0x7FC00000U);
-            fltRegs.Write(ins.Rtyp.rd, x);
-        }
-        break; case InstructionType::FMSUBS: {
-            feclearexcept(FE_ALL_EXCEPT);
-            float x = (fltRegs.Read(ins.R4typ.rs1) * fltRegs.Read(ins.R4typ.rs2)) - fltRegs.Read(ins.R4typ.rs3);
-            uint32_t flags = (bool(fetestexcept(FE_INEXACT))   << 0)
-                           | (bool(fetestexcept(FE_UNDERFLOW)) << 1)
-                           | (bool(fetestexcept(FE_OVERFLOW))  << 2)
-                           | (bool(fetestexcept(FE_DIVBYZERO)) << 3)
-                           | (bool(fetestexcept(FE_INVALID))   << 4);
-            csr.Write(CSR_fflags, flags);
+            fltRegs.Write<Track>(ins->rd, x);
+        }
+        EXTENSION_INSTRUCTION(F, FMSUBS) {
+            ROUNDING_MODE();
+            float a = fltRegs.Read(ins->rs1), b = fltRegs.Read(ins->rs2), c = fltRegs.Read(ins->rs3);
+            float x = ROUNDED((a * b) - c, std::fma((double)a, b, -(double)c));
             if (std::isnan(x)) x = bit_cast<float>(0x7FC00000U);
-            fltRegs.Write(ins.Rtyp.rd, x);
-        }
-        break; case InstructionType::FNMSUBS: {
-            feclearexcept(FE_ALL_EXCEPT);
-            float x = -(fltRegs.Read(ins.R4typ.rs1) * fltRegs.Read(ins.R4typ.rs2)) + fltRegs.Read(ins.R4typ.rs3);
-            uint32_t flags = (bool(fetestexcept(FE_INEXACT))   << 0)
-                           | (bool(fetestexcept(FE_UNDERFLOW)) << 1)
-                           | (bool(fetestexcept(FE_OVERFLOW))  << 2)
-                           | (bool(fetestexcept(FE_DIVBYZERO)) << 3)
-                           | (bool(fetestexcept(FE_INVALID))   << 4);
-            csr.Write(CSR_fflags, flags);
+            fltRegs.Write<Track>(ins->rd, x);
+        }
+        EXTENSION_INSTRUCTION(F, FNMSUBS) {
+            ROUNDING_MODE();
+            float a = fltRegs.Read(ins->rs1), b = fltRegs.Read(ins->rs2), c = fltRegs.Read(ins->rs3);
+            float x = ROUNDED(-(a * b) + c, std::fma(-(double)a, b, c));
             if (std::isnan(x)) x = bit_cast<float>(0x7FC00000U);
-            fltRegs.Write(ins.Rtyp.rd, x);
-        }
-        break; case InstructionType::FNMADDS: {
-            feclearexcept(FE_ALL_EXCEPT);
-            float x = -(fltRegs.Read(ins.R4typ.rs1) * fltRegs.Read(ins.R4typ.rs2)) - fltRegs.Read(ins.R4typ.rs3);
-            uint32_t flags = (bool(fetestexcept(FE_INEXACT))   << 0)
-                           | (bool(fetestexcept(FE_UNDERFLOW)) << 1)
-                           | (bool(fetestexcept(FE_OVERFLOW))  << 2)
-                           | (bool(fetestexcept(FE_DIVBYZERO)) << 3)
-                           | (bool(fetestexcept(FE_INVALID))   << 4);
-            csr.Write(CSR_fflags, flags);
+            fltRegs.Write<Track>(ins->rd, x);
+        }
+        EXTENSION_INSTRUCTION(F, FNMADDS) {
+            ROUNDING_MODE();
+            float a = fltRegs.Read(ins->rs1), b = fltRegs.Read(ins->rs2), c = fltRegs.Read(ins->rs3);
+            float x = ROUNDED(-(a * b) - c, std::fma(-(double)a, b, -(double)c));
             if (std::isnan(x)) x = bit_cast<float>(0x7FC00000U);
-            fltRegs.Write(ins.Rtyp.rd, x);
-        }
-        break; case InstructionType::FADDS: {
-            feclearexcept(FE_ALL_EXCEPT);
-            float x = fltRegs.Read(ins.Rtyp.rs1) + fltRegs.Read(ins.Rtyp.rs2);
-            uint32_t flags = (bool(fetestexcept(FE_INEXACT))   << 0)
-                           | (bool(fetestexcept(FE_UNDERFLOW)) << 1)
-                           | (bool(fetestexcept(FE_OVERFLOW))  << 2)
-                           | (bool(fetestexcept(FE_DIVBYZERO)) << 3)
-                           | (bool(fetestexcept(FE_INVALID))   << 4);
-            csr.Write(CSR_fflags, flags);
+            fltRegs.Write<Track>(ins->rd, x);
+        }
+        EXTENSION_INSTRUCTION(F, FADDS) {
+            ROUNDING_MODE();
+            float a = fltRegs.Read(ins->rs1), b = fltRegs.Read(ins->rs2);
+            float x = ROUNDED(a + b, (double)a + b);
             if (std::isnan(x)) x = bit_cast<float>(0x7FC00000U);
-            fltRegs.Write(ins.Rtyp.rd, x);
-        }
-        break; case InstructionType::FSUBS: {
-            feclearexcept(FE_ALL_EXCEPT);
-            float x = fltRegs.Read(ins.Rtyp.rs1) - fltRegs.Read(ins.Rtyp.rs2);
-            uint32_t flags = (bool(fetestexcept(FE_INEXACT))   << 0)
-                           | (bool(fetestexcept(FE_UNDERFLOW)) << 1)
-                           | (bool(fetestexcept(FE_OVERFLOW))  << 2)
-                           | (bool(fetestexcept(FE_DIVBYZERO)) << 3)
-                           | (bool(fetestexcept(FE_INVALID))   << 4);
-            csr.Write(CSR_fflags, flags);
+            fltRegs.Write<Track>(ins->rd, x);
+        }
+        EXTENSION_INSTRUCTION(F, FSUBS) {
+            ROUNDING_MODE();
+            float a = fltRegs.Read(ins->rs1), b = fltRegs.Read(ins->rs2);
+            float x = ROUNDED(a - b, (double)a - b);
             if (std::isnan(x)) x = bit_cast<float>(0x7FC00000U);
-            fltRegs.Write(ins.Rtyp.rd, x);
-        }
-        break; case InstructionType::FMULS: {
-            feclearexcept(FE_ALL_EXCEPT);
-            float x = fltRegs.Read(ins.Rtyp.rs1) * fltRegs.Read(ins.Rtyp.rs2);
-            uint32_t flags = (bool(fetestexcept(FE_INEXACT))   << 0)
-                           | (bool(fetestexcept(FE_UNDERFLOW)) << 1)
-                           | (bool(fetestexcept(FE_OVERFLOW))  << 2)
-                           | (bool(fetestexcept(FE_DIVBYZERO)) << 3)
-                           | (bool(fetestexcept(FE_INVALID))   << 4);
-            csr.Write(CSR_fflags, flags);
+            fltRegs.Write<Track>(ins->rd, x);
+        }
+        EXTENSION_INSTRUCTION(F, FMULS) {
+            ROUNDING_MODE();
+            float a = fltRegs.Read(ins->rs1), b = fltRegs.Read(ins->rs2);
+            float x = ROUNDED(a * b, (double)a * b);
             if (std::isnan(x)) x = bit_cast<float>(0x7FC00000U);
-            fltRegs.Write(ins.Rtyp.rd, x);
-        }
-        break; case InstructionType::FDIVS: {
-            feclearexcept(FE_ALL_EXCEPT);
-            float x = fltRegs.Read(ins.Rtyp.rs1) / fltRegs.Read(ins.Rtyp.rs2);
-            uint32_t flags = (bool(fetestexcept(FE_INEXACT))   << 0)
-                           | (bool(fetestexcept(FE_UNDERFLOW)) << 1)
-                           | (bool(fetestexcept(FE_OVERFLOW))  << 2)
-                           | (bool(fetestexcept(FE_DIVBYZERO)) << 3)
-                           | (bool(fetestexcept(FE_INVALID))   << 4);
-            csr.Write(CSR_fflags, flags);
+            fltRegs.Write<Track>(ins->rd, x);
+        }
+        EXTENSION_INSTRUCTION(F, FDIVS) {
+            ROUNDING_MODE();
+            float a = fltRegs.Read(ins->rs1), b = fltRegs.Read(ins->rs2);
+            float x = ROUNDED(a / b, (double)a / b);
             if (std::isnan(x)) x = bit_cast<float>(0x7FC00000U);
-            fltRegs.Write(ins.Rtyp.rd, x);
-        }
-        break; case InstructionType::FSQRTS: {
-            feclearexcept(FE_ALL_EXCEPT);
-            float x = sqrtf(fltRegs.Read(ins.Rtyp.rs1));
-            uint32_t flags = (bool(fetestexcept(FE_INEXACT))   << 0)
-                           | (bool(fetestexcept(FE_UNDERFLOW)) << 1)
-                           | (bool(fetestexcept(FE_OVERFLOW))  << 2)
-                           | (bool(fetestexcept(FE_DIVBYZERO)) << 3)
-                           | (bool(fetestexcept(FE_INVALID))   << 4);
-            csr.Write(CSR_fflags, flags);
+            fltRegs.Write<Track>(ins->rd, x);
+        }
+        EXTENSION_INSTRUCTION(F, FSQRTS) {
+            ROUNDING_MODE();
+            float a = fltRegs.Read(ins->rs1);
+            float x = ROUNDED(sqrtf(a), sqrt((double)a));
             if (std::isnan(x)) x = bit_cast<float>(0x7FC00000U);
-            fltRegs.Write(ins.Rtyp.rd, x);
-        }
-        break; case InstructionType::FSGNJS:  {
-            uint32_t rs1_u32 = bit_cast<uint32_t>(fltRegs.Read(ins.Rtyp.rs1));
-            uint32_t rs2_u32 = bit_cast<uint32_t>(fltRegs.Read(ins.Rtyp.rs2));
-            fltRegs.Write(ins.Rtyp.rd, bit_cast<float>((rs2_u32 & 0x80000000) | (rs1_u32 & ~0x80000000)));
-        }
-        break; case InstructionType::FSGNJNS: {
-            uint32_t rs1_u32 = bit_cast<uint32_t>(fltRegs.Read(ins.Rtyp.rs1));
-            uint32_t rs2_u32 = bit_cast<uint32_t>(fltRegs.Read(ins.Rtyp.rs2));
-            fltRegs.Write(ins.Rtyp.rd, bit_cast<float>((~rs2_u32 & 0x80000000) | (rs1_u32 & ~0x80000000)));
-        }
-        break; case InstructionType::FSGNJXS: {
-            uint32_t rs1_u32 = bit_cast<uint32_t>(fltRegs.Read(ins.Rtyp.rs1));
-            uint32_t rs2_u32 = bit_cast<uint32_t>(fltRegs.Read(ins.Rtyp.rs2));
-            fltRegs.Write(ins.Rtyp.rd, bit_cast<float>((rs2_u32 & 0x80000000) ^ rs1_u32));
-        }
-        break; case InstructionType::FMINS: {
-            feclearexcept(FE_ALL_EXCEPT);
-            float a = fltRegs.Read(ins.Rtyp.rs1);
-            float b = fltRegs.Read(ins.Rtyp.rs2);
+            fltRegs.Write<Track>(ins->rd, x);
+        }
+        EXTENSION_INSTRUCTION(F, FSGNJS)  {
+            uint32_t rs1_u32 = bit_cast<uint32_t>(fltRegs.Read(ins->rs1));
+            uint32_t rs2_u32 = bit_cast<uint32_t>(fltRegs.Read(ins->rs2));
+            fltRegs.Write<Track>(ins->rd, bit_cast<float>((rs2_u32 & 0x80000000) | (rs1_u32 & ~0x80000000)));
+        }
+        EXTENSION_INSTRUCTION(F, FSGNJNS) {
+            uint32_t rs1_u32 = bit_cast<uint32_t>(fltRegs.Read(ins->rs1));
+            uint32_t rs2_u32 = bit_cast<uint32_t>(fltRegs.Read(ins->rs2));
+            fltRegs.Write<Track>(ins->rd, bit_cast<float>((~rs2_u32 & 0x80000000) | (rs1_u32 & ~0x80000000)));
+        }
+        EXTENSION_INSTRUCTION(F, FSGNJXS) {
+            uint32_t rs1_u32 = bit_cast<uint32_t>(fltRegs.Read(ins->rs1));
+            uint32_t rs2_u32 = bit_cast<uint32_t>(fltRegs.Read(ins->rs2));
+            fltRegs.Write<Track>(ins->rd, bit_cast<float>((rs2_u32 & 0x80000000) ^ rs1_u32));
+        }
+        EXTENSION_INSTRUCTION(F, FMINS) {
+            CLAIM_FLOAT_FLAGS();
+            float a = fltRegs.Read(ins->rs1);
+            float b = fltRegs.Read(ins->rs2);
             float x = fminf(a, b);
-            uint32_t flags = (bool(fetestexcept(FE_INEXACT))   << 0)
-                           | (bool(fetestexcept(FE_UNDERFLOW)) << 1)
-                           | (bool(fetestexcept(FE_OVERFLOW))  << 2)
-                           | (bool(fetestexcept(FE_DIVBYZERO)) << 3)
-                           | (bool(fetestexcept(FE_INVALID))   << 4);
+            // The host only raises this if the min/max is actually computed, which the compiler may skip
+            if (IsSignalingNaN(a) || IsSignalingNaN(b)) RAISE_FLOAT_FLAGS(0b10000);
             if (std::isnan(a)) x = b;
             if (std::isnan(b)) x = a;
             if (std::isnan(x)) {
@@ -1263,19 +2964,15 @@ bool CPU::Step()
             if (a == 0.0f && b == 0.0f && bit_cast<uint32_t>(a) != bit_cast<uint32_t>(b)) {
                 x = (bit_cast<uint32_t>(a) == bit_cast<uint32_t>(0.0f)) ? b : a;
             }
-            csr.Write(CSR_fflags, flags);
-            fltRegs.Write(ins.Rtyp.rd, x);
+            fltRegs.Write<Track>(ins->rd, x);
         }
-        break; case InstructionType::FMAXS: {
-            feclearexcept(FE_ALL_EXCEPT);
-            float a = fltRegs.Read(ins.Rtyp.rs1);
-            float b = fltRegs.Read(ins.Rtyp.rs2);
+        EXTENSION_INSTRUCTION(F, FMAXS) {
+            CLAIM_FLOAT_FLAGS();
+            float a = fltRegs.Read(ins->rs1);
+            float b = fltRegs.Read(ins->rs2);
             float x = fmaxf(a, b);
-            uint32_t flags = (bool(fetestexcept(FE_INEXACT))   << 0)
-                           | (bool(fetestexcept(FE_UNDERFLOW)) << 1)
-                           | (bool(fetestexcept(FE_OVERFLOW))  << 2)
-                           | (bool(fetestexcept(FE_DIVBYZERO)) << 3)
-                           | (bool(fetestexcept(FE_INVALID))   << 4);
+            // The host only raises this if the min/max is actually computed, which the compiler may skip
+            if (IsSignalingNaN(a) || IsSignalingNaN(b)) RAISE_FLOAT_FLAGS(0b10000);
             // This matters because the bit patterns of NAN are implementation defined
             if (std::isnan(a)) x = b;
             if (std::isnan(b)) x = a;
@@ -1286,109 +2983,143 @@ bool CPU::Step()
             if (a == 0.0f && b == 0.0f && bit_cast<uint32_t>(a) != bit_cast<uint32_t>(b)) {
                 x = (bit_cast<uint32_t>(a) == bit_cast<uint32_t>(0.0f)) ? a : b;
             }
-            csr.Write(CSR_fflags, flags);
-            fltRegs.Write(ins.Rtyp.rd, x);
+            fltRegs.Write<Track>(ins->rd, x);
         }
-        break; case InstructionType::FCVTWS: {
-            feclearexcept(FE_ALL_EXCEPT);
-            float x = fltRegs.Read(ins.Rtyp.rs1);
+        EXTENSION_INSTRUCTION(F, FCVTWS) {
+            ROUNDING_MODE();
+            // Out of range values are integral already, so they do not raise inexact along with invalid
+            float x = ROUNDED_TO_INTEGER(fltRegs.Read(ins->rs1));
             int32_t y = 0;
-            uint32_t flags = 0;
-            if (std::isnan(x) || x > static_cast<float>(INT_MAX)) {
-                flags |= 0b10000;
+            if (std::isnan(x) || x >= 2147483648.0f) {
+                RAISE_FLOAT_FLAGS(0b10000);
                 y = INT_MAX;
             }
-            else if (x < static_cast<float>(INT_MIN)) {
-                flags |= 0b10000;
+            else if (x < -2147483648.0f) {
+                RAISE_FLOAT_FLAGS(0b10000);
                 y = INT_MIN;
             }
             else y = static_cast<int32_t>(x);
-            flags |= (bool(fetestexcept(FE_INEXACT))   << 0)
-                  |  (bool(fetestexcept(FE_UNDERFLOW)) << 1)
-                  |  (bool(fetestexcept(FE_OVERFLOW))  << 2)
-                  |  (bool(fetestexcept(FE_DIVBYZERO)) << 3)
-                  |  (bool(fetestexcept(FE_INVALID))   << 4);
-            csr.Write(CSR_fflags, flags);
-            intRegs.Write(ins.Rtyp.rd, y);
-        }
-        break; case InstructionType::FCVTWUS: {
-            feclearexcept(FE_ALL_EXCEPT);
-            float x = fltRegs.Read(ins.Rtyp.rs1);
+            intRegs.Write<Track>(ins->rd, y);
+        }
+        EXTENSION_INSTRUCTION(F, FCVTWUS) {
+            ROUNDING_MODE();
+            float x = fltRegs.Read(ins->rs1);
             uint32_t y = 0;
-            uint32_t flags = 0;
-            if (std::isnan(x) || x > static_cast<float>(UINT_MAX))  {
-                flags |= 0b10000;
-                y = UINT_MAX;
+            if (x < 0.0f) {
+                // Only what rounds to zero is in range, anything else is invalid but not inexact
+                bool isInRange = x > -1.0f && (roundingMode == RM_RTZ || roundingMode == RM_RUP
+                    || (roundingMode == RM_RNE && x >= -0.5f) || (roundingMode == RM_RMM && x > -0.5f));
+                RAISE_FLOAT_FLAGS(isInRange ? 0b00001 : 0b10000);
             }
-            else if (x <= -1.0f)  {
-                flags |= 0b10000;
-                y = 0;
+            else {
+                x = ROUNDED_TO_INTEGER(x);
+                if (std::isnan(x) || x >= 4294967296.0f) {
+                    RAISE_FLOAT_FLAGS(0b10000);
+                    y = UINT_MAX;
+                }
+                else y = static_cast<uint32_t>(x);
             }
-            else y = static_cast<uint32_t>(x);
-            flags |= (bool(fetestexcept(FE_INEXACT))   << 0)
-                  |  (bool(fetestexcept(FE_UNDERFLOW)) << 1)
-                  |  (bool(fetestexcept(FE_OVERFLOW))  << 2)
-                  |  (bool(fetestexcept(FE_DIVBYZERO)) << 3)
-                  |  (bool(fetestexcept(FE_INVALID))   << 4);
-            csr.Write(CSR_fflags, flags);
-            intRegs.Write(ins.Rtyp.rd, y);
-        }
-        break; case InstructionType::FMVXW:   intRegs.Write(ins.Rtyp.rd, bit_cast<uint32_t>(fltRegs.Read(ins.Rtyp.rs1)));
-        break; case InstructionType::FEQS: {
-            feclearexcept(FE_ALL_EXCEPT);
-            intRegs.Write(ins.Rtyp.rd, fltRegs.Read(ins.Rtyp.rs1) == fltRegs.Read(ins.Rtyp.rs2));
-            uint32_t flags = (bool(fetestexcept(FE_INEXACT))   << 0)
-                           | (bool(fetestexcept(FE_UNDERFLOW)) << 1)
-                           | (bool(fetestexcept(FE_OVERFLOW))  << 2)
-                           | (bool(fetestexcept(FE_DIVBYZERO)) << 3)
-                           | (bool(fetestexcept(FE_INVALID))   << 4);
-            csr.Write(CSR_fflags, flags);
-        }
-        break; case InstructionType::FLTS: {
-            feclearexcept(FE_ALL_EXCEPT);
-            intRegs.Write(ins.Rtyp.rd, fltRegs.Read(ins.Rtyp.rs1) <  fltRegs.Read(ins.Rtyp.rs2));
-            uint32_t flags = (bool(fetestexcept(FE_INEXACT))   << 0)
-                           | (bool(fetestexcept(FE_UNDERFLOW)) << 1)
-                           | (bool(fetestexcept(FE_OVERFLOW))  << 2)
-                           | (bool(fetestexcept(FE_DIVBYZERO)) << 3)
-                           | (bool(fetestexcept(FE_INVALID))   << 4);
-            csr.Write(CSR_fflags, flags);
-        }
-        break; case InstructionType::FLES: {
-            feclearexcept(FE_ALL_EXCEPT);
-            intRegs.Write(ins.Rtyp.rd, fltRegs.Read(ins.Rtyp.rs1) <= fltRegs.Read(ins.Rtyp.rs2));
-            uint32_t flags = (bool(fetestexcept(FE_INEXACT))   << 0)
-                           | (bool(fetestexcept(FE_UNDERFLOW)) << 1)
-                           | (bool(fetestexcept(FE_OVERFLOW))  << 2)
-                           | (bool(fetestexcept(FE_DIVBYZERO)) << 3)
-                           | (bool(fetestexcept(FE_INVALID))   << 4);
-            csr.Write(CSR_fflags, flags);
-        }
-        break; case InstructionType::FCLASSS: {
-            float x = fltRegs.Read(ins.Rtyp.rs1);
-            int cls = std::fpclassify(x);
+            intRegs.Write<Track>(ins->rd, y);
+        }
+        EXTENSION_INSTRUCTION(F, FMVXW)   intRegs.Write<Track>(ins->rd, bit_cast<uint32_t>(fltRegs.Read(ins->rs1)));
+        EXTENSION_INSTRUCTION(F, FEQS) {
+            CLAIM_FLOAT_FLAGS();
+            intRegs.Write<Track>(ins->rd, fltRegs.Read(ins->rs1) == fltRegs.Read(ins->rs2));
+        }
+        EXTENSION_INSTRUCTION(F, FLTS) {
+            CLAIM_FLOAT_FLAGS();
+            intRegs.Write<Track>(ins->rd, fltRegs.Read(ins->rs1) <  fltRegs.Read(ins->rs2));
+        }
+        EXTENSION_INSTRUCTION(F, FLES) {
+            CLAIM_FLOAT_FLAGS();
+            intRegs.Write<Track>(ins->rd, fltRegs.Read(ins->rs1) <= fltRegs.Read(ins->rs2));
+        }
+        EXTENSION_INSTRUCTION(F, FCLASSS) {
+            // Classified from the bits, since comparing a signaling NaN raises invalid on the host
+            uint32_t x = bit_cast<uint32_t>(fltRegs.Read(ins->rs1));
+            bool isNegative = x >> 31;
+            uint32_t exponent = (x >> 23) & 0xFF;
+            uint32_t mantissa = x & 0x7FFFFF;
             uint32_t result = 0;
-            if (cls == FP_INFINITE) {
-                result = (x < 0.0f) ? 0 : 7;
+            if (exponent == 0xFF && mantissa != 0) {
+                result = (mantissa & 0x400000) ? 9 : 8;
+            }
+            else if (exponent == 0xFF) {
+                result = isNegative ? 0 : 7;
             }
-            else if (cls == FP_NAN) {
-                result = (bit_cast<uint32_t>(x) == 0x7FC00000U) ? 9 : 8;
+            else if (exponent != 0) {
+                result = isNegative ? 1 : 6;
             }
-            else if (cls == FP_NORMAL) {
-                result = (x < 0.0f) ? 1 : 6;
+            else if (mantissa != 0) {
+                result = isNegative ? 2 : 5;
+            }
+            else {
+                result = isNegative ? 3 : 4;
             }
-            else if (cls == FP_SUBNORMAL) {
-                result = (x < 0.0f) ? 2 : 5;
+            intRegs.Write<Track>(ins->rd, 1U << result);
+        }
+        EXTENSION_INSTRUCTION(F, FCVTSW) {
+            ROUNDING_MODE();
+            int32_t a = intRegs.Read<int32_t>(ins->rs1);
+            fltRegs.Write<Track>(ins->rd, ROUNDED((float)a, a));
+        }
+        EXTENSION_INSTRUCTION(F, FCVTSWU) {
+            ROUNDING_MODE();
+            uint32_t a = intRegs.Read<uint32_t>(ins->rs1);
+            fltRegs.Write<Track>(ins->rd, ROUNDED((float)a, a));
+        }
+        EXTENSION_INSTRUCTION(F, FMVWX)   fltRegs.Write<Track>(ins->rd, bit_cast<float>(intRegs.Read<uint32_t>(ins->rs1)));
+        // Fused pairs only execute their first instruction if the budget ends between the two
+        INSTRUCTION(LUI_ADDI)
+        HANDLER(AUIPC_ADDI)
+            if (ins + 1 == end) intRegs.Write<Track>(ins->rd, ins->imm);
+            else { intRegs.Write<Track>(ins->rd, ins->imm + ins[1].imm); SKIP_TO_SECOND(); }
+        INSTRUCTION(AUIPC_LW)
+            intRegs.Write<Track>(ins->rd, ins->imm);
+            if (ins + 1 != end) {
+                SKIP_TO_SECOND();
+                CHECKED_ADDRESS(int32_t);
+                intRegs.Write<Track>(ins->rd, Load<Paging, int32_t>(effectiveAddress));
             }
-            else if (cls == FP_ZERO) {
-                result = (copysignf(1.0f, x) < 0) ? 3 : 4;
+        INSTRUCTION(AUIPC_JALR)
+            intRegs.Write<Track>(ins->rd, ins->imm);
+            if (ins + 1 != end) {
+                SKIP_TO_SECOND();
+                uint32_t target = (intRegs.Read<uint32_t>(ins->rs1) + ins->imm) & ~0b1U;
+                intRegs.Write<Track>(ins->rd, ins->nextPc);
+                nextPc = target;
             }
-            intRegs.Write(ins.Rtyp.rd, 1U << result);
+        INSTRUCTION(SLLI_SRLI)
+            if (ins + 1 == end) intRegs.Write<Track>(ins->rd, intRegs.Read<uint32_t>(ins->rs1) << ins->imm);
+            else { intRegs.Write<Track>(ins->rd, (intRegs.Read<uint32_t>(ins->rs1) << ins->imm) >> ins->imm); SKIP_TO_SECOND(); }
+        EXTENSION_INSTRUCTION(M, MULH_MUL) {
+            int64_t product = (int64_t)intRegs.Read<int32_t>(ins->rs1) * (int64_t)intRegs.Read<int32_t>(ins->rs2);
+            intRegs.Write<Track>(ins->rd, (uint32_t)(product >> 32));
+            if (ins + 1 != end) { SKIP_TO_SECOND(); intRegs.Write<Track>(ins->rd, (uint32_t)product); }
+        }
+        EXTENSION_INSTRUCTION(M, MULHU_MUL) {
+            uint64_t product = (uint64_t)intRegs.Read<uint32_t>(ins->rs1) * (uint64_t)intRegs.Read<uint32_t>(ins->rs2);
+            intRegs.Write<Track>(ins->rd, (uint32_t)(product >> 32));
+            if (ins + 1 != end) { SKIP_TO_SECOND(); intRegs.Write<Track>(ins->rd, (uint32_t)product); }
         }
-        break; case InstructionType::FCVTSW:  fltRegs.Write(ins.Rtyp.rd, (float)intRegs.Read< int32_t>(ins.Rtyp.rs1));
-        break; case InstructionType::FCVTSWU: fltRegs.Write(ins.Rtyp.rd, (float)intRegs.Read<uint32_t>(ins.Rtyp.rs1));
-        break; case InstructionType::FMVWX:   fltRegs.Write(ins.Rtyp.rd, bit_cast<float>(intRegs.Read<uint32_t>(ins.Rtyp.rs1)));
-        break;
+        NEXT();
     }
-    return true;
-}
\ No newline at end of file
+
+#undef INSTRUCTION
+#undef EXTENSION_INSTRUCTION
+#undef CLAIM_FLOAT_FLAGS
+#undef RAISE_FLOAT_FLAGS
+#undef ROUNDING_MODE
+#undef ROUNDED
+#undef ROUNDED_TO_INTEGER
+#undef NEXT
+#undef SKIP_TO_SECOND
+#undef CHECKED_ADDRESS
+#undef FAULT
+#undef STOP
+#undef HANDLER
+#undef DISPATCH
+}
+#if CPU_THREADED_DISPATCH
+#pragma GCC diagnostic pop
+#endif
@@ -4,7 +4,19 @@
 #include <cassert>
 #include <cstring>
 #include <cstdio>
+#include <cfenv>
 #include <bit>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <coroutine>
+#include <utility>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include "jit.hpp"
+#include "aot.hpp"
 
 
 #define CSR_cycle          0xc00
@@ -323,36 +335,293 @@
 #define CSR_vstvec         0x205
 
 
+// Privilege modes, as encoded in mstatus.MPP
+#define PRIV_U             0
+#define PRIV_S             1
+#define PRIV_M             3
+
+#define MSTATUS_SIE        (1u << 1)
+#define MSTATUS_MIE        (1u << 3)
+#define MSTATUS_SPIE       (1u << 5)
+#define MSTATUS_MPIE       (1u << 7)
+#define MSTATUS_SPP        (1u << 8)
+#define MSTATUS_MPP_SHIFT  11
+#define MSTATUS_MPP        (3u << MSTATUS_MPP_SHIFT)
+#define MSTATUS_FS         (3u << 13)
+#define MSTATUS_XS         (3u << 15)
+#define MSTATUS_SUM        (1u << 18) // Supervisor may access User memory
+#define MSTATUS_MXR        (1u << 19) // Make eXecutable Readable
+#define MSTATUS_SD         (1u << 31)
+// The bits of mstatus that sstatus shows
+#define SSTATUS_MASK       (MSTATUS_SIE | MSTATUS_SPIE | MSTATUS_SPP | MSTATUS_FS | MSTATUS_XS | MSTATUS_SUM | MSTATUS_MXR | MSTATUS_SD)
+
+#define SATP_MODE          (1u << 31) // Sv32, otherwise Bare
+#define SATP_PPN           0x003FFFFFu
+
+// Sv32 page table entry bits, the physical page number starts at bit 10
+#define PTE_V              (1u << 0)
+#define PTE_R              (1u << 1)
+#define PTE_W              (1u << 2)
+#define PTE_X              (1u << 3)
+#define PTE_U              (1u << 4)
+#define PTE_G              (1u << 5)
+#define PTE_A              (1u << 6)
+#define PTE_D              (1u << 7)
+
+// Exception codes in mcause for the faults that Step and Run record
+#define CAUSE_FETCH_ACCESS     1
+#define CAUSE_LOAD_MISALIGNED  4
+#define CAUSE_LOAD_ACCESS      5
+#define CAUSE_STORE_MISALIGNED 6
+#define CAUSE_STORE_ACCESS     7
+#define CAUSE_FETCH_PAGE_FAULT 12
+#define CAUSE_LOAD_PAGE_FAULT  13
+#define CAUSE_STORE_PAGE_FAULT 15
+// Set in mcause for interrupts, whose codes are their bits in mip and mie
+#define CAUSE_INTERRUPT        (1u << 31)
+
+#define MIP_MSIP           (1u << 3) // Machine software interrupt, see Machine
+
+// The predecessor and successor sets of a FENCE, which DecodeOperands leaves in imm
+#define FENCE_PRED_W       (1u << 4)
+#define FENCE_SUCC_R       (1u << 1)
+
+// Where a Machine puts its CLINT, which has the MSIP register of hart i at offset 4 * i
+#define CLINT_BASE         0x02000000u
+#define CLINT_SIZE         0x10000u
+
+// Writing these can change how addresses are translated
+inline bool AffectsTranslation(uint32_t csr)
+{
+    return csr == CSR_satp || csr == CSR_mstatus || csr == CSR_sstatus;
+}
+
+
+// Rounding modes, as encoded in the rm field of float instructions and in frm
+#define RM_RNE             0b000 // Round to Nearest, ties to Even
+#define RM_RTZ             0b001 // Round towards Zero
+#define RM_RDN             0b010 // Round Down (towards -inf)
+#define RM_RUP             0b011 // Round Up (towards +inf)
+#define RM_RMM             0b100 // Round to Nearest, ties to Max Magnitude
+#define RM_DYN             0b111 // Only in the rm field, selects frm
+
+// Whether writes can record what they changed, for the debugger to highlight
+#ifdef EMULATOR_STANDALONE
+#define CPU_TRACK_CHANGES 0
+#else
+#define CPU_TRACK_CHANGES 1
+#endif
+
+
 template<typename BufferType, uint32_t _Size>
 struct MemoryBase
 {
     constexpr static uint32_t Size = _Size;
-#ifndef EMULATOR_STANDALONE
+#if CPU_TRACK_CHANGES
     bool didChange[Size];
 #endif
     BufferType buffer[Size];
 };
 
 
-template<uint32_t Size>
-struct Memory : public MemoryBase<uint8_t, Size>
+struct MappedFile;
+struct Snapshot;
+
+
+// A range of guest addresses that is backed by host memory
+struct MemoryRegion
 {
+    uint32_t start;
+    uint64_t size;
+};
+
+
+// Something at a range of guest physical addresses that is not memory, like a UART or a timer.
+// Accesses are passed their offset from start and their size, which is 1, 2 or 4 bytes.
+struct Device
+{
+    uint32_t start;
+    uint64_t size;
+    std::function<uint32_t(uint32_t offset, uint32_t size)> read;
+    std::function<void(uint32_t offset, uint32_t size, uint32_t value)> write;
+};
+
+
+// Guest memory lives in a host address range that is reserved up front, so that guest address a
+// is at buffer[a]. Only mapped regions are backed, and their pages only cost host memory once touched.
+// Everything else in the range is inaccessible. Read and Write do not check addresses, the CPU
+// checks each access against permissions first and passes the ones that hit a device on to it.
+struct Memory
+{
+    constexpr static uint64_t WindowSize = uint64_t(1) << 32;
+    constexpr static uint32_t PageSize = 4096;
+    constexpr static uint32_t PageCount = WindowSize / PageSize;
+    // What pages holds for each page, devices count up from FirstDevice
+    constexpr static uint8_t Unmapped = 0;
+    constexpr static uint8_t RAM = 1;
+    constexpr static uint8_t FirstDevice = 2;
+    // What permissions holds for each page of memory, the program's access to it, as ELF segments
+    // give it. The emulator decodes instructions from pages that the program may not read.
+    constexpr static uint8_t Readable = 1;
+    constexpr static uint8_t Writable = 2;
+    constexpr static uint8_t Executable = 4;
+    // Set once instructions on the page have been decoded or translated, so stores to it look for them
+    constexpr static uint8_t HoldsCode = 8;
+    // Instructions can be fetched from pages that are executable, or writable, since the program may
+    // have written them there itself, as in riscv-tests/isa/rv32ui-p-fence_i
+    constexpr static uint8_t Fetchable = Executable | Writable;
+    // Set while a snapshot still shares the page's contents, so that stores save them for it first
+    constexpr static uint8_t Shared = 16;
+    // Set while the page has not been written since it was mapped or cleared, see dirty
+    constexpr static uint8_t Clean = 32;
+    // Stores to pages with any of these go through NoteWrite first
+    constexpr static uint8_t Watched = Shared | Clean;
+    // What IsPlainStore looks at, every bit but Writable sends a store the slow way
+    constexpr static uint8_t StoreMask = Writable | HoldsCode | Watched;
+    // What a CPU starts out with, and what InitializeFromELF gives a program on top of its segments
+    constexpr static uint32_t DefaultSize = 1024 * 1024;
+    // pages, permissions and dirty, which share a reservation
+    constexpr static size_t TablesSize = 2 * PageCount + PageCount / 8;
+
+    Memory();
+    // A copy gets its own window with the same regions and contents
+    Memory(const Memory& other);
+    Memory& operator=(const Memory& other);
+    ~Memory();
+
+    // Backs [start, start + size), rounded out to whole pages, with zeroes that the program may do
+    // anything with. Pages that are already mapped keep their contents and permissions. Returns false
+    // if a device is in the way or the host cannot provide the memory.
+    bool Map(uint32_t start, uint64_t size);
+    // Backs the mapped range [start, start + size) with the same range of file from offset, which
+    // has to lie as far into a page as start. Pages are shared with the file until they are
+    // written, and the rest of the first and last one is zeroed. Returns false if it cannot.
+    bool MapFile(uint32_t start, uint32_t size, const MappedFile& file, uint64_t offset);
+    // Sets what the program may do with the mapped pages under [start, start + size)
+    void Protect(uint32_t start, uint64_t size, uint8_t allowed);
+    // Harts that share memory mark code while others note their first writes, see firstWriteLock
+    void MarkCode(uint32_t start, uint32_t size)
+    {
+        for (uint32_t page = start / PageSize; page <= (start + size - 1) / PageSize; ++page)
+            if (!(permissions[page] & HoldsCode)) [[unlikely]]
+                NoteCode(page);
+    }
+    void NoteCode(uint32_t page);
+    // Unmaps memory, devices stay attached
+    void UnmapAll();
+    // Gives the pages under the range of device to it. Returns false if they overlap memory or another device.
+    bool AttachDevice(Device device);
+    void DetachDevices();
+    // Zeroes the pages that have been written, see dirty
+    void Clear();
+    void ClearChanges();
+
+    // Whether [address, address + size) is all memory
+    bool Contains(uint32_t address, uint32_t size) const
+    {
+        uint64_t last = (static_cast<uint64_t>(address) + size - 1) / PageSize;
+        for (uint64_t page = address / PageSize; page <= last; ++page)
+            if (page >= PageCount || pages[page] != RAM)
+                return false;
+        return true;
+    }
+
+    uint8_t PageKind(uint32_t address) const { return pages[address / PageSize]; }
+
+    // Whether a load can read buffer directly, which is when it lies in a single readable page of
+    // memory. Anything else is up to CPU::CheckLoad.
+    bool IsPlainLoad(uint32_t address, uint32_t size) const
+    {
+        return address % PageSize <= PageSize - size && (permissions[address / PageSize] & Readable);
+    }
+
+    // Whether a store can go straight to buffer, which is when it lies in a single writable page
+    // of memory without code that no snapshot shares. Anything else is up to CPU::CheckStore.
+    bool IsPlainStore(uint32_t address, uint32_t size) const
+    {
+        return address % PageSize <= PageSize - size && (permissions[address / PageSize] & StoreMask) == Writable;
+    }
+
+    // Marks the pages under [start, start + size) dirty, and has the snapshot that still shares any
+    // of them save it, before they are written
+    void NoteWrite(uint32_t start, uint32_t size)
+    {
+        for (uint32_t page = start / PageSize; page <= (start + size - 1) / PageSize; ++page)
+            if (permissions[page] & Watched) [[unlikely]]
+                NoteFirstWrite(page);
+    }
+    void NoteFirstWrite(uint32_t page);
+    bool IsDirty(uint32_t page) const { return (dirty[page / 64] >> (page % 64)) & 1; }
+    // Shares every page of memory with snapshot, instead of any it shared them with before
+    void Share(Snapshot& snapshot);
+    // Stops sharing pages with the snapshot, which can no longer be restored
+    void ReleaseSnapshot();
+
+    // The device that [address, address + size) lies in, if any
+    Device* DeviceAt(uint32_t address, uint32_t size)
+    {
+        if (pages[address / PageSize] < FirstDevice)
+            return nullptr;
+        Device& device = devices[pages[address / PageSize] - FirstDevice];
+        if (static_cast<uint64_t>(address - device.start) + size > device.size)
+            return nullptr;
+        return &device;
+    }
+
     template<typename T>
     T Read(uint32_t address) const
     {
-        assert(address + sizeof(T) <= this->Size);
         T t;
-        memcpy((uint8_t*) &t, this->buffer + address, sizeof(T));
+        memcpy((uint8_t*) &t, buffer + address, sizeof(T));
         return t;
     }
 
-    template<typename T>
+    template<bool Track = true, typename T>
     void Write(uint32_t address, T value)
     {
-        assert(address + sizeof(T) <= this->Size);
-        memset(this->didChange + address, 1, sizeof(T));
-        memcpy(this->buffer + address, (const uint8_t*) &value, sizeof(T));
+        NoteWrite(address, sizeof(T));
+        WritePlain<Track>(address, value);
+    }
+
+    // Write for stores that IsPlainStore allowed, or whose pages have been through NoteWrite.
+    // The write comes first, so that nothing has changed if it faults.
+    template<bool Track = true, typename T>
+    void WritePlain(uint32_t address, T value)
+    {
+        memcpy(buffer + address, (const uint8_t*) &value, sizeof(T));
+#if CPU_TRACK_CHANGES
+        if constexpr (Track)
+            memset(didChange + address, 1, sizeof(T));
+#endif
     }
+
+    // Writing it directly goes unnoticed by dirty, see NoteWrite
+    uint8_t* buffer = nullptr;
+#if CPU_TRACK_CHANGES
+    // Mirrors buffer in a window of its own
+    bool* didChange = nullptr;
+#endif
+    // Sorted and disjoint, adjacent regions are merged
+    std::vector<MemoryRegion> regions;
+    std::vector<Device> devices;
+    // What each page of the window is, so that lookups do not search regions or devices
+    uint8_t* pages = nullptr;
+    // Zero for every page that is not memory
+    uint8_t* permissions = nullptr;
+    // The snapshot that the Shared pages belong to, see CPU::TakeSnapshot
+    Snapshot* snapshot = nullptr;
+    // A bit for each page, set once the program or the host has written it since it was mapped or
+    // cleared, so the rest still reads as zero. dirtyPages lists the same pages in the order they
+    // were first written.
+    uint64_t* dirty = nullptr;
+    std::vector<uint32_t> dirtyPages;
+    // The pages with HoldsCode, in the order they were marked, so that clearing does not look for them
+    std::vector<uint32_t> codePages;
+    // The ranges MapFile has backed with a file, which clearing gives back
+    std::vector<MemoryRegion> fileRanges;
+    // Held by NoteFirstWrite and NoteCode, which harts that share memory may get to for the same page at once.
+    // Mapping, clearing and snapshots are only for when none of them is running.
+    std::mutex firstWriteLock;
 };
 
 
@@ -366,10 +635,12 @@ struct RegisterFile : public MemoryBase<BufferType, Size>
         return static_cast<T>(this->buffer[x]);
     }
     
+    template<bool Track = true>
     void Write(uint32_t x, auto value)
     {
         assert(x < this->Size);
-        this->didChange[x] = true;
+        if constexpr (Track && CPU_TRACK_CHANGES)
+            this->didChange[x] = true;
         this->buffer[x] = static_cast<BufferType>(value);
     }
 };
@@ -382,7 +653,8 @@ struct IntegerRegisterFile : public RegisterFile<uint32_t, 32>
     template<typename T=uint32_t>
     T Read(uint32_t x) const { return (x == 0) ? 0 : Base::Read<T>(x); }
 
-    void Write(uint32_t x, auto value) { if (x != 0) Base::Write(x, value); }
+    template<bool Track = true>
+    void Write(uint32_t x, auto value) { if (x != 0) Base::Write<Track>(x, value); }
 };
 
 struct CSRFile : RegisterFile<uint32_t, 4096>
@@ -396,15 +668,18 @@ struct CSRFile : RegisterFile<uint32_t, 4096>
             break; case CSR_frm:    return (Base::Read(CSR_fcsr) >> 5) & 0b111;
             break; case CSR_fflags: return Base::Read(CSR_fcsr) & 0b00011111;
             break; case CSR_fcsr:   return Base::Read(CSR_fcsr) & 0b11111111;
+            break; case CSR_sstatus: return Base::Read(CSR_mstatus) & SSTATUS_MASK;
         }
     }
 
+    template<bool Track = true>
     void Write(uint32_t x, uint32_t value)
     {
         switch (x) {
-            default:                Base::Write(x, value);
-            break; case CSR_frm:    Base::Write(CSR_fcsr, (Base::Read(CSR_fcsr) & ~(0b111 << 5)) | ((value & 0b111) << 5));
-            break; case CSR_fflags: Base::Write(CSR_fcsr, (Base::Read(CSR_fcsr) & ~(0b11111)) | (value & 0b11111));
+            default:                Base::Write<Track>(x, value);
+            break; case CSR_frm:    Base::Write<Track>(CSR_fcsr, (Base::Read(CSR_fcsr) & ~(0b111 << 5)) | ((value & 0b111) << 5));
+            break; case CSR_fflags: Base::Write<Track>(CSR_fcsr, (Base::Read(CSR_fcsr) & ~(0b11111)) | (value & 0b11111));
+            break; case CSR_sstatus: Base::Write<Track>(CSR_mstatus, (Base::Read(CSR_mstatus) & ~SSTATUS_MASK) | (value & SSTATUS_MASK));
         }
     }
 };
@@ -416,6 +691,8 @@ enum class InstructionType : uint32_t
 
     // Privileged
     MRET,
+    SRET,
+    SFENCE_VMA,
 
     // I
     LUI,
@@ -480,6 +757,19 @@ enum class InstructionType : uint32_t
     REM,
     REMU,
 
+    // A
+    LR_W,
+    SC_W,
+    AMOSWAP_W,
+    AMOADD_W,
+    AMOXOR_W,
+    AMOAND_W,
+    AMOOR_W,
+    AMOMIN_W,
+    AMOMAX_W,
+    AMOMINU_W,
+    AMOMAXU_W,
+
     // F
     FLW,
     FSW,
@@ -508,10 +798,160 @@ enum class InstructionType : uint32_t
     FCVTSWU,
     FMVWX,
 
+    // Fused pairs, which only the block cache produces. The first instruction of the pair gets
+    // the fused type and executes the second one too, which stays in place after it.
+    LUI_ADDI,
+    AUIPC_ADDI,
+    AUIPC_LW,
+    AUIPC_JALR,
+    SLLI_SRLI,
+    MULH_MUL,
+    MULHU_MUL,
+
     COUNT,
 };
 
 
+// How FormatInstruction lays out the operands of an instruction
+enum class InstructionFormat : uint8_t
+{
+    Unimplemented,
+    Bare,                 // name only
+    Immediate,            // x, x, imm
+    Shift,                // x, x, shamt
+    Upper,                // x, imm
+    Register,             // x, x, x
+    Jump,                 // x, offset
+    Branch,               // x, x, offset
+    Load,                 // x, imm(x)
+    Store,                // x, imm(x)
+    LoadReserved,         // x, (x)
+    Atomic,               // x, x, (x)
+    CSR,                  // x, csr, x
+    FloatLoad,            // f, imm(x)
+    FloatStore,           // f, imm(x)
+    FloatRegister,        // f, f, f
+    FloatFused,           // f, f, f, f, rm
+    FloatRounded,         // f, f, f, rm
+    FloatUnaryRounded,    // f, f, rm
+    FloatToInteger,       // x, f, rm
+    IntegerToFloat,       // f, x, rm
+    FloatMoveToInteger,   // x, f
+    FloatMoveFromInteger, // f, x
+};
+
+
+// An instruction word w encodes type when (w & mask) == match
+struct InstructionEncoding
+{
+    InstructionType type;
+    InstructionFormat format;
+    uint32_t mask;
+    uint32_t match;
+};
+
+// Every instruction DecodeInstruction recognizes. The decode tables are generated from this at
+// compile time, so adding an instruction only takes a row here (and a name and a handler).
+inline constexpr InstructionEncoding InstructionEncodings[] = {
+    { InstructionType::MRET,    InstructionFormat::Bare,      0xFFFFFFFF, 0x30200073 },
+    { InstructionType::SRET,    InstructionFormat::Bare,      0xFFFFFFFF, 0x10200073 },
+    { InstructionType::SFENCE_VMA, InstructionFormat::Bare,   0xFE007FFF, 0x12000073 },
+    { InstructionType::LUI,     InstructionFormat::Upper,     0x0000007F, 0x00000037 },
+    { InstructionType::AUIPC,   InstructionFormat::Upper,     0x0000007F, 0x00000017 },
+    { InstructionType::JAL,     InstructionFormat::Jump,      0x0000007F, 0x0000006F },
+    { InstructionType::JALR,    InstructionFormat::Immediate, 0x0000007F, 0x00000067 },
+    { InstructionType::BEQ,     InstructionFormat::Branch,    0x0000707F, 0x00000063 },
+    { InstructionType::BNE,     InstructionFormat::Branch,    0x0000707F, 0x00001063 },
+    { InstructionType::BLT,     InstructionFormat::Branch,    0x0000707F, 0x00004063 },
+    { InstructionType::BGE,     InstructionFormat::Branch,    0x0000707F, 0x00005063 },
+    { InstructionType::BLTU,    InstructionFormat::Branch,    0x0000707F, 0x00006063 },
+    { InstructionType::BGEU,    InstructionFormat::Branch,    0x0000707F, 0x00007063 },
+    { InstructionType::LB,      InstructionFormat::Load,      0x0000707F, 0x00000003 },
+    { InstructionType::LH,      InstructionFormat::Load,      0x0000707F, 0x00001003 },
+    { InstructionType::LW,      InstructionFormat::Load,      0x0000707F, 0x00002003 },
+    { InstructionType::LBU,     InstructionFormat::Load,      0x0000707F, 0x00004003 },
+    { InstructionType::LHU,     InstructionFormat::Load,      0x0000707F, 0x00005003 },
+    { InstructionType::SB,      InstructionFormat::Store,     0x0000707F, 0x00000023 },
+    { InstructionType::SH,      InstructionFormat::Store,     0x0000707F, 0x00001023 },
+    { InstructionType::SW,      InstructionFormat::Store,     0x0000707F, 0x00002023 },
+    { InstructionType::ADDI,    InstructionFormat::Immediate, 0x0000707F, 0x00000013 },
+    { InstructionType::SLTI,    InstructionFormat::Immediate, 0x0000707F, 0x00002013 },
+    { InstructionType::SLTIU,   InstructionFormat::Immediate, 0x0000707F, 0x00003013 },
+    { InstructionType::XORI,    InstructionFormat::Immediate, 0x0000707F, 0x00004013 },
+    { InstructionType::ORI,     InstructionFormat::Immediate, 0x0000707F, 0x00006013 },
+    { InstructionType::ANDI,    InstructionFormat::Immediate, 0x0000707F, 0x00007013 },
+    { InstructionType::SLLI,    InstructionFormat::Shift,     0x0000707F, 0x00001013 },
+    { InstructionType::SRLI,    InstructionFormat::Shift,     0xFE00707F, 0x00005013 },
+    { InstructionType::SRAI,    InstructionFormat::Shift,     0xFE00707F, 0x40005013 },
+    { InstructionType::ADD,     InstructionFormat::Register,  0xFE00707F, 0x00000033 },
+    { InstructionType::SUB,     InstructionFormat::Register,  0xFE00707F, 0x40000033 },
+    { InstructionType::SLL,     InstructionFormat::Register,  0xFE00707F, 0x00001033 },
+    { InstructionType::SLT,     InstructionFormat::Register,  0xFE00707F, 0x00002033 },
+    { InstructionType::SLTU,    InstructionFormat::Register,  0xFE00707F, 0x00003033 },
+    { InstructionType::XOR,     InstructionFormat::Register,  0xFE00707F, 0x00004033 },
+    { InstructionType::SRL,     InstructionFormat::Register,  0xFE00707F, 0x00005033 },
+    { InstructionType::SRA,     InstructionFormat::Register,  0xFE00707F, 0x40005033 },
+    { InstructionType::OR,      InstructionFormat::Register,  0xFE00707F, 0x00006033 },
+    { InstructionType::AND,     InstructionFormat::Register,  0xFE00707F, 0x00007033 },
+    { InstructionType::FENCE,   InstructionFormat::Bare,      0x0000707F, 0x0000000F },
+    { InstructionType::ECALL,   InstructionFormat::Bare,      0xFFF0707F, 0x00000073 },
+    { InstructionType::EBREAK,  InstructionFormat::Bare,      0xFFF0707F, 0x00100073 },
+    { InstructionType::FENCE_I, InstructionFormat::Bare,      0x0000707F, 0x0000100F },
+    { InstructionType::CSRRW,   InstructionFormat::CSR,       0x0000707F, 0x00001073 },
+    { InstructionType::CSRRS,   InstructionFormat::CSR,       0x0000707F, 0x00002073 },
+    { InstructionType::CSRRC,   InstructionFormat::CSR,       0x0000707F, 0x00003073 },
+    { InstructionType::CSRRWI,  InstructionFormat::CSR,       0x0000707F, 0x00005073 },
+    { InstructionType::CSRRSI,  InstructionFormat::CSR,       0x0000707F, 0x00006073 },
+    { InstructionType::CSRRCI,  InstructionFormat::CSR,       0x0000707F, 0x00007073 },
+    { InstructionType::MUL,     InstructionFormat::Register,  0xFE00707F, 0x02000033 },
+    { InstructionType::MULH,    InstructionFormat::Register,  0xFE00707F, 0x02001033 },
+    { InstructionType::MULHSU,  InstructionFormat::Register,  0xFE00707F, 0x02002033 },
+    { InstructionType::MULHU,   InstructionFormat::Register,  0xFE00707F, 0x02003033 },
+    { InstructionType::DIV,     InstructionFormat::Register,  0xFE00707F, 0x02004033 },
+    { InstructionType::DIVU,    InstructionFormat::Register,  0xFE00707F, 0x02005033 },
+    { InstructionType::REM,     InstructionFormat::Register,  0xFE00707F, 0x02006033 },
+    { InstructionType::REMU,    InstructionFormat::Register,  0xFE00707F, 0x02007033 },
+    // The aq and rl bits are left out, every atomic is sequentially consistent
+    { InstructionType::LR_W,      InstructionFormat::LoadReserved, 0xF9F0707F, 0x1000202F },
+    { InstructionType::SC_W,      InstructionFormat::Atomic,    0xF800707F, 0x1800202F },
+    { InstructionType::AMOSWAP_W, InstructionFormat::Atomic,    0xF800707F, 0x0800202F },
+    { InstructionType::AMOADD_W,  InstructionFormat::Atomic,    0xF800707F, 0x0000202F },
+    { InstructionType::AMOXOR_W,  InstructionFormat::Atomic,    0xF800707F, 0x2000202F },
+    { InstructionType::AMOAND_W,  InstructionFormat::Atomic,    0xF800707F, 0x6000202F },
+    { InstructionType::AMOOR_W,   InstructionFormat::Atomic,    0xF800707F, 0x4000202F },
+    { InstructionType::AMOMIN_W,  InstructionFormat::Atomic,    0xF800707F, 0x8000202F },
+    { InstructionType::AMOMAX_W,  InstructionFormat::Atomic,    0xF800707F, 0xA000202F },
+    { InstructionType::AMOMINU_W, InstructionFormat::Atomic,    0xF800707F, 0xC000202F },
+    { InstructionType::AMOMAXU_W, InstructionFormat::Atomic,    0xF800707F, 0xE000202F },
+    { InstructionType::FLW,     InstructionFormat::FloatLoad,  0x0000007F, 0x00000007 },
+    { InstructionType::FSW,     InstructionFormat::FloatStore, 0x0000007F, 0x00000027 },
+    { InstructionType::FMADDS,  InstructionFormat::FloatFused, 0x0000007F, 0x00000043 },
+    { InstructionType::FMSUBS,  InstructionFormat::FloatFused, 0x0000007F, 0x00000047 },
+    { InstructionType::FNMSUBS, InstructionFormat::FloatFused, 0x0000007F, 0x0000004B },
+    { InstructionType::FNMADDS, InstructionFormat::FloatFused, 0x0000007F, 0x0000004F },
+    { InstructionType::FADDS,   InstructionFormat::FloatRounded, 0xFE00007F, 0x00000053 },
+    { InstructionType::FSUBS,   InstructionFormat::FloatRounded, 0xFE00007F, 0x08000053 },
+    { InstructionType::FMULS,   InstructionFormat::FloatRounded, 0xFE00007F, 0x10000053 },
+    { InstructionType::FDIVS,   InstructionFormat::FloatRounded, 0xFE00007F, 0x18000053 },
+    { InstructionType::FSQRTS,  InstructionFormat::FloatUnaryRounded, 0xFE00007F, 0x58000053 },
+    { InstructionType::FSGNJS,  InstructionFormat::FloatRegister, 0xFE00707F, 0x20000053 },
+    { InstructionType::FSGNJNS, InstructionFormat::FloatRegister, 0xFE00707F, 0x20001053 },
+    { InstructionType::FSGNJXS, InstructionFormat::FloatRegister, 0xFE00707F, 0x20002053 },
+    { InstructionType::FMINS,   InstructionFormat::FloatRegister, 0xFE00707F, 0x28000053 },
+    { InstructionType::FMAXS,   InstructionFormat::FloatRegister, 0xFE00707F, 0x28001053 },
+    { InstructionType::FCVTWS,  InstructionFormat::FloatToInteger, 0xFFF0007F, 0xC0000053 },
+    { InstructionType::FCVTWUS, InstructionFormat::FloatToInteger, 0xFFF0007F, 0xC0100053 },
+    { InstructionType::FMVXW,   InstructionFormat::FloatMoveToInteger, 0xFE00707F, 0xE0000053 },
+    { InstructionType::FEQS,    InstructionFormat::FloatRegister, 0xFE00707F, 0xA0002053 },
+    { InstructionType::FLTS,    InstructionFormat::FloatRegister, 0xFE00707F, 0xA0001053 },
+    { InstructionType::FLES,    InstructionFormat::FloatRegister, 0xFE00707F, 0xA0000053 },
+    { InstructionType::FCLASSS, InstructionFormat::FloatMoveToInteger, 0xFE00707F, 0xE0001053 },
+    { InstructionType::FCVTSW,  InstructionFormat::IntegerToFloat, 0xFFF0007F, 0xD0000053 },
+    { InstructionType::FCVTSWU, InstructionFormat::IntegerToFloat, 0xFFF0007F, 0xD0100053 },
+    { InstructionType::FMVWX,   InstructionFormat::FloatMoveFromInteger, 0xFE00007F, 0xF0000053 },
+};
+
+
 struct RawInstruction
 {
     struct R4_Type
@@ -612,6 +1052,172 @@ static_assert(sizeof(RawInstruction) == 4);
 static_assert(std::is_trivial_v<RawInstruction>);
 
 
+// An instruction with all of its operands extracted ahead of time, so that it can be
+// executed repeatedly without re-reading and re-decoding the raw instruction word.
+struct DecodedInstruction
+{
+    InstructionType type;
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    uint8_t rs3;
+    // Sign-extended immediate, shift amount, CSR number or rounding mode. For AUIPC, JAL and
+    // branches this is the absolute result (pc + offset), since the pc is known at decode time.
+    uint32_t imm;
+    uint32_t nextPc;
+};
+
+static_assert(sizeof(DecodedInstruction) == 16);
+
+
+struct BasicBlock
+{
+    uint32_t startPc;
+    uint32_t endPc;
+    std::vector<DecodedInstruction> instructions;
+    // Tiering state, see CPU::Run
+    uint32_t executionCount = 0;
+    bool isTranslatable = true;
+    const uint8_t* translation = nullptr;
+};
+
+
+struct BlockCache
+{
+    // Stores are checked against cached code at this granularity, so that data sharing a page
+    // with code does not constantly throw away the blocks around it
+    constexpr static uint32_t RegionBits = 8;
+    constexpr static uint32_t MaxBlockLength = 64;
+    constexpr static uint32_t LookupSize = 1024;
+
+    BlockCache() = default;
+    // Blocks are derived from memory, so a copied CPU rebuilds its own instead of sharing them
+    BlockCache(const BlockCache&) : BlockCache() {}
+    BlockCache& operator=(const BlockCache&) { Clear(); return *this; }
+
+    BasicBlock* Find(uint32_t pc)
+    {
+        BasicBlock*& entry = lookup[(pc >> 2) % LookupSize];
+        if (entry != nullptr && entry->startPc == pc)
+            return entry;
+        auto it = blocks.find(pc);
+        if (it == blocks.end())
+            return nullptr;
+        entry = &it->second;
+        return entry;
+    }
+
+    bool ContainsCode(uint32_t address, uint32_t size) const
+    {
+        uint32_t first = address >> RegionBits;
+        uint32_t last = (address + size - 1) >> RegionBits;
+        return (first < codeRegions.size() && codeRegions[first]) || (last < codeRegions.size() && codeRegions[last]);
+    }
+
+    BasicBlock& Insert(BasicBlock&& block);
+    void Invalidate(uint32_t address, uint32_t size);
+    void InvalidateAll();
+    void FlushPendingInvalidations();
+    void Clear();
+
+    std::unordered_map<uint32_t, BasicBlock> blocks;
+    BasicBlock* lookup[LookupSize] = {};
+    std::vector<bool> codeRegions;
+    std::vector<uint32_t> pendingRegions;
+    bool pendingFlushAll = false;
+};
+
+
+enum class AccessType : uint32_t
+{
+    Read,
+    Write,
+    Execute,
+};
+
+
+// Remembers recent Sv32 translations, separately for each kind of access since a page's
+// permissions differ between them. An entry maps the virtual page in its tag to host memory by
+// an addend, so a hit costs an index, a compare and an add.
+struct TLB
+{
+    constexpr static uint32_t Size = 256;
+
+    struct Entry
+    {
+        // No virtual page has the low bits set, so this never matches
+        uint32_t tag = UINT32_MAX;
+        // The host address of a virtual address in the page is address + addend
+        uintptr_t addend = 0;
+    };
+
+    TLB() = default;
+    // The addends point into the memory of the CPU that made them
+    TLB(const TLB&) : TLB() {}
+    TLB& operator=(const TLB&) { Flush(); return *this; }
+
+    static uint32_t Index(uint32_t address) { return (address / Memory::PageSize) % Size; }
+    // Keeps the low bits an aligned access of size leaves clear, so misaligned accesses always miss
+    static uint32_t Tag(uint32_t address, uint32_t size) { return address & (~(Memory::PageSize - 1) | (size - 1)); }
+
+    void Flush()
+    {
+        for (Entry* entries : { read, write, execute })
+            for (uint32_t i = 0; i < Size; ++i)
+                entries[i] = Entry{};
+    }
+
+    Entry read[Size];
+    Entry write[Size];
+    Entry execute[Size];
+};
+
+
+enum class Dispatch : uint32_t
+{
+    Switch,
+    Threaded,
+};
+
+
+// The instruction set extensions a program is allowed to use, which InitializeFromELF picks from
+// the ELF file. Instructions outside of them are illegal.
+enum class Extensions : uint32_t
+{
+    RV32I,
+    RV32IM,
+    RV32IMA,
+    RV32IMAF,
+};
+
+
+// What happens to a load or store whose address is not a multiple of its size
+enum class MisalignedAccess : uint32_t
+{
+    // It is made as it is, which the host can do at no extra cost
+    Native,
+    // It stops execution before it is made, like a real core that traps, see StopReason::MisalignedAccess
+    Trap,
+    // It is made as it is, and counted for its instruction in CPU::misalignedAccesses
+    Count,
+};
+
+
+// Everything that CPU::Execute is specialized on, so that each combination compiles to its own
+// interpreter without the checks, cases and bookkeeping that it does not need
+template<bool _Threaded, Extensions _Extensions, bool _TrackChanges, bool _Paging>
+struct ExecutionPolicy
+{
+    constexpr static bool Threaded = _Threaded;
+    constexpr static bool HasM = _Extensions != Extensions::RV32I;
+    constexpr static bool HasA = _Extensions >= Extensions::RV32IMA;
+    constexpr static bool HasF = _Extensions == Extensions::RV32IMAF;
+    constexpr static bool TrackChanges = _TrackChanges && CPU_TRACK_CHANGES;
+    // Whether loads and stores go through the TLB
+    constexpr static bool Paging = _Paging;
+};
+
+
 enum class ParseELFResult : uint32_t
 {
     Ok,
@@ -625,18 +1231,344 @@ enum class ParseELFResult : uint32_t
 };
 
 
-struct CPU
+enum class StopReason : uint32_t
+{
+    Budget,
+    Ecall,
+    Ebreak,
+    IllegalInstruction,
+    Breakpoint,
+    // A load, store or instruction fetch outside of memory
+    MemoryFault,
+    // A translated access that the page tables do not allow, see CPU::Walk
+    PageFault,
+    // A store or instruction fetch that the permissions of its page do not allow
+    AccessFault,
+    // A load or store that is not aligned to its size, when misaligned accesses trap
+    MisalignedAccess,
+};
+
+
+struct RunResult
+{
+    StopReason reason;
+    uint64_t instructionCount;
+};
+
+
+// The state of a CPU at some point, which CPU::Restore goes back to. Memory is not copied when it
+// is taken: the CPU shares its pages with the snapshot, and saves each one here the first time the
+// program writes it afterwards. Restoring copies back only those and shares them again, so it costs
+// as much as the pages written since. Writes the host makes to Memory::buffer directly are not
+// noticed, and devices keep their state.
+struct Snapshot
+{
+    Snapshot() = default;
+    // The memory it shares pages with points back at it
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+    ~Snapshot();
+
+    uint32_t pc = 0;
+    IntegerRegisterFile intRegs;
+    FloatRegisterFile fltRegs;
+    CSRFile csr;
+    uint32_t privilege = PRIV_M;
+    // The memory that shares its pages, until it is mapped, cleared or snapshotted again
+    Memory* memory = nullptr;
+    // What the pages the program has written held, by page number
+    std::unordered_map<uint32_t, std::vector<uint8_t>> pages;
+};
+
+
+// Where a CPU's memory is, which it has to itself unless it is a hart of a Machine. Copying one
+// copies the contents of its memory, into memory of its own for a new CPU.
+struct MemoryHolder
+{
+    MemoryHolder() : ownMemory(std::make_unique<Memory>()), memory(*ownMemory) {}
+    explicit MemoryHolder(Memory& shared) : memory(shared) {}
+    MemoryHolder(const MemoryHolder& other) : MemoryHolder() { memory = other.memory; }
+    MemoryHolder& operator=(const MemoryHolder& other) { memory = other.memory; return *this; }
+
+    std::unique_ptr<Memory> ownMemory;
+    Memory& memory;
+};
+
+
+// A hart, with the memory it runs on
+struct CPU : MemoryHolder
 {
 public:
+    CPU() = default;
+    // A hart with the given mhartid on memory that other harts share
+    CPU(Memory& shared, uint32_t hartId);
     void Reset();
-    ParseELFResult InitializeFromELF(uint8_t* data, size_t size);
+    // Reset without clearing memory, which other harts may share
+    void ResetHart();
+    ParseELFResult InitializeFromELF(const uint8_t* data, size_t size);
+    // Maps the segments from the file where it can instead of copying them, see Memory::MapFile.
+    // Pages read from the file until they are written, even once file is closed, so it must not
+    // change or be truncated while they are mapped, or reading them faults the host.
+    ParseELFResult InitializeFromELF(const MappedFile& file);
+    // Executes a single instruction, returns false if execution stopped for any reason
     bool Step();
+    // Executes up to maxInstructions from the block cache, or from native translations when
+    // there are no breakpoints and no paging. On an ecall or ebreak, pc is left after the
+    // instruction, on an illegal instruction, fault or breakpoint it is left at the instruction.
+    // Page, access and misalignment faults leave their cause and address in mcause and mtval,
+    // but are not taken.
+    RunResult Run(uint64_t maxInstructions);
+    void SetBreakpoint(uint32_t address, bool enabled);
+    void SetChangeTracking(bool enabled);
+    void SetMisalignedAccess(MisalignedAccess mode);
+    // Makes snapshot hold the state of the CPU as it is now, see Snapshot
+    void TakeSnapshot(Snapshot& snapshot);
+    // Goes back to snapshot. Returns false if it was not taken here, or memory has been mapped or
+    // cleared since.
+    bool Restore(Snapshot& snapshot);
+    // Traps to mtvec if a software interrupt is pending in mip, and mie and mstatus enable it.
+    // Returns whether it did.
+    bool TakeInterrupt();
+    // Accrues the flags raised by float instructions since ClaimFloatFlags into fcsr. This is
+    // inline because translated code calls it too.
+    void FoldFloatFlags()
+    {
+        int raised = fetestexcept(FE_ALL_EXCEPT);
+        uint32_t flags = (bool(raised & FE_INEXACT)   << 0)
+                       | (bool(raised & FE_UNDERFLOW) << 1)
+                       | (bool(raised & FE_OVERFLOW)  << 2)
+                       | (bool(raised & FE_DIVBYZERO) << 3)
+                       | (bool(raised & FE_INVALID)   << 4);
+        csr.Write(CSR_fflags, csr.Read(CSR_fflags) | flags);
+        floatFlagsPending = false;
+    }
+private:
+    friend struct JIT;
+    ParseELFResult LoadELF(const uint8_t* data, size_t size, const MappedFile* file);
+    using ExecuteFunction = StopReason (CPU::*)(const DecodedInstruction* ins, const DecodedInstruction* end);
+    template<typename Policy>
+    StopReason Execute(const DecodedInstruction* ins, const DecodedInstruction* end);
+    template<bool Threaded, bool TrackChanges, bool Paging>
+    static ExecuteFunction SelectExecute(Extensions extensions);
+    ExecuteFunction SelectExecute(Dispatch dispatchMode) const;
+    RunResult RunBlocks(uint64_t maxInstructions);
+    // Stops execution at accessingInstruction when its access faults
+    template<typename Execution> RunResult GuardMemoryFaults(Execution execution);
+    // Whether a misaligned access to address may go ahead, counting it if it does. Otherwise its
+    // cause and address are left in mcause and mtval.
+    bool AllowMisaligned(const DecodedInstruction& ins, uint32_t address);
+    void ClaimFloatFlags();
+    void SetHostRoundingMode(uint32_t roundingMode);
+    // Rounds to nearest with ties away from zero, which the host cannot do on its own
+    template<typename Operation> float RoundToMaxMagnitude(Operation operation);
+    BasicBlock& LookupBlock(uint32_t address);
+    // The instruction word at address as the program fetches it, or nullptr with the reason it cannot
+    const uint8_t* InstructionAt(uint32_t address, StopReason& fault);
+    // Translates address with the page tables, and fills the TLB entry for its page if it is allowed
+    bool Walk(uint32_t address, AccessType access, uint32_t& physical, StopReason& fault);
+    // Leaves an access or page fault in mcause and mtval
+    void RecordFault(uint32_t address, AccessType access, StopReason fault);
+    // Recomputes paging after satp, mstatus or the privilege mode changed. isRemapped is for
+    // changes that may have pointed virtual addresses elsewhere.
+    void UpdateTranslation(bool isRemapped = false);
+    // The host address of a translated access to a page, or nullptr if the page belongs to a device.
+    // Page faults end execution.
+    uint8_t* TranslateData(uint32_t address, AccessType access, uint32_t& physical);
+    // Translated accesses that miss the TLB, because of the page or because they are misaligned
+    uint32_t LoadMissed(uint32_t address, uint32_t size);
+    void StoreMissed(uint32_t address, const void* value, uint32_t size, bool track);
+    template<bool Paging, typename T> T Load(uint32_t address)
+    {
+        if constexpr (Paging) {
+            const TLB::Entry& entry = tlb.read[TLB::Index(address)];
+            if (entry.tag != TLB::Tag(address, sizeof(T))) [[unlikely]] {
+                uint32_t value = LoadMissed(address, sizeof(T));
+                T t;
+                memcpy(&t, &value, sizeof(T));
+                return t;
+            }
+            T t;
+            memcpy(&t, reinterpret_cast<const uint8_t*>(address + entry.addend), sizeof(T));
+            return t;
+        }
+        else {
+            if (!memory.IsPlainLoad(address, sizeof(T))) [[unlikely]] {
+                uint32_t value = CheckLoad(address, sizeof(T));
+                T t;
+                memcpy(&t, &value, sizeof(T));
+                return t;
+            }
+            return memory.Read<T>(address);
+        }
+    }
+    template<bool Paging, bool Track = true, typename T> void Store(uint32_t address, T value)
+    {
+        if constexpr (Paging) {
+            const TLB::Entry& entry = tlb.write[TLB::Index(address)];
+            if (entry.tag != TLB::Tag(address, sizeof(T))) [[unlikely]] {
+                StoreMissed(address, &value, sizeof(T), Track);
+                return;
+            }
+            // Walk only fills write entries for writable pages that are not watched
+            uint32_t physical = static_cast<uint32_t>(reinterpret_cast<uint8_t*>(address + entry.addend) - memory.buffer);
+            memory.WritePlain<Track>(physical, value);
+            if (memory.permissions[physical / Memory::PageSize] & Memory::HoldsCode) [[unlikely]]
+                InvalidateCode(address, sizeof(T), physical);
+        }
+        else {
+            if (!memory.IsPlainStore(address, sizeof(T))) [[unlikely]] {
+                CheckStore(address, &value, sizeof(T), Track);
+                return;
+            }
+            memory.WritePlain<Track>(address, value);
+        }
+    }
+    // The host address of the word an atomic instruction acts on, once it has been checked like a
+    // store to it would be, or like a load for lr.w. physical is left with its physical address.
+    template<bool Paging, bool Track> uint32_t* AtomicWord(uint32_t address, bool isStore, uint32_t& physical);
+    // Faults accesses outside of memory or to pages that do not allow them. Stores that go ahead
+    // invalidate the code they modify and have their writes noted.
+    void CheckMemory(uint32_t address, uint32_t size, AccessType access);
+    // Accesses that IsPlainLoad or IsPlainStore turned away, which go to the device they are in,
+    // if any, or to memory once CheckMemory has let them
+    uint32_t CheckLoad(uint32_t address, uint32_t size);
+    void CheckStore(uint32_t address, const void* value, uint32_t size, bool track);
+    // Drops whatever cached or translated code a store has modified. Blocks are found by the
+    // address the program fetches them from, translations by where they are in memory.
+    void InvalidateCode(uint32_t address, uint32_t size, uint32_t physical)
+    {
+        if (blockCache.ContainsCode(address, size)) [[unlikely]]
+            blockCache.Invalidate(address, size);
+        // Translated code is fixed, so the whole image is dropped once the program modifies it
+        if (aot != nullptr && physical + size > aot->codeStart && physical < aot->codeEnd) [[unlikely]]
+            aot = nullptr;
+    }
+    void InvalidateCode(uint32_t address, uint32_t size) { InvalidateCode(address, size, address); }
 public:
     uint32_t pc;
     IntegerRegisterFile intRegs;
     FloatRegisterFile fltRegs;
     CSRFile csr;
-    Memory<1024*1024> memory;
+    // What mhartid reads, Reset leaves it there
+    uint32_t hartId = 0;
+    BlockCache blockCache;
+    TLB tlb;
+    JIT jit;
+    // Ahead of time translation of the loaded program, if any, see tools/aot.cpp
+    const AOTImage* aot = nullptr;
+    Dispatch dispatch = Dispatch::Threaded;
+    Extensions extensions = Extensions::RV32IMAF;
+    // See SetMisalignedAccess
+    MisalignedAccess misalignedAccess = MisalignedAccess::Native;
+    // How many misaligned accesses each instruction has made, by its address, when they are counted
+    std::unordered_map<uint32_t, uint64_t> misalignedAccesses;
+    // Whether execution fills in the didChange arrays, which only the debugger looks at, see SetChangeTracking
+    bool trackChanges = false;
+    // Whether the host's floating-point exception flags belong to the guest and hold flags that
+    // fcsr does not have yet. Only ever set inside Step and Run, which fold them before returning.
+    bool floatFlagsPending = false;
+    // The rounding mode the host is set to, which Step and Run leave at RM_RNE, the host's default
+    uint32_t hostRoundingMode = RM_RNE;
+    // The instruction whose guest access the interpreter is making, see GuardMemoryFaults
+    const DecodedInstruction* accessingInstruction = nullptr;
+    uint32_t privilege = PRIV_M;
+    // The word the last lr.w reserved, by physical address, and the value it read. sc.w stores by
+    // comparing and exchanging that value, which keeps it lock free between CPUs that share memory,
+    // so it also succeeds if the word was written with the same value in between.
+    bool hasReservation = false;
+    uint32_t reservedAddress = 0;
+    uint32_t reservedValue = 0;
+    // Whether accesses are translated, which is when satp selects Sv32 outside of machine mode
+    bool paging = false;
+    std::unordered_set<uint32_t> breakpoints;
+};
+
+
+enum class Scheduling : uint32_t
+{
+    // Every hart runs on a host thread of its own
+    Threads,
+    // The harts take turns running a quantum each on the calling thread, always in the same order,
+    // so that a run can be reproduced. Spawned devices run in between, see Machine::time.
+    RoundRobin,
+};
+
+
+// A device that acts on its own, as a coroutine that a Machine resumes once the virtual time it
+// waits for with co_await Machine::Delay has come, see Machine::Spawn
+struct DeviceCoroutine
+{
+    struct promise_type
+    {
+        // When it is to be resumed
+        uint64_t wakeTime = 0;
+
+        DeviceCoroutine get_return_object() { return DeviceCoroutine{ std::coroutine_handle<promise_type>::from_promise(*this) }; }
+        // It starts once it is spawned, and stays around once done for the machine to destroy
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    // Suspends the coroutine until the machine's time is at least time
+    struct Wake
+    {
+        uint64_t time;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<promise_type> handle) const noexcept { handle.promise().wakeTime = time; }
+        void await_resume() const noexcept {}
+    };
+
+    explicit DeviceCoroutine(std::coroutine_handle<promise_type> _handle) : handle(_handle) {}
+    DeviceCoroutine(DeviceCoroutine&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    DeviceCoroutine& operator=(DeviceCoroutine&& other) noexcept { std::swap(handle, other.handle); return *this; }
+    ~DeviceCoroutine() { if (handle) handle.destroy(); }
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+
+// Harts that share one memory, scheduled as scheduling says. They interrupt each other by
+// writing 1 to the MSIP register of the CLINT at CLINT_BASE, which a hart sees in mip once it
+// has run out the quantum of instructions it is in.
+struct Machine
+{
+    constexpr static uint64_t Quantum = 10000;
+
+    explicit Machine(uint32_t hartCount);
+    // Harts and the CLINT point at the machine and its memory
+    Machine(const Machine&) = delete;
+    Machine& operator=(const Machine&) = delete;
+
+    // Also goes back to time 0, and drops the spawned devices
+    void Reset();
+    // Loads the program for every hart, which all start at its entry, see CPU::InitializeFromELF
+    ParseELFResult InitializeFromELF(const uint8_t* data, size_t size);
+    // Runs every hart until it stops for a reason other than the budget, or has run maxInstructions.
+    // Returns why each one stopped.
+    std::vector<RunResult> Run(uint64_t maxInstructions);
+    // Has device start at the current time. Only round robin scheduling keeps time, so devices
+    // do not run on threads.
+    void Spawn(DeviceCoroutine device);
+    // What a device co_awaits to be resumed ticks from now
+    DeviceCoroutine::Wake Delay(uint64_t ticks) const { return { time + ticks }; }
+
+    Memory memory;
+    // Kept where they are, since translations point into them
+    std::vector<std::unique_ptr<CPU>> harts;
+    // The MSIP register of each hart
+    std::unique_ptr<std::atomic<uint32_t>[]> msip;
+    Scheduling scheduling = Scheduling::Threads;
+    // Goes up by Quantum each time the harts have had their turns, whether they used all of it or not
+    uint64_t time = 0;
+    std::vector<DeviceCoroutine> devices;
+private:
+    RunResult RunHart(uint32_t hart, uint64_t maxInstructions);
+    std::vector<RunResult> RunRoundRobin(uint64_t maxInstructions);
+    // Runs up to a quantum of the hart, at most budget instructions, once it has taken its interrupt
+    RunResult RunQuantum(uint32_t hart, uint64_t budget);
 };
 
 
@@ -648,7 +1580,17 @@ struct FormattedInstruction
 };
 
 const char* ParseELFResultMessage(ParseELFResult result);
+// Checks the ELF header the way InitializeFromELF does, without loading the program anywhere
+ParseELFResult CheckELF(const uint8_t* data, size_t size);
+const char* StopReasonMessage(StopReason reason);
 const char* InstructionName(InstructionType type);
 void FormatInstruction(RawInstruction ins, char* buffer, size_t buffsz);
 FormattedInstruction FormatInstruction(RawInstruction ins);
 InstructionType DecodeInstruction(RawInstruction instruction);
+// The row of InstructionEncodings for type, with an empty mask and match for ILLEGAL
+const InstructionEncoding& EncodingOf(InstructionType type);
+DecodedInstruction DecodeOperands(RawInstruction instruction, uint32_t pc);
+// The smallest set of extensions that includes the instruction
+Extensions RequiredExtensions(InstructionType type);
+// The type of the first instruction of a fused pair, or the type itself if it is not fused
+InstructionType UnfusedType(InstructionType type);
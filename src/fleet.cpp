@@ -0,0 +1,138 @@
+#include "fleet.hpp"
+#include "lockstep.hpp"
+#include "helpers.hpp"
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <algorithm>
+
+
+// The instances a worker has left, [next, end) packed into one word, so that the worker can take
+// them from the front while others steal from the back without a lock
+struct alignas(64) FleetRange
+{
+    std::atomic<uint64_t> range = 0;
+};
+
+static uint64_t PackRange(uint32_t next, uint32_t end) { return (static_cast<uint64_t>(next) << 32) | end; }
+
+static bool TakeFront(FleetRange& own, uint32_t& instance)
+{
+    uint64_t current = own.range.load();
+    while (true) {
+        uint32_t next = static_cast<uint32_t>(current >> 32);
+        uint32_t end = static_cast<uint32_t>(current);
+        if (next >= end)
+            return false;
+        if (own.range.compare_exchange_weak(current, PackRange(next + 1, end))) {
+            instance = next;
+            return true;
+        }
+    }
+}
+
+// Moves the back half of what victim has left to thief, which has nothing left
+static bool StealHalf(FleetRange& victim, FleetRange& thief)
+{
+    uint64_t current = victim.range.load();
+    while (true) {
+        uint32_t next = static_cast<uint32_t>(current >> 32);
+        uint32_t end = static_cast<uint32_t>(current);
+        if (next >= end)
+            return false;
+        uint32_t middle = next + (end - next) / 2;
+        if (victim.range.compare_exchange_weak(current, PackRange(next, middle))) {
+            thief.range.store(PackRange(middle, end));
+            return true;
+        }
+    }
+}
+
+ParseELFResult Fleet::Load(const MappedFile& program)
+{
+    ParseELFResult result = CheckELF(program.data, program.size);
+    file = (result == ParseELFResult::Ok) ? &program : nullptr;
+    return result;
+}
+
+std::vector<FleetResult> Fleet::Run(uint32_t instanceCount)
+{
+    assert(file != nullptr);
+    std::vector<FleetResult> results(instanceCount);
+    uint32_t workers = (workerCount != 0) ? workerCount : std::max(1u, std::thread::hardware_concurrency());
+    workers = std::max(1u, std::min(workers, instanceCount));
+    // Each worker starts out with an even share
+    std::vector<FleetRange> ranges(workers);
+    for (uint32_t i = 0; i < workers; ++i)
+        ranges[i].range.store(PackRange(static_cast<uint32_t>(uint64_t(instanceCount) * i / workers), static_cast<uint32_t>(uint64_t(instanceCount) * (i + 1) / workers)));
+
+    assert(lanes == 1 || lanes == 8 || lanes == 16);
+    auto work = [&](uint32_t worker) {
+        std::vector<std::unique_ptr<CPU>> cpus(lanes);
+        std::unique_ptr<Snapshot[]> starts = std::make_unique<Snapshot[]>(lanes);
+        for (uint32_t lane = 0; lane < lanes; ++lane) {
+            cpus[lane] = std::make_unique<CPU>();
+            if (configure)
+                configure(*cpus[lane]);
+            ParseELFResult loadResult = cpus[lane]->InitializeFromELF(*file);
+            assert(loadResult == ParseELFResult::Ok);
+            (void) loadResult;
+            cpus[lane]->TakeSnapshot(starts[lane]);
+        }
+        std::unique_ptr<Lockstep<8>> narrow = (lanes == 8) ? std::make_unique<Lockstep<8>>() : nullptr;
+        std::unique_ptr<Lockstep<16>> wide = (lanes == 16) ? std::make_unique<Lockstep<16>>() : nullptr;
+        std::vector<CPU*> group(lanes);
+        std::vector<uint32_t> instances(lanes);
+        std::vector<uint64_t> budgets(lanes);
+        std::vector<RunResult> runs(lanes);
+        std::vector<bool> isFresh(lanes, true);
+        while (true) {
+            // A group is what the worker has left, up to a lane for each
+            uint32_t count = 0;
+            while (count < lanes && TakeFront(ranges[worker], instances[count]))
+                ++count;
+            for (uint32_t i = 1; i < workers && count == 0; ++i)
+                if (StealHalf(ranges[(worker + i) % workers], ranges[worker]))
+                    while (count < lanes && TakeFront(ranges[worker], instances[count]))
+                        ++count;
+            // What is left belongs to workers that are still at it
+            if (count == 0)
+                break;
+
+            for (uint32_t lane = 0; lane < count; ++lane) {
+                CPU& cpu = *cpus[lane];
+                if (!isFresh[lane]) {
+                    bool restored = cpu.Restore(starts[lane]);
+                    assert(restored);
+                    (void) restored;
+                }
+                isFresh[lane] = false;
+                group[lane] = &cpu;
+                budgets[lane] = setup ? setup(cpu, instances[lane]) : UINT64_MAX;
+            }
+            std::span<CPU* const> groupCpus(group.data(), count);
+            std::span<const uint64_t> groupBudgets(budgets.data(), count);
+            std::span<RunResult> groupRuns(runs.data(), count);
+            if (narrow)
+                narrow->Run(groupCpus, groupBudgets, groupRuns);
+            else if (wide)
+                wide->Run(groupCpus, groupBudgets, groupRuns);
+            else
+                runs[0] = cpus[0]->Run(budgets[0]);
+            for (uint32_t lane = 0; lane < count; ++lane) {
+                FleetResult& result = results[instances[lane]];
+                result.run = runs[lane];
+                result.exitCode = cpus[lane]->intRegs.Read(10);
+                if (finish)
+                    finish(*cpus[lane], instances[lane], result);
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (uint32_t i = 1; i < workers; ++i)
+        threads.emplace_back(work, i);
+    work(0);
+    for (std::thread& thread : threads)
+        thread.join();
+    return results;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <functional>
+#include "cpu.hpp"
+
+
+struct MappedFile;
+
+
+struct FleetResult
+{
+    RunResult run;
+    // What the instance left in a0, which riscv-tests and exit calls pass their status in
+    uint32_t exitCode;
+};
+
+
+// Runs many instances of one program, each from the state the program starts out in. Every worker
+// thread loads the program once for each of its lanes, with its segments mapped from the file, and
+// goes back to that state between instances by restoring a snapshot, so an instance costs the
+// pages it writes rather than a load. Translations stay with the worker, and carry over between
+// its instances.
+struct Fleet
+{
+    // Checks the program's ELF header, without loading it. The workers map its segments when Run
+    // starts, so it has to stay open and unchanged until Run returns.
+    ParseELFResult Load(const MappedFile& program);
+    // Runs instances [0, instanceCount), which idle workers steal from busy ones, and returns how
+    // each one stopped
+    std::vector<FleetResult> Run(uint32_t instanceCount);
+
+    const MappedFile* file = nullptr;
+    // One for each host core if 0
+    uint32_t workerCount = 0;
+    // How many instances each worker runs at once, 1, or 8 or 16 in lockstep, see Lockstep. Each
+    // lane has a CPU of its own.
+    uint32_t lanes = 1;
+    // The callbacks are called on the workers' threads, for several instances at once.
+    // Gives each worker's CPU its settings, like whether to translate, before it loads the program
+    std::function<void(CPU& cpu)> configure;
+    // Gives an instance its input, with Memory::Write so that restoring undoes it, and returns how
+    // many instructions it may run. Without it, instances run until they stop.
+    std::function<uint64_t(CPU& cpu, uint32_t instance)> setup;
+    // Reads an instance's output once it has stopped
+    std::function<void(const CPU& cpu, uint32_t instance, const FleetResult& result)> finish;
+};
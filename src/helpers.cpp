@@ -1,10 +1,76 @@
 #include "helpers.hpp"
 #include <fstream>
 
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 std::vector<uint8_t> ReadEntireFile(std::string_view filename)
 {
-    std::ifstream input(filename.data(), std::ios::binary);
-    std::vector<uint8_t> buffer(std::istreambuf_iterator<char>(input), {});
+    std::ifstream input(filename.data(), std::ios::binary | std::ios::ate);
+    if (!input)
+        return {};
+    std::vector<uint8_t> buffer(static_cast<size_t>(input.tellg()));
+    input.seekg(0);
+    input.read(reinterpret_cast<char*>(buffer.data()), static_cast<std::streamsize>(buffer.size()));
     return buffer;
 }
 
+bool MappedFile::Open(const char* filename)
+{
+    Close();
+#if defined(_WIN32)
+    file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        file = nullptr;
+        return false;
+    }
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+        Close();
+        return false;
+    }
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    data = (mapping != nullptr) ? static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+    size = static_cast<size_t>(fileSize.QuadPart);
+#else
+    descriptor = open(filename, O_RDONLY);
+    struct stat status;
+    if (descriptor < 0 || fstat(descriptor, &status) != 0 || status.st_size == 0) {
+        Close();
+        return false;
+    }
+    void* view = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE, descriptor, 0);
+    data = (view != MAP_FAILED) ? static_cast<const uint8_t*>(view) : nullptr;
+    size = static_cast<size_t>(status.st_size);
+#endif
+    if (data == nullptr) {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void MappedFile::Close()
+{
+#if defined(_WIN32)
+    if (data != nullptr) UnmapViewOfFile(data);
+    if (mapping != nullptr) CloseHandle(mapping);
+    if (file != nullptr) CloseHandle(file);
+    file = nullptr;
+    mapping = nullptr;
+#else
+    if (data != nullptr) munmap(const_cast<uint8_t*>(data), size);
+    if (descriptor >= 0) close(descriptor);
+    descriptor = -1;
+#endif
+    data = nullptr;
+    size = 0;
+}
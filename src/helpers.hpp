@@ -6,6 +6,28 @@
 
 std::vector<uint8_t> ReadEntireFile(std::string_view filename);
 
+// A file mapped read only into the host address space, without reading it up front
+struct MappedFile
+{
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { Close(); }
+
+    bool Open(const char* filename);
+    void Close();
+
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+#if defined(_WIN32)
+    void* file = nullptr;
+    void* mapping = nullptr;
+#else
+    // Kept open so that parts of the file can be mapped elsewhere, see Memory::MapFile
+    int descriptor = -1;
+#endif
+};
+
 // Old compilers no std::bit_cast :(
 template<typename T>
 T bit_cast(auto value)
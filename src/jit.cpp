@@ -0,0 +1,798 @@
+#include "jit.hpp"
+#include "cpu.hpp"
+
+#if CPU_JIT
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+#if CPU_JIT
+
+enum HostRegister : uint8_t
+{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+// Condition codes as encoded in jcc and setcc
+enum Condition : uint8_t
+{
+    CondB  = 0x2,
+    CondAE = 0x3,
+    CondE  = 0x4,
+    CondNE = 0x5,
+    CondBE = 0x6,
+    CondA  = 0x7,
+    CondS  = 0x8,
+    CondL  = 0xC,
+    CondGE = 0xD,
+};
+
+// The reg field of the 0x81 (immediate) group, the register form opcode is (op << 3) | 1
+enum AluOp : uint8_t { Add = 0, Or = 1, And = 4, Sub = 5, Xor = 6, Cmp = 7 };
+enum ShiftOp : uint8_t { Shl = 4, Shr = 5, Sar = 7 };
+
+#if defined(_WIN32)
+constexpr HostRegister ArgRegisters[] = { RCX, RDX, R8 };
+#else
+constexpr HostRegister ArgRegisters[] = { RDI, RSI, RDX };
+#endif
+
+// Guest registers are cached in callee-saved host registers, so they survive calls into C++.
+// RBX holds the CPU pointer, all guest state is addressed relative to it.
+constexpr HostRegister CachedRegisters[] = { RBP, R12, R13, R14, R15 };
+constexpr uint32_t NumCachedRegisters = sizeof(CachedRegisters) / sizeof(CachedRegisters[0]);
+
+// Six pushes and this keep the stack 16-byte aligned for calls, and include the Win64 shadow space
+constexpr uint8_t FrameSize = 40;
+
+
+struct Emitter
+{
+    uint8_t* cursor;
+
+    void Byte(uint8_t b) { *cursor++ = b; }
+    void Dword(uint32_t d) { memcpy(cursor, &d, sizeof(d)); cursor += sizeof(d); }
+    void Qword(uint64_t q) { memcpy(cursor, &q, sizeof(q)); cursor += sizeof(q); }
+
+    void Rex(bool w, uint8_t reg, uint8_t rm)
+    {
+        uint8_t rex = 0x40 | (w << 3) | ((reg & 8) >> 1) | ((rm & 8) >> 3);
+        if (rex != 0x40) Byte(rex);
+    }
+    void ModRM(uint8_t mod, uint8_t reg, uint8_t rm) { Byte((mod << 6) | ((reg & 7) << 3) | (rm & 7)); }
+    // [rbx + disp32]
+    void MemoryOperand(uint8_t reg, int32_t disp) { ModRM(2, reg, RBX); Dword(disp); }
+
+    void Mov(HostRegister dst, HostRegister src) { Rex(false, src, dst); Byte(0x89); ModRM(3, src, dst); }
+    void Mov64(HostRegister dst, HostRegister src) { Rex(true, src, dst); Byte(0x89); ModRM(3, src, dst); }
+    void MovImm(HostRegister dst, uint32_t imm) { Rex(false, 0, dst); Byte(0xB8 + (dst & 7)); Dword(imm); }
+    void Load(HostRegister dst, int32_t disp) { Rex(false, dst, RBX); Byte(0x8B); MemoryOperand(dst, disp); }
+    void Store(int32_t disp, HostRegister src) { Rex(false, src, RBX); Byte(0x89); MemoryOperand(src, disp); }
+    void StoreImm(int32_t disp, uint32_t imm) { Byte(0xC7); MemoryOperand(0, disp); Dword(imm); }
+    void StoreByteImm(int32_t disp, uint8_t imm) { Byte(0xC6); MemoryOperand(0, disp); Byte(imm); }
+
+    void Alu(AluOp op, HostRegister dst, HostRegister src) { Rex(false, src, dst); Byte((op << 3) | 1); ModRM(3, src, dst); }
+    void AluImm(AluOp op, HostRegister dst, uint32_t imm) { Rex(false, 0, dst); Byte(0x81); ModRM(3, op, dst); Dword(imm); }
+    void AluMemImm(AluOp op, int32_t disp, uint32_t imm) { Byte(0x81); MemoryOperand(op, disp); Dword(imm); }
+    void Shift(ShiftOp op, HostRegister dst, uint8_t amount) { Rex(false, 0, dst); Byte(0xC1); ModRM(3, op, dst); Byte(amount); }
+    void ShiftCL(ShiftOp op, HostRegister dst) { Rex(false, 0, dst); Byte(0xD3); ModRM(3, op, dst); }
+    // eax = condition ? 1 : 0
+    void SetEAX(Condition cond) { Byte(0x0F); Byte(0x90 + cond); ModRM(3, 0, RAX); Byte(0x0F); Byte(0xB6); ModRM(3, RAX, RAX); }
+    void Imul(HostRegister dst, HostRegister src) { Rex(false, dst, src); Byte(0x0F); Byte(0xAF); ModRM(3, dst, src); }
+    // edx:eax = eax * src, signed (imul) or unsigned (mul)
+    void WideImul(HostRegister src) { Rex(false, 0, src); Byte(0xF7); ModRM(3, 5, src); }
+    void WideMul(HostRegister src) { Rex(false, 0, src); Byte(0xF7); ModRM(3, 4, src); }
+    // dst = byte [base + index], zero extended. base must not be rbp or r13.
+    void LoadByteIndexed(HostRegister dst, HostRegister base, HostRegister index)
+    {
+        uint8_t rex = 0x40 | ((dst & 8) >> 1) | ((index & 8) >> 2) | ((base & 8) >> 3);
+        if (rex != 0x40) Byte(rex);
+        Byte(0x0F); Byte(0xB6);
+        ModRM(0, dst, 4);
+        Byte(((index & 7) << 3) | (base & 7));
+    }
+
+    void Mfence() { Byte(0x0F); Byte(0xAE); Byte(0xF0); }
+
+    void MovImm64(HostRegister dst, uint64_t imm) { Rex(true, 0, dst); Byte(0xB8 + (dst & 7)); Qword(imm); }
+
+    // eax = [base + rax], with the given opcode (8B, or 0F xx for the extending loads)
+    void LoadIndexed(uint16_t opcode, HostRegister base)
+    {
+        if (opcode > 0xFF) Byte(opcode >> 8);
+        Byte(opcode & 0xFF);
+        ModRM(0, RAX, 4);
+        Byte((RAX << 3) | base); // SIB: [base + rax]
+    }
+    // [base + rax] = cl, cx or ecx
+    void StoreIndexed(uint32_t size, HostRegister base)
+    {
+        if (size == 2) Byte(0x66);
+        Byte(size == 1 ? 0x88 : 0x89);
+        ModRM(0, RCX, 4);
+        Byte((RAX << 3) | base);
+    }
+
+    void Call(const void* function)
+    {
+        Rex(true, 0, RAX); Byte(0xB8); Qword(reinterpret_cast<uint64_t>(function));
+        Byte(0xFF); ModRM(3, 2, RAX);
+    }
+
+    // Both return the location of the rel32 operand, to be patched once the target is known
+    uint8_t* Jump() { Byte(0xE9); Dword(0); return cursor - 4; }
+    uint8_t* JumpIf(Condition cond) { Byte(0x0F); Byte(0x80 + cond); Dword(0); return cursor - 4; }
+};
+
+static void PatchJump(uint8_t* site, const uint8_t* target)
+{
+    int32_t rel = static_cast<int32_t>(target - (site + 4));
+    memcpy(site, &rel, sizeof(rel));
+}
+
+static uint32_t DivideSigned(uint32_t dividend, uint32_t divisor)
+{
+    if (divisor == 0) return 0xFFFFFFFF;
+    if (dividend == 0x80000000 && divisor == 0xFFFFFFFF) return dividend;
+    return static_cast<uint32_t>(static_cast<int32_t>(dividend) / static_cast<int32_t>(divisor));
+}
+
+static uint32_t DivideUnsigned(uint32_t dividend, uint32_t divisor)
+{
+    return (divisor == 0) ? 0xFFFFFFFF : dividend / divisor;
+}
+
+static uint32_t RemainderSigned(uint32_t dividend, uint32_t divisor)
+{
+    if (divisor == 0) return dividend;
+    if (dividend == 0x80000000 && divisor == 0xFFFFFFFF) return 0;
+    return static_cast<uint32_t>(static_cast<int32_t>(dividend) % static_cast<int32_t>(divisor));
+}
+
+static uint32_t RemainderUnsigned(uint32_t dividend, uint32_t divisor)
+{
+    return (divisor == 0) ? dividend : dividend % divisor;
+}
+
+// Translations make stores themselves, and only the ones that the page permissions let straight
+// through, so the CPU is only called to track them
+template<typename T>
+void JIT::TrackStoreFromTranslation([[maybe_unused]] CPU* cpu, [[maybe_unused]] uint32_t address)
+{
+#if CPU_TRACK_CHANGES
+    memset(cpu->memory.didChange + address, 1, sizeof(T));
+#endif
+}
+
+static bool IsTranslatable(InstructionType type)
+{
+    // RV32IM and the float moves and accesses, which InstructionType lists together
+    return (type >= InstructionType::LUI && type <= InstructionType::FENCE)
+        || (type >= InstructionType::MUL && type <= InstructionType::REMU)
+        || type == InstructionType::FLW || type == InstructionType::FSW
+        || type == InstructionType::FMVXW || type == InstructionType::FMVWX;
+}
+
+static int32_t Offset(const CPU& cpu, const void* field)
+{
+    std::ptrdiff_t offset = static_cast<const uint8_t*>(field) - reinterpret_cast<const uint8_t*>(&cpu);
+    assert(offset >= 0 && offset <= INT32_MAX);
+    return static_cast<int32_t>(offset);
+}
+
+
+// Emits the code for a single block
+struct Translator
+{
+    struct SideExit
+    {
+        uint8_t* jump;
+        uint32_t pc;
+        uint32_t dirty;
+        JITExit reason;
+        // Instructions of the block that did not run, which are given back to the budget
+        uint32_t refund;
+    };
+
+    struct ChainedExit
+    {
+        uint8_t* jump;
+        uint32_t targetPc;
+    };
+
+    Emitter e;
+    int32_t intRegsOffset;
+    int32_t intChangedOffset;
+    int32_t fltRegsOffset;
+    int32_t fltChangedOffset;
+    const Memory* memory;
+    int32_t pcOffset;
+    int32_t budgetOffset;
+    const uint8_t* exitStub;
+    bool trackChanges;
+    bool checkAlignment;
+    int8_t cachedIndex[32];
+    // Cached registers that have been written since the block was entered
+    uint32_t dirty = 0;
+    // Instructions left in the block, including the one being emitted
+    uint32_t remaining = 0;
+    std::vector<SideExit> sideExits;
+    std::vector<ChainedExit> chainedExits;
+
+    void MarkChanged(int32_t disp)
+    {
+        if (trackChanges) e.StoreByteImm(disp, 1);
+    }
+
+    template<typename T>
+    const void* StoreFunction() const
+    {
+        return trackChanges ? reinterpret_cast<const void*>(JIT::TrackStoreFromTranslation<T>) : nullptr;
+    }
+
+    void LoadGuest(HostRegister dst, uint32_t x)
+    {
+        if (x == 0) e.Alu(Xor, dst, dst);
+        else if (cachedIndex[x] >= 0) e.Mov(dst, CachedRegisters[cachedIndex[x]]);
+        else e.Load(dst, intRegsOffset + 4 * x);
+    }
+
+    void StoreGuest(uint32_t x, HostRegister src)
+    {
+        if (x == 0) return;
+        if (cachedIndex[x] >= 0) {
+            e.Mov(CachedRegisters[cachedIndex[x]], src);
+            dirty |= 1 << cachedIndex[x];
+        }
+        else {
+            e.Store(intRegsOffset + 4 * x, src);
+            MarkChanged(intChangedOffset + x);
+        }
+    }
+
+    void WriteBack(uint32_t dirtyMask)
+    {
+        for (uint32_t x = 1; x < 32; ++x) {
+            if (cachedIndex[x] >= 0 && (dirtyMask & (1 << cachedIndex[x]))) {
+                e.Store(intRegsOffset + 4 * x, CachedRegisters[cachedIndex[x]]);
+                MarkChanged(intChangedOffset + x);
+            }
+        }
+    }
+
+    void SideExitIf(Condition cond, uint32_t pc, JITExit reason, uint32_t refund)
+    {
+        sideExits.push_back({ e.JumpIf(cond), pc, dirty, reason, refund });
+    }
+
+    // Leaves eax = rs1 + imm
+    void EffectiveAddress(const DecodedInstruction& ins)
+    {
+        LoadGuest(RAX, ins.rs1);
+        if (ins.imm != 0) e.AluImm(Add, RAX, ins.imm);
+    }
+
+    // Leaves the interpreter to deal with an access at eax that is not aligned to its size, unless
+    // the host makes those. Clobbers edx.
+    void CheckAlignment(uint32_t pc, uint32_t size)
+    {
+        if (!checkAlignment || size == 1)
+            return;
+        e.Mov(RDX, RAX);
+        e.AluImm(And, RDX, size - 1);
+        SideExitIf(CondNE, pc, JITExit::Interpret, remaining);
+    }
+
+    // Leaves the interpreter to deal with loads that Memory::IsPlainLoad does not allow, which
+    // covers ones outside of memory and ones from pages the program may not read. Clobbers edx and r8.
+    void GuestLoad(const DecodedInstruction& ins, uint32_t pc, uint16_t opcode, uint32_t size)
+    {
+        EffectiveAddress(ins);
+        CheckAlignment(pc, size);
+        if (size > 1) {
+            e.Mov(RDX, RAX);
+            e.AluImm(And, RDX, Memory::PageSize - 1);
+            e.AluImm(Cmp, RDX, Memory::PageSize - size);
+            SideExitIf(CondA, pc, JITExit::Interpret, remaining);
+        }
+        e.Mov(RDX, RAX);
+        e.Shift(Shr, RDX, 12);
+        e.MovImm64(R8, reinterpret_cast<uint64_t>(memory->permissions));
+        e.LoadByteIndexed(RDX, R8, RDX);
+        e.AluImm(And, RDX, Memory::Readable);
+        SideExitIf(CondE, pc, JITExit::Interpret, remaining);
+
+        e.MovImm64(RDX, reinterpret_cast<uint64_t>(memory->buffer));
+        e.LoadIndexed(opcode, RDX);
+    }
+
+    // Expects the address in eax and the value in ecx. Leaves the interpreter to deal with stores
+    // that Memory::IsPlainStore does not allow, which covers ones outside of memory, ones that
+    // modify code and the first ones to each page since it was cleared or snapshotted, so the
+    // translation never has to exit after a store. Clobbers edx and r8.
+    void GuestStore(uint32_t pc, const void* function, uint32_t size)
+    {
+        CheckAlignment(pc, size);
+        if (size > 1) {
+            e.Mov(RDX, RAX);
+            e.AluImm(And, RDX, Memory::PageSize - 1);
+            e.AluImm(Cmp, RDX, Memory::PageSize - size);
+            SideExitIf(CondA, pc, JITExit::Interpret, remaining);
+        }
+        e.Mov(RDX, RAX);
+        e.Shift(Shr, RDX, 12);
+        e.MovImm64(R8, reinterpret_cast<uint64_t>(memory->permissions));
+        e.LoadByteIndexed(RDX, R8, RDX);
+        e.AluImm(And, RDX, Memory::StoreMask);
+        e.AluImm(Cmp, RDX, Memory::Writable);
+        SideExitIf(CondNE, pc, JITExit::Interpret, remaining);
+
+        e.MovImm64(RDX, reinterpret_cast<uint64_t>(memory->buffer));
+        e.StoreIndexed(size, RDX);
+        if (function != nullptr) {
+            e.Mov(ArgRegisters[1], RAX);
+            e.Mov64(ArgRegisters[0], RBX);
+            e.Call(function);
+        }
+    }
+
+    // Expects the operands in eax and ecx, leaves the result in eax
+    void CallBinary(uint32_t (*function)(uint32_t, uint32_t))
+    {
+#if defined(_WIN32)
+        e.Mov(RDX, RCX);
+        e.Mov(RCX, RAX);
+#else
+        e.Mov(RDI, RAX);
+        e.Mov(RSI, RCX);
+#endif
+        e.Call(reinterpret_cast<const void*>(function));
+    }
+
+    void Branch(const DecodedInstruction& ins, Condition cond)
+    {
+        LoadGuest(RAX, ins.rs1);
+        LoadGuest(RCX, ins.rs2);
+        e.Alu(Cmp, RAX, RCX);
+        // Moves leave the flags alone
+        WriteBack(dirty);
+        chainedExits.push_back({ e.JumpIf(cond), ins.imm });
+        chainedExits.push_back({ e.Jump(), ins.nextPc });
+    }
+
+    // Returns false if the instruction ended the block
+    bool Emit(const DecodedInstruction& ins, uint32_t pc)
+    {
+        switch (ins.type) {
+            // What IsTranslatable turns away
+            case InstructionType::ILLEGAL:
+            case InstructionType::MRET:
+            case InstructionType::SRET:
+            case InstructionType::SFENCE_VMA:
+            case InstructionType::ECALL:
+            case InstructionType::EBREAK:
+            case InstructionType::FENCE_I:
+            case InstructionType::CSRRW:
+            case InstructionType::CSRRS:
+            case InstructionType::CSRRC:
+            case InstructionType::CSRRWI:
+            case InstructionType::CSRRSI:
+            case InstructionType::CSRRCI:
+            case InstructionType::LR_W:
+            case InstructionType::SC_W:
+            case InstructionType::AMOSWAP_W:
+            case InstructionType::AMOADD_W:
+            case InstructionType::AMOXOR_W:
+            case InstructionType::AMOAND_W:
+            case InstructionType::AMOOR_W:
+            case InstructionType::AMOMIN_W:
+            case InstructionType::AMOMAX_W:
+            case InstructionType::AMOMINU_W:
+            case InstructionType::AMOMAXU_W:
+            case InstructionType::FMADDS:
+            case InstructionType::FMSUBS:
+            case InstructionType::FNMSUBS:
+            case InstructionType::FNMADDS:
+            case InstructionType::FADDS:
+            case InstructionType::FSUBS:
+            case InstructionType::FMULS:
+            case InstructionType::FDIVS:
+            case InstructionType::FSQRTS:
+            case InstructionType::FSGNJS:
+            case InstructionType::FSGNJNS:
+            case InstructionType::FSGNJXS:
+            case InstructionType::FMINS:
+            case InstructionType::FMAXS:
+            case InstructionType::FCVTWS:
+            case InstructionType::FCVTWUS:
+            case InstructionType::FEQS:
+            case InstructionType::FLTS:
+            case InstructionType::FLES:
+            case InstructionType::FCLASSS:
+            case InstructionType::FCVTSW:
+            case InstructionType::FCVTSWU:
+            case InstructionType::LUI_ADDI:
+            case InstructionType::AUIPC_ADDI:
+            case InstructionType::AUIPC_LW:
+            case InstructionType::AUIPC_JALR:
+            case InstructionType::SLLI_SRLI:
+            case InstructionType::MULH_MUL:
+            case InstructionType::MULHU_MUL:
+            case InstructionType::COUNT:
+                assert(false && "Instruction is not translatable");
+            break; case InstructionType::LUI:
+            case InstructionType::AUIPC:
+                e.MovImm(RAX, ins.imm);
+                StoreGuest(ins.rd, RAX);
+            break; case InstructionType::ADDI:
+                LoadGuest(RAX, ins.rs1);
+                if (ins.imm != 0) e.AluImm(Add, RAX, ins.imm);
+                StoreGuest(ins.rd, RAX);
+            break; case InstructionType::SLTI:
+            case InstructionType::SLTIU:
+                LoadGuest(RAX, ins.rs1);
+                e.AluImm(Cmp, RAX, ins.imm);
+                e.SetEAX(ins.type == InstructionType::SLTI ? CondL : CondB);
+                StoreGuest(ins.rd, RAX);
+            break; case InstructionType::XORI:
+            case InstructionType::ORI:
+            case InstructionType::ANDI:
+                LoadGuest(RAX, ins.rs1);
+                e.AluImm(ins.type == InstructionType::XORI ? Xor : ins.type == InstructionType::ORI ? Or : And, RAX, ins.imm);
+                StoreGuest(ins.rd, RAX);
+            break; case InstructionType::SLLI:
+            case InstructionType::SRLI:
+            case InstructionType::SRAI:
+                LoadGuest(RAX, ins.rs1);
+                e.Shift(ins.type == InstructionType::SLLI ? Shl : ins.type == InstructionType::SRLI ? Shr : Sar, RAX, static_cast<uint8_t>(ins.imm));
+                StoreGuest(ins.rd, RAX);
+            break; case InstructionType::ADD:
+            case InstructionType::SUB:
+            case InstructionType::XOR:
+            case InstructionType::OR:
+            case InstructionType::AND:
+                LoadGuest(RAX, ins.rs1);
+                LoadGuest(RCX, ins.rs2);
+                e.Alu(ins.type == InstructionType::ADD ? Add : ins.type == InstructionType::SUB ? Sub
+                    : ins.type == InstructionType::XOR ? Xor : ins.type == InstructionType::OR ? Or : And, RAX, RCX);
+                StoreGuest(ins.rd, RAX);
+            break; case InstructionType::SLT:
+            case InstructionType::SLTU:
+                LoadGuest(RAX, ins.rs1);
+                LoadGuest(RCX, ins.rs2);
+                e.Alu(Cmp, RAX, RCX);
+                e.SetEAX(ins.type == InstructionType::SLT ? CondL : CondB);
+                StoreGuest(ins.rd, RAX);
+            break; case InstructionType::SLL:
+            case InstructionType::SRL:
+            case InstructionType::SRA:
+                // The host masks the shift amount to 5 bits like the guest does
+                LoadGuest(RAX, ins.rs1);
+                LoadGuest(RCX, ins.rs2);
+                e.ShiftCL(ins.type == InstructionType::SLL ? Shl : ins.type == InstructionType::SRL ? Shr : Sar, RAX);
+                StoreGuest(ins.rd, RAX);
+            break; case InstructionType::MUL:
+                LoadGuest(RAX, ins.rs1);
+                LoadGuest(RCX, ins.rs2);
+                e.Imul(RAX, RCX);
+                StoreGuest(ins.rd, RAX);
+            break; case InstructionType::MULH:
+            case InstructionType::MULHU:
+                LoadGuest(RAX, ins.rs1);
+                LoadGuest(RCX, ins.rs2);
+                if (ins.type == InstructionType::MULH) e.WideImul(RCX);
+                else e.WideMul(RCX);
+                StoreGuest(ins.rd, RDX);
+            break; case InstructionType::MULHSU:
+                // Sign extend rs1 to 64 bits, rs2 is already zero extended, then take the high half of the product
+                LoadGuest(RAX, ins.rs1);
+                LoadGuest(RCX, ins.rs2);
+                e.Byte(0x48); e.Byte(0x63); e.ModRM(3, RAX, RAX); // movsxd rax, eax
+                e.Byte(0x48); e.Byte(0x0F); e.Byte(0xAF); e.ModRM(3, RAX, RCX); // imul rax, rcx
+                e.Byte(0x48); e.Byte(0xC1); e.ModRM(3, Shr, RAX); e.Byte(32); // shr rax, 32
+                StoreGuest(ins.rd, RAX);
+            break; case InstructionType::DIV:
+            case InstructionType::DIVU:
+            case InstructionType::REM:
+            case InstructionType::REMU:
+                // x86 division traps on the cases that RISC-V defines results for, so leave those to C++
+                LoadGuest(RAX, ins.rs1);
+                LoadGuest(RCX, ins.rs2);
+                CallBinary(ins.type == InstructionType::DIV ? DivideSigned : ins.type == InstructionType::DIVU ? DivideUnsigned
+                         : ins.type == InstructionType::REM ? RemainderSigned : RemainderUnsigned);
+                StoreGuest(ins.rd, RAX);
+            break; case InstructionType::LB:  GuestLoad(ins, pc, 0x0FBE, 1); StoreGuest(ins.rd, RAX);
+            break; case InstructionType::LBU: GuestLoad(ins, pc, 0x0FB6, 1); StoreGuest(ins.rd, RAX);
+            break; case InstructionType::LH:  GuestLoad(ins, pc, 0x0FBF, 2); StoreGuest(ins.rd, RAX);
+            break; case InstructionType::LHU: GuestLoad(ins, pc, 0x0FB7, 2); StoreGuest(ins.rd, RAX);
+            break; case InstructionType::LW:  GuestLoad(ins, pc, 0x8B, 4); StoreGuest(ins.rd, RAX);
+            break; case InstructionType::FLW:
+                GuestLoad(ins, pc, 0x8B, 4);
+                e.Store(fltRegsOffset + 4 * ins.rd, RAX);
+                MarkChanged(fltChangedOffset + ins.rd);
+            break; case InstructionType::SB:
+                EffectiveAddress(ins);
+                LoadGuest(RCX, ins.rs2);
+                GuestStore(pc, StoreFunction<uint8_t>(), 1);
+            break; case InstructionType::SH:
+                EffectiveAddress(ins);
+                LoadGuest(RCX, ins.rs2);
+                GuestStore(pc, StoreFunction<uint16_t>(), 2);
+            break; case InstructionType::SW:
+                EffectiveAddress(ins);
+                LoadGuest(RCX, ins.rs2);
+                GuestStore(pc, StoreFunction<uint32_t>(), 4);
+            break; case InstructionType::FSW:
+                EffectiveAddress(ins);
+                e.Load(RCX, fltRegsOffset + 4 * ins.rs2);
+                GuestStore(pc, StoreFunction<uint32_t>(), 4);
+            break; case InstructionType::FMVXW:
+                e.Load(RAX, fltRegsOffset + 4 * ins.rs1);
+                StoreGuest(ins.rd, RAX);
+            break; case InstructionType::FMVWX:
+                LoadGuest(RAX, ins.rs1);
+                e.Store(fltRegsOffset + 4 * ins.rd, RAX);
+                MarkChanged(fltChangedOffset + ins.rd);
+            break; case InstructionType::FENCE:
+                // The host keeps every other order the guest can ask for
+                if ((ins.imm & FENCE_PRED_W) && (ins.imm & FENCE_SUCC_R))
+                    e.Mfence();
+            break; case InstructionType::JAL:
+                e.MovImm(RAX, ins.nextPc);
+                StoreGuest(ins.rd, RAX);
+                WriteBack(dirty);
+                chainedExits.push_back({ e.Jump(), ins.imm });
+                return false;
+            break; case InstructionType::JALR:
+                // The target is only known at runtime, so return to the dispatcher to find it
+                LoadGuest(RAX, ins.rs1);
+                if (ins.imm != 0) e.AluImm(Add, RAX, ins.imm);
+                e.AluImm(And, RAX, ~0b1U);
+                e.MovImm(RCX, ins.nextPc);
+                StoreGuest(ins.rd, RCX);
+                WriteBack(dirty);
+                e.Store(pcOffset, RAX);
+                e.MovImm(RAX, static_cast<uint32_t>(JITExit::Continue));
+                PatchJump(e.Jump(), exitStub);
+                return false;
+            break; case InstructionType::BEQ:  Branch(ins, CondE);  return false;
+            break; case InstructionType::BNE:  Branch(ins, CondNE); return false;
+            break; case InstructionType::BLT:  Branch(ins, CondL);  return false;
+            break; case InstructionType::BGE:  Branch(ins, CondGE); return false;
+            break; case InstructionType::BLTU: Branch(ins, CondB);  return false;
+            break; case InstructionType::BGEU: Branch(ins, CondAE); return false;
+        }
+        return true;
+    }
+};
+
+
+static void EmitStubs(Emitter& e, uint8_t*& exitStub)
+{
+    // uint32_t Enter(CPU* cpu, const uint8_t* translation)
+    e.Byte(0x53); // push rbx
+    e.Byte(0x55); // push rbp
+    for (HostRegister r : { R12, R13, R14, R15 }) { e.Rex(false, 0, r); e.Byte(0x50 + (r & 7)); }
+    e.Byte(0x48); e.Byte(0x83); e.ModRM(3, Sub, RSP); e.Byte(FrameSize);
+    e.Mov64(RBX, ArgRegisters[0]);
+    e.Rex(false, 0, ArgRegisters[1]); e.Byte(0xFF); e.ModRM(3, 4, ArgRegisters[1]); // jmp arg1
+
+    // Translations jump here with the JITExit in eax
+    exitStub = e.cursor;
+    e.Byte(0x48); e.Byte(0x83); e.ModRM(3, Add, RSP); e.Byte(FrameSize);
+    for (HostRegister r : { R15, R14, R13, R12 }) { e.Rex(false, 0, r); e.Byte(0x58 + (r & 7)); }
+    e.Byte(0x5D); // pop rbp
+    e.Byte(0x5B); // pop rbx
+    e.Byte(0xC3); // ret
+}
+
+const uint8_t* JIT::Translate(CPU& cpu, const BasicBlock& block)
+{
+    if (auto it = translations.find(block.startPc); it != translations.end())
+        return it->second.entry;
+
+    size_t count = 0;
+    // Instructions outside of the program's extensions are left to the interpreter, which reports them
+    auto canTranslate = [&](InstructionType type) { return IsTranslatable(UnfusedType(type)) && RequiredExtensions(type) <= cpu.extensions; };
+    while (count < block.instructions.size() && canTranslate(block.instructions[count].type))
+        ++count;
+    if (count == 0)
+        return nullptr;
+
+    if (code == nullptr) {
+#if defined(_WIN32)
+        code = static_cast<uint8_t*>(VirtualAlloc(nullptr, CodeBufferSize, MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READWRITE));
+#else
+        void* mapping = mmap(nullptr, CodeBufferSize, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        code = (mapping == MAP_FAILED) ? nullptr : static_cast<uint8_t*>(mapping);
+#endif
+        if (code == nullptr) {
+            enabled = false;
+            return nullptr;
+        }
+    }
+    if (CodeBufferSize - codeUsed < MaxTranslationSize) {
+        // Start over once the buffer is full, hot blocks will be translated again soon enough
+        Clear();
+        for (auto& [pc, cached] : cpu.blockCache.blocks)
+            cached.translation = nullptr;
+    }
+    if (codeUsed == 0) {
+        Emitter e{ code };
+        EmitStubs(e, exitStub);
+        codeUsed = e.cursor - code;
+    }
+
+    Translator t{
+        .e = { code + codeUsed },
+        .intRegsOffset = Offset(cpu, cpu.intRegs.buffer),
+#if CPU_TRACK_CHANGES
+        .intChangedOffset = Offset(cpu, cpu.intRegs.didChange),
+#else
+        .intChangedOffset = 0,
+#endif
+        .fltRegsOffset = Offset(cpu, cpu.fltRegs.buffer),
+#if CPU_TRACK_CHANGES
+        .fltChangedOffset = Offset(cpu, cpu.fltRegs.didChange),
+#else
+        .fltChangedOffset = 0,
+#endif
+        .memory = &cpu.memory,
+        .pcOffset = Offset(cpu, &cpu.pc),
+        .budgetOffset = Offset(cpu, &budget),
+        .exitStub = exitStub,
+        .trackChanges = cpu.trackChanges && CPU_TRACK_CHANGES,
+        .checkAlignment = cpu.misalignedAccess != MisalignedAccess::Native,
+        .cachedIndex = {},
+        .dirty = 0,
+        .remaining = 0,
+        .sideExits = {},
+        .chainedExits = {},
+    };
+    Emitter& e = t.e;
+    uint8_t* entry = e.cursor;
+
+    // Give the host registers to the most used guest registers
+    uint32_t uses[32] = {};
+    for (size_t i = 0; i < count; ++i) {
+        const DecodedInstruction& ins = block.instructions[i];
+        ++uses[ins.rd]; ++uses[ins.rs1]; ++uses[ins.rs2];
+    }
+    uses[0] = 0;
+    memset(t.cachedIndex, -1, sizeof(t.cachedIndex));
+    for (uint32_t slot = 0; slot < NumCachedRegisters; ++slot) {
+        uint32_t best = 0;
+        for (uint32_t x = 1; x < 32; ++x)
+            if (t.cachedIndex[x] < 0 && uses[x] > uses[best]) best = x;
+        if (best == 0) break;
+        t.cachedIndex[best] = static_cast<int8_t>(slot);
+    }
+
+    e.AluMemImm(Sub, t.budgetOffset, static_cast<uint32_t>(count));
+    t.SideExitIf(CondS, block.startPc, JITExit::Continue, static_cast<uint32_t>(count));
+    for (uint32_t x = 1; x < 32; ++x)
+        if (t.cachedIndex[x] >= 0)
+            e.Load(CachedRegisters[t.cachedIndex[x]], t.intRegsOffset + 4 * x);
+
+    uint32_t pc = block.startPc;
+    bool fallsThrough = true;
+    for (size_t i = 0; i < count && fallsThrough; ++i) {
+        // Native code has no dispatch to save, so fused pairs are translated one instruction at a time
+        DecodedInstruction ins = block.instructions[i];
+        ins.type = UnfusedType(ins.type);
+        t.remaining = static_cast<uint32_t>(count - i);
+        fallsThrough = t.Emit(ins, pc);
+        pc = block.instructions[i].nextPc;
+    }
+    if (fallsThrough) {
+        t.WriteBack(t.dirty);
+        t.chainedExits.push_back({ e.Jump(), pc });
+    }
+
+    // Out of line exits, which leave the block with the guest state written back
+    for (const Translator::SideExit& exit : t.sideExits) {
+        PatchJump(exit.jump, e.cursor);
+        t.WriteBack(exit.dirty);
+        if (exit.refund != 0) e.AluMemImm(Add, t.budgetOffset, exit.refund);
+        e.StoreImm(t.pcOffset, exit.pc);
+        e.MovImm(RAX, static_cast<uint32_t>(exit.reason));
+        PatchJump(e.Jump(), exitStub);
+    }
+
+    Translation& translation = translations[block.startPc];
+    translation = { .startPc = block.startPc, .endPc = pc, .entry = entry, .jumpTargets = {} };
+    for (const Translator::ChainedExit& exit : t.chainedExits) {
+        uint8_t* stub = e.cursor;
+        e.StoreImm(t.pcOffset, exit.targetPc);
+        e.MovImm(RAX, static_cast<uint32_t>(JITExit::Continue));
+        PatchJump(e.Jump(), exitStub);
+
+        auto target = translations.find(exit.targetPc);
+        PatchJump(exit.jump, target != translations.end() ? target->second.entry : stub);
+        jumpsTo[exit.targetPc].push_back({ .site = exit.jump, .stub = stub, .fromPc = block.startPc });
+        translation.jumpTargets.push_back(exit.targetPc);
+    }
+    // Link the translations that were waiting for this one
+    for (const JumpSite& site : jumpsTo[block.startPc])
+        PatchJump(site.site, entry);
+
+    codeUsed = e.cursor - code;
+    codeUsed = (codeUsed + 15) & ~size_t(15);
+    assert(e.cursor - entry <= static_cast<std::ptrdiff_t>(MaxTranslationSize));
+    return entry;
+}
+
+JITExit JIT::Run(CPU& cpu, const uint8_t* entry, int32_t& instructionBudget)
+{
+    using Enter = uint32_t (*)(CPU* cpu, const uint8_t* translation);
+    budget = instructionBudget;
+    JITExit exit = static_cast<JITExit>(reinterpret_cast<Enter>(code)(&cpu, entry));
+    instructionBudget = budget;
+    return exit;
+}
+
+void JIT::FlushPendingInvalidations(const BlockCache& blockCache)
+{
+    if (blockCache.pendingFlushAll) {
+        Clear();
+        return;
+    }
+    if (blockCache.pendingRegions.empty() || translations.empty())
+        return;
+
+    std::vector<uint32_t> invalidated;
+    for (const auto& [startPc, translation] : translations) {
+        uint32_t firstRegion = translation.startPc >> BlockCache::RegionBits;
+        uint32_t lastRegion = (translation.endPc - 1) >> BlockCache::RegionBits;
+        for (uint32_t region : blockCache.pendingRegions) {
+            if (firstRegion <= region && region <= lastRegion) {
+                invalidated.push_back(startPc);
+                break;
+            }
+        }
+    }
+
+    for (uint32_t startPc : invalidated) {
+        auto it = translations.find(startPc);
+        // Unlink everything that jumps into the translation, and forget the jumps out of it
+        for (const JumpSite& site : jumpsTo[startPc])
+            PatchJump(site.site, site.stub);
+        for (uint32_t target : it->second.jumpTargets)
+            std::erase_if(jumpsTo[target], [=](const JumpSite& site) { return site.fromPc == startPc; });
+        translations.erase(it);
+    }
+}
+
+void JIT::Clear()
+{
+    translations.clear();
+    jumpsTo.clear();
+    codeUsed = 0;
+    exitStub = nullptr;
+}
+
+JIT::~JIT()
+{
+    if (code == nullptr) return;
+#if defined(_WIN32)
+    VirtualFree(code, 0, MEM_RELEASE);
+#else
+    munmap(code, CodeBufferSize);
+#endif
+}
+
+#else
+
+const uint8_t* JIT::Translate(CPU&, const BasicBlock&) { return nullptr; }
+JITExit JIT::Run(CPU&, const uint8_t*, int32_t&) { return JITExit::Interpret; }
+void JIT::FlushPendingInvalidations(const BlockCache&) {}
+void JIT::Clear() {}
+JIT::~JIT() {}
+
+#endif
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <unordered_map>
+
+// The translator emits x86-64 machine code, on other hosts everything stays in the interpreter
+#if defined(__x86_64__) || defined(_M_X64)
+#define CPU_JIT 1
+#else
+#define CPU_JIT 0
+#endif
+
+
+struct CPU;
+struct BasicBlock;
+struct BlockCache;
+
+
+enum class JITExit : uint32_t
+{
+    // Execution can continue at cpu.pc
+    Continue,
+    // The instruction at cpu.pc must go through the interpreter, e.g. because of an out of bounds access
+    Interpret,
+};
+
+
+// Translates hot basic blocks to native code. Translations jump directly to each other
+// when the target is known and has been translated, and return to the caller otherwise.
+struct JIT
+{
+    constexpr static size_t CodeBufferSize = 16 * 1024 * 1024;
+    constexpr static size_t MaxTranslationSize = 16 * 1024;
+
+    JIT() = default;
+    // Translations refer to the CPU they were made for, so a copied CPU makes its own
+    JIT(const JIT&) : JIT() {}
+    JIT& operator=(const JIT&) { Clear(); return *this; }
+    ~JIT();
+
+    // Returns nullptr if the block does not start with a translatable instruction
+    const uint8_t* Translate(CPU& cpu, const BasicBlock& block);
+    // Runs translated code until the budget runs out or it leaves translated code, and takes the
+    // instructions that ran out of the budget. Each block is charged on entry, and refunds what
+    // it did not get to on a side exit, so the count is exact.
+    JITExit Run(CPU& cpu, const uint8_t* entry, int32_t& instructionBudget);
+    void FlushPendingInvalidations(const BlockCache& blockCache);
+    void Clear();
+
+    template<typename T>
+    static void TrackStoreFromTranslation(CPU* cpu, uint32_t address);
+
+    struct JumpSite
+    {
+        // The rel32 operand of a jmp or jcc, and the stub it points to while the target is untranslated
+        uint8_t* site;
+        uint8_t* stub;
+        uint32_t fromPc;
+    };
+
+    struct Translation
+    {
+        uint32_t startPc;
+        uint32_t endPc;
+        uint8_t* entry;
+        std::vector<uint32_t> jumpTargets;
+    };
+
+    bool enabled = true;
+    uint32_t hotThreshold = 32;
+    // The budget of the current run, which translated code returns once it goes negative
+    int32_t budget = 0;
+
+    uint8_t* code = nullptr;
+    size_t codeUsed = 0;
+    uint8_t* exitStub = nullptr;
+    std::unordered_map<uint32_t, Translation> translations;
+    std::unordered_map<uint32_t, std::vector<JumpSite>> jumpsTo;
+};
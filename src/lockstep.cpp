@@ -0,0 +1,453 @@
+#include "lockstep.hpp"
+#include <bit>
+#include <algorithm>
+
+
+// Everything in RV32I but system instructions, and the M extension where the program may use it
+static bool IsLockstep(InstructionType type, Extensions extensions)
+{
+    if (type >= InstructionType::LUI && type <= InstructionType::AND) return true;
+    if (type >= InstructionType::MUL && type <= InstructionType::REMU) return extensions != Extensions::RV32I;
+    return type == InstructionType::FENCE;
+}
+
+static bool IsTransfer(InstructionType type)
+{
+    return type >= InstructionType::JAL && type <= InstructionType::BGEU;
+}
+
+// Where ins writes memory when rs1 holds base, if it does
+static bool StoreTarget(const DecodedInstruction& ins, uint32_t base, uint32_t& address, uint32_t& size)
+{
+    InstructionType type = ins.type;
+    if (type == InstructionType::SB || type == InstructionType::SH || type == InstructionType::SW || type == InstructionType::FSW) {
+        address = base + ins.imm;
+        size = type == InstructionType::SB ? 1 : type == InstructionType::SH ? 2 : 4;
+        return true;
+    }
+    // SC and the AMOs, which InstructionType lists together
+    if (type >= InstructionType::SC_W && type <= InstructionType::AMOMAXU_W) {
+        address = base;
+        size = 4;
+        return true;
+    }
+    return false;
+}
+
+template<uint32_t Lanes>
+void Lockstep<Lanes>::Run(std::span<CPU* const> laneCpus, std::span<const uint64_t> laneBudgets, std::span<RunResult> laneResults)
+{
+    assert(laneCpus.size() <= Lanes && laneBudgets.size() == laneCpus.size() && laneResults.size() == laneCpus.size());
+    ++run;
+    results = laneResults.data();
+    live = 0;
+    for (uint32_t i = 0; i < Lanes; ++i) {
+        active[i] = 0;
+        counts[i] = 0;
+        cpus[i] = (i < laneCpus.size()) ? laneCpus[i] : nullptr;
+        if (cpus[i] == nullptr)
+            continue;
+        budgets[i] = laneBudgets[i];
+        live |= 1u << i;
+        Reload(i);
+        // Translated addresses and breakpoints are left to the CPU's own loop
+        if (cpus[i]->paging || !cpus[i]->breakpoints.empty())
+            Detach(i, pcs[i]);
+    }
+
+    uint32_t rounds = 0;
+    uint32_t grouped = 0;
+    while (live != 0) {
+        for (uint32_t i = 0; i < Lanes; ++i) {
+            if ((live >> i) & 1 && counts[i] == budgets[i]) {
+                Spill(i, pcs[i]);
+                Finish(i, { StopReason::Budget, counts[i] });
+            }
+        }
+        if (live == 0)
+            break;
+        if (std::popcount(live) == 1 || (rounds == DivergenceWindow && grouped < rounds * MinAverageGroup)) {
+            for (uint32_t i = 0; i < Lanes; ++i)
+                if ((live >> i) & 1)
+                    Detach(i, pcs[i]);
+            break;
+        }
+        if (rounds == DivergenceWindow)
+            rounds = grouped = 0;
+
+        // The lanes furthest behind go first, the others wait for them
+        uint32_t pc = UINT32_MAX;
+        for (uint32_t i = 0; i < Lanes; ++i)
+            if ((live >> i) & 1)
+                pc = std::min(pc, pcs[i]);
+        uint32_t group = 0;
+        for (uint32_t i = 0; i < Lanes; ++i)
+            if ((live >> i) & 1 && pcs[i] == pc)
+                group |= 1u << i;
+        ++rounds;
+        grouped += std::popcount(group);
+
+        Block* block = BlockFor(pc, group);
+        if (block == nullptr) {
+            // It faults, which is up to the CPUs
+            for (uint32_t i = 0; i < Lanes; ++i)
+                if ((group >> i) & 1)
+                    Detach(i, pc);
+            continue;
+        }
+        uint64_t length = block->instructions.size();
+        for (uint32_t i = 0; i < Lanes; ++i)
+            if ((group >> i) & 1)
+                length = std::min(length, budgets[i] - counts[i]);
+        if (group != 0)
+            Execute(*block, group, static_cast<uint32_t>(length));
+    }
+}
+
+template<uint32_t Lanes>
+typename Lockstep<Lanes>::Block* Lockstep<Lanes>::BlockFor(uint32_t pc, uint32_t& group)
+{
+    Block*& entry = lookup[(pc >> 2) % LookupSize];
+    if (entry != nullptr && entry->startPc == pc && entry->checkedRun == run && (entry->checkedLanes & group) == group)
+        return entry;
+
+    // Blocks are decoded from the first lane, and again if it holds something else there by now
+    uint32_t first = std::countr_zero(group);
+    auto it = blocks.find(pc);
+    if (it == blocks.end() || !Holds(first, pc, it->second)) {
+        const CPU& cpu = *cpus[first];
+        Block block{ .startPc = pc, .extensions = cpu.extensions, .instructions = {}, .words = {} };
+        for (uint32_t address = pc; block.instructions.size() < MaxBlockLength; address += 4) {
+            if (!cpu.memory.Contains(address, 4) || !(cpu.memory.permissions[address / Memory::PageSize] & Memory::Fetchable))
+                break;
+            uint32_t word = cpu.memory.Read<uint32_t>(address);
+            DecodedInstruction ins = DecodeOperands(word, address);
+            block.words.push_back(word);
+            block.instructions.push_back(ins);
+            if (IsTransfer(ins.type) || !IsLockstep(ins.type, cpu.extensions))
+                break;
+        }
+        if (block.instructions.empty())
+            return nullptr;
+        uint32_t lastRegion = (pc + static_cast<uint32_t>(block.words.size()) * 4 - 1) >> BlockCache::RegionBits;
+        if (codeRegions.size() <= lastRegion)
+            codeRegions.resize(lastRegion + 1);
+        for (uint32_t region = pc >> BlockCache::RegionBits; region <= lastRegion; ++region)
+            codeRegions[region] = true;
+        it = blocks.insert_or_assign(pc, std::move(block)).first;
+    }
+
+    Block& block = it->second;
+    entry = &block;
+    if (block.checkedRun != run) {
+        block.checkedRun = run;
+        block.checkedLanes = 0;
+    }
+    // Once checked, the lane notices when it writes the block, see Store
+    for (uint32_t i = 0; i < Lanes; ++i) {
+        if (!((group >> i) & 1) || ((block.checkedLanes >> i) & 1))
+            continue;
+        if (Holds(i, pc, block)) {
+            cpus[i]->memory.MarkCode(pc, static_cast<uint32_t>(block.words.size()) * 4);
+            block.checkedLanes |= 1u << i;
+        }
+        else {
+            group &= ~(1u << i);
+            Detach(i, pc);
+        }
+    }
+    return &block;
+}
+
+template<uint32_t Lanes>
+bool Lockstep<Lanes>::Holds(uint32_t lane, uint32_t pc, const Block& block) const
+{
+    const CPU& cpu = *cpus[lane];
+    uint32_t size = static_cast<uint32_t>(block.words.size()) * 4;
+    if (cpu.extensions != block.extensions || !cpu.memory.Contains(pc, size))
+        return false;
+    for (uint64_t page = pc / Memory::PageSize; page <= (uint64_t(pc) + size - 1) / Memory::PageSize; ++page)
+        if (!(cpu.memory.permissions[page] & Memory::Fetchable))
+            return false;
+    return memcmp(cpu.memory.buffer + pc, block.words.data(), size) == 0;
+}
+
+template<uint32_t Lanes>
+bool Lockstep<Lanes>::IsCode(uint32_t address, uint32_t size) const
+{
+    uint64_t last = (uint64_t(address) + size - 1) >> BlockCache::RegionBits;
+    for (uint64_t region = address >> BlockCache::RegionBits; region <= last; ++region)
+        if (region < codeRegions.size() && codeRegions[region])
+            return true;
+    return false;
+}
+
+// Computes expression for every lane, of its a and b from rs1 and rs2, imm and next, and keeps it
+// for the active ones. The loop works on copies, which the compiler knows nothing else points
+// into, so that it is free to vectorize it.
+#define LANEWISE(destination, expression) \
+    do { \
+        uint32_t lhs[Lanes], rhs[Lanes], mask[Lanes], out[Lanes]; \
+        memcpy(lhs, regs[ins.rs1], sizeof(lhs)); \
+        memcpy(rhs, regs[ins.rs2], sizeof(rhs)); \
+        memcpy(mask, active, sizeof(mask)); \
+        memcpy(out, destination, sizeof(out)); \
+        for (uint32_t i = 0; i < Lanes; ++i) { \
+            uint32_t a = lhs[i], b = rhs[i]; \
+            (void) a; (void) b; \
+            uint32_t result = (expression); \
+            out[i] = (result & mask[i]) | (out[i] & ~mask[i]); \
+        } \
+        memcpy(destination, out, sizeof(out)); \
+    } while (0)
+
+template<uint32_t Lanes>
+void Lockstep<Lanes>::Execute(const Block& block, uint32_t group, uint32_t length)
+{
+    for (uint32_t i = 0; i < Lanes; ++i)
+        active[i] = ((group >> i) & 1) ? UINT32_MAX : 0;
+    bool isTransfer = false;
+    for (position = 0; position < length; ++position) {
+        const DecodedInstruction& ins = block.instructions[position];
+        uint32_t* d = regs[ins.rd != 0 ? ins.rd : Discard];
+        const uint32_t imm = ins.imm;
+        const uint32_t next = ins.nextPc;
+        switch (ins.type) {
+            // What IsLockstep turns away, which ends the block
+            case InstructionType::ILLEGAL:
+            case InstructionType::MRET:
+            case InstructionType::SRET:
+            case InstructionType::SFENCE_VMA:
+            case InstructionType::ECALL:
+            case InstructionType::EBREAK:
+            case InstructionType::FENCE_I:
+            case InstructionType::CSRRW:
+            case InstructionType::CSRRS:
+            case InstructionType::CSRRC:
+            case InstructionType::CSRRWI:
+            case InstructionType::CSRRSI:
+            case InstructionType::CSRRCI:
+            case InstructionType::LR_W:
+            case InstructionType::SC_W:
+            case InstructionType::AMOSWAP_W:
+            case InstructionType::AMOADD_W:
+            case InstructionType::AMOXOR_W:
+            case InstructionType::AMOAND_W:
+            case InstructionType::AMOOR_W:
+            case InstructionType::AMOMIN_W:
+            case InstructionType::AMOMAX_W:
+            case InstructionType::AMOMINU_W:
+            case InstructionType::AMOMAXU_W:
+            case InstructionType::FLW:
+            case InstructionType::FSW:
+            case InstructionType::FMADDS:
+            case InstructionType::FMSUBS:
+            case InstructionType::FNMSUBS:
+            case InstructionType::FNMADDS:
+            case InstructionType::FADDS:
+            case InstructionType::FSUBS:
+            case InstructionType::FMULS:
+            case InstructionType::FDIVS:
+            case InstructionType::FSQRTS:
+            case InstructionType::FSGNJS:
+            case InstructionType::FSGNJNS:
+            case InstructionType::FSGNJXS:
+            case InstructionType::FMINS:
+            case InstructionType::FMAXS:
+            case InstructionType::FCVTWS:
+            case InstructionType::FCVTWUS:
+            case InstructionType::FMVXW:
+            case InstructionType::FEQS:
+            case InstructionType::FLTS:
+            case InstructionType::FLES:
+            case InstructionType::FCLASSS:
+            case InstructionType::FCVTSW:
+            case InstructionType::FCVTSWU:
+            case InstructionType::FMVWX:
+            case InstructionType::LUI_ADDI:
+            case InstructionType::AUIPC_ADDI:
+            case InstructionType::AUIPC_LW:
+            case InstructionType::AUIPC_JALR:
+            case InstructionType::SLLI_SRLI:
+            case InstructionType::MULH_MUL:
+            case InstructionType::MULHU_MUL:
+            case InstructionType::COUNT:
+                for (uint32_t i = 0; i < Lanes; ++i)
+                    if (active[i])
+                        StepLane(i, ins);
+            break; case InstructionType::LUI:   LANEWISE(d, imm);
+            break; case InstructionType::AUIPC: LANEWISE(d, imm);
+            break; case InstructionType::JAL:   LANEWISE(d, next); LANEWISE(pcs, imm); isTransfer = true;
+            // The target comes first, rd may be rs1
+            break; case InstructionType::JALR:  LANEWISE(pcs, (a + imm) & ~1u); LANEWISE(d, next); isTransfer = true;
+            break; case InstructionType::BEQ:   LANEWISE(pcs, a == b ? imm : next); isTransfer = true;
+            break; case InstructionType::BNE:   LANEWISE(pcs, a != b ? imm : next); isTransfer = true;
+            break; case InstructionType::BLT:   LANEWISE(pcs, (int32_t)a <  (int32_t)b ? imm : next); isTransfer = true;
+            break; case InstructionType::BGE:   LANEWISE(pcs, (int32_t)a >= (int32_t)b ? imm : next); isTransfer = true;
+            break; case InstructionType::BLTU:  LANEWISE(pcs, a <  b ? imm : next); isTransfer = true;
+            break; case InstructionType::BGEU:  LANEWISE(pcs, a >= b ? imm : next); isTransfer = true;
+            break; case InstructionType::LB:    Load<int8_t>(ins);
+            break; case InstructionType::LH:    Load<int16_t>(ins);
+            break; case InstructionType::LW:    Load<int32_t>(ins);
+            break; case InstructionType::LBU:   Load<uint8_t>(ins);
+            break; case InstructionType::LHU:   Load<uint16_t>(ins);
+            break; case InstructionType::SB:    Store<uint8_t>(ins);
+            break; case InstructionType::SH:    Store<uint16_t>(ins);
+            break; case InstructionType::SW:    Store<uint32_t>(ins);
+            break; case InstructionType::ADDI:  LANEWISE(d, a + imm);
+            break; case InstructionType::SLTI:  LANEWISE(d, (int32_t)a < (int32_t)imm);
+            break; case InstructionType::SLTIU: LANEWISE(d, a < imm);
+            break; case InstructionType::XORI:  LANEWISE(d, a ^ imm);
+            break; case InstructionType::ORI:   LANEWISE(d, a | imm);
+            break; case InstructionType::ANDI:  LANEWISE(d, a & imm);
+            break; case InstructionType::SLLI:  LANEWISE(d, a << imm);
+            break; case InstructionType::SRLI:  LANEWISE(d, a >> imm);
+            break; case InstructionType::SRAI:  LANEWISE(d, (uint32_t)((int32_t)a >> imm));
+            break; case InstructionType::ADD:   LANEWISE(d, a + b);
+            break; case InstructionType::SUB:   LANEWISE(d, a - b);
+            break; case InstructionType::SLL:   LANEWISE(d, a << (b & 0b11111));
+            break; case InstructionType::SLT:   LANEWISE(d, (int32_t)a < (int32_t)b);
+            break; case InstructionType::SLTU:  LANEWISE(d, a < b);
+            break; case InstructionType::XOR:   LANEWISE(d, a ^ b);
+            break; case InstructionType::SRL:   LANEWISE(d, a >> (b & 0b11111));
+            break; case InstructionType::SRA:   LANEWISE(d, (uint32_t)((int32_t)a >> (b & 0b11111)));
+            break; case InstructionType::OR:    LANEWISE(d, a | b);
+            break; case InstructionType::AND:   LANEWISE(d, a & b);
+            // Every instance has memory of its own, which nothing else accesses
+            break; case InstructionType::FENCE: {}
+            break; case InstructionType::MUL:   LANEWISE(d, a * b);
+            break; case InstructionType::MULH:  LANEWISE(d, (uint32_t)(((int64_t)(int32_t)a * (int64_t)(int32_t)b) >> 32));
+            break; case InstructionType::MULHSU:LANEWISE(d, (uint32_t)(((uint64_t)(int64_t)(int32_t)a * (uint64_t)b) >> 32));
+            break; case InstructionType::MULHU: LANEWISE(d, (uint32_t)(((uint64_t)a * (uint64_t)b) >> 32));
+            break; case InstructionType::DIV:   LANEWISE(d, b == 0 ? UINT32_MAX : (uint32_t)((int64_t)(int32_t)a / (int64_t)(int32_t)b));
+            break; case InstructionType::DIVU:  LANEWISE(d, b == 0 ? UINT32_MAX : a / b);
+            break; case InstructionType::REM:   LANEWISE(d, b == 0 ? a : (uint32_t)((int64_t)(int32_t)a % (int64_t)(int32_t)b));
+            break; case InstructionType::REMU:  LANEWISE(d, b == 0 ? a : a % b);
+        }
+    }
+    // The lanes still active have run the whole block
+    uint32_t next = block.instructions[length - 1].nextPc;
+    for (uint32_t i = 0; i < Lanes; ++i) {
+        if (!active[i])
+            continue;
+        counts[i] += length;
+        if (!isTransfer)
+            pcs[i] = next;
+    }
+}
+
+#undef LANEWISE
+
+template<uint32_t Lanes>
+template<typename T>
+void Lockstep<Lanes>::Load(const DecodedInstruction& ins)
+{
+    uint32_t* d = regs[ins.rd != 0 ? ins.rd : Discard];
+    for (uint32_t i = 0; i < Lanes; ++i) {
+        if (!active[i])
+            continue;
+        const CPU& cpu = *cpus[i];
+        uint32_t address = regs[ins.rs1][i] + ins.imm;
+        bool isNative = address % sizeof(T) == 0 || cpu.misalignedAccess == MisalignedAccess::Native;
+        if (isNative && cpu.memory.IsPlainLoad(address, sizeof(T)))
+            d[i] = static_cast<uint32_t>(cpu.memory.Read<T>(address));
+        else
+            StepLane(i, ins);
+    }
+}
+
+template<uint32_t Lanes>
+template<typename T>
+void Lockstep<Lanes>::Store(const DecodedInstruction& ins)
+{
+    for (uint32_t i = 0; i < Lanes; ++i) {
+        if (!active[i])
+            continue;
+        Memory& memory = cpus[i]->memory;
+        uint32_t address = regs[ins.rs1][i] + ins.imm;
+        T value = static_cast<T>(regs[ins.rs2][i]);
+        if (address % sizeof(T) == 0 || cpus[i]->misalignedAccess == MisalignedAccess::Native) {
+            if (memory.IsPlainStore(address, sizeof(T))) {
+                memory.WritePlain<false>(address, value);
+                continue;
+            }
+            // The first write to a page since it was cleared or snapshotted
+            if (memory.Contains(address, sizeof(T))) {
+                uint8_t first = memory.permissions[address / Memory::PageSize];
+                uint8_t last = memory.permissions[(address + sizeof(T) - 1) / Memory::PageSize];
+                if ((first & last & Memory::Writable) && !((first | last) & Memory::HoldsCode)) {
+                    memory.Write<false>(address, value);
+                    continue;
+                }
+            }
+        }
+        StepLane(i, ins);
+    }
+}
+
+template<uint32_t Lanes>
+void Lockstep<Lanes>::StepLane(uint32_t lane, const DecodedInstruction& ins)
+{
+    uint32_t pc = ins.nextPc - 4;
+    // Other lanes go on running the block it would modify
+    uint32_t address, size;
+    if (StoreTarget(ins, regs[ins.rs1][lane], address, size) && IsCode(address, size)) {
+        counts[lane] += position;
+        Detach(lane, pc);
+        return;
+    }
+    CPU& cpu = *cpus[lane];
+    Spill(lane, pc);
+    RunResult result = cpu.Run(1);
+    if (result.reason != StopReason::Budget) {
+        Finish(lane, { result.reason, counts[lane] + position + result.instructionCount });
+        return;
+    }
+    Reload(lane);
+    if (cpu.paging) {
+        counts[lane] += position + 1;
+        Detach(lane, pcs[lane]);
+    }
+    else if (pcs[lane] != ins.nextPc) {
+        // It waits for a round of its own
+        counts[lane] += position + 1;
+        active[lane] = 0;
+    }
+}
+
+template<uint32_t Lanes>
+void Lockstep<Lanes>::Detach(uint32_t lane, uint32_t pc)
+{
+    Spill(lane, pc);
+    RunResult result = cpus[lane]->Run(budgets[lane] - counts[lane]);
+    Finish(lane, { result.reason, counts[lane] + result.instructionCount });
+}
+
+template<uint32_t Lanes>
+void Lockstep<Lanes>::Finish(uint32_t lane, RunResult result)
+{
+    results[lane] = result;
+    live &= ~(1u << lane);
+    active[lane] = 0;
+}
+
+template<uint32_t Lanes>
+void Lockstep<Lanes>::Spill(uint32_t lane, uint32_t pc)
+{
+    CPU& cpu = *cpus[lane];
+    cpu.pc = pc;
+    for (uint32_t x = 1; x < 32; ++x)
+        cpu.intRegs.Write<false>(x, regs[x][lane]);
+}
+
+template<uint32_t Lanes>
+void Lockstep<Lanes>::Reload(uint32_t lane)
+{
+    const CPU& cpu = *cpus[lane];
+    pcs[lane] = cpu.pc;
+    for (uint32_t x = 1; x < 32; ++x)
+        regs[x][lane] = cpu.intRegs.Read(x);
+}
+
+template struct Lockstep<8>;
+template struct Lockstep<16>;
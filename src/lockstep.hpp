@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+#include <unordered_map>
+#include "cpu.hpp"
+
+
+// Runs instances of a program that mostly take the same path together, Lanes of them at a time,
+// each on a CPU of its own. Their integer registers are laid out lane by lane, so that while
+// instances are at the same pc, an instruction is executed for all of them by a loop over the
+// lanes that the compiler vectorizes, as wide as the host it is built for allows. Instances that
+// branch apart are masked off, and the ones at the lowest pc go first, so that the others wait
+// for them where their paths meet again. Loads and stores go to each instance's own memory, and
+// everything but RV32IM integer instructions runs one instance at a time through CPU::Run.
+// Instances that write the code they run, or have spread out too far to share much work, finish
+// on their own.
+template<uint32_t Lanes>
+struct Lockstep
+{
+    static_assert(Lanes == 8 || Lanes == 16, "Lanes are meant to fill 256 or 512 bit vectors");
+
+    constexpr static uint32_t MaxBlockLength = 64;
+    constexpr static uint32_t LookupSize = 1024;
+    // Instances finish on their own once the ones at the same pc have averaged fewer than
+    // MinAverageGroup over a window of rounds, each of which runs a block for one group
+    constexpr static uint32_t DivergenceWindow = 256;
+    constexpr static uint32_t MinAverageGroup = Lanes / 4;
+
+    // Runs each of cpus, at most Lanes of them, for up to as many instructions as budgets gives it,
+    // from its pc and registers, and leaves in results how it stopped, as CPU::Run would have. Their
+    // state is only up to date once this returns. The ones with paging or breakpoints run on their own.
+    void Run(std::span<CPU* const> cpus, std::span<const uint64_t> budgets, std::span<RunResult> results);
+
+private:
+    // Straight line code up to a control transfer or an instruction that is not executed in
+    // lockstep, which ends it, decoded from the memory of one instance
+    struct Block
+    {
+        uint32_t startPc;
+        // What it was decoded for, instructions outside of them are not executed in lockstep
+        Extensions extensions;
+        std::vector<DecodedInstruction> instructions;
+        // What they were decoded from, which every instance that runs the block must hold too
+        std::vector<uint32_t> words;
+        // The lanes whose memory has been checked against words during run checkedRun
+        uint32_t checkedLanes = 0;
+        uint64_t checkedRun = 0;
+    };
+
+    // The block at pc for the lanes in group, who have been checked to hold it. The ones that do
+    // not are detached. Returns nullptr if the first lane of the group cannot fetch from pc.
+    Block* BlockFor(uint32_t pc, uint32_t& group);
+    bool Holds(uint32_t lane, uint32_t pc, const Block& block) const;
+    // Runs the first length instructions of block for the lanes in group
+    void Execute(const Block& block, uint32_t group, uint32_t length);
+    template<typename T> void Load(const DecodedInstruction& ins);
+    template<typename T> void Store(const DecodedInstruction& ins);
+    // Runs ins for lane on its CPU. The lane stays active if it went on to the next instruction.
+    void StepLane(uint32_t lane, const DecodedInstruction& ins);
+    // Lets lane run the rest of its budget on its own, from pc
+    void Detach(uint32_t lane, uint32_t pc);
+    void Finish(uint32_t lane, RunResult result);
+    // Moves a lane's pc and registers between its CPU and here
+    void Spill(uint32_t lane, uint32_t pc);
+    void Reload(uint32_t lane);
+    bool IsCode(uint32_t address, uint32_t size) const;
+
+    // regs[x][lane], the last row takes writes to x0
+    constexpr static uint32_t Discard = 32;
+    alignas(64) uint32_t regs[33][Lanes] = {};
+    uint32_t pcs[Lanes] = {};
+    // All ones for the lanes that execute the current instruction, zero for the others
+    alignas(64) uint32_t active[Lanes] = {};
+    // A bit for each lane that is still running in lockstep
+    uint32_t live = 0;
+    // The instruction of the current block that is being executed
+    uint32_t position = 0;
+    uint64_t counts[Lanes] = {};
+    uint64_t budgets[Lanes] = {};
+    CPU* cpus[Lanes] = {};
+    RunResult* results = nullptr;
+    uint64_t run = 0;
+    // By their first pc, they stay between runs
+    std::unordered_map<uint32_t, Block> blocks;
+    Block* lookup[LookupSize] = {};
+    // Which regions of BlockCache::RegionBits hold code of a block, which stores detach lanes from
+    std::vector<bool> codeRegions;
+};
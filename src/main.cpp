@@ -23,7 +23,7 @@ struct Instruction
     bool hasBreakpoint;
 };
 static CPU cpu;
-static CPU initialState{};
+static Snapshot initialState;
 static std::map<uint32_t, Instruction> instructionListing;
 
 
@@ -32,6 +32,7 @@ static void FileOpenButtonPressed()
     auto dialog = pfd::open_file("Select RISC-V ELF file");
     std::vector<std::string> selectedFiles = dialog.result();
     if (!selectedFiles.empty()) {
+        // Copied rather than mapped, since the file is likely to be rebuilt while it is being debugged
         std::vector<uint8_t> buffer = ReadEntireFile(selectedFiles[0]);
         ParseELFResult result = cpu.InitializeFromELF(buffer.data(), buffer.size());
         if (result != ParseELFResult::Ok) {
@@ -40,21 +41,22 @@ static void FileOpenButtonPressed()
         }
     }
     instructionListing.clear();
-    for (uint32_t i = 0; i+4 <= cpu.memory.Size; i += 4) {
-        uint32_t word = cpu.memory.Read<uint32_t>(i);
-        if (DecodeInstruction(word) != InstructionType::ILLEGAL)
-            instructionListing[i] = { FormatInstruction(word), false };
+    for (const MemoryRegion& region : cpu.memory.regions) {
+        for (uint64_t i = region.start; i+4 <= region.start + region.size; i += 4) {
+            uint32_t word = cpu.memory.Read<uint32_t>(static_cast<uint32_t>(i));
+            if (DecodeInstruction(word) != InstructionType::ILLEGAL)
+                instructionListing[static_cast<uint32_t>(i)] = { FormatInstruction(word), false };
+        }
     }
-    initialState = cpu;
+    cpu.breakpoints.clear();
+    cpu.TakeSnapshot(initialState);
 }
 
 static void DebugStartButtonPressed()
 {
-    while (true) {
-        if (!cpu.Step()) break;
-        if (auto it = instructionListing.find(cpu.pc); it != instructionListing.end())
-            if (it->second.hasBreakpoint) break;
-    }
+    RunResult result = cpu.Run(UINT64_MAX);
+    if (result.reason != StopReason::Breakpoint)
+        printf("%s at %08X after %llu instructions\n", StopReasonMessage(result.reason), cpu.pc, (unsigned long long) result.instructionCount);
 }
 
 static void DebugStopButtonPressed()
@@ -64,7 +66,8 @@ static void DebugStopButtonPressed()
 
 static void DebugRestartButtonPressed()
 {
-    cpu = initialState;
+    // Breakpoints belong to the CPU, so they stay set
+    cpu.Restore(initialState);
 }
 
 static void DebugStepOverButtonPressed()
@@ -76,7 +79,7 @@ static void DebugStepIntoButtonPressed()
 {
     memset(cpu.intRegs.didChange, false, cpu.intRegs.Size);
     memset(cpu.fltRegs.didChange, false, cpu.fltRegs.Size);
-    memset(cpu.memory.didChange, false, cpu.memory.Size);
+    cpu.memory.ClearChanges();
     cpu.Step();
 }
 
@@ -90,10 +93,14 @@ static void GLFWErrorCallback(int error, const char* description)
     fprintf(stderr, "GLFW Error %d: %s\n", error, description);
 }
 
+// The memory window shows the region that pc is in, off is relative to its start
+static MemoryRegion shownRegion;
+
 static bool MemoryHighlightFn(const ImU8* data, size_t off)
 {
     (void) data;
-    return cpu.memory.didChange[off] || ((off & ~0b11) == cpu.pc);
+    uint32_t address = static_cast<uint32_t>(shownRegion.start + off);
+    return cpu.memory.didChange[address] || ((address & ~0b11) == cpu.pc);
 }
 
 
@@ -107,6 +114,8 @@ struct Button
 
 int main()
 {
+    // The debugger highlights whatever the last step changed
+    cpu.SetChangeTracking(true);
     glfwSetErrorCallback(GLFWErrorCallback);
     if (!glfwInit())
         return 1;
@@ -215,7 +224,8 @@ int main()
                     bool isCurrentInstruction = address == cpu.pc;
                     char buff[32];
                     snprintf(buff, sizeof(buff), "##%08X:", address);
-                    ImGui::Checkbox(buff, &instruction.hasBreakpoint);
+                    if (ImGui::Checkbox(buff, &instruction.hasBreakpoint))
+                        cpu.SetBreakpoint(address, instruction.hasBreakpoint);
                     ImGui::SameLine();
                     if (isCurrentInstruction) ImGui::PushStyleColor(ImGuiCol_Text, highlightColor);
                     ImGui::Text("%08X: %s", address, instruction.formatted.buffer);
@@ -259,7 +269,12 @@ int main()
             ImGui::End();
 
 
-            memEdit.DrawWindow("Memory", cpu.memory.buffer, cpu.memory.Size);
+            if (!cpu.memory.regions.empty()) {
+                shownRegion = cpu.memory.regions.front();
+                for (const MemoryRegion& region : cpu.memory.regions)
+                    if (cpu.pc - region.start < region.size) shownRegion = region;
+                memEdit.DrawWindow("Memory", cpu.memory.buffer + shownRegion.start, shownRegion.size, shownRegion.start);
+            }
         }
 
         // Rendering
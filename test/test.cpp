@@ -1,8 +1,25 @@
 #include "cpu.hpp"
+#include "fleet.hpp"
+#include "lockstep.hpp"
 #include "helpers.hpp"
+#include "elf.h"
+#include <string>
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
 
 static CPU cpu{};
 
+// What the command line asks of TestISA, see main
+static struct
+{
+    const char* filter = nullptr;
+    uint32_t repeat = 1;
+    uint32_t jobs = 0;
+} options;
+
 static void TestDecode()
 {
     { RawInstruction ins{0x00001a37}; InstructionType type = DecodeInstruction(ins); assert(type == InstructionType::LUI); FormattedInstruction out = FormatInstruction(ins); printf("%s\n", out.buffer); } // lui x20, 0x1
@@ -103,6 +120,7 @@ static void TestDecode()
     { RawInstruction ins{0x0310000f}; InstructionType type = DecodeInstruction(ins); assert(type == InstructionType::FENCE); FormattedInstruction out = FormatInstruction(ins); printf("%s\n", out.buffer); } // fence rw, w
     { RawInstruction ins{0x0820000f}; InstructionType type = DecodeInstruction(ins); assert(type == InstructionType::FENCE); FormattedInstruction out = FormatInstruction(ins); printf("%s\n", out.buffer); } // fence i, r
     { RawInstruction ins{0x0ff0000f}; InstructionType type = DecodeInstruction(ins); assert(type == InstructionType::FENCE); FormattedInstruction out = FormatInstruction(ins); printf("%s\n", out.buffer); } // fence iorw, iorw
+    { RawInstruction ins{0x0000100f}; InstructionType type = DecodeInstruction(ins); assert(type == InstructionType::FENCE_I); FormattedInstruction out = FormatInstruction(ins); printf("%s\n", out.buffer); } // fence.i
     { RawInstruction ins{0x00000073}; InstructionType type = DecodeInstruction(ins); assert(type == InstructionType::ECALL); FormattedInstruction out = FormatInstruction(ins); printf("%s\n", out.buffer); } // ecall
     { RawInstruction ins{0x10569073}; InstructionType type = DecodeInstruction(ins); assert(type == InstructionType::CSRRW); FormattedInstruction out = FormatInstruction(ins); printf("%s\n", out.buffer); } // csrrw x0, stvec, x13
     { RawInstruction ins{0x18079073}; InstructionType type = DecodeInstruction(ins); assert(type == InstructionType::CSRRW); FormattedInstruction out = FormatInstruction(ins); printf("%s\n", out.buffer); } // csrrw x0, satp, x15
@@ -209,7 +227,249 @@ static void TestDecode()
 }
 
 
-static void TestISA()
+// The nested switch the decode tables replaced, which they must still agree with
+static InstructionType ReferenceDecode(RawInstruction instruction)
+{
+    if ((instruction.value & 0b11) != 0b11)
+        return InstructionType::ILLEGAL;
+
+    switch (instruction.value) {
+        case 0b00110000001000000000000001110011: return InstructionType::MRET;
+        case 0b00010000001000000000000001110011: return InstructionType::SRET;
+    }
+    if (instruction.Rtyp.opcode == 0b1110011 && instruction.Rtyp.funct3 == 0 && instruction.Rtyp.rd == 0 && instruction.Rtyp.funct7 == 0b0001001)
+        return InstructionType::SFENCE_VMA;
+
+    switch (instruction.Rtyp.opcode) {
+        case 0b0110111: return InstructionType::LUI;
+        case 0b0010111: return InstructionType::AUIPC;
+        case 0b1101111: return InstructionType::JAL;
+        case 0b1100111: return InstructionType::JALR;
+        case 0b1100011: {
+            switch (instruction.Btyp.funct3) {
+                case 0b000: return InstructionType::BEQ;
+                case 0b001: return InstructionType::BNE;
+                case 0b100: return InstructionType::BLT;
+                case 0b101: return InstructionType::BGE;
+                case 0b110: return InstructionType::BLTU;
+                case 0b111: return InstructionType::BGEU;
+            }
+        } break;
+        case 0b0000011: {
+            switch (instruction.Ityp.funct3) {
+                case 0b000: return InstructionType::LB;
+                case 0b001: return InstructionType::LH;
+                case 0b010: return InstructionType::LW;
+                case 0b100: return InstructionType::LBU;
+                case 0b101: return InstructionType::LHU;
+            }
+        } break;
+        case 0b0100011: {
+            switch (instruction.Styp.funct3) {
+                case 0b000: return InstructionType::SB;
+                case 0b001: return InstructionType::SH;
+                case 0b010: return InstructionType::SW;
+            }
+        } break;
+        case 0b0010011: {
+            switch (instruction.Ityp.funct3) {
+                case 0b000: return InstructionType::ADDI;
+                case 0b010: return InstructionType::SLTI;
+                case 0b011: return InstructionType::SLTIU;
+                case 0b100: return InstructionType::XORI;
+                case 0b110: return InstructionType::ORI;
+                case 0b111: return InstructionType::ANDI;
+                case 0b001: return InstructionType::SLLI;
+                case 0b101: {
+                    switch (instruction.Rtyp.funct7) {
+                        case 0b0000000: return InstructionType::SRLI;
+                        case 0b0100000: return InstructionType::SRAI;
+                    }
+                } break;
+            }
+        } break;
+        case 0b0110011: {
+            switch (instruction.Rtyp.funct3) {
+                case 0b000: {
+                    switch (instruction.Rtyp.funct7) {
+                        case 0b0000000: return InstructionType::ADD;
+                        case 0b0100000: return InstructionType::SUB;
+                        case 0b0000001: return InstructionType::MUL;
+                    }
+                } break;
+                case 0b001: {
+                    switch (instruction.Rtyp.funct7) {
+                        case 0b0000000: return InstructionType::SLL;
+                        case 0b0000001: return InstructionType::MULH;
+                    }
+                } break;
+                case 0b010: {
+                    switch (instruction.Rtyp.funct7) {
+                        case 0b0000000: return InstructionType::SLT;
+                        case 0b0000001: return InstructionType::MULHSU;
+                    }
+                } break;
+                case 0b011: {
+                    switch (instruction.Rtyp.funct7) {
+                        case 0b0000000: return InstructionType::SLTU;
+                        case 0b0000001: return InstructionType::MULHU;
+                    }
+                } break;
+                case 0b100: {
+                    switch (instruction.Rtyp.funct7) {
+                        case 0b0000000: return InstructionType::XOR;
+                        case 0b0000001: return InstructionType::DIV;
+                    }
+                } break;
+                case 0b101: {
+                    switch (instruction.Rtyp.funct7) {
+                        case 0b0000000: return InstructionType::SRL;
+                        case 0b0100000: return InstructionType::SRA;
+                        case 0b0000001: return InstructionType::DIVU;
+                    }
+                } break;
+                case 0b110: {
+                    switch (instruction.Rtyp.funct7) {
+                        case 0b0000000: return InstructionType::OR;
+                        case 0b0000001: return InstructionType::REM;
+                    }
+                } break;
+                case 0b111: {
+                    switch (instruction.Rtyp.funct7) {
+                        case 0b0000000: return InstructionType::AND;
+                        case 0b0000001: return InstructionType::REMU;
+                    }
+                } break;
+            }
+        } break;
+        case 0b0001111: {
+            switch (instruction.Ityp.funct3) {
+                case 0b000: return InstructionType::FENCE;
+                case 0b001: return InstructionType::FENCE_I;
+            }
+        } break;
+        case 0b1110011: {
+            switch (instruction.Rtyp.funct3) {
+                case 0b000: {
+                    switch (instruction.Ityp.imm11_0) {
+                        case 0b000000000000: return InstructionType::ECALL;
+                        case 0b000000000001: return InstructionType::EBREAK;
+                    }
+                } break;
+                case 0b001: return InstructionType::CSRRW;
+                case 0b010: return InstructionType::CSRRS;
+                case 0b011: return InstructionType::CSRRC;
+                case 0b101: return InstructionType::CSRRWI;
+                case 0b110: return InstructionType::CSRRSI;
+                case 0b111: return InstructionType::CSRRCI;
+            }
+        } break;
+        case 0b0101111: {
+            if (instruction.Rtyp.funct3 != 0b010) break;
+            // The low two bits of funct7 are aq and rl
+            switch (instruction.Rtyp.funct7 >> 2) {
+                case 0b00010: return (instruction.Rtyp.rs2 == 0) ? InstructionType::LR_W : InstructionType::ILLEGAL;
+                case 0b00011: return InstructionType::SC_W;
+                case 0b00001: return InstructionType::AMOSWAP_W;
+                case 0b00000: return InstructionType::AMOADD_W;
+                case 0b00100: return InstructionType::AMOXOR_W;
+                case 0b01100: return InstructionType::AMOAND_W;
+                case 0b01000: return InstructionType::AMOOR_W;
+                case 0b10000: return InstructionType::AMOMIN_W;
+                case 0b10100: return InstructionType::AMOMAX_W;
+                case 0b11000: return InstructionType::AMOMINU_W;
+                case 0b11100: return InstructionType::AMOMAXU_W;
+            }
+        } break;
+        case 0b0000111: return InstructionType::FLW;
+        case 0b0100111: return InstructionType::FSW;
+        case 0b1000011: return InstructionType::FMADDS;
+        case 0b1000111: return InstructionType::FMSUBS;
+        case 0b1001011: return InstructionType::FNMSUBS;
+        case 0b1001111: return InstructionType::FNMADDS;
+        case 0b1010011: {
+            switch (instruction.Rtyp.funct7) {
+                case 0b0000000: return InstructionType::FADDS;
+                case 0b0000100: return InstructionType::FSUBS;
+                case 0b0001000: return InstructionType::FMULS;
+                case 0b0001100: return InstructionType::FDIVS;
+                case 0b0101100: return InstructionType::FSQRTS;
+                case 0b0010000: {
+                    switch (instruction.Rtyp.funct3) {
+                        case 0b000: return InstructionType::FSGNJS;
+                        case 0b001: return InstructionType::FSGNJNS;
+                        case 0b010: return InstructionType::FSGNJXS;
+                    }
+                } break;
+                case 0b0010100: {
+                    switch (instruction.Rtyp.funct3) {
+                        case 0b000: return InstructionType::FMINS;
+                        case 0b001: return InstructionType::FMAXS;
+                    }
+                } break;
+                case 0b1100000: {
+                    switch (instruction.Rtyp.rs2) {
+                        case 0b00000: return InstructionType::FCVTWS;
+                        case 0b00001: return InstructionType::FCVTWUS;
+                    }
+                } break;
+                case 0b1110000: {
+                    switch (instruction.Rtyp.funct3) {
+                        case 0b000: return InstructionType::FMVXW;
+                        case 0b001: return InstructionType::FCLASSS;
+                    }
+                } break;
+                case 0b1010000: {
+                    switch (instruction.Rtyp.funct3) {
+                        case 0b010: return InstructionType::FEQS;
+                        case 0b001: return InstructionType::FLTS;
+                        case 0b000: return InstructionType::FLES;
+                    }
+                } break;
+                case 0b1101000: {
+                    switch (instruction.Rtyp.rs2) {
+                        case 0b00000: return InstructionType::FCVTSW;
+                        case 0b00001: return InstructionType::FCVTSWU;
+                    }
+                } break;
+                case 0b1111000: return InstructionType::FMVWX;
+            }
+        } break;
+    }
+    return InstructionType::ILLEGAL;
+}
+
+static void TestDecodeTable()
+{
+    for (const InstructionEncoding& encoding : InstructionEncodings) {
+        assert(DecodeInstruction(encoding.match) == encoding.type);
+        assert(EncodingOf(encoding.type).match == encoding.match);
+        assert(strcmp(FormatInstruction(encoding.match).buffer, "unimp") != 0);
+    }
+
+    // Every combination of opcode, funct3, rs2/imm[4:0] and funct7, which are all the bits either
+    // decoder looks at besides rd and rs1, and those are filled in from a simple LCG
+    uint32_t seed = 1;
+    for (uint32_t upper = 0; upper < (1U << 12); ++upper) {
+        for (uint32_t funct3 = 0; funct3 < 8; ++funct3) {
+            for (uint32_t opcode = 0; opcode < 128; ++opcode) {
+                seed = seed * 1664525 + 1013904223;
+                // Leave rd and rs1 zero once in a while, which mret and ecall depend on
+                uint32_t registers = (seed >> 28) == 0 ? 0 : (seed & 0x000F8F80);
+                RawInstruction ins{(upper << 20) | (funct3 << 12) | opcode | registers};
+                assert(DecodeInstruction(ins) == ReferenceDecode(ins));
+            }
+        }
+    }
+    assert(DecodeInstruction(0x30200073) == InstructionType::MRET);
+    assert(DecodeInstruction(0x30200173) == InstructionType::ILLEGAL);
+    printf("Test decode table: PASSED\n");
+}
+
+
+// If aotDirectory is given, each test runs with the image that tools/aot.cpp generated for it there
+// Runs every test with Step when batched is false, and with Run otherwise
+static void TestISA(bool batched, const char* engineName, const char* aotDirectory = nullptr)
 {
     const char* testNames[] = {
         "riscv-tests/isa/rv32ui-p-add",
@@ -272,31 +532,1079 @@ static void TestISA()
         "riscv-tests/isa/rv32uf-p-fclass",
         "riscv-tests/isa/rv32uf-p-fdiv",
     };
-    size_t numTests = sizeof(testNames) / sizeof(testNames[0]);
+    std::vector<const char*> selected;
+    for (const char* testName : testNames)
+        if (options.filter == nullptr || strstr(testName, options.filter) != nullptr)
+            selected.push_back(testName);
+
+    // Every repeat of every test is a job, which workers take in order, each on a CPU of its own
+    // set up like the shared one
+    struct Outcome
+    {
+        uint32_t result;
+        uint64_t instructionCount;
+        double milliseconds;
+    };
+    std::vector<Outcome> outcomes(selected.size() * options.repeat);
+    std::atomic<size_t> nextJob = 0;
+    auto work = [&] {
+        std::unique_ptr<CPU> worker = std::make_unique<CPU>();
+        worker->jit.enabled = cpu.jit.enabled;
+        worker->jit.hotThreshold = cpu.jit.hotThreshold;
+        worker->dispatch = cpu.dispatch;
+        for (size_t job; (job = nextJob++) < outcomes.size();) {
+            const char* testName = selected[job / options.repeat];
+            MappedFile file;
+            bool opened = file.Open(testName);
+            assert(opened);
+            ParseELFResult parseResult = worker->InitializeFromELF(file);
+            assert(parseResult == ParseELFResult::Ok);
+
+            AOTModule module;
+            if (aotDirectory != nullptr) {
+#if defined(_WIN32)
+                std::string path = std::string(aotDirectory) + "/" + (strrchr(testName, '/') + 1) + ".dll";
+#else
+                std::string path = std::string(aotDirectory) + "/" + (strrchr(testName, '/') + 1) + ".so";
+#endif
+                AOTLoadResult loadResult = module.Load(path.c_str());
+                if (loadResult != AOTLoadResult::Ok)
+                    fprintf(stderr, "%s: %s\n", path.c_str(), AOTLoadResultMessage(loadResult));
+                assert(loadResult == AOTLoadResult::Ok && module.Matches(*worker));
+                worker->aot = module.image;
+            }
+
+            Outcome& outcome = outcomes[job];
+            auto start = std::chrono::steady_clock::now();
+            if (batched) {
+                RunResult runResult = worker->Run(UINT64_MAX);
+                if (runResult.reason != StopReason::Ecall)
+                    fprintf(stderr, "%s: %s\n", testName, StopReasonMessage(runResult.reason));
+                assert(runResult.reason == StopReason::Ecall);
+                outcome.instructionCount = runResult.instructionCount;
+            }
+            else {
+                for (outcome.instructionCount = 1; worker->Step(); ++outcome.instructionCount);
+            }
+            outcome.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            worker->aot = nullptr;
+            outcome.result = worker->intRegs.Read(10);
+        }
+    };
+    uint32_t jobs = (options.jobs != 0) ? options.jobs : std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> workers;
+    for (uint32_t i = 1; i < std::min<size_t>(jobs, outcomes.size()); ++i)
+        workers.emplace_back(work);
+    work();
+    for (std::thread& worker : workers)
+        worker.join();
+
+    // Reported in order once all are done, with the fastest of the repeats
     int numFailed = 0;
-    for (size_t i = 0; i < numTests; ++i) {
-        const char* testName = testNames[i];
+    for (size_t i = 0; i < selected.size(); ++i) {
+        const Outcome* repeats = &outcomes[i * options.repeat];
+        double fastest = repeats[0].milliseconds;
+        for (uint32_t j = 1; j < options.repeat; ++j) {
+            // Every run of a test does the same
+            assert(repeats[j].result == repeats[0].result && repeats[j].instructionCount == repeats[0].instructionCount);
+            fastest = std::min(fastest, repeats[j].milliseconds);
+        }
+        printf("Test %s (%s): ", selected[i], engineName);
+        if (repeats[0].result != 0) {
+            printf("FAILED (%d)\n", repeats[0].result >> 1);
+            ++numFailed;
+        }
+        else {
+            printf("PASSED (%llu instructions, %.3f ms)\n", (unsigned long long) repeats[0].instructionCount, fastest);
+        }
+    }
+    assert(numFailed == 0);
+}
+
+// Run has to count exactly the instructions that Step executes, however the budget splits them up
+static void TestRun(const char* engineName)
+{
+    const char* testName = "riscv-tests/isa/rv32um-p-mul";
+    std::vector<uint8_t> buffer = ReadEntireFile(testName);
+
+    ParseELFResult parseResult = cpu.InitializeFromELF(buffer.data(), buffer.size());
+    assert(parseResult == ParseELFResult::Ok);
+    uint64_t numSteps = 1;
+    uint32_t breakpoint = 0;
+    for (; cpu.Step(); ++numSteps)
+        if (numSteps == 200) breakpoint = cpu.pc;
+
+    parseResult = cpu.InitializeFromELF(buffer.data(), buffer.size());
+    assert(parseResult == ParseELFResult::Ok);
+    uint64_t numRun = 0;
+    RunResult result;
+    do {
+        result = cpu.Run(7);
+        numRun += result.instructionCount;
+    } while (result.reason == StopReason::Budget);
+    assert(result.reason == StopReason::Ecall && numRun == numSteps);
+
+    parseResult = cpu.InitializeFromELF(buffer.data(), buffer.size());
+    assert(parseResult == ParseELFResult::Ok);
+    cpu.SetBreakpoint(breakpoint, true);
+    result = cpu.Run(UINT64_MAX);
+    assert(result.reason == StopReason::Breakpoint && cpu.pc == breakpoint && result.instructionCount <= 200);
+    cpu.SetBreakpoint(breakpoint, false);
+    numRun = result.instructionCount;
+    result = cpu.Run(UINT64_MAX);
+    assert(result.reason == StopReason::Ecall && numRun + result.instructionCount == numSteps);
+    printf("Test run (%s): PASSED\n", engineName);
+}
+
+// The interpreter is specialized on the program's extensions and on change tracking
+static void TestPolicies()
+{
+    std::vector<uint8_t> buffer = ReadEntireFile("riscv-tests/isa/rv32um-p-mul");
+    ParseELFResult parseResult = cpu.InitializeFromELF(buffer.data(), buffer.size());
+    assert(parseResult == ParseELFResult::Ok);
+    assert(cpu.extensions == Extensions::RV32IMAF);
+    cpu.extensions = Extensions::RV32I;
+    RunResult result = cpu.Run(UINT64_MAX);
+    assert(result.reason == StopReason::IllegalInstruction);
+    assert(RequiredExtensions(DecodeInstruction(cpu.memory.Read<uint32_t>(cpu.pc))) == Extensions::RV32IM);
+    cpu.extensions = Extensions::RV32IMAF;
+
+#if CPU_TRACK_CHANGES
+    for (bool track : { false, true }) {
+        parseResult = cpu.InitializeFromELF(buffer.data(), buffer.size());
+        assert(parseResult == ParseELFResult::Ok);
+        cpu.SetChangeTracking(track);
+        result = cpu.Run(UINT64_MAX);
+        assert(result.reason == StopReason::Ecall);
+        assert(cpu.intRegs.didChange[10] == track);
+    }
+    cpu.SetChangeTracking(false);
+#endif
+    printf("Test policies: PASSED\n");
+}
+
+// Fused pairs have to leave the same state as executing their instructions one at a time,
+// including when the budget splits a pair
+static void TestFusion()
+{
+    const uint32_t program[] = {
+        0x123452b7, // lui x5, 0x12345
+        0x67828293, // addi x5, x5, 1656
+        0x00000317, // auipc x6, 0x0
+        0x03832383, // lw x7, 56(x6)
+        0x01029413, // slli x8, x5, 16
+        0x01045413, // srli x8, x8, 16
+        0x027294b3, // mulh x9, x5, x7
+        0x02728533, // mul x10, x5, x7
+        0x00000097, // auipc x1, 0x0
+        0x010080e7, // jalr x1, 16(x1)
+        0x00000073, // ecall
+        0x00000013, // addi x0, x0, 0
+        0x00000073, // ecall
+        0x00000000,
+        0x00000000,
+        0x00000000,
+        0x87654321, // loaded by lw
+    };
+    auto load = [&] {
+        cpu.Reset();
+        cpu.memory.Map(0, sizeof(program));
+        for (uint32_t i = 0; i < sizeof(program) / sizeof(program[0]); ++i)
+            cpu.memory.Write(i * 4, program[i]);
+    };
+
+    load();
+    uint64_t numSteps = 1;
+    while (cpu.Step()) ++numSteps;
+    assert(cpu.pc == 0x34);
+    IntegerRegisterFile expected = cpu.intRegs;
+
+    for (uint64_t chunk = 1; chunk <= 4; ++chunk) {
+        load();
+        uint64_t numRun = 0;
+        RunResult result;
+        do {
+            result = cpu.Run(chunk);
+            numRun += result.instructionCount;
+        } while (result.reason == StopReason::Budget);
+        assert(result.reason == StopReason::Ecall && numRun == numSteps && cpu.pc == 0x34);
+        assert(memcmp(cpu.intRegs.buffer, expected.buffer, sizeof(expected.buffer)) == 0);
+    }
+
+    load();
+    cpu.Run(UINT64_MAX);
+    const BasicBlock* block = cpu.blockCache.Find(0);
+    assert(block != nullptr);
+    assert(block->instructions[0].type == InstructionType::LUI_ADDI);
+    assert(block->instructions[2].type == InstructionType::AUIPC_LW);
+    assert(block->instructions[4].type == InstructionType::SLLI_SRLI);
+    assert(block->instructions[6].type == InstructionType::MULH_MUL);
+    assert(block->instructions[8].type == InstructionType::AUIPC_JALR);
+    printf("Test fusion: PASSED\n");
+}
+
+// Float instructions leave their flags with the host until fcsr is accessed, which has to look
+// the same as accruing them right away, no matter where Run stops or what the host does in between
+static void TestFloatFlags()
+{
+    const uint32_t program[] = {
+        0xf00000d3, // fmv.w.x f1, x0
+        0x3f8002b7, // lui x5, 0x3f800
+        0xf0028153, // fmv.w.x f2, x5
+        0x181171d3, // fdiv.s f3, f2, f1
+        0x00100313, // addi x6, x0, 1
+        0x001023f3, // csrrs x7, fflags, x0
+        0x00101073, // csrrw x0, fflags, x0
+        0x00217253, // fadd.s f4, f2, f2
+        0x00102473, // csrrs x8, fflags, x0
+        0x00000073, // ecall
+    };
+    for (uint64_t chunk : { (uint64_t) 1, (uint64_t) 3, UINT64_MAX }) {
+        cpu.Reset();
+        cpu.memory.Map(0, sizeof(program));
+        for (uint32_t i = 0; i < sizeof(program) / sizeof(program[0]); ++i)
+            cpu.memory.Write(i * 4, program[i]);
+        RunResult result;
+        do {
+            result = cpu.Run(chunk);
+            // Raises divide by zero on the host, which must not end up in fflags
+            volatile float zero = 0.0f;
+            volatile float quotient = 1.0f / zero;
+            (void) quotient;
+        } while (result.reason == StopReason::Budget);
+        assert(result.reason == StopReason::Ecall);
+        assert(cpu.intRegs.Read(7) == 0b01000);
+        assert(cpu.intRegs.Read(8) == 0);
+        assert(cpu.csr.Read(CSR_fflags) == 0);
+    }
+
+    // A memory fault keeps the flags raised before it
+    const uint32_t faulting[] = {
+        0xf00000d3, // fmv.w.x f1, x0
+        0x3f8002b7, // lui x5, 0x3f800
+        0xf0028153, // fmv.w.x f2, x5
+        0x181171d3, // fdiv.s f3, f2, f1
+        0xffc02483, // lw x9, -4(x0)
+    };
+    cpu.Reset();
+    for (uint32_t i = 0; i < sizeof(faulting) / sizeof(faulting[0]); ++i)
+        cpu.memory.Write(i * 4, faulting[i]);
+    RunResult result = cpu.Run(UINT64_MAX);
+    assert(result.reason == StopReason::MemoryFault && cpu.pc == 0x10);
+    assert(cpu.csr.Read(CSR_fflags) == 0b01000);
+    printf("Test float flags: PASSED\n");
+}
+
+// Every rounding mode, given statically in the instruction and dynamically through frm, on
+// values that land exactly between two results so that each mode is told apart
+static void TestRoundingModes()
+{
+    struct Expected { float sum; int32_t integer; float converted; };
+    // 1 + 2^-24, 2.5 and 2^24 + 1 for each of rne, rtz, rdn, rup and rmm, then the same negated
+    const Expected expected[2][5] = {
+        {
+            { 1.0f, 2, 16777216.0f },
+            { 1.0f, 2, 16777216.0f },
+            { 1.0f, 2, 16777216.0f },
+            { 1.00000012f, 3, 16777218.0f },
+            { 1.00000012f, 3, 16777218.0f },
+        },
+        {
+            { -1.0f, -2, -16777216.0f },
+            { -1.0f, -2, -16777216.0f },
+            { -1.00000012f, -3, -16777218.0f },
+            { -1.0f, -2, -16777216.0f },
+            { -1.00000012f, -3, -16777218.0f },
+        },
+    };
+    auto run = [](uint32_t rm, uint32_t frm, float sign) {
+        const uint32_t program[] = {
+            0x002081d3 | (rm << 12), // fadd.s f3, f1, f2, rm
+            0xc0020353 | (rm << 12), // fcvt.w.s x6, f4, rm
+            0xd00282d3 | (rm << 12), // fcvt.s.w f5, x5, rm
+            0x00000073, // ecall
+        };
+        cpu.Reset();
+        cpu.memory.Map(0, sizeof(program));
+        for (uint32_t i = 0; i < sizeof(program) / sizeof(program[0]); ++i)
+            cpu.memory.Write(i * 4, program[i]);
+        cpu.csr.Write(CSR_frm, frm);
+        cpu.fltRegs.Write(1, sign * 1.0f);
+        cpu.fltRegs.Write(2, sign * 0x1p-24f);
+        cpu.fltRegs.Write(4, sign * 2.5f);
+        cpu.intRegs.Write(5, static_cast<uint32_t>(static_cast<int32_t>(sign) * 16777217));
+        return cpu.Run(UINT64_MAX).reason;
+    };
+
+    for (uint32_t mode = RM_RNE; mode <= RM_RMM; ++mode) {
+        for (uint32_t negative = 0; negative < 2; ++negative) {
+            const Expected& e = expected[negative][mode];
+            float sign = negative ? -1.0f : 1.0f;
+            for (bool dynamic : { false, true }) {
+                StopReason reason = run(dynamic ? RM_DYN : mode, dynamic ? mode : RM_RNE, sign);
+                assert(reason == StopReason::Ecall);
+                assert(cpu.fltRegs.Read(3) == e.sum);
+                assert(cpu.intRegs.Read<int32_t>(6) == e.integer);
+                assert(cpu.fltRegs.Read(5) == e.converted);
+                assert(cpu.csr.Read(CSR_fflags) == 0b00001);
+                // The host goes back to its own rounding mode between runs
+                assert(fegetround() == FE_TONEAREST);
+            }
+        }
+    }
+    // Reserved rounding modes are illegal, whether they come from the instruction or from frm
+    StopReason reason = run(0b101, RM_RNE, 1.0f);
+    assert(reason == StopReason::IllegalInstruction && cpu.pc == 0);
+    reason = run(RM_DYN, 0b110, 1.0f);
+    assert(reason == StopReason::IllegalInstruction && cpu.pc == 0);
+    printf("Test rounding modes: PASSED\n");
+}
+
+// Memory is only where it is mapped, anywhere in the address space, and copies carry it along.
+// Accesses anywhere else stop at the instruction, with everything before it done.
+static void TestMemory(const char* engineName)
+{
+    const uint32_t program[] = {
+        0x400002b7, // lui x5, 0x40000
+        0x50000337, // lui x6, 0x50000
+        0x02a00393, // addi x7, x0, 42
+        0xfe732e23, // sw x7, -4(x6)
+        0xffc32403, // lw x8, -4(x6)
+        0x0002a483, // lw x9, 0(x5)
+        0x00032503, // lw x10, 0(x6)
+        0xfe702f23, // sw x7, -2(x0)
+        0x00000073, // ecall
+    };
+    const uint32_t base = 0xFFFFF000;
+    cpu.Reset();
+    cpu.memory.UnmapAll();
+    bool mapped = cpu.memory.Map(base, sizeof(program));
+    assert(mapped);
+    mapped = cpu.memory.Map(0x40000000, 0x10000000);
+    assert(mapped);
+    for (uint32_t i = 0; i < sizeof(program) / sizeof(program[0]); ++i)
+        cpu.memory.Write(base + i * 4, program[i]);
+    cpu.pc = base;
+
+    RunResult result = cpu.Run(UINT64_MAX);
+    assert(result.reason == StopReason::MemoryFault && cpu.pc == base + 0x18 && result.instructionCount == 6);
+    assert(cpu.csr.Read(CSR_mcause) == CAUSE_LOAD_ACCESS && cpu.csr.Read(CSR_mtval) == 0x50000000);
+    assert(cpu.intRegs.Read(8) == 42 && cpu.intRegs.Read(9) == 0);
+    // A store that runs off the end of the address space faults without writing anything
+    cpu.pc += 4;
+    result = cpu.Run(UINT64_MAX);
+    assert(result.reason == StopReason::MemoryFault && cpu.pc == base + 0x1C && result.instructionCount == 0);
+    assert(cpu.csr.Read(CSR_mcause) == CAUSE_STORE_ACCESS && cpu.csr.Read(CSR_mtval) == 0xFFFFFFFE);
+    assert(cpu.memory.Read<uint16_t>(0xFFFFFFFE) == 0);
+    cpu.csr.Write(CSR_mtval, 0);
+    bool stepped = cpu.Step();
+    assert(!stepped && cpu.pc == base + 0x1C);
+    assert(cpu.csr.Read(CSR_mcause) == CAUSE_STORE_ACCESS && cpu.csr.Read(CSR_mtval) == 0xFFFFFFFE);
+    // And so does a fetch
+    cpu.pc = 0x30000000;
+    result = cpu.Run(UINT64_MAX);
+    assert(result.reason == StopReason::MemoryFault && cpu.pc == 0x30000000 && result.instructionCount == 0);
+    assert(cpu.csr.Read(CSR_mcause) == CAUSE_FETCH_ACCESS && cpu.csr.Read(CSR_mtval) == 0x30000000);
+    cpu.pc = base + 0x1C;
+
+    CPU copy = cpu;
+    assert(copy.memory.regions.size() == 2 && copy.memory.Read<uint32_t>(0x4FFFFFFC) == 42);
+    copy.memory.Write(0x4FFFFFFC, 7u);
+    assert(cpu.memory.Read<uint32_t>(0x4FFFFFFC) == 42);
+    cpu.Reset();
+    assert(cpu.memory.regions.size() == 2 && cpu.memory.Read<uint32_t>(0x4FFFFFFC) == 0);
+    printf("Test memory (%s): PASSED\n", engineName);
+}
+
+// Supervisor code with Sv32 paging, set up by machine code that points satp at the page tables
+// and returns to supervisor mode. Translated accesses go wherever the tables say, including
+// across pages, and the ones the tables do not allow stop with a page fault.
+static void TestPaging(const char* engineName)
+{
+    const uint32_t program[] = {
+        0x18029073, // csrrw x0, satp, x5
+        0x30200073, // mret
+        0x40000337, // lui x6, 0x40000
+        0x00732223, // sw x7, 4(x6)
+        0x00432403, // lw x8, 4(x6)
+        0x40001537, // lui x10, 0x40001
+        0x00052483, // lw x9, 0(x10)
+        0xffe52603, // lw x12, -2(x10)
+        0x00752023, // sw x7, 0(x10)
+        0x12000073, // sfence.vma x0, x0
+        0x00452583, // lw x11, 4(x10)
+        0x00000073, // ecall
+    };
+    for (bool stepped : { false, true }) {
+        cpu.Reset();
+        cpu.memory.UnmapAll();
+        cpu.memory.Map(0, 0x22000);
+        for (uint32_t i = 0; i < sizeof(program) / sizeof(program[0]); ++i)
+            cpu.memory.Write(i * 4, program[i]);
+        // The root table at 0x10000 maps the code at 0 to itself, and 0x40000000 to the data
+        // pages at 0x20000 (read and write) and 0x21000 (read only)
+        cpu.memory.Write(0x10000, (0x11u << 10) | PTE_V);
+        cpu.memory.Write(0x10400, (0x12u << 10) | PTE_V);
+        cpu.memory.Write(0x11000, (0x00u << 10) | PTE_V | PTE_R | PTE_X);
+        cpu.memory.Write(0x12000, (0x20u << 10) | PTE_V | PTE_R | PTE_W);
+        cpu.memory.Write(0x12004, (0x21u << 10) | PTE_V | PTE_R);
+        cpu.memory.Write(0x21000, 99u);
+        cpu.intRegs.Write(5, SATP_MODE | 0x10);
+        cpu.intRegs.Write(7, 42);
+        cpu.csr.Write(CSR_mstatus, PRIV_S << MSTATUS_MPP_SHIFT);
+        cpu.csr.Write(CSR_mepc, 0x08);
+
+        if (stepped) {
+            while (cpu.Step()) {}
+        }
+        else {
+            RunResult result = cpu.Run(UINT64_MAX);
+            assert(result.reason == StopReason::PageFault && result.instructionCount == 8);
+        }
+        assert(cpu.pc == 0x20 && cpu.privilege == PRIV_S && cpu.paging);
+        assert(cpu.csr.Read(CSR_mcause) == CAUSE_STORE_PAGE_FAULT && cpu.csr.Read(CSR_mtval) == 0x40001000);
+        assert(cpu.intRegs.Read(8) == 42 && cpu.memory.Read<uint32_t>(0x20004) == 42);
+        assert(cpu.intRegs.Read(9) == 99 && cpu.intRegs.Read(12) == (99u << 16));
+        assert(cpu.memory.Read<uint32_t>(0x21000) == 99);
+        // Pages are marked accessed, and dirty once written
+        assert(cpu.memory.Read<uint32_t>(0x12000) & PTE_D);
+        assert((cpu.memory.Read<uint32_t>(0x12004) & (PTE_A | PTE_D)) == PTE_A);
+
+        // The remapped page is only seen after sfence.vma
+        cpu.memory.Write(0x12004, (0x20u << 10) | PTE_V | PTE_R | PTE_W);
+        cpu.pc += 4;
+        if (stepped) {
+            while (cpu.Step()) {}
+        }
+        else {
+            RunResult result = cpu.Run(UINT64_MAX);
+            assert(result.reason == StopReason::Ecall);
+        }
+        assert(cpu.intRegs.Read(11) == 42);
+    }
+
+    // Fetches are translated too, so an unmapped pc stops the run
+    cpu.pc = 0x80000000;
+    RunResult result = cpu.Run(UINT64_MAX);
+    assert(result.reason == StopReason::PageFault && cpu.pc == 0x80000000);
+    assert(cpu.csr.Read(CSR_mcause) == CAUSE_FETCH_PAGE_FAULT && cpu.csr.Read(CSR_mtval) == 0x80000000);
+    printf("Test paging (%s): PASSED\n", engineName);
+}
+
+static void TestDevices(const char* engineName)
+{
+    const uint32_t program[] = {
+        0x100002b7, // lui x5, 0x10000
+        0x04100313, // addi x6, x0, 0x41
+        0x00628023, // sb x6, 0(x5)
+        0x0062a423, // sw x6, 8(x5)
+        0x0042d383, // lhu x7, 4(x5)
+        0x00528403, // lb x8, 5(x5)
+        0x0102a483, // lw x9, 16(x5)
+        0x00000073, // ecall
+    };
+    struct Access { uint32_t offset, size, value; };
+    std::vector<Access> writes;
+    cpu.Reset();
+    cpu.memory.UnmapAll();
+    cpu.memory.Map(0, 0x1000);
+    bool attached = cpu.memory.AttachDevice({ 0x800, 16, {}, {} });
+    assert(!attached);
+    attached = cpu.memory.AttachDevice({
+        0x10000000, 16,
+        [](uint32_t offset, uint32_t) { return 0x12345680 + offset; },
+        [&](uint32_t offset, uint32_t size, uint32_t value) { writes.push_back({ offset, size, value }); },
+    });
+    assert(attached);
+    bool mapped = cpu.memory.Map(0x10000000, 4);
+    assert(!mapped && !cpu.memory.Contains(0x10000000, 4));
+    for (uint32_t i = 0; i < sizeof(program) / sizeof(program[0]); ++i)
+        cpu.memory.Write(i * 4, program[i]);
+
+    for (bool stepped : { false, true }) {
+        writes.clear();
+        cpu.pc = 0;
+        if (stepped) {
+            while (cpu.Step()) {}
+        }
+        else {
+            // The budget can run out right after a device access
+            RunResult result = cpu.Run(3);
+            assert(result.reason == StopReason::Budget && result.instructionCount == 3 && cpu.pc == 0x0C);
+            result = cpu.Run(UINT64_MAX);
+            assert(result.reason == StopReason::MemoryFault && result.instructionCount == 3);
+        }
+        // The device only answers for its 16 bytes, not the rest of its page
+        assert(cpu.pc == 0x18);
+        assert(writes.size() == 2);
+        assert(writes[0].offset == 0 && writes[0].size == 1 && writes[0].value == 0x41);
+        assert(writes[1].offset == 8 && writes[1].size == 4 && writes[1].value == 0x41);
+        assert(cpu.intRegs.Read(7) == 0x5684 && cpu.intRegs.Read(8) == 0xFFFFFF85);
+    }
+    cpu.memory.DetachDevices();
+    printf("Test devices (%s): PASSED\n", engineName);
+}
+
+static void TestSegments(const char* engineName)
+{
+    const uint32_t program[] = {
+        0x000112b7, // lui x5, 0x11
+        0x0002a303, // lw x6, 0(x5)
+        0x0042a383, // lw x7, 4(x5)
+        0x000124b7, // lui x9, 0x12
+        0x0064a023, // sw x6, 0(x9)
+        0x00010437, // lui x8, 0x10
+        0x00642023, // sw x6, 0(x8)
+        0x00000073, // ecall
+    };
+    // Code at 0x10000, data at 0x11000 followed by .bss up to 0x13000, read only data at 0x13000,
+    // and execute only code at 0x14000
+    std::vector<uint8_t> file(0x3000, 0xAA);
+    Elf32_Ehdr header = {};
+    memcpy(header.e_ident, ELFMAG, SELFMAG);
+    header.e_ident[EI_CLASS] = ELFCLASS32;
+    header.e_ident[EI_DATA] = ELFDATA2LSB;
+    header.e_type = ET_EXEC;
+    header.e_machine = EM_RISCV;
+    header.e_version = EV_CURRENT;
+    header.e_entry = 0x10000;
+    header.e_phoff = sizeof(Elf32_Ehdr);
+    header.e_ehsize = sizeof(Elf32_Ehdr);
+    header.e_phentsize = sizeof(Elf32_Phdr);
+    header.e_shentsize = sizeof(Elf32_Shdr);
+    header.e_phnum = 4;
+    const Elf32_Phdr segments[] = {
+        { PT_LOAD, 0x1000, 0x10000, 0x10000, sizeof(program), sizeof(program), PF_R | PF_X, 0x1000 },
+        { PT_LOAD, 0x2000, 0x11000, 0x11000, 4, 0x2000, PF_R | PF_W, 0x1000 },
+        { PT_LOAD, 0x2004, 0x13000, 0x13000, 4, 4, PF_R, 0x1000 },
+        { PT_LOAD, 0x2008, 0x14000, 0x14000, 4, 4, PF_X, 0x1000 },
+    };
+    memcpy(file.data(), &header, sizeof(header));
+    memcpy(file.data() + sizeof(header), segments, sizeof(segments));
+    memcpy(file.data() + 0x1000, program, sizeof(program));
+    const uint32_t data = 0x12345678;
+    memcpy(file.data() + 0x2000, &data, sizeof(data));
+    const uint32_t load = 0x00042283; // lw x5, 0(x8)
+    memcpy(file.data() + 0x2008, &load, sizeof(load));
+
+    ParseELFResult parseResult = cpu.InitializeFromELF(file.data(), file.size());
+    assert(parseResult == ParseELFResult::Ok);
+    RunResult result = cpu.Run(UINT64_MAX);
+    // Code cannot be written, and .bss is zeroed rather than filled from the file
+    assert(result.reason == StopReason::AccessFault && result.instructionCount == 6 && cpu.pc == 0x10018);
+    assert(cpu.csr.Read(CSR_mcause) == CAUSE_STORE_ACCESS && cpu.csr.Read(CSR_mtval) == 0x10000);
+    assert(cpu.memory.Read<uint32_t>(0x10000) == program[0]);
+    assert(cpu.intRegs.Read(6) == data && cpu.intRegs.Read(7) == 0);
+    assert(cpu.memory.Read<uint32_t>(0x12000) == data && cpu.memory.Read<uint32_t>(0x12FFC) == 0);
+
+    // Read only data cannot be run
+    cpu.pc = 0x13000;
+    result = cpu.Run(UINT64_MAX);
+    assert(result.reason == StopReason::AccessFault && cpu.pc == 0x13000);
+    assert(cpu.csr.Read(CSR_mcause) == CAUSE_FETCH_ACCESS && cpu.csr.Read(CSR_mtval) == 0x13000);
+    // And execute only code cannot be read, though it runs
+    cpu.pc = 0x14000;
+    cpu.intRegs.Write(8, 0x14000);
+    result = cpu.Run(UINT64_MAX);
+    assert(result.reason == StopReason::AccessFault && cpu.pc == 0x14000);
+    assert(cpu.csr.Read(CSR_mcause) == CAUSE_LOAD_ACCESS && cpu.csr.Read(CSR_mtval) == 0x14000);
+    printf("Test segments (%s): PASSED\n", engineName);
+}
+
+static void TestMappedELF()
+{
+    const char* testName = "riscv-tests/isa/rv32ui-p-sw";
+    std::vector<uint8_t> buffer = ReadEntireFile(testName);
+    static CPU copied{};
+    ParseELFResult parseResult = copied.InitializeFromELF(buffer.data(), buffer.size());
+    assert(parseResult == ParseELFResult::Ok);
+    MappedFile file;
+    bool opened = file.Open(testName);
+    assert(opened);
+    parseResult = cpu.InitializeFromELF(file);
+    assert(parseResult == ParseELFResult::Ok);
+
+    // Mapped segments read the same as copied ones, including the memory around them
+    assert(cpu.memory.regions.size() == copied.memory.regions.size());
+    for (const MemoryRegion& region : copied.memory.regions)
+        assert(memcmp(cpu.memory.buffer + region.start, copied.memory.buffer + region.start, region.size) == 0);
+    // The program's stores stay out of the file, and resetting does not bring it back
+    RunResult result = cpu.Run(UINT64_MAX);
+    assert(result.reason == StopReason::Ecall && cpu.intRegs.Read(10) == 0);
+    assert(memcmp(file.data, buffer.data(), buffer.size()) == 0);
+    cpu.Reset();
+    assert(cpu.memory.Read<uint32_t>(0x80000000) == 0 && cpu.memory.Read<uint32_t>(0x80002000) == 0);
+    printf("Test mapped ELF: PASSED\n");
+}
+
+static void TestSnapshots(const char* engineName)
+{
+    for (const char* testName : { "riscv-tests/isa/rv32ui-p-sw", "riscv-tests/isa/rv32ui-p-fence_i" }) {
         std::vector<uint8_t> buffer = ReadEntireFile(testName);
         ParseELFResult parseResult = cpu.InitializeFromELF(buffer.data(), buffer.size());
         assert(parseResult == ParseELFResult::Ok);
+        static CPU loaded{};
+        loaded = cpu;
+        static Snapshot snapshot;
+        cpu.TakeSnapshot(snapshot);
+        // Restoring undoes only the pages the program wrote, and leaves it able to run again,
+        // including after it has modified its own code
+        for (int i = 0; i < 2; ++i) {
+            RunResult result = cpu.Run(UINT64_MAX);
+            assert(result.reason == StopReason::Ecall && cpu.intRegs.Read(10) == 0);
+            assert(!snapshot.pages.empty() && snapshot.pages.size() < 8);
+            bool restored = cpu.Restore(snapshot);
+            assert(restored);
+            assert(cpu.pc == loaded.pc && cpu.intRegs.Read(10) == loaded.intRegs.Read(10));
+            for (const MemoryRegion& region : loaded.memory.regions)
+                assert(memcmp(cpu.memory.buffer + region.start, loaded.memory.buffer + region.start, region.size) == 0);
+        }
+        // Clearing memory drops it
+        cpu.Reset();
+        bool restored = cpu.Restore(snapshot);
+        bool restoredLoaded = loaded.Restore(snapshot);
+        assert(!restored && !restoredLoaded);
+    }
+    printf("Test snapshots (%s): PASSED\n", engineName);
+}
+
+static void TestDirtyPages(const char* engineName)
+{
+    const uint32_t program[] = {
+        0x000052b7, // lui x5, 0x5
+        0x0052a023, // sw x5, 0(x5)
+        0x00007337, // lui x6, 0x7
+        0x00532223, // sw x5, 4(x6)
+        0x00000073, // ecall
+    };
+    cpu.Reset();
+    cpu.memory.UnmapAll();
+    cpu.memory.Map(0, 0x8000);
+    assert(cpu.memory.dirtyPages.empty());
+    for (uint32_t i = 0; i < sizeof(program) / sizeof(program[0]); ++i)
+        cpu.memory.Write(i * 4, program[i]);
+    RunResult result = cpu.Run(UINT64_MAX);
+    assert(result.reason == StopReason::Ecall);
+    // The host's writes count too, each page once
+    assert((cpu.memory.dirtyPages == std::vector<uint32_t>{ 0, 5, 7 }));
+    assert(cpu.memory.IsDirty(5) && !cpu.memory.IsDirty(6));
 
-        while (cpu.Step());
+    // Resetting zeroes exactly those, and the program's stores are noticed again afterwards
+    cpu.Reset();
+    assert(cpu.memory.dirtyPages.empty() && !cpu.memory.IsDirty(5));
+    assert(cpu.memory.Read<uint32_t>(0) == 0 && cpu.memory.Read<uint32_t>(0x5000) == 0 && cpu.memory.Read<uint32_t>(0x7004) == 0);
+    for (uint32_t i = 0; i < sizeof(program) / sizeof(program[0]); ++i)
+        cpu.memory.Write(i * 4, program[i]);
+    result = cpu.Run(UINT64_MAX);
+    assert(result.reason == StopReason::Ecall);
+    assert(cpu.memory.Read<uint32_t>(0x7004) == 0x5000 && cpu.memory.IsDirty(7));
+    printf("Test dirty pages (%s): PASSED\n", engineName);
+}
 
-        uint32_t result = cpu.intRegs.Read(10);
-        printf("Test %s: ", testName);
-        if (result != 0) {
-            printf("FAILED (%d)\n", result >> 1);
-            ++numFailed;
+static void TestMisaligned(const char* engineName)
+{
+    const uint32_t program[] = {
+        0x000012b7, // lui x5, 0x1
+        0x02a00313, // addi x6, x0, 42
+        0x0062a0a3, // sw x6, 1(x5)
+        0x0012a383, // lw x7, 1(x5)
+        0x00229403, // lh x8, 2(x5)
+        0x00000073, // ecall
+    };
+    auto load = [&] {
+        cpu.Reset();
+        cpu.memory.UnmapAll();
+        cpu.memory.Map(0, 0x2000);
+        for (uint32_t i = 0; i < sizeof(program) / sizeof(program[0]); ++i)
+            cpu.memory.Write(i * 4, program[i]);
+    };
+
+    // Native and counted accesses behave the same, only the count tells them apart
+    for (MisalignedAccess mode : { MisalignedAccess::Native, MisalignedAccess::Count }) {
+        load();
+        cpu.SetMisalignedAccess(mode);
+        cpu.misalignedAccesses.clear();
+        RunResult result = cpu.Run(UINT64_MAX);
+        assert(result.reason == StopReason::Ecall);
+        assert(cpu.intRegs.Read(7) == 42 && cpu.intRegs.Read(8) == 0);
+        if (mode == MisalignedAccess::Native) assert(cpu.misalignedAccesses.empty());
+        else assert((cpu.misalignedAccesses == std::unordered_map<uint32_t, uint64_t>{ { 8, 1 }, { 12, 1 } }));
+    }
+
+    // Trapping stops at the store before it is made, and then at the load
+    load();
+    cpu.SetMisalignedAccess(MisalignedAccess::Trap);
+    RunResult result = cpu.Run(UINT64_MAX);
+    assert(result.reason == StopReason::MisalignedAccess && result.instructionCount == 2 && cpu.pc == 8);
+    assert(cpu.csr.Read(CSR_mcause) == CAUSE_STORE_MISALIGNED && cpu.csr.Read(CSR_mtval) == 0x1001);
+    assert(cpu.memory.Read<uint32_t>(0x1000) == 0);
+    cpu.pc = 12;
+    result = cpu.Run(UINT64_MAX);
+    assert(result.reason == StopReason::MisalignedAccess && cpu.pc == 12);
+    assert(cpu.csr.Read(CSR_mcause) == CAUSE_LOAD_MISALIGNED && cpu.intRegs.Read(7) == 0);
+    cpu.SetMisalignedAccess(MisalignedAccess::Native);
+    printf("Test misaligned accesses (%s): PASSED\n", engineName);
+}
+
+static void TestAtomics(const char* engineName)
+{
+    const uint32_t program[] = {
+        0x000012b7, // lui x5, 0x1
+        0x00500313, // addi x6, x0, 5
+        0x1002a3af, // lr.w x7, (x5)
+        0x1862a42f, // sc.w x8, x6, (x5)
+        0x1862a4af, // sc.w x9, x6, (x5)
+        0x0062a52f, // amoadd.w x10, x6, (x5)
+        0x0862a5af, // amoswap.w x11, x6, (x5)
+        0xffd00613, // addi x12, x0, -3
+        0x80c2a6af, // amomin.w x13, x12, (x5)
+        0xe062a72f, // amomaxu.w x14, x6, (x5)
+        0xa062a7af, // amomax.w x15, x6, (x5)
+        0x60c2a82f, // amoand.w x16, x12, (x5)
+        0x20c2a8af, // amoxor.w x17, x12, (x5)
+        0x4062a92f, // amoor.w x18, x6, (x5)
+        0xc062a9af, // amominu.w x19, x6, (x5)
+        0x00000073, // ecall
+        0x00228e13, // addi x28, x5, 2
+        0x006e252f, // amoadd.w x10, x6, (x28)
+    };
+    cpu.Reset();
+    cpu.memory.UnmapAll();
+    cpu.memory.Map(0, 0x2000);
+    for (uint32_t i = 0; i < sizeof(program) / sizeof(program[0]); ++i)
+        cpu.memory.Write(i * 4, program[i]);
+    cpu.memory.Write(0x1000, 10u);
+
+    // The first sc.w succeeds and ends the reservation, so the second fails
+    RunResult result = cpu.Run(UINT64_MAX);
+    assert(result.reason == StopReason::Ecall);
+    assert(cpu.intRegs.Read(7) == 10 && cpu.intRegs.Read(8) == 0 && cpu.intRegs.Read(9) == 1);
+    assert(cpu.intRegs.Read(10) == 5 && cpu.intRegs.Read(11) == 10 && cpu.intRegs.Read(13) == 5);
+    assert(cpu.intRegs.Read(14) == 0xfffffffd && cpu.intRegs.Read(15) == 0xfffffffd && cpu.intRegs.Read(16) == 5);
+    assert(cpu.intRegs.Read(17) == 5 && cpu.intRegs.Read(18) == 0xfffffff8 && cpu.intRegs.Read(19) == 0xfffffffd);
+    assert(cpu.memory.Read<uint32_t>(0x1000) == 5);
+
+    // Atomics cannot be split, so they trap even where other misaligned accesses are allowed
+    cpu.SetMisalignedAccess(MisalignedAccess::Count);
+    cpu.pc = 64;
+    result = cpu.Run(UINT64_MAX);
+    assert(result.reason == StopReason::MisalignedAccess && cpu.pc == 68);
+    assert(cpu.csr.Read(CSR_mcause) == CAUSE_STORE_MISALIGNED && cpu.csr.Read(CSR_mtval) == 0x1002);
+    assert(cpu.memory.Read<uint32_t>(0x1000) == 5);
+    cpu.SetMisalignedAccess(MisalignedAccess::Native);
+    printf("Test atomics (%s): PASSED\n", engineName);
+}
+
+static const uint32_t countingProgram[] = {
+    0xf1402573, // csrr x10, mhartid
+    0x000012b7, // lui x5, 0x1
+    0x00100313, // addi x6, x0, 1
+    0x000013b7, // lui x7, 0x1
+    0x0062a02f, // amoadd.w x0, x6, (x5)
+    0xfff38393, // addi x7, x7, -1
+    0xfe039ce3, // bne x7, x0, -8
+    0x00251413, // slli x8, x10, 2
+    0x00540433, // add x8, x8, x5
+    0x06450493, // addi x9, x10, 100
+    0x00942223, // sw x9, 4(x8)
+    0x0330000f, // fence rw, rw
+    0x00000073, // ecall
+};
+
+// Hart 0 interrupts hart 1, the others wait for an interrupt with only the software interrupt enabled
+static const uint32_t interruptingProgram[] = {
+    0xf1402573, // csrr x10, mhartid
+    0x00100313, // addi x6, x0, 1
+    0x00051863, // bne x10, x0, 16
+    0x020002b7, // lui x5, 0x2000
+    0x0062a223, // sw x6, 4(x5)
+    0x00000073, // ecall
+    0x03000393, // addi x7, x0, 0x30
+    0x30539073, // csrw mtvec, x7
+    0x00800393, // addi x7, x0, 8
+    0x30439073, // csrw mie, x7
+    0x30039073, // csrw mstatus, x7
+    0x0000006f, // jal x0, 0
+    0x342025f3, // csrr x11, mcause
+    0x34102673, // csrr x12, mepc
+    0x00000073, // ecall
+};
+
+static Machine machine(4);
+
+template<uint32_t Length>
+static void LoadHarts(const uint32_t (&program)[Length], Scheduling scheduling)
+{
+    machine.Reset();
+    machine.scheduling = scheduling;
+    for (uint32_t i = 0; i < Length; ++i)
+        machine.memory.Write(i * 4, program[i]);
+    for (const std::unique_ptr<CPU>& hart : machine.harts) {
+        hart->jit.enabled = cpu.jit.enabled;
+        hart->dispatch = cpu.dispatch;
+    }
+}
+
+static void TestHarts(const char* engineName)
+{
+    for (Scheduling scheduling : { Scheduling::Threads, Scheduling::RoundRobin }) {
+        // Every hart's additions make it, and each one knows which it is
+        LoadHarts(countingProgram, scheduling);
+        for (const RunResult& result : machine.Run(UINT64_MAX))
+            assert(result.reason == StopReason::Ecall);
+        assert(machine.memory.Read<uint32_t>(0x1000) == 4 * 0x1000);
+        for (uint32_t i = 0; i < 4; ++i)
+            assert(machine.memory.Read<uint32_t>(0x1004 + 4 * i) == 100 + i && machine.harts[i]->csr.Read(CSR_mhartid) == i);
+
+        LoadHarts(interruptingProgram, scheduling);
+        std::vector<RunResult> results = machine.Run(10 * Machine::Quantum);
+        assert(results[0].reason == StopReason::Ecall && results[1].reason == StopReason::Ecall);
+        assert(machine.msip[0].load() == 0 && machine.msip[1].load() == 1);
+        assert(machine.harts[1]->csr.Read(CSR_mcause) == (CAUSE_INTERRUPT | 3) && machine.harts[1]->csr.Read(CSR_mepc) == 0x2C);
+        assert(machine.harts[1]->pc == 0x3C && (machine.harts[1]->csr.Read(CSR_mstatus) & MSTATUS_MPIE));
+        // The other two wait for as long as they are let
+        assert(results[2].reason == StopReason::Budget && results[3].reason == StopReason::Budget);
+    }
+    printf("Test harts (%s): PASSED\n", engineName);
+}
+
+// Interrupts hart 2 once three quanta have passed, and hart 3 two later
+static DeviceCoroutine InterruptLater(Machine& target)
+{
+    co_await target.Delay(3 * Machine::Quantum);
+    target.msip[2].store(1);
+    co_await target.Delay(2 * Machine::Quantum);
+    target.msip[3].store(1);
+}
+
+static void TestRoundRobin(const char* engineName)
+{
+    // Hart 1 is interrupted before it has enabled interrupts, so it takes it at its next turn
+    LoadHarts(interruptingProgram, Scheduling::RoundRobin);
+    machine.Spawn(InterruptLater(machine));
+    std::vector<RunResult> results = machine.Run(UINT64_MAX);
+    constexpr uint64_t Quantum = Machine::Quantum;
+    assert(results[0].reason == StopReason::Ecall && results[0].instructionCount == 6);
+    assert(results[1].reason == StopReason::Ecall && results[1].instructionCount == Quantum + 3);
+    assert(results[2].reason == StopReason::Ecall && results[2].instructionCount == 3 * Quantum + 3);
+    assert(results[3].reason == StopReason::Ecall && results[3].instructionCount == 5 * Quantum + 3);
+    assert(machine.devices.size() == 1 && machine.devices[0].handle.done() && machine.time == 6 * Quantum);
+    printf("Test round robin (%s): PASSED\n", engineName);
+}
+
+// Every instance starts from the loaded program, whatever the one before it on the worker did
+static void TestFleet(const char* engineName)
+{
+    constexpr uint32_t InputAddress = 0x80080000;
+    constexpr uint32_t InstanceCount = 64;
+    MappedFile file;
+    bool opened = file.Open("riscv-tests/isa/rv32ui-p-add");
+    assert(opened);
+    for (uint32_t lanes : { 1, 8, 16 }) {
+        Fleet fleet;
+        ParseELFResult parseResult = fleet.Load(file);
+        assert(parseResult == ParseELFResult::Ok);
+        fleet.workerCount = 4;
+        fleet.lanes = lanes;
+        fleet.configure = [](CPU& worker) {
+            worker.jit.enabled = cpu.jit.enabled;
+            worker.jit.hotThreshold = cpu.jit.hotThreshold;
+        };
+        // Odd instances run out of budget
+        fleet.setup = [](CPU& worker, uint32_t instance) -> uint64_t {
+            assert(worker.memory.Read<uint32_t>(InputAddress) == 0 && worker.intRegs.Read(10) == 0);
+            worker.memory.Write(InputAddress, instance + 1);
+            return (instance % 2 != 0) ? 100 : UINT64_MAX;
+        };
+        std::atomic<uint32_t> finished = 0;
+        fleet.finish = [&](const CPU& worker, uint32_t instance, const FleetResult&) {
+            assert(worker.memory.Read<uint32_t>(InputAddress) == instance + 1);
+            ++finished;
+        };
+        std::vector<FleetResult> results = fleet.Run(InstanceCount);
+        assert(results.size() == InstanceCount && finished == InstanceCount);
+        for (uint32_t i = 0; i < InstanceCount; ++i) {
+            const FleetResult& result = results[i];
+            if (i % 2 != 0)
+                assert(result.run.reason == StopReason::Budget && result.run.instructionCount == 100);
+            else
+                assert(result.run.reason == StopReason::Ecall && result.exitCode == 0 && result.run.instructionCount == results[0].run.instructionCount);
         }
-        else {
-            printf("PASSED\n");
+    }
+    printf("Test fleet (%s): PASSED\n", engineName);
+}
+
+// Loops a0 times, adding the squares of odd counts and taking away the even ones, so that
+// instances with different a0 part ways in the loop and meet again after it
+static const uint32_t divergingProgram[] = {
+    0x00000293, // addi x5, x0, 0
+    0x00000313, // addi x6, x0, 0
+    0x340516f3, // csrrw x13, mscratch, x10
+    0x02a35263, // bge x6, x10, 36
+    0x00137393, // andi x7, x6, 1
+    0x00038863, // beq x7, x0, 16
+    0x02630433, // mul x8, x6, x6
+    0x008282b3, // add x5, x5, x8
+    0x0080006f, // jal x0, 8
+    0x406282b3, // sub x5, x5, x6
+    0x00130313, // addi x6, x6, 1
+    0xfe1ff06f, // jal x0, -32
+    0x40502023, // sw x5, 0x400(x0)
+    0x40002603, // lw x12, 0x400(x0)
+    0x00000073, // ecall
+};
+
+template<uint32_t Lanes>
+static void TestLockstepLanes()
+{
+    // The last lane is left empty, and one runs out of budget in the loop
+    constexpr uint32_t Count = Lanes - 1;
+    constexpr uint32_t BudgetLane = 2;
+    std::vector<std::unique_ptr<CPU>> instances, references;
+    CPU* group[Count];
+    uint64_t budgets[Count];
+    RunResult results[Count];
+    for (uint32_t i = 0; i < Count; ++i) {
+        for (std::vector<std::unique_ptr<CPU>>* cpus : { &instances, &references }) {
+            std::unique_ptr<CPU>& instance = cpus->emplace_back(std::make_unique<CPU>());
+            instance->jit.enabled = cpu.jit.enabled;
+            instance->jit.hotThreshold = cpu.jit.hotThreshold;
+            for (uint32_t j = 0; j < sizeof(divergingProgram) / sizeof(divergingProgram[0]); ++j)
+                instance->memory.Write(j * 4, divergingProgram[j]);
+            instance->intRegs.Write(10, 3 * i + i % 3);
         }
+        group[i] = instances[i].get();
+        budgets[i] = (i == BudgetLane) ? 50 : UINT64_MAX;
+    }
+    std::unique_ptr<Lockstep<Lanes>> lockstep = std::make_unique<Lockstep<Lanes>>();
+    lockstep->Run(group, budgets, results);
+    for (uint32_t i = 0; i < Count; ++i) {
+        const CPU& instance = *instances[i];
+        const CPU& reference = *references[i];
+        RunResult expected = references[i]->Run(budgets[i]);
+        assert(results[i].reason == expected.reason && results[i].instructionCount == expected.instructionCount);
+        assert(instance.pc == reference.pc && instance.csr.Read(CSR_mscratch) == reference.csr.Read(CSR_mscratch));
+        for (uint32_t x = 0; x < 32; ++x)
+            assert(instance.intRegs.Read(x) == reference.intRegs.Read(x));
+        if (i == BudgetLane)
+            continue;
+        int32_t sum = 0;
+        for (int32_t n = 0; n < static_cast<int32_t>(3 * i + i % 3); ++n)
+            sum += (n % 2 != 0) ? n * n : -n;
+        assert(results[i].reason == StopReason::Ecall && instance.intRegs.Read<int32_t>(12) == sum);
+        assert(instance.memory.Read<int32_t>(0x400) == sum);
     }
-    assert(numFailed == 0);
 }
 
-int main()
+static void TestLockstep(const char* engineName)
 {
+    TestLockstepLanes<8>();
+    TestLockstepLanes<16>();
+
+    // Lockstep runs the riscv-tests like each instance would on its own, including the ones that
+    // modify their code, access memory misaligned and use instructions it leaves to the CPU
+    const char* testNames[] = {
+        "riscv-tests/isa/rv32ui-p-beq",
+        "riscv-tests/isa/rv32ui-p-fence_i",
+        "riscv-tests/isa/rv32ui-p-jalr",
+        "riscv-tests/isa/rv32ui-p-lh",
+        "riscv-tests/isa/rv32ui-p-ma_data",
+        "riscv-tests/isa/rv32ui-p-sb",
+        "riscv-tests/isa/rv32ui-p-sra",
+        "riscv-tests/isa/rv32um-p-div",
+        "riscv-tests/isa/rv32um-p-mulhsu",
+        "riscv-tests/isa/rv32uf-p-fadd",
+    };
+    for (const char* testName : testNames) {
+        MappedFile file;
+        bool opened = file.Open(testName);
+        assert(opened);
+        std::vector<FleetResult> results[2];
+        for (uint32_t lanes : { 1, 8 }) {
+            Fleet fleet;
+            ParseELFResult parseResult = fleet.Load(file);
+            assert(parseResult == ParseELFResult::Ok);
+            fleet.workerCount = 1;
+            fleet.lanes = lanes;
+            fleet.configure = [](CPU& instance) {
+                instance.jit.enabled = cpu.jit.enabled;
+                instance.jit.hotThreshold = cpu.jit.hotThreshold;
+            };
+            results[lanes != 1] = fleet.Run(12);
+        }
+        for (uint32_t i = 0; i < 12; ++i) {
+            const FleetResult& result = results[1][i];
+            assert(result.run.reason == StopReason::Ecall && result.exitCode == 0);
+            assert(result.run.instructionCount == results[0][i].run.instructionCount);
+        }
+    }
+    printf("Test lockstep (%s): PASSED\n", engineName);
+}
+
+// test [--filter text] [--repeat count] [--jobs count] [aot directory]
+// The filter picks the riscv-tests whose names contain text, which run count times each on count
+// workers, by default one for each host core
+int main(int argc, char** argv)
+{
+    const char* aotDirectory = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+            options.filter = argv[++i];
+        else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+            options.repeat = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc)
+            options.jobs = std::max(1, atoi(argv[++i]));
+        else
+            aotDirectory = argv[i];
+    }
+
     TestDecode();
-    TestISA();
+    TestDecodeTable();
+    TestISA(false, "interpreter");
+    cpu.jit.enabled = false;
+    cpu.dispatch = Dispatch::Switch;
+    TestISA(true, "block cache, switch");
+    cpu.dispatch = Dispatch::Threaded;
+    TestISA(true, "block cache, threaded");
+    TestRun("block cache");
+    TestPolicies();
+    TestFusion();
+    TestFloatFlags();
+    TestRoundingModes();
+    TestMemory("block cache");
+    TestPaging("block cache");
+    TestDevices("block cache");
+    TestSegments("block cache");
+    TestMappedELF();
+    TestSnapshots("block cache");
+    TestDirtyPages("block cache");
+    TestMisaligned("block cache");
+    TestAtomics("block cache");
+    TestHarts("block cache");
+    TestRoundRobin("block cache");
+    TestFleet("block cache");
+    TestLockstep("block cache");
+#if CPU_JIT
+    // Translate every block the first time it is reached, so the tests exercise the JIT and not just the interpreter
+    cpu.jit.enabled = true;
+    cpu.jit.hotThreshold = 1;
+    TestISA(true, "jit");
+    TestRun("jit");
+    TestMemory("jit");
+    TestPaging("jit");
+    TestDevices("jit");
+    TestSegments("jit");
+    TestSnapshots("jit");
+    TestDirtyPages("jit");
+    TestMisaligned("jit");
+    TestAtomics("jit");
+    TestHarts("jit");
+    TestRoundRobin("jit");
+    TestFleet("jit");
+    TestLockstep("jit");
+#endif
+    if (aotDirectory != nullptr) {
+        cpu.jit.enabled = false;
+        TestISA(true, "aot", aotDirectory);
+    }
 }
@@ -0,0 +1,571 @@
+// Translates the program in an ELF file to C++ ahead of time and compiles it into a shared object,
+// which the emulator loads with AOTModule and runs instead of interpreting the code it covers.
+//
+// Usage: aot <input ELF> <output shared object> [directory containing cpu.hpp, defaults to src]
+// The compiler is taken from $CXX, or c++ (cl on Windows) if it is not set.
+
+#include "cpu.hpp"
+#include "aot.hpp"
+#include "helpers.hpp"
+#include "elf.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <set>
+#include <vector>
+
+
+struct Segment
+{
+    uint32_t start;
+    uint32_t end;
+};
+
+struct Program
+{
+    std::vector<Segment> segments;
+    std::set<uint32_t> instructions;
+    // Addresses that translated code can be entered at
+    std::set<uint32_t> leaders;
+
+    bool IsCode(uint32_t address) const
+    {
+        for (const Segment& segment : segments)
+            if (segment.start <= address && address + 4 <= segment.end && address % 4 == 0)
+                return true;
+        return false;
+    }
+};
+
+
+static CPU cpu;
+
+
+static bool IsTranslatable(const DecodedInstruction& ins)
+{
+    switch (ins.type) {
+        case InstructionType::LUI:
+        case InstructionType::AUIPC:
+        case InstructionType::JAL:
+        case InstructionType::JALR:
+        case InstructionType::BEQ:
+        case InstructionType::BNE:
+        case InstructionType::BLT:
+        case InstructionType::BGE:
+        case InstructionType::BLTU:
+        case InstructionType::BGEU:
+        case InstructionType::LB:
+        case InstructionType::LH:
+        case InstructionType::LW:
+        case InstructionType::LBU:
+        case InstructionType::LHU:
+        case InstructionType::SB:
+        case InstructionType::SH:
+        case InstructionType::SW:
+        case InstructionType::ADDI:
+        case InstructionType::SLTI:
+        case InstructionType::SLTIU:
+        case InstructionType::XORI:
+        case InstructionType::ORI:
+        case InstructionType::ANDI:
+        case InstructionType::SLLI:
+        case InstructionType::SRLI:
+        case InstructionType::SRAI:
+        case InstructionType::ADD:
+        case InstructionType::SUB:
+        case InstructionType::SLL:
+        case InstructionType::SLT:
+        case InstructionType::SLTU:
+        case InstructionType::XOR:
+        case InstructionType::SRL:
+        case InstructionType::SRA:
+        case InstructionType::OR:
+        case InstructionType::AND:
+        case InstructionType::FENCE:
+        case InstructionType::MUL:
+        case InstructionType::MULH:
+        case InstructionType::MULHSU:
+        case InstructionType::MULHU:
+        case InstructionType::DIV:
+        case InstructionType::DIVU:
+        case InstructionType::REM:
+        case InstructionType::REMU:
+        case InstructionType::FLW:
+        case InstructionType::FSW:
+        case InstructionType::FMVXW:
+        case InstructionType::FMVWX:
+            return true;
+        // The interpreter switches to translated accesses if these turn paging on
+        case InstructionType::CSRRW:
+        case InstructionType::CSRRS:
+        case InstructionType::CSRRC:
+        case InstructionType::CSRRWI:
+        case InstructionType::CSRRSI:
+        case InstructionType::CSRRCI:
+            return !AffectsTranslation(ins.imm);
+        case InstructionType::ILLEGAL:
+        case InstructionType::MRET:
+        case InstructionType::SRET:
+        case InstructionType::SFENCE_VMA:
+        case InstructionType::ECALL:
+        case InstructionType::EBREAK:
+        case InstructionType::FENCE_I:
+        case InstructionType::LR_W:
+        case InstructionType::SC_W:
+        case InstructionType::AMOSWAP_W:
+        case InstructionType::AMOADD_W:
+        case InstructionType::AMOXOR_W:
+        case InstructionType::AMOAND_W:
+        case InstructionType::AMOOR_W:
+        case InstructionType::AMOMIN_W:
+        case InstructionType::AMOMAX_W:
+        case InstructionType::AMOMINU_W:
+        case InstructionType::AMOMAXU_W:
+        case InstructionType::FMADDS:
+        case InstructionType::FMSUBS:
+        case InstructionType::FNMSUBS:
+        case InstructionType::FNMADDS:
+        case InstructionType::FADDS:
+        case InstructionType::FSUBS:
+        case InstructionType::FMULS:
+        case InstructionType::FDIVS:
+        case InstructionType::FSQRTS:
+        case InstructionType::FSGNJS:
+        case InstructionType::FSGNJNS:
+        case InstructionType::FSGNJXS:
+        case InstructionType::FMINS:
+        case InstructionType::FMAXS:
+        case InstructionType::FCVTWS:
+        case InstructionType::FCVTWUS:
+        case InstructionType::FEQS:
+        case InstructionType::FLTS:
+        case InstructionType::FLES:
+        case InstructionType::FCLASSS:
+        case InstructionType::FCVTSW:
+        case InstructionType::FCVTSWU:
+        // Only the block cache fuses instructions
+        case InstructionType::LUI_ADDI:
+        case InstructionType::AUIPC_ADDI:
+        case InstructionType::AUIPC_LW:
+        case InstructionType::AUIPC_JALR:
+        case InstructionType::SLLI_SRLI:
+        case InstructionType::MULH_MUL:
+        case InstructionType::MULHU_MUL:
+        case InstructionType::COUNT:
+            break;
+    }
+    return false;
+}
+
+static bool IsBranch(InstructionType type)
+{
+    return type == InstructionType::BEQ || type == InstructionType::BNE
+        || type == InstructionType::BLT || type == InstructionType::BGE
+        || type == InstructionType::BLTU || type == InstructionType::BGEU;
+}
+
+// Whether execution can continue with the next instruction in translated code
+static bool FallsThrough(const DecodedInstruction& ins)
+{
+    return IsTranslatable(ins) && ins.type != InstructionType::JAL && ins.type != InstructionType::JALR;
+}
+
+static DecodedInstruction Decode(uint32_t address)
+{
+    return DecodeOperands(cpu.memory.Read<uint32_t>(address), address);
+}
+
+
+static std::vector<Segment> ExecutableSegments(const std::vector<uint8_t>& file)
+{
+    Elf32_Ehdr header;
+    memcpy(&header, file.data(), sizeof(header));
+    std::vector<Segment> segments;
+    for (size_t i = 0; i < header.e_phnum; ++i) {
+        size_t offset = header.e_phoff + i * sizeof(Elf32_Phdr);
+        assert(offset + sizeof(Elf32_Phdr) <= file.size());
+        Elf32_Phdr pHeader;
+        memcpy(&pHeader, file.data() + offset, sizeof(pHeader));
+        if (pHeader.p_type == PT_LOAD && (pHeader.p_flags & PF_X)) {
+            uint32_t start = pHeader.p_paddr;
+            segments.push_back({ start, start + pHeader.p_filesz });
+        }
+    }
+    return segments;
+}
+
+// Symbols in code are often only reached indirectly, e.g. trap handlers and functions called through pointers
+static void AddSymbols(const std::vector<uint8_t>& file, const Program& program, std::vector<uint32_t>& roots)
+{
+    Elf32_Ehdr header;
+    memcpy(&header, file.data(), sizeof(header));
+    for (size_t i = 0; i < header.e_shnum; ++i) {
+        size_t offset = header.e_shoff + i * sizeof(Elf32_Shdr);
+        if (offset + sizeof(Elf32_Shdr) > file.size()) break;
+        Elf32_Shdr sHeader;
+        memcpy(&sHeader, file.data() + offset, sizeof(sHeader));
+        if (sHeader.sh_type != SHT_SYMTAB) continue;
+
+        for (size_t j = 0; (j + 1) * sizeof(Elf32_Sym) <= sHeader.sh_size; ++j) {
+            size_t symbolOffset = sHeader.sh_offset + j * sizeof(Elf32_Sym);
+            if (symbolOffset + sizeof(Elf32_Sym) > file.size()) break;
+            Elf32_Sym symbol;
+            memcpy(&symbol, file.data() + symbolOffset, sizeof(symbol));
+            uint32_t type = ELF32_ST_TYPE(symbol.st_info);
+            uint32_t address = symbol.st_value;
+            if ((type == STT_FUNC || type == STT_NOTYPE) && symbol.st_shndx != SHN_UNDEF && program.IsCode(address))
+                roots.push_back(address);
+        }
+    }
+}
+
+// Follows every direct control transfer from the roots. Addresses materialized with auipc or lui
+// followed by addi or jalr are followed as well, since they are usually jump targets (la, call, tail).
+static void FindCode(Program& program, std::vector<uint32_t> roots)
+{
+    for (uint32_t root : roots)
+        if (program.IsCode(root))
+            program.leaders.insert(root);
+
+    while (!roots.empty()) {
+        uint32_t address = roots.back();
+        roots.pop_back();
+        while (program.IsCode(address) && program.instructions.insert(address).second) {
+            DecodedInstruction ins = Decode(address);
+
+            auto addRoot = [&](uint32_t target) {
+                if (!program.IsCode(target)) return;
+                program.leaders.insert(target);
+                roots.push_back(target);
+            };
+
+            if ((ins.type == InstructionType::AUIPC || ins.type == InstructionType::LUI) && ins.rd != 0 && program.IsCode(ins.nextPc)) {
+                DecodedInstruction next = Decode(ins.nextPc);
+                if ((next.type == InstructionType::ADDI || next.type == InstructionType::JALR) && next.rs1 == ins.rd)
+                    addRoot((ins.imm + next.imm) & ~0b1U);
+            }
+
+            if (IsBranch(ins.type)) {
+                addRoot(ins.imm);
+                addRoot(ins.nextPc);
+            }
+            else if (ins.type == InstructionType::JAL) {
+                addRoot(ins.imm);
+                if (ins.rd != 0) addRoot(ins.nextPc);
+                break;
+            }
+            else if (ins.type == InstructionType::JALR) {
+                if (ins.rd != 0) addRoot(ins.nextPc);
+                break;
+            }
+            else if (ins.type == InstructionType::ILLEGAL || ins.type == InstructionType::MRET || ins.type == InstructionType::SRET) {
+                break;
+            }
+            else if (!IsTranslatable(ins)) {
+                // The interpreter comes back once it has executed the rest of its block
+                addRoot(ins.nextPc);
+            }
+            address = ins.nextPc;
+        }
+    }
+}
+
+
+static std::string Format(const char* format, auto... args)
+{
+    char buffer[512];
+    snprintf(buffer, sizeof(buffer), format, args...);
+    return buffer;
+}
+
+static std::string X(uint32_t x) { return (x == 0) ? "discard" : Format("x%u", x); }
+static std::string Src(uint32_t x) { return Format("x%u", x); }
+
+// refund is the number of instructions, starting with this one, that were charged to the budget
+// but do not run if it exits before executing
+static std::string TranslateLoad(const DecodedInstruction& ins, uint32_t pc, uint32_t refund, const char* type, uint32_t size)
+{
+    return Format("{ uint32_t a = x%u + 0x%08Xu; if (!cpu.memory.IsPlainLoad(a, %u)) EXIT(Interpret, 0x%08Xu, %u); %s = (uint32_t) cpu.memory.Read<%s>(a); }",
+        ins.rs1, ins.imm, size, pc, refund, X(ins.rd).c_str(), type);
+}
+
+static std::string TranslateStore(const DecodedInstruction& ins, uint32_t pc, uint32_t refund, const char* type, const std::string& value, uint32_t size)
+{
+    // Stores outside of memory, to read only pages or to code, which includes this image, are left to the interpreter
+    return Format("{ uint32_t a = x%u + 0x%08Xu; if (!cpu.memory.IsPlainStore(a, %u)) EXIT(Interpret, 0x%08Xu, %u); "
+                  "cpu.memory.WritePlain<Track>(a, (%s) (%s)); }",
+        ins.rs1, ins.imm, size, pc, refund, type, value.c_str());
+}
+
+static std::string Jump(const Program& program, uint32_t target)
+{
+    if (program.leaders.contains(target))
+        return Format("goto L_%08X;", target);
+    return Format("EXIT(Interpret, 0x%08Xu, 0);", target);
+}
+
+static std::string TranslateBranch(const Program& program, const DecodedInstruction& ins, const char* type, const char* op)
+{
+    return Format("if ((%s) x%u %s (%s) x%u) ", type, ins.rs1, op, type, ins.rs2) + Jump(program, ins.imm);
+}
+
+static std::string TranslateCSR(const DecodedInstruction& ins, const std::string& source, const char* newValue)
+{
+    // Float instructions go through the interpreter, which may have left flags for fcsr with the host
+    return Format("{ if (cpu.floatFlagsPending) cpu.FoldFloatFlags(); uint32_t old = cpu.csr.Read(%u); uint32_t src = %s; %s = old; cpu.csr.Write<Track>(%u, %s); }",
+        ins.imm, source.c_str(), X(ins.rd).c_str(), ins.imm, newValue);
+}
+
+static std::string TranslateInstruction(const Program& program, const DecodedInstruction& ins, uint32_t pc, uint32_t refund)
+{
+    std::string rd = X(ins.rd);
+    std::string rs1 = Src(ins.rs1);
+    std::string rs2 = Src(ins.rs2);
+    const char* d = rd.c_str();
+    const char* s1 = rs1.c_str();
+    const char* s2 = rs2.c_str();
+
+    // The interpreter reports instructions that the program may not use as illegal
+    if (RequiredExtensions(ins.type) > cpu.extensions || !IsTranslatable(ins))
+        return Format("EXIT(Interpret, 0x%08Xu, %u);", pc, refund);
+    switch (ins.type) {
+        // What IsTranslatable turns away
+        case InstructionType::ILLEGAL:
+        case InstructionType::MRET:
+        case InstructionType::SRET:
+        case InstructionType::SFENCE_VMA:
+        case InstructionType::ECALL:
+        case InstructionType::EBREAK:
+        case InstructionType::FENCE_I:
+        case InstructionType::LR_W:
+        case InstructionType::SC_W:
+        case InstructionType::AMOSWAP_W:
+        case InstructionType::AMOADD_W:
+        case InstructionType::AMOXOR_W:
+        case InstructionType::AMOAND_W:
+        case InstructionType::AMOOR_W:
+        case InstructionType::AMOMIN_W:
+        case InstructionType::AMOMAX_W:
+        case InstructionType::AMOMINU_W:
+        case InstructionType::AMOMAXU_W:
+        case InstructionType::FMADDS:
+        case InstructionType::FMSUBS:
+        case InstructionType::FNMSUBS:
+        case InstructionType::FNMADDS:
+        case InstructionType::FADDS:
+        case InstructionType::FSUBS:
+        case InstructionType::FMULS:
+        case InstructionType::FDIVS:
+        case InstructionType::FSQRTS:
+        case InstructionType::FSGNJS:
+        case InstructionType::FSGNJNS:
+        case InstructionType::FSGNJXS:
+        case InstructionType::FMINS:
+        case InstructionType::FMAXS:
+        case InstructionType::FCVTWS:
+        case InstructionType::FCVTWUS:
+        case InstructionType::FEQS:
+        case InstructionType::FLTS:
+        case InstructionType::FLES:
+        case InstructionType::FCLASSS:
+        case InstructionType::FCVTSW:
+        case InstructionType::FCVTSWU:
+        case InstructionType::LUI_ADDI:
+        case InstructionType::AUIPC_ADDI:
+        case InstructionType::AUIPC_LW:
+        case InstructionType::AUIPC_JALR:
+        case InstructionType::SLLI_SRLI:
+        case InstructionType::MULH_MUL:
+        case InstructionType::MULHU_MUL:
+        case InstructionType::COUNT:
+            break;
+        case InstructionType::LUI:    return Format("%s = 0x%08Xu;", d, ins.imm);
+        case InstructionType::AUIPC:  return Format("%s = 0x%08Xu;", d, ins.imm);
+        case InstructionType::ADDI:   return Format("%s = %s + 0x%08Xu;", d, s1, ins.imm);
+        case InstructionType::SLTI:   return Format("%s = (int32_t) %s < (int32_t) 0x%08Xu;", d, s1, ins.imm);
+        case InstructionType::SLTIU:  return Format("%s = %s < 0x%08Xu;", d, s1, ins.imm);
+        case InstructionType::XORI:   return Format("%s = %s ^ 0x%08Xu;", d, s1, ins.imm);
+        case InstructionType::ORI:    return Format("%s = %s | 0x%08Xu;", d, s1, ins.imm);
+        case InstructionType::ANDI:   return Format("%s = %s & 0x%08Xu;", d, s1, ins.imm);
+        case InstructionType::SLLI:   return Format("%s = %s << %u;", d, s1, ins.imm);
+        case InstructionType::SRLI:   return Format("%s = %s >> %u;", d, s1, ins.imm);
+        case InstructionType::SRAI:   return Format("%s = (uint32_t) ((int32_t) %s >> %u);", d, s1, ins.imm);
+        case InstructionType::ADD:    return Format("%s = %s + %s;", d, s1, s2);
+        case InstructionType::SUB:    return Format("%s = %s - %s;", d, s1, s2);
+        case InstructionType::SLL:    return Format("%s = %s << (%s & 31);", d, s1, s2);
+        case InstructionType::SLT:    return Format("%s = (int32_t) %s < (int32_t) %s;", d, s1, s2);
+        case InstructionType::SLTU:   return Format("%s = %s < %s;", d, s1, s2);
+        case InstructionType::XOR:    return Format("%s = %s ^ %s;", d, s1, s2);
+        case InstructionType::SRL:    return Format("%s = %s >> (%s & 31);", d, s1, s2);
+        case InstructionType::SRA:    return Format("%s = (uint32_t) ((int32_t) %s >> (%s & 31));", d, s1, s2);
+        case InstructionType::OR:     return Format("%s = %s | %s;", d, s1, s2);
+        case InstructionType::AND:    return Format("%s = %s & %s;", d, s1, s2);
+        case InstructionType::MUL:    return Format("%s = %s * %s;", d, s1, s2);
+        case InstructionType::MULH:   return Format("%s = (uint32_t) (((int64_t) (int32_t) %s * (int64_t) (int32_t) %s) >> 32);", d, s1, s2);
+        case InstructionType::MULHSU: return Format("%s = (uint32_t) (((int64_t) (int32_t) %s * (uint64_t) %s) >> 32);", d, s1, s2);
+        case InstructionType::MULHU:  return Format("%s = (uint32_t) (((uint64_t) %s * (uint64_t) %s) >> 32);", d, s1, s2);
+        case InstructionType::DIV:    return Format("%s = (%s == 0) ? 0xFFFFFFFFu : (uint32_t) (int32_t) ((int64_t) (int32_t) %s / (int64_t) (int32_t) %s);", d, s2, s1, s2);
+        case InstructionType::DIVU:   return Format("%s = (%s == 0) ? 0xFFFFFFFFu : %s / %s;", d, s2, s1, s2);
+        case InstructionType::REM:    return Format("%s = (%s == 0) ? %s : (uint32_t) (int32_t) ((int64_t) (int32_t) %s %% (int64_t) (int32_t) %s);", d, s2, s1, s1, s2);
+        case InstructionType::REMU:   return Format("%s = (%s == 0) ? %s : %s %% %s;", d, s2, s1, s1, s2);
+        case InstructionType::LB:     return TranslateLoad(ins, pc, refund, "int8_t", 1);
+        case InstructionType::LH:     return TranslateLoad(ins, pc, refund, "int16_t", 2);
+        case InstructionType::LW:     return TranslateLoad(ins, pc, refund, "int32_t", 4);
+        case InstructionType::LBU:    return TranslateLoad(ins, pc, refund, "uint8_t", 1);
+        case InstructionType::LHU:    return TranslateLoad(ins, pc, refund, "uint16_t", 2);
+        case InstructionType::SB:     return TranslateStore(ins, pc, refund, "uint8_t", rs2, 1);
+        case InstructionType::SH:     return TranslateStore(ins, pc, refund, "uint16_t", rs2, 2);
+        case InstructionType::SW:     return TranslateStore(ins, pc, refund, "uint32_t", rs2, 4);
+        case InstructionType::FLW:
+            return Format("{ uint32_t a = x%u + 0x%08Xu; if (!cpu.memory.IsPlainLoad(a, 4)) EXIT(Interpret, 0x%08Xu, %u); cpu.fltRegs.Write<Track>(%u, cpu.memory.Read<float>(a)); }",
+                ins.rs1, ins.imm, pc, refund, ins.rd);
+        case InstructionType::FSW:    return TranslateStore(ins, pc, refund, "float", Format("cpu.fltRegs.Read(%u)", ins.rs2), 4);
+        case InstructionType::FMVXW:  return Format("{ float f = cpu.fltRegs.Read(%u); memcpy(&%s, &f, 4); }", ins.rs1, d);
+        case InstructionType::FMVWX:  return Format("{ float f; memcpy(&f, &%s, 4); cpu.fltRegs.Write<Track>(%u, f); }", s1, ins.rd);
+        case InstructionType::FENCE:
+            // As the interpreter does it, which keeps the compiler from moving accesses across it too
+            return ((ins.imm & FENCE_PRED_W) && (ins.imm & FENCE_SUCC_R))
+                ? "std::atomic_thread_fence(std::memory_order_seq_cst);"
+                : "std::atomic_thread_fence(std::memory_order_acq_rel);";
+        case InstructionType::CSRRW:  return TranslateCSR(ins, rs1, "src");
+        case InstructionType::CSRRS:  return TranslateCSR(ins, rs1, "old | src");
+        case InstructionType::CSRRC:  return TranslateCSR(ins, rs1, "old & ~src");
+        case InstructionType::CSRRWI: return TranslateCSR(ins, Format("%uu", ins.rs1), "src");
+        case InstructionType::CSRRSI: return TranslateCSR(ins, Format("%uu", ins.rs1), "old | src");
+        case InstructionType::CSRRCI: return TranslateCSR(ins, Format("%uu", ins.rs1), "old & ~src");
+        case InstructionType::JAL:    return Format("%s = 0x%08Xu; ", d, ins.nextPc) + Jump(program, ins.imm);
+        case InstructionType::JALR:   return Format("{ uint32_t target = (%s + 0x%08Xu) & ~1u; %s = 0x%08Xu; pc = target; goto dispatch; }", s1, ins.imm, d, ins.nextPc);
+        case InstructionType::BEQ:    return TranslateBranch(program, ins, "uint32_t", "==");
+        case InstructionType::BNE:    return TranslateBranch(program, ins, "uint32_t", "!=");
+        case InstructionType::BLT:    return TranslateBranch(program, ins, "int32_t", "<");
+        case InstructionType::BGE:    return TranslateBranch(program, ins, "int32_t", ">=");
+        case InstructionType::BLTU:   return TranslateBranch(program, ins, "uint32_t", "<");
+        case InstructionType::BGEU:   return TranslateBranch(program, ins, "uint32_t", ">=");
+    }
+    return Format("EXIT(Interpret, 0x%08Xu, %u);", pc, refund);
+}
+
+static std::string GenerateSource(const Program& program, const char* inputPath, uint32_t codeStart, uint32_t codeEnd, uint64_t codeHash)
+{
+    std::string out;
+    out += Format("// Generated by tools/aot.cpp from %s, do not edit\n", inputPath);
+    out += "#include \"cpu.hpp\"\n"
+           "#include \"aot.hpp\"\n\n"
+           "#if defined(_WIN32)\n"
+           "#define AOT_EXPORT extern \"C\" __declspec(dllexport)\n"
+           "#else\n"
+           "#define AOT_EXPORT extern \"C\" __attribute__((visibility(\"default\")))\n"
+           "#endif\n\n"
+           "#define EXIT(reason, address, refund) do { result = AOTExit::reason; pc = address; remaining += refund; goto leave; } while (0)\n\n";
+    out += Format("constexpr uint32_t CodeStart = 0x%08Xu;\nconstexpr uint32_t CodeEnd = 0x%08Xu;\n\n", codeStart, codeEnd);
+    out += "template<bool Track>\nstatic AOTExit Run(CPU& cpu, int32_t& budget)\n{\n"
+           "    AOTExit result = AOTExit::Continue;\n"
+           "    int32_t remaining = budget;\n"
+           "    uint32_t pc = cpu.pc;\n"
+           "    [[maybe_unused]] uint32_t discard;\n"
+           "    [[maybe_unused]] constexpr uint32_t x0 = 0;\n";
+    for (uint32_t x = 1; x < 32; ++x)
+        out += Format("    uint32_t x%u = cpu.intRegs.buffer[%u];\n", x, x);
+    out += "    goto dispatch;\n\n";
+
+    // Translated code is laid out in address order, so fall through needs no jump
+    std::vector<uint32_t> addresses(program.instructions.begin(), program.instructions.end());
+    uint32_t length = 0;
+    uint32_t position = 0;
+    for (size_t i = 0; i < addresses.size(); ++i) {
+        uint32_t pc = addresses[i];
+        DecodedInstruction ins = Decode(pc);
+        if (program.leaders.contains(pc)) {
+            // Charge the budget for the whole run of instructions up to the next leader up front
+            length = 0;
+            position = 0;
+            for (size_t j = i; j < addresses.size() && (j == i || !program.leaders.contains(addresses[j])); ++j) {
+                ++length;
+                if (!FallsThrough(Decode(addresses[j])) || (j + 1 < addresses.size() && addresses[j + 1] != addresses[j] + 4))
+                    break;
+            }
+            out += Format("L_%08X:\n    if ((remaining -= %u) < 0) EXIT(Continue, 0x%08Xu, %u);\n", pc, length, pc, length);
+        }
+        uint32_t refund = (position < length) ? length - position : 0;
+        ++position;
+        out += Format("    %s // %s\n", TranslateInstruction(program, ins, pc, refund).c_str(), FormatInstruction(cpu.memory.Read<uint32_t>(pc)).buffer);
+        bool isNextAdjacent = i + 1 < addresses.size() && addresses[i + 1] == ins.nextPc;
+        if (FallsThrough(ins) && !isNextAdjacent)
+            out += Format("    EXIT(Interpret, 0x%08Xu, 0);\n", ins.nextPc);
+    }
+
+    out += "\ndispatch:\n    switch (pc) {\n";
+    for (uint32_t leader : program.leaders)
+        if (program.instructions.contains(leader))
+            out += Format("        case 0x%08Xu: goto L_%08X;\n", leader, leader);
+    out += "        default: result = AOTExit::Interpret; break;\n    }\n\n";
+
+    out += "leave:\n    cpu.pc = pc;\n    budget = remaining;\n";
+    for (uint32_t x = 1; x < 32; ++x)
+        out += Format("    if (cpu.intRegs.buffer[%u] != x%u) cpu.intRegs.Write<Track>(%u, x%u);\n", x, x, x, x);
+    out += "    return result;\n}\n\n";
+    out += "static AOTExit RunImage(CPU& cpu, int32_t& budget)\n{\n"
+           "    return cpu.trackChanges ? Run<true>(cpu, budget) : Run<false>(cpu, budget);\n}\n\n";
+
+    out += Format("AOT_EXPORT const AOTImage aotImage = { AOTImage::CurrentVersion, sizeof(CPU), 0x%08Xu, 0x%08Xu, 0x%016llXull, RunImage };\n",
+        codeStart, codeEnd, static_cast<unsigned long long>(codeHash));
+    return out;
+}
+
+
+int main(int argc, char** argv)
+{
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <input ELF> <output shared object> [directory containing cpu.hpp]\n", argv[0]);
+        return 1;
+    }
+    const char* inputPath = argv[1];
+    std::string outputPath = argv[2];
+    const char* includeDirectory = (argc > 3) ? argv[3] : "src";
+
+    std::vector<uint8_t> file = ReadEntireFile(inputPath);
+    ParseELFResult parseResult = cpu.InitializeFromELF(file.data(), file.size());
+    if (parseResult != ParseELFResult::Ok) {
+        fprintf(stderr, "%s: %s\n", inputPath, ParseELFResultMessage(parseResult));
+        return 1;
+    }
+
+    Program program;
+    program.segments = ExecutableSegments(file);
+    std::vector<uint32_t> roots = { cpu.pc };
+    AddSymbols(file, program, roots);
+    FindCode(program, roots);
+    if (program.instructions.empty()) {
+        fprintf(stderr, "%s: No code found\n", inputPath);
+        return 1;
+    }
+
+    uint32_t codeStart = *program.instructions.begin();
+    uint32_t codeEnd = *program.instructions.rbegin() + 4;
+    uint64_t codeHash = HashCode(cpu.memory.buffer + codeStart, codeEnd - codeStart);
+
+    size_t extension = outputPath.find_last_of('.');
+    size_t directory = outputPath.find_last_of("/\\");
+    std::string sourcePath = (extension != std::string::npos && (directory == std::string::npos || extension > directory))
+        ? outputPath.substr(0, extension) + ".cpp" : outputPath + ".cpp";
+    FILE* source = fopen(sourcePath.c_str(), "wb");
+    if (source == nullptr) {
+        fprintf(stderr, "Could not open %s for writing\n", sourcePath.c_str());
+        return 1;
+    }
+    std::string code = GenerateSource(program, inputPath, codeStart, codeEnd, codeHash);
+    fwrite(code.data(), 1, code.size(), source);
+    fclose(source);
+
+    const char* compiler = getenv("CXX");
+#if defined(_WIN32)
+    std::string command = Format("%s /nologo /TP /EHsc /std:c++20 /O2 /LD /I%s %s /Fe%s",
+        compiler ? compiler : "cl", includeDirectory, sourcePath.c_str(), outputPath.c_str());
+#else
+    std::string command = Format("%s -std=c++20 -O2 -shared -fPIC -I%s %s -o %s",
+        compiler ? compiler : "c++", includeDirectory, sourcePath.c_str(), outputPath.c_str());
+#endif
+    printf("Translated %zu instructions, %zu entry points\n%s\n", program.instructions.size(), program.leaders.size(), command.c_str());
+    return system(command.c_str()) == 0 ? 0 : 1;
+}